@@ -0,0 +1,455 @@
+/***************************************************************
+                            bench.cpp
+
+Benchmarks the ROM upload code of every flashcart backend
+against the simulated carts in FakeFTDI. For each cart, ROM size
+and byte order, it reports the throughput, the percentiles of
+the time between the writes that carry ROM data, and the CPU
+time that was used. The cart's SDRAM is checked afterwards, so
+a broken upload path can't look fast.
+***************************************************************/
+
+#include <sys/resource.h>
+#include <chrono>
+#include <algorithm>
+#include "../main.h"
+#include "../helper.h"
+#include "../device.h"
+#include "../device_64drive.h"
+#include "../device_everdrive.h"
+#include "../device_sc64.h"
+#include "../network.h"
+#include "../byteorder.h"
+#include "../screenshot.h"
+#include "../FakeFTDI/fakeftdi.h"
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define MAX_SIZES  16
+#define MAX_ORDERS 3
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef struct {
+    const char* name;
+    const char* arg;
+    int  faketype;
+    void (*set)(ftdi_context_t*, int);
+    bool (*open)(ftdi_context_t*);
+    bool (*sendrom)(ftdi_context_t*, romfile_t*, u32);
+    void (*close)(ftdi_context_t*);
+} benchcart_t;
+
+typedef struct {
+    double wall;    // In seconds
+    double cpu;     // In seconds
+    double* latencies;
+    u32    latencycount;
+    bool   valid;   // Whether the SDRAM matched the ROM every time
+} benchresult_t;
+
+
+/*********************************
+        Function Prototypes
+*********************************/
+
+void parse_args(int argc, char* argv[]);
+void list_args();
+
+
+/*********************************
+             Globals
+*********************************/
+
+// Program globals (normally defined in main.cpp)
+bool    global_usecolors   = false;
+int     global_cictype     = -1;
+u32     global_savetype    = 0;
+bool    global_listenmode  = false;
+bool    global_debugmode   = false;
+bool    global_networkmode = false;
+int     global_byteorder   = 0;
+bool    global_romcache    = false;
+bool    global_fixcrc      = false;
+bool    global_verify      = false;
+char*   global_debugout    = NULL;
+logfile_t* global_debugoutptr = NULL;
+u64     global_logsize     = 0;
+time_t  global_logtime     = 0;
+int     global_logsync     = -1;
+bool    global_logzip      = false;
+char*   global_sessionout  = NULL;
+char*   global_videoout    = NULL;
+int     global_screenshotformat = SCREENSHOT_PNG;
+int     global_pnglevel    = -1;
+char*   global_exportpath  = NULL;
+time_t  global_timeout     = 0;
+time_t  global_timeouttime = 0;
+bool    global_closefail   = false;
+char*   global_filename    = NULL;
+
+// The carts that can be benchmarked
+static const benchcart_t local_carts[] = {
+    {"64drive HW2",  "64drive",   FAKECART_64DRIVE2,  device_set_64drive2,  device_open_64drive,   device_sendrom_64drive,   device_close_64drive},
+    {"SummerCart64", "sc64",      FAKECART_SC64,      device_set_sc64,      device_open_sc64,      device_sendrom_sc64,      device_close_sc64},
+    {"EverDrive",    "everdrive", FAKECART_EVERDRIVE, device_set_everdrive, device_open_everdrive, device_sendrom_everdrive, device_close_everdrive},
+};
+#define CART_COUNT (int)(sizeof(local_carts)/sizeof(local_carts[0]))
+
+// Settings
+static bool   local_usecart[CART_COUNT] = {true, true, true};
+static u32    local_sizes[MAX_SIZES] = {1, 8, 32};
+static int    local_sizecount = 3;
+static int    local_orders[MAX_ORDERS] = {BYTEORDER_Z64, BYTEORDER_V64};
+static int    local_ordercount = 2;
+static int    local_runs = 3;
+static double local_bandwidth = 0;
+
+
+/*==============================
+    network_main
+    Network mode isn't benchmarked, so this stands
+    in for the real one (which needs ENet)
+    @param A pointer to the cart context
+==============================*/
+
+void network_main(ftdi_context_t* cart)
+{
+}
+
+
+/*==============================
+    bench_cputime
+    Gets how much CPU time the process used so far
+    @returns The CPU time, in seconds
+==============================*/
+
+static double bench_cputime()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec+usage.ru_utime.tv_usec/1000000.0+usage.ru_stime.tv_sec+usage.ru_stime.tv_usec/1000000.0;
+}
+
+
+/*==============================
+    bench_makerom
+    Creates a ROM file to upload
+    @param The size of the ROM, in bytes
+    @param The BYTEORDER_ value to store the ROM in
+    @param A buffer to store the big endian ROM in
+    @returns A string with the path to the file
+==============================*/
+
+static char* bench_makerom(u32 size, int order, u8* expected)
+{
+    u32 i, seed = 0x12345678;
+    char* path = strdup("/tmp/unfloader-bench-XXXXXX");
+    int fd = mkstemp(path);
+    u8* data;
+    if (fd == -1)
+        terminate("Unable to create a temporary ROM file.");
+
+    // Generate some noise, with a valid header word
+    for (i=0; i<size; i+=4)
+    {
+        seed = seed*1664525+1013904223;
+        memcpy(expected+i, &seed, 4);
+    }
+    expected[0] = 0x80;
+    expected[1] = 0x37;
+    expected[2] = 0x12;
+    expected[3] = 0x40;
+
+    // Store it in the requested byte order. Swapping is its own inverse, so the same conversion works both ways
+    data = (u8*) malloc(size);
+    if (data == NULL)
+        terminate("Unable to allocate memory for the ROM.");
+    byteorder_convert(data, expected, size, order);
+    if (write(fd, data, size) != (ssize_t)size)
+        terminate("Unable to write the temporary ROM file.");
+    close(fd);
+    free(data);
+    return path;
+}
+
+
+/*==============================
+    bench_percentile
+    Gets a percentile out of a sorted list of times
+    @param The sorted list
+    @param The number of items in the list
+    @param The percentile, from 0 to 1
+    @returns The time at that percentile, in milliseconds
+==============================*/
+
+static double bench_percentile(const double* list, u32 count, double percentile)
+{
+    u32 index = (u32)(percentile*count);
+    if (count == 0)
+        return 0;
+    if (index >= count)
+        index = count-1;
+    return list[index]*1000.0;
+}
+
+
+/*==============================
+    bench_run
+    Uploads a ROM to a simulated cart a few times
+    @param A pointer to the cart to use
+    @param The size of the ROM, in bytes
+    @param The BYTEORDER_ value of the ROM
+    @param A pointer to store the results in
+==============================*/
+
+static void bench_run(const benchcart_t* bench, u32 size, int order, benchresult_t* result)
+{
+    int i;
+    u8* expected = (u8*) malloc(size);
+    char* path;
+    if (expected == NULL)
+        terminate("Unable to allocate memory for the ROM.");
+    path = bench_makerom(size, order, expected);
+    memset(result, 0, sizeof(benchresult_t));
+    result->valid = true;
+    fakeftdi_setup(&bench->faketype, 1, local_bandwidth);
+
+    for (i=0; i<local_runs; i++)
+    {
+        ftdi_context_t cart;
+        romfile_t* rom;
+        const double* latencies;
+        u8  header[4];
+        u32 count;
+        double cpustart;
+        std::chrono::steady_clock::time_point start;
+        memset(&cart, 0, sizeof(ftdi_context_t));
+
+        // Prepare the cart the same way device_find and device_sendrom would
+        bench->set(&cart, 0);
+        if (!bench->open(&cart))
+            terminate("%s", cart.error);
+        rom = romfile_open(path);
+        if (rom == NULL)
+            terminate("Unable to open the temporary ROM file.");
+        global_filename = path;
+        romfile_read(rom, 0, header, 4);
+        global_byteorder = byteorder_detect(header);
+
+        // Time the upload
+        fakeftdi_resetstats();
+        cpustart = bench_cputime();
+        start = std::chrono::steady_clock::now();
+        if (!bench->sendrom(&cart, rom, rom->size))
+            terminate("%s", cart.error);
+        result->wall += std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        result->cpu += bench_cputime()-cpustart;
+        romfile_close(rom);
+        bench->close(&cart);
+        delta_free(&cart.delta);
+
+        // Make sure the cart got the right data
+        if (memcmp(fakeftdi_getsdram(0), expected, size) != 0)
+            result->valid = false;
+
+        // Keep all the latencies
+        count = fakeftdi_getlatencies(&latencies);
+        result->latencies = (double*) realloc(result->latencies, sizeof(double)*(result->latencycount+count));
+        memcpy(result->latencies+result->latencycount, latencies, sizeof(double)*count);
+        result->latencycount += count;
+    }
+    std::sort(result->latencies, result->latencies+result->latencycount);
+
+    // Cleanup
+    remove(path);
+    free(path);
+    free(expected);
+}
+
+
+/*==============================
+    main
+    Program entrypoint
+    @param The number of extra arguments
+    @param An array with the arguments
+==============================*/
+
+int main(int argc, char* argv[])
+{
+    int i, j, k;
+    FILE* devnull;
+    SCREEN* screen;
+
+    parse_args(argc, argv);
+
+    // The backends print through curses, so send all of that somewhere nobody will see it
+    devnull = fopen("/dev/null", "w");
+    screen = newterm(NULL, devnull, stdin);
+    if (screen == NULL)
+        screen = newterm("vt100", devnull, stdin);
+    if (screen == NULL)
+    {
+        fprintf(stderr, "Unable to initialize curses.\n");
+        return 1;
+    }
+
+    // Nobody can see the "press any key" prompt if a backend fails, so don't wait on it
+    global_timeout = 1;
+
+    // Print the header
+    printf("%-13s %6s %5s %9s %9s %9s %9s %9s %9s\n", "Cart", "Size", "Order", "MB/s", "p50 ms", "p90 ms", "p99 ms", "Max ms", "CPU ms");
+    fflush(stdout);
+
+    // Run every combination of settings
+    for (i=0; i<CART_COUNT; i++)
+    {
+        if (!local_usecart[i])
+            continue;
+        for (j=0; j<local_sizecount; j++)
+        {
+            for (k=0; k<local_ordercount; k++)
+            {
+                benchresult_t result;
+                u32 size = local_sizes[j]*1024*1024;
+                bench_run(&local_carts[i], size, local_orders[k], &result);
+                printf("%-13s %4dMB %5s %9.2f %9.3f %9.3f %9.3f %9.3f %9.2f%s\n", local_carts[i].name, local_sizes[j], byteorder_name(local_orders[k])+1,
+                       (size/(1024.0*1024.0))*local_runs/result.wall,
+                       bench_percentile(result.latencies, result.latencycount, 0.50),
+                       bench_percentile(result.latencies, result.latencycount, 0.90),
+                       bench_percentile(result.latencies, result.latencycount, 0.99),
+                       bench_percentile(result.latencies, result.latencycount, 1.00),
+                       result.cpu*1000.0/local_runs,
+                       result.valid ? "" : "  SDRAM MISMATCH");
+                fflush(stdout);
+                free(result.latencies);
+            }
+        }
+    }
+
+    // Cleanup
+    endwin();
+    delscreen(screen);
+    fclose(devnull);
+    return 0;
+}
+
+
+/*==============================
+    bench_error
+    Prints an error about the arguments and quits
+    @param The error message
+    @param Variadic arguments to print as well
+==============================*/
+
+static void bench_error(const char* reason, ...)
+{
+    va_list args;
+    va_start(args, reason);
+    fprintf(stderr, "Error: ");
+    vfprintf(stderr, reason, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(-1);
+}
+
+
+/*==============================
+    parse_args
+    Parses the arguments passed to the benchmark
+    @param The number of extra arguments
+    @param An array with the arguments
+==============================*/
+
+void parse_args(int argc, char* argv[])
+{
+    int i, j;
+    for (i=1; i<argc; i++)
+    {
+        char* command = argv[i];
+        char* value = (i+1<argc) ? argv[i+1] : NULL;
+        char* token;
+
+        if (!strcmp(command, "-help"))
+        {
+            list_args();
+            exit(0);
+        }
+        else if (value == NULL)
+            bench_error("Missing parameter(s) for command '%s'.", command);
+        else if (!strcmp(command, "-carts")) // Which carts to benchmark
+        {
+            for (j=0; j<CART_COUNT; j++)
+                local_usecart[j] = false;
+            for (token = strtok(value, ","); token != NULL; token = strtok(NULL, ","))
+            {
+                for (j=0; j<CART_COUNT; j++)
+                    if (!strcmp(token, local_carts[j].arg))
+                        break;
+                if (j == CART_COUNT)
+                    bench_error("Unknown cart '%s'.", token);
+                local_usecart[j] = true;
+            }
+        }
+        else if (!strcmp(command, "-sizes")) // Which ROM sizes to use
+        {
+            local_sizecount = 0;
+            for (token = strtok(value, ","); token != NULL && local_sizecount < MAX_SIZES; token = strtok(NULL, ","))
+            {
+                local_sizes[local_sizecount] = strtol(token, NULL, 0);
+                if (local_sizes[local_sizecount] < 1 || local_sizes[local_sizecount]*1024*1024 > FAKECART_SDRAMSIZE)
+                    bench_error("Invalid ROM size '%s'.", token);
+                local_sizecount++;
+            }
+        }
+        else if (!strcmp(command, "-orders")) // Which byte orders to use
+        {
+            local_ordercount = 0;
+            for (token = strtok(value, ","); token != NULL && local_ordercount < MAX_ORDERS; token = strtok(NULL, ","))
+            {
+                if (!strcmp(token, "z64"))
+                    local_orders[local_ordercount++] = BYTEORDER_Z64;
+                else if (!strcmp(token, "v64"))
+                    local_orders[local_ordercount++] = BYTEORDER_V64;
+                else if (!strcmp(token, "n64"))
+                    local_orders[local_ordercount++] = BYTEORDER_N64;
+                else
+                    bench_error("Unknown byte order '%s'.", token);
+            }
+        }
+        else if (!strcmp(command, "-runs")) // How many times to upload each ROM
+        {
+            local_runs = strtol(value, NULL, 0);
+            if (local_runs < 1)
+                bench_error("Invalid number of runs '%s'.", value);
+        }
+        else if (!strcmp(command, "-bandwidth")) // Simulated link speed
+            local_bandwidth = atof(value);
+        else
+            bench_error("Unknown command '%s'.", command);
+        i++;
+    }
+}
+
+
+/*==============================
+    list_args
+    Prints the arguments the benchmark takes
+==============================*/
+
+void list_args()
+{
+    printf("Parameters: [optional]\n");
+    printf("  -help\t\t\t   Show this list.\n");
+    printf("  -carts <list>\t\t   Carts to benchmark (default: 64drive,sc64,everdrive).\n");
+    printf("  -sizes <list>\t\t   ROM sizes in MB (default: 1,8,32).\n");
+    printf("  -orders <list>\t   ROM byte orders (default: z64,v64).\n");
+    printf("  -runs <int>\t\t   Uploads per combination (default: 3).\n");
+    printf("  -bandwidth <MB/s>\t   Simulated USB speed (default: unlimited).\n");
+}
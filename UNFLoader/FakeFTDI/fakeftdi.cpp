@@ -0,0 +1,850 @@
+/***************************************************************
+                          fakeftdi.cpp
+
+Implements the parts of the FTDI D2XX API that UNFLoader uses,
+backed by simulated flashcarts instead of real hardware. Each
+cart understands its command protocol (64drive HW2, SummerCart64
+or EverDrive), keeps an SDRAM backing store, and sends back the
+same replies the real cart would. Debug data sent by the host is
+echoed back in DMA@/CMPH packets, like a ROM running the USB
+library would. The link can optionally be throttled to a given
+bandwidth, and the time between the writes that carry ROM data
+is recorded for benchmarking.
+
+Besides being linked into the benchmark, this file can be built
+as a libftd2xx.so replacement with "make fakeftdi", and loaded
+into UNFLoader with LD_PRELOAD or LD_LIBRARY_PATH. In that case
+it's configured with these environment variables:
+    FAKEFTDI_CARTS     Comma separated list of carts to plug in
+                       (64drive, sc64 or everdrive)
+    FAKEFTDI_BANDWIDTH Link speed in MB/s (default: unlimited)
+    FAKEFTDI_ECHO      Set to 0 to stop echoing debug data
+    FAKEFTDI_DUMP      File to write the SDRAM to when the cart
+                       is closed (carts after the first one get
+                       their index appended)
+    FAKEFTDI_CORRUPT   Comma separated list of SDRAM addresses
+                       whose byte gets damaged the first time
+                       it's written to
+***************************************************************/
+
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include "../main.h"
+#include "fakeftdi.h"
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define REPLY_SIZE  4096 // How many reply bytes to allocate space for at a time
+#define CORRUPT_MAX 16   // How many addresses can be damaged
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef std::chrono::steady_clock fakeclock;
+
+typedef struct {
+    int  type;          // FAKECART_ value
+    bool open;
+    u8*  sdram;
+    u32  written;       // The end of the highest SDRAM range that was written to
+    u8*  reply;         // Bytes waiting to be read by the host
+    u32  replysize;
+    u32  replyread;     // How many of the reply bytes were already read
+    u32  replycap;
+    u32  readtimeout;   // In milliseconds, 0 to wait forever
+    u8   command[16];   // The command being received
+    u32  commandsize;
+    u8   pending;       // The command whose data is being received
+    u32  address;       // Where the data goes in SDRAM
+    u32  left;          // How many bytes of data are still expected
+    bool debugdata;     // Whether the data is a debug packet instead of an SDRAM write
+    u8*  debug;         // The debug packet being received
+    u32  debugtype;
+    u32  debugsize;
+    u32  debugfill;
+    EVENT_HANDLE* event; // Signalled when there's something to read, if set
+    DWORD eventmask;
+    std::mutex lock;
+    std::condition_variable signal;
+} fakecart_t;
+
+
+/*********************************
+             Globals
+*********************************/
+
+static fakecart_t* local_carts[FAKECART_MAX];
+static int    local_cartcount = 0;
+static double local_bandwidth = 0; // In bytes per second, 0 for unlimited
+static bool   local_echo = true;
+static const char* local_dump = NULL;
+static u32    local_corrupt[CORRUPT_MAX];
+static bool   local_corrupted[CORRUPT_MAX];
+static int    local_corruptcount = 0;
+
+// Benchmark statistics, shared by every cart
+static std::mutex local_statslock;
+static fakeclock::time_point local_busyuntil;
+static fakeclock::time_point local_lastdata;
+static double* local_latencies = NULL;
+static u32     local_latencycount = 0;
+static u32     local_latencycap = 0;
+
+
+/*==============================
+    fakecart_be32
+    Reads a big endian word
+    @param A pointer to the word
+    @returns The word
+==============================*/
+
+static u32 fakecart_be32(const u8* data)
+{
+    return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+
+/*==============================
+    fakecart_reply
+    Queues bytes for the host to read
+    @param A pointer to the cart
+    @param The bytes to send
+    @param The number of bytes
+==============================*/
+
+static void fakecart_reply(fakecart_t* cart, const void* data, u32 size)
+{
+    // Throw away what was already read, and grow the buffer if needed
+    if (cart->replyread == cart->replysize)
+        cart->replysize = cart->replyread = 0;
+    if (cart->replysize+size > cart->replycap)
+    {
+        cart->replycap = cart->replysize+size+REPLY_SIZE;
+        cart->reply = (u8*) realloc(cart->reply, cart->replycap);
+        if (cart->reply == NULL)
+        {
+            fprintf(stderr, "fakeftdi: unable to allocate memory for replies.\n");
+            exit(1);
+        }
+    }
+    memcpy(cart->reply+cart->replysize, data, size);
+    cart->replysize += size;
+    cart->signal.notify_all();
+    if (cart->event != NULL && (cart->eventmask & FT_EVENT_RXCHAR))
+    {
+        pthread_mutex_lock(&cart->event->eMutex);
+        pthread_cond_signal(&cart->event->eCondVar);
+        pthread_mutex_unlock(&cart->event->eMutex);
+    }
+}
+
+
+/*==============================
+    fakecart_cmp
+    Queues a four byte completion signal
+    @param A pointer to the cart
+    @param The first three bytes
+    @param The last byte
+==============================*/
+
+static void fakecart_cmp(fakecart_t* cart, const char* magic, u8 last)
+{
+    u8 cmp[4] = {(u8)magic[0], (u8)magic[1], (u8)magic[2], last};
+    fakecart_reply(cart, cmp, 4);
+}
+
+
+/*==============================
+    fakecart_debugpacket
+    Queues a debug packet, framed the same way the USB library does
+    @param A pointer to the cart
+    @param The DATATYPE_ of the packet
+    @param The data to send
+    @param The size of the data
+==============================*/
+
+static void fakecart_debugpacket(fakecart_t* cart, u32 type, const void* data, u32 size)
+{
+    u8  header[8] = {'D', 'M', 'A', '@', (u8)type, (u8)(size >> 16), (u8)(size >> 8), (u8)size};
+    u8  padding[16] = {0};
+    u32 alignment, total = 8+size+4;
+    fakecart_reply(cart, header, 8);
+    fakecart_reply(cart, data, size);
+    fakecart_cmp(cart, "CMP", 'H');
+
+    // The SummerCart64 and EverDrive send whole words and blocks
+    switch (cart->type)
+    {
+        case FAKECART_SC64: alignment = 4; break;
+        case FAKECART_EVERDRIVE: alignment = 16; break;
+        default: alignment = 0;
+    }
+    if (alignment != 0 && (total % alignment) != 0)
+        fakecart_reply(cart, padding, alignment-(total % alignment));
+}
+
+
+/*==============================
+    fakecart_debugstart
+    Gets ready to receive a debug packet from the host
+    @param A pointer to the cart
+    @param The DATATYPE_ and size of the packet, packed like in the DMA header
+    @param How many bytes the host is going to send
+==============================*/
+
+static void fakecart_debugstart(fakecart_t* cart, u32 header, u32 transfer)
+{
+    cart->debugtype = (header >> 24) & 0xFF;
+    cart->debugsize = header & 0xFFFFFF;
+    cart->debugfill = 0;
+    cart->debug = (u8*) realloc(cart->debug, cart->debugsize+1);
+    if (cart->debug == NULL)
+    {
+        fprintf(stderr, "fakeftdi: unable to allocate memory for debug data.\n");
+        exit(1);
+    }
+    cart->debugdata = true;
+    cart->left = transfer;
+}
+
+
+/*==============================
+    fakecart_sdram
+    Clamps an SDRAM range so it stays inside the backing store
+    @param The address of the range
+    @param The size of the range
+    @returns The number of bytes of the range that exist
+==============================*/
+
+static u32 fakecart_sdram(u32 address, u32 size)
+{
+    if (address >= FAKECART_SDRAMSIZE)
+        return 0;
+    if (size > FAKECART_SDRAMSIZE-address)
+        return FAKECART_SDRAMSIZE-address;
+    return size;
+}
+
+
+/*==============================
+    fakecart_commandsize
+    Figures out how long the command being received is
+    @param A pointer to the cart
+    @returns The size of the command, in bytes
+==============================*/
+
+static u32 fakecart_commandsize(fakecart_t* cart)
+{
+    switch (cart->type)
+    {
+        case FAKECART_64DRIVE2:
+            if (cart->commandsize < 1)
+                return 4;
+            switch (cart->command[0])
+            {
+                case 0x20: // LOADRAM
+                case 0x30: // DUMPRAM
+                    return 12;
+                case 0x40: // USBRECV
+                case 0x70: // SETSAVE
+                case 0x72: // SETCIC
+                    return 8;
+                default:
+                    return 4;
+            }
+        case FAKECART_SC64:
+            return 12;
+        default:
+            return 16;
+    }
+}
+
+
+/*==============================
+    fakecart_command_64drive
+    Executes a 64drive command
+    @param A pointer to the cart
+==============================*/
+
+static void fakecart_command_64drive(fakecart_t* cart)
+{
+    u8  command = cart->command[0];
+    u32 param1 = fakecart_be32(cart->command+4);
+    u32 param2 = fakecart_be32(cart->command+8);
+    switch (command)
+    {
+        case 0x20: // LOADRAM, replies once the data arrived
+            cart->pending = command;
+            cart->address = param1;
+            cart->left = param2 & 0xFFFFFF;
+            return;
+        case 0x40: // USBRECV, replies once the data arrived
+            cart->pending = command;
+            fakecart_debugstart(cart, param1, param1 & 0xFFFFFF);
+            return;
+        case 0x30: // DUMPRAM
+        {
+            u32 size = param2 & 0xFFFFFF;
+            u32 valid = fakecart_sdram(param1, size);
+            fakecart_reply(cart, cart->sdram+param1, valid);
+            if (valid < size)
+            {
+                u8* zeroes = (u8*) calloc(size-valid, 1);
+                fakecart_reply(cart, zeroes, size-valid);
+                free(zeroes);
+            }
+            break;
+        }
+    }
+    fakecart_cmp(cart, "CMP", command);
+}
+
+
+/*==============================
+    fakecart_command_sc64
+    Executes a SummerCart64 command
+    @param A pointer to the cart
+==============================*/
+
+static void fakecart_command_sc64(fakecart_t* cart)
+{
+    u8  command = cart->command[3];
+    u32 arg1 = fakecart_be32(cart->command+4);
+    u32 arg2 = fakecart_be32(cart->command+8);
+    switch (command)
+    {
+        case 'W': // Write to SDRAM, replies once the data arrived
+            cart->pending = command;
+            cart->address = arg1;
+            cart->left = arg2;
+            return;
+        case 'D': // Debug data, doesn't reply
+            cart->pending = command;
+            fakecart_debugstart(cart, arg1, arg2);
+            return;
+    }
+    fakecart_cmp(cart, "CMP", command);
+}
+
+
+/*==============================
+    fakecart_command_everdrive
+    Executes an EverDrive command
+    @param A pointer to the cart
+==============================*/
+
+static void fakecart_command_everdrive(fakecart_t* cart)
+{
+    u8  command = cart->command[3];
+    u32 address = fakecart_be32(cart->command+4)-0x10000000;
+    u32 size = fakecart_be32(cart->command+8)*512;
+    u32 arg = fakecart_be32(cart->command+12);
+
+    // Debug packets come in 512 byte blocks, followed by a 16 byte CMPH block
+    if (cart->command[0] == 'D')
+    {
+        u32 header = fakecart_be32(cart->command+4);
+        cart->pending = command;
+        fakecart_debugstart(cart, header, (((header & 0xFFFFFF)+511) & ~511)+16);
+        return;
+    }
+    switch (command)
+    {
+        case 't': // Test
+        {
+            u8 reply[16] = {'c', 'm', 'd', 'r'};
+            fakecart_reply(cart, reply, 16);
+            break;
+        }
+        case 'W': // Write to SDRAM
+            cart->pending = command;
+            cart->address = address;
+            cart->left = size;
+            break;
+        case 'R': // Read from SDRAM
+            fakecart_reply(cart, cart->sdram+address, fakecart_sdram(address, size));
+            break;
+        case 'c': // Fill SDRAM
+            memset(cart->sdram+address, (u8)arg, fakecart_sdram(address, size));
+            break;
+    }
+}
+
+
+/*==============================
+    fakecart_receive
+    Handles bytes sent by the host
+    @param A pointer to the cart
+    @param The bytes that were sent
+    @param The number of bytes
+    @returns How many of the bytes were data for a command
+==============================*/
+
+static u32 fakecart_receive(fakecart_t* cart, const u8* data, u32 size)
+{
+    u32 databytes = 0;
+    if (cart->type == FAKECART_FT245)
+        return 0;
+    while (size > 0)
+    {
+        // If a command is waiting for data, give it to the command
+        if (cart->left > 0)
+        {
+            u32 count = (size < cart->left) ? size : cart->left;
+            if (cart->debugdata)
+            {
+                // Keep the packet, but not the padding after it
+                u32 keep = cart->debugsize-cart->debugfill;
+                if (keep > count)
+                    keep = count;
+                memcpy(cart->debug+cart->debugfill, data, keep);
+                cart->debugfill += keep;
+            }
+            else
+            {
+                u32 valid = fakecart_sdram(cart->address, count);
+                memcpy(cart->sdram+cart->address, data, valid);
+                for (int i=0; i<local_corruptcount; i++)
+                {
+                    if (!local_corrupted[i] && local_corrupt[i] >= cart->address && local_corrupt[i] < cart->address+valid)
+                    {
+                        cart->sdram[local_corrupt[i]] ^= 0x5A;
+                        local_corrupted[i] = true;
+                    }
+                }
+                if (valid > 0 && cart->address+valid > cart->written)
+                    cart->written = cart->address+valid;
+                cart->address += count;
+                databytes += count;
+            }
+            cart->left -= count;
+            data += count;
+            size -= count;
+            if (cart->left > 0)
+                continue;
+
+            // Reply once all the data arrived
+            if (cart->type == FAKECART_64DRIVE2 || (cart->type == FAKECART_SC64 && cart->pending == 'W'))
+                fakecart_cmp(cart, "CMP", cart->pending);
+
+            // Echo debug packets back, like a ROM running the USB library would
+            if (cart->debugdata)
+            {
+                cart->debugdata = false;
+                if (local_echo)
+                    fakecart_debugpacket(cart, cart->debugtype, cart->debug, cart->debugsize);
+            }
+            continue;
+        }
+
+        // Otherwise, it's part of a command
+        cart->command[cart->commandsize++] = *data++;
+        size--;
+
+        // Drop bytes until the command magic lines up
+        if ((cart->type == FAKECART_64DRIVE2 && cart->commandsize == 4 && memcmp(cart->command+1, "CMD", 3) != 0) ||
+            (cart->type == FAKECART_SC64 && cart->commandsize == 3 && memcmp(cart->command, "CMD", 3) != 0) ||
+            (cart->type == FAKECART_EVERDRIVE && cart->commandsize == 3 && memcmp(cart->command, "cmd", 3) != 0 && memcmp(cart->command, "DMA", 3) != 0))
+        {
+            memmove(cart->command, cart->command+1, --cart->commandsize);
+            continue;
+        }
+
+        // Execute it once it's complete
+        if (cart->commandsize == fakecart_commandsize(cart))
+        {
+            if (cart->type == FAKECART_64DRIVE2)
+                fakecart_command_64drive(cart);
+            else if (cart->type == FAKECART_SC64)
+                fakecart_command_sc64(cart);
+            else
+                fakecart_command_everdrive(cart);
+            cart->commandsize = 0;
+        }
+    }
+    return databytes;
+}
+
+
+/*==============================
+    fakeftdi_init
+    Plugs in the carts from the environment, or a
+    single 64drive, if nothing was set up
+==============================*/
+
+static void fakeftdi_init()
+{
+    int types[FAKECART_MAX];
+    int count = 0;
+    char* carts = getenv("FAKEFTDI_CARTS");
+    char* bandwidth = getenv("FAKEFTDI_BANDWIDTH");
+    char* echo = getenv("FAKEFTDI_ECHO");
+    char* corrupt = getenv("FAKEFTDI_CORRUPT");
+    if (local_cartcount > 0)
+        return;
+
+    // Read the list of carts
+    if (carts != NULL)
+    {
+        char* list = strdup(carts);
+        char* token;
+        for (token = strtok(list, ","); token != NULL && count < FAKECART_MAX; token = strtok(NULL, ","))
+        {
+            if (!strcmp(token, "64drive"))
+                types[count++] = FAKECART_64DRIVE2;
+            else if (!strcmp(token, "sc64"))
+                types[count++] = FAKECART_SC64;
+            else if (!strcmp(token, "everdrive"))
+                types[count++] = FAKECART_EVERDRIVE;
+            else if (!strcmp(token, "ft245"))
+                types[count++] = FAKECART_FT245;
+            else
+                fprintf(stderr, "fakeftdi: unknown cart '%s'.\n", token);
+        }
+        free(list);
+    }
+    if (count == 0)
+        types[count++] = FAKECART_64DRIVE2;
+
+    // Apply the other settings
+    local_echo = (echo == NULL || strcmp(echo, "0") != 0);
+    local_dump = getenv("FAKEFTDI_DUMP");
+    if (corrupt != NULL)
+    {
+        char* list = strdup(corrupt);
+        char* token;
+        for (token = strtok(list, ","); token != NULL && local_corruptcount < CORRUPT_MAX; token = strtok(NULL, ","))
+            local_corrupt[local_corruptcount++] = strtoul(token, NULL, 0);
+        free(list);
+    }
+    fakeftdi_setup(types, count, (bandwidth != NULL) ? atof(bandwidth) : 0);
+}
+
+
+/*==============================
+    fakeftdi_dump
+    Writes the part of a cart's SDRAM that was used to a file
+    @param The index of the cart
+==============================*/
+
+static void fakeftdi_dump(int index)
+{
+    char path[512];
+    FILE* fp;
+    if (index == 0)
+        snprintf(path, sizeof(path), "%s", local_dump);
+    else
+        snprintf(path, sizeof(path), "%s.%d", local_dump, index);
+    fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "fakeftdi: unable to open '%s' for writing.\n", path);
+        return;
+    }
+    fwrite(local_carts[index]->sdram, 1, local_carts[index]->written, fp);
+    fclose(fp);
+}
+
+
+/*==============================
+    fakeftdi_setup
+    Plugs in simulated carts, replacing any that were there
+    @param An array of FAKECART_ values
+    @param The number of carts
+    @param The bandwidth of the link in MB/s, or 0 for unlimited
+==============================*/
+
+void fakeftdi_setup(const int* types, int count, double bandwidth)
+{
+    int i;
+
+    // Unplug the old carts
+    for (i=0; i<local_cartcount; i++)
+    {
+        free(local_carts[i]->sdram);
+        free(local_carts[i]->reply);
+        free(local_carts[i]->debug);
+        delete local_carts[i];
+    }
+
+    // Plug in the new ones
+    if (count > FAKECART_MAX)
+        count = FAKECART_MAX;
+    for (i=0; i<count; i++)
+    {
+        fakecart_t* cart = new fakecart_t();
+        cart->type = types[i];
+        cart->sdram = (u8*) calloc(FAKECART_SDRAMSIZE, 1);
+        if (cart->sdram == NULL)
+        {
+            fprintf(stderr, "fakeftdi: unable to allocate memory for SDRAM.\n");
+            exit(1);
+        }
+        local_carts[i] = cart;
+    }
+    local_cartcount = count;
+    local_bandwidth = bandwidth*1024*1024;
+    fakeftdi_resetstats();
+}
+
+
+/*==============================
+    fakeftdi_resetstats
+    Starts a new measurement
+==============================*/
+
+void fakeftdi_resetstats()
+{
+    local_busyuntil = local_lastdata = fakeclock::now();
+    local_latencycount = 0;
+}
+
+
+/*==============================
+    fakeftdi_getlatencies
+    Gets the time between each write that carried data
+    @param A pointer to store the array of times (in seconds) in
+    @returns The number of times in the array
+==============================*/
+
+u32 fakeftdi_getlatencies(const double** latencies)
+{
+    *latencies = local_latencies;
+    return local_latencycount;
+}
+
+
+/*==============================
+    fakeftdi_getsdram
+    Gets the SDRAM backing store of a cart
+    @param The index of the cart
+    @returns A pointer to the SDRAM, or NULL if the cart doesn't exist
+==============================*/
+
+const u8* fakeftdi_getsdram(int index)
+{
+    if (index < 0 || index >= local_cartcount)
+        return NULL;
+    return local_carts[index]->sdram;
+}
+
+
+/*==============================
+    fakeftdi_debugsend
+    Makes a cart send a debug packet to the host, as if
+    the ROM running on it had called usb_write
+    @param The index of the cart
+    @param The DATATYPE_ of the packet
+    @param The data to send
+    @param The size of the data
+==============================*/
+
+void fakeftdi_debugsend(int index, int datatype, const void* data, u32 size)
+{
+    fakecart_t* cart;
+    fakeftdi_init();
+    if (index < 0 || index >= local_cartcount)
+        return;
+    cart = local_carts[index];
+    std::lock_guard<std::mutex> guard(cart->lock);
+    fakecart_debugpacket(cart, datatype, data, size & 0xFFFFFF);
+}
+
+
+/*********************************
+            D2XX API
+*********************************/
+
+FT_STATUS FT_CreateDeviceInfoList(LPDWORD lpdwNumDevs)
+{
+    fakeftdi_init();
+    *lpdwNumDevs = local_cartcount;
+    return FT_OK;
+}
+
+FT_STATUS FT_GetDeviceInfoList(FT_DEVICE_LIST_INFO_NODE* pDest, LPDWORD lpdwNumDevs)
+{
+    int i;
+    fakeftdi_init();
+    for (i=0; i<local_cartcount && (DWORD)i<*lpdwNumDevs; i++)
+    {
+        memset(&pDest[i], 0, sizeof(FT_DEVICE_LIST_INFO_NODE));
+        pDest[i].LocId = 0x100+i;
+        sprintf(pDest[i].SerialNumber, "FAKE%d%03d", local_carts[i]->type, i); // Different carts never share a serial number
+        switch (local_carts[i]->type)
+        {
+            case FAKECART_64DRIVE2:
+                pDest[i].ID = 0x4036014;
+                strcpy(pDest[i].Description, "64drive USB device");
+                break;
+            case FAKECART_SC64:
+                pDest[i].ID = 0x4036014;
+                strcpy(pDest[i].Description, "SummerCart64");
+                break;
+            case FAKECART_EVERDRIVE:
+            case FAKECART_FT245:
+                pDest[i].ID = 0x4036001;
+                strcpy(pDest[i].Description, "FT245R USB FIFO");
+                break;
+        }
+    }
+    *lpdwNumDevs = i;
+    return FT_OK;
+}
+
+FT_STATUS FT_Open(int deviceNumber, FT_HANDLE* pHandle)
+{
+    fakeftdi_init();
+    if (deviceNumber < 0 || deviceNumber >= local_cartcount)
+        return FT_DEVICE_NOT_FOUND;
+    if (local_carts[deviceNumber]->open)
+        return FT_DEVICE_NOT_OPENED;
+    local_carts[deviceNumber]->open = true;
+    *pHandle = local_carts[deviceNumber];
+    return FT_OK;
+}
+
+FT_STATUS FT_Close(FT_HANDLE ftHandle)
+{
+    int i;
+    fakecart_t* cart = (fakecart_t*)ftHandle;
+    std::lock_guard<std::mutex> guard(cart->lock);
+    cart->open = false;
+    cart->replysize = cart->replyread = 0;
+    cart->commandsize = cart->left = 0;
+    cart->debugdata = false;
+    cart->event = NULL;
+    if (local_dump != NULL)
+        for (i=0; i<local_cartcount; i++)
+            if (local_carts[i] == cart)
+                fakeftdi_dump(i);
+    return FT_OK;
+}
+
+FT_STATUS FT_Write(FT_HANDLE ftHandle, LPVOID lpBuffer, DWORD dwBytesToWrite, LPDWORD lpBytesWritten)
+{
+    fakecart_t* cart = (fakecart_t*)ftHandle;
+    u32 databytes;
+    {
+        std::lock_guard<std::mutex> guard(cart->lock);
+        databytes = fakecart_receive(cart, (const u8*)lpBuffer, dwBytesToWrite);
+    }
+
+    // Pretend the bytes took a while to get through the link
+    if (local_bandwidth > 0)
+    {
+        fakeclock::time_point busyuntil;
+        {
+            std::lock_guard<std::mutex> guard(local_statslock);
+            fakeclock::time_point now = fakeclock::now();
+            if (local_busyuntil < now)
+                local_busyuntil = now;
+            local_busyuntil += std::chrono::duration_cast<fakeclock::duration>(std::chrono::duration<double>(dwBytesToWrite/local_bandwidth));
+            busyuntil = local_busyuntil;
+        }
+        std::this_thread::sleep_until(busyuntil);
+    }
+
+    // Remember how long it's been since the last write with data
+    if (databytes > 0)
+    {
+        std::lock_guard<std::mutex> guard(local_statslock);
+        fakeclock::time_point now = fakeclock::now();
+        if (local_latencycount == local_latencycap)
+        {
+            local_latencycap = local_latencycap*2+64;
+            local_latencies = (double*) realloc(local_latencies, sizeof(double)*local_latencycap);
+        }
+        local_latencies[local_latencycount++] = std::chrono::duration<double>(now-local_lastdata).count();
+        local_lastdata = now;
+    }
+    *lpBytesWritten = dwBytesToWrite;
+    return FT_OK;
+}
+
+FT_STATUS FT_Read(FT_HANDLE ftHandle, LPVOID lpBuffer, DWORD dwBytesToRead, LPDWORD lpBytesReturned)
+{
+    fakecart_t* cart = (fakecart_t*)ftHandle;
+    std::unique_lock<std::mutex> guard(cart->lock);
+    u32 count;
+
+    // Like the real driver, wait until all the bytes arrived or the timeout ran out
+    auto arrived = [&]{return cart->replysize-cart->replyread >= dwBytesToRead;};
+    if (cart->readtimeout == 0)
+        cart->signal.wait(guard, arrived);
+    else
+        cart->signal.wait_for(guard, std::chrono::milliseconds(cart->readtimeout), arrived);
+    count = cart->replysize-cart->replyread;
+    if (count > dwBytesToRead)
+        count = dwBytesToRead;
+    memcpy(lpBuffer, cart->reply+cart->replyread, count);
+    cart->replyread += count;
+    *lpBytesReturned = count;
+    return FT_OK;
+}
+
+FT_STATUS FT_GetQueueStatus(FT_HANDLE ftHandle, DWORD* dwRxBytes)
+{
+    fakecart_t* cart = (fakecart_t*)ftHandle;
+    std::lock_guard<std::mutex> guard(cart->lock);
+    *dwRxBytes = cart->replysize-cart->replyread;
+    return FT_OK;
+}
+
+FT_STATUS FT_SetEventNotification(FT_HANDLE ftHandle, DWORD Mask, PVOID Param)
+{
+    fakecart_t* cart = (fakecart_t*)ftHandle;
+    std::lock_guard<std::mutex> guard(cart->lock);
+    cart->eventmask = Mask;
+    cart->event = (EVENT_HANDLE*)Param;
+    return FT_OK;
+}
+
+FT_STATUS FT_Purge(FT_HANDLE ftHandle, ULONG Mask)
+{
+    fakecart_t* cart = (fakecart_t*)ftHandle;
+    std::lock_guard<std::mutex> guard(cart->lock);
+    if (Mask & FT_PURGE_RX)
+        cart->replysize = cart->replyread = 0;
+    return FT_OK;
+}
+
+FT_STATUS FT_ResetDevice(FT_HANDLE ftHandle)
+{
+    return FT_OK;
+}
+
+FT_STATUS FT_ResetPort(FT_HANDLE ftHandle)
+{
+    return FT_OK;
+}
+
+FT_STATUS FT_SetTimeouts(FT_HANDLE ftHandle, ULONG ReadTimeout, ULONG WriteTimeout)
+{
+    fakecart_t* cart = (fakecart_t*)ftHandle;
+    std::lock_guard<std::mutex> guard(cart->lock);
+    cart->readtimeout = ReadTimeout;
+    return FT_OK;
+}
+
+FT_STATUS FT_SetBitMode(FT_HANDLE ftHandle, UCHAR ucMask, UCHAR ucEnable)
+{
+    return FT_OK;
+}
+
+FT_STATUS FT_SetLatencyTimer(FT_HANDLE ftHandle, UCHAR ucLatency)
+{
+    return FT_OK;
+}
+
+FT_STATUS FT_SetUSBParameters(FT_HANDLE ftHandle, ULONG ulInTransferSize, ULONG ulOutTransferSize)
+{
+    return FT_OK;
+}
@@ -0,0 +1,28 @@
+#ifndef __FAKEFTDI_HEADER
+#define __FAKEFTDI_HEADER
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define FAKECART_64DRIVE2  0
+    #define FAKECART_SC64      1
+    #define FAKECART_EVERDRIVE 2
+    #define FAKECART_FT245     3 // Some other device with the same USB chip as the EverDrive, which never answers
+
+    #define FAKECART_MAX       8
+    #define FAKECART_SDRAMSIZE 64*1024*1024
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    void      fakeftdi_setup(const int* types, int count, double bandwidth);
+    void      fakeftdi_resetstats();
+    u32       fakeftdi_getlatencies(const double** latencies);
+    const u8* fakeftdi_getsdram(int index);
+    void      fakeftdi_debugsend(int index, int datatype, const void* data, u32 size);
+
+#endif
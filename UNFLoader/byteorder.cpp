@@ -0,0 +1,297 @@
+/***************************************************************
+                          byteorder.cpp
+
+Detects the byte order of a ROM and converts it to big endian.
+The conversion kernel (AVX2, SSSE3, SSE2 or plain C) is picked
+at runtime based on what the CPU supports.
+***************************************************************/
+
+#include "main.h"
+#include "helper.h"
+#include "byteorder.h"
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define BYTEORDER_X86
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #define TARGET(isa)
+    #else
+        #define TARGET(isa) __attribute__((target(isa)))
+    #endif
+#endif
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef void (*byteorder_func)(u8* dest, const u8* src, u32 size);
+
+typedef struct {
+    const char*    name;
+    byteorder_func swap16;
+    byteorder_func swap32;
+} byteorder_kernel_t;
+
+
+/*==============================
+    byteorder_swap16_scalar
+    Swaps every pair of bytes
+    @param The buffer to write to (can be the same as the source)
+    @param The buffer to read from
+    @param The number of bytes
+==============================*/
+
+static void byteorder_swap16_scalar(u8* dest, const u8* src, u32 size)
+{
+    u32 i;
+    for (i=0; i+1<size; i+=2)
+    {
+        u8 temp = src[i];
+        dest[i] = src[i+1];
+        dest[i+1] = temp;
+    }
+    if (i < size)
+        dest[i] = src[i];
+}
+
+
+/*==============================
+    byteorder_swap32_scalar
+    Reverses every group of four bytes
+    @param The buffer to write to (can be the same as the source)
+    @param The buffer to read from
+    @param The number of bytes
+==============================*/
+
+static void byteorder_swap32_scalar(u8* dest, const u8* src, u32 size)
+{
+    u32 i;
+    for (i=0; i+3<size; i+=4)
+    {
+        u8 temp0 = src[i], temp1 = src[i+1];
+        dest[i] = src[i+3];
+        dest[i+1] = src[i+2];
+        dest[i+2] = temp1;
+        dest[i+3] = temp0;
+    }
+    for (; i<size; i++)
+        dest[i] = src[i];
+}
+
+
+#ifdef BYTEORDER_X86
+
+/*==============================
+    byteorder_swap16_sse2
+    SSE2 version of byteorder_swap16_scalar
+==============================*/
+
+TARGET("sse2") static void byteorder_swap16_sse2(u8* dest, const u8* src, u32 size)
+{
+    u32 i;
+    for (i=0; i+16<=size; i+=16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i*)(dest+i), v);
+    }
+    byteorder_swap16_scalar(dest+i, src+i, size-i);
+}
+
+
+/*==============================
+    byteorder_swap32_sse2
+    SSE2 version of byteorder_swap32_scalar
+==============================*/
+
+TARGET("sse2") static void byteorder_swap32_sse2(u8* dest, const u8* src, u32 size)
+{
+    u32 i;
+    for (i=0; i+16<=size; i+=16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1); // Swap the 16-bit halves
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i*)(dest+i), v);
+    }
+    byteorder_swap32_scalar(dest+i, src+i, size-i);
+}
+
+
+/*==============================
+    byteorder_swap16_ssse3
+    SSSE3 version of byteorder_swap16_scalar
+==============================*/
+
+TARGET("ssse3") static void byteorder_swap16_ssse3(u8* dest, const u8* src, u32 size)
+{
+    u32 i;
+    const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (i=0; i+16<=size; i+=16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+        _mm_storeu_si128((__m128i*)(dest+i), _mm_shuffle_epi8(v, mask));
+    }
+    byteorder_swap16_scalar(dest+i, src+i, size-i);
+}
+
+
+/*==============================
+    byteorder_swap32_ssse3
+    SSSE3 version of byteorder_swap32_scalar
+==============================*/
+
+TARGET("ssse3") static void byteorder_swap32_ssse3(u8* dest, const u8* src, u32 size)
+{
+    u32 i;
+    const __m128i mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (i=0; i+16<=size; i+=16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+        _mm_storeu_si128((__m128i*)(dest+i), _mm_shuffle_epi8(v, mask));
+    }
+    byteorder_swap32_scalar(dest+i, src+i, size-i);
+}
+
+
+/*==============================
+    byteorder_swap16_avx2
+    AVX2 version of byteorder_swap16_scalar
+==============================*/
+
+TARGET("avx2") static void byteorder_swap16_avx2(u8* dest, const u8* src, u32 size)
+{
+    u32 i;
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (i=0; i+64<=size; i+=64)
+    {
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(src+i));
+        __m256i v2 = _mm256_loadu_si256((const __m256i*)(src+i+32));
+        _mm256_storeu_si256((__m256i*)(dest+i), _mm256_shuffle_epi8(v1, mask));
+        _mm256_storeu_si256((__m256i*)(dest+i+32), _mm256_shuffle_epi8(v2, mask));
+    }
+    byteorder_swap16_scalar(dest+i, src+i, size-i);
+}
+
+
+/*==============================
+    byteorder_swap32_avx2
+    AVX2 version of byteorder_swap32_scalar
+==============================*/
+
+TARGET("avx2") static void byteorder_swap32_avx2(u8* dest, const u8* src, u32 size)
+{
+    u32 i;
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (i=0; i+64<=size; i+=64)
+    {
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(src+i));
+        __m256i v2 = _mm256_loadu_si256((const __m256i*)(src+i+32));
+        _mm256_storeu_si256((__m256i*)(dest+i), _mm256_shuffle_epi8(v1, mask));
+        _mm256_storeu_si256((__m256i*)(dest+i+32), _mm256_shuffle_epi8(v2, mask));
+    }
+    byteorder_swap32_scalar(dest+i, src+i, size-i);
+}
+
+#endif
+
+
+/*==============================
+    byteorder_pick
+    Picks the fastest conversion kernel this CPU supports
+    @returns A pointer to the kernel
+==============================*/
+
+static const byteorder_kernel_t* byteorder_pick()
+{
+    static const byteorder_kernel_t scalar = {"scalar", byteorder_swap16_scalar, byteorder_swap32_scalar};
+    #ifdef BYTEORDER_X86
+        static const byteorder_kernel_t sse2 = {"SSE2", byteorder_swap16_sse2, byteorder_swap32_sse2};
+        static const byteorder_kernel_t ssse3 = {"SSSE3", byteorder_swap16_ssse3, byteorder_swap32_ssse3};
+        static const byteorder_kernel_t avx2 = {"AVX2", byteorder_swap16_avx2, byteorder_swap32_avx2};
+        if (cpu_has_avx2())
+            return &avx2;
+        if (cpu_has_ssse3())
+            return &ssse3;
+        if (cpu_has_sse2())
+            return &sse2;
+    #endif
+    return &scalar;
+}
+
+
+/*==============================
+    byteorder_detect
+    Figures out the byte order of a ROM from its first word
+    @param A pointer to the first 4 bytes of the ROM
+    @returns The BYTEORDER_ value of the ROM
+==============================*/
+
+int byteorder_detect(const u8* header)
+{
+    // The first byte of every ROM is the PI domain 1 setting, which is always 0x80
+    if (header[0] == 0x80)
+        return BYTEORDER_Z64;
+    if (header[1] == 0x80)
+        return BYTEORDER_V64;
+    if (header[3] == 0x80)
+        return BYTEORDER_N64;
+
+    // Doesn't look like an N64 ROM, so send it as is
+    return BYTEORDER_Z64;
+}
+
+
+/*==============================
+    byteorder_convert
+    Converts data to big endian
+    @param The buffer to write to (can be the same as the source)
+    @param The buffer to read from
+    @param The number of bytes
+    @param The BYTEORDER_ value of the source
+==============================*/
+
+void byteorder_convert(u8* dest, const u8* src, u32 size, int order)
+{
+    static const byteorder_kernel_t* kernel = byteorder_pick();
+    switch (order)
+    {
+        case BYTEORDER_V64: kernel->swap16(dest, src, size); break;
+        case BYTEORDER_N64: kernel->swap32(dest, src, size); break;
+        default:
+            if (dest != src)
+                memcpy(dest, src, size);
+    }
+}
+
+
+/*==============================
+    byteorder_name
+    Returns the file extension commonly used for a byte order
+    @param The BYTEORDER_ value
+    @returns A string with the name
+==============================*/
+
+const char* byteorder_name(int order)
+{
+    switch (order)
+    {
+        case BYTEORDER_V64: return ".v64";
+        case BYTEORDER_N64: return ".n64";
+        default:            return ".z64";
+    }
+}
+
+
+/*==============================
+    byteorder_kernel
+    Returns the name of the conversion kernel in use
+    @returns A string with the name
+==============================*/
+
+const char* byteorder_kernel()
+{
+    return byteorder_pick()->name;
+}
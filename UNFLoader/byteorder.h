@@ -0,0 +1,23 @@
+#ifndef __BYTEORDER_HEADER
+#define __BYTEORDER_HEADER
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define BYTEORDER_Z64 0 // Big endian, what the N64 expects
+    #define BYTEORDER_V64 1 // Every 16-bit word byteswapped
+    #define BYTEORDER_N64 2 // Every 32-bit word little endian
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    int         byteorder_detect(const u8* header);
+    void        byteorder_convert(u8* dest, const u8* src, u32 size, int order);
+    const char* byteorder_name(int order);
+    const char* byteorder_kernel();
+
+#endif
@@ -0,0 +1,159 @@
+/***************************************************************
+                          cartcache.cpp
+
+Remembers which USB devices turned out to be flashcarts, so that
+autodetection can skip the handshake with them next time. Each
+line of the cache file has the serial number of the device's USB
+chip (or '-' if it doesn't have one), its location, the type of
+cart that was found there, and the device's ID and description.
+The last two have to match for the line to be trusted, so that a
+different cart that ends up with the same serial number or port
+is probed again.
+***************************************************************/
+
+#include "main.h"
+#include "helper.h"
+#include "device.h"
+#include "cartcache.h"
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define LINE_SIZE 256
+
+
+/*==============================
+    cartcache_matches
+    Checks if a line of the cache file is about a device
+    @param The serial number in the line
+    @param The location in the line
+    @param A string with the serial number of the device
+    @param The location of the device
+    @returns Whether the line is about the device
+==============================*/
+
+static bool cartcache_matches(const char* lineserial, DWORD linelocation, const char* serial, DWORD location)
+{
+    // Devices without a serial number can only be told apart by the port they're plugged into
+    if (serial[0] == '\0')
+        return (!strcmp(lineserial, "-") && linelocation == location);
+    return !strcmp(lineserial, serial);
+}
+
+
+/*==============================
+    cartcache_lookup
+    Looks for a device in the cache
+    @param A string with the serial number of the device
+    @param The location of the device
+    @param The ID of the device
+    @param A string with the description of the device
+    @returns The type of cart that was found there before, or
+             CART_NONE if it isn't in the cache or the device
+             changed since
+==============================*/
+
+int cartcache_lookup(const char* serial, DWORD location, DWORD id, const char* description)
+{
+    char  line[LINE_SIZE];
+    char* path = gen_configpath(CARTCACHE_FILENAME);
+    FILE* fp;
+    int   carttype = CART_NONE;
+    if (path == NULL)
+        return CART_NONE;
+
+    // Open the cache file, if there is one
+    fp = fopen(path, "r");
+    free(path);
+    if (fp == NULL)
+        return CART_NONE;
+
+    // Look for the line with our device
+    while (carttype == CART_NONE && fgets(line, LINE_SIZE, fp) != NULL)
+    {
+        char name[LINE_SIZE];
+        unsigned int readlocation;
+        unsigned int readid;
+        int readtype;
+        int descstart = 0;
+        if (sscanf(line, "%255s %x %d %x %n", name, &readlocation, &readtype, &readid, &descstart) != 4 || !cartcache_matches(name, readlocation, serial, location))
+            continue;
+
+        // Only trust it if the device still describes itself the same way
+        line[strcspn(line, "\r\n")] = '\0';
+        if (readid == (unsigned int)id && !strcmp(line+descstart, description))
+            carttype = readtype;
+    }
+    fclose(fp);
+    return carttype;
+}
+
+
+/*==============================
+    cartcache_store
+    Stores the type of cart a device is, replacing
+    what was there before
+    @param A string with the serial number of the device
+    @param The location of the device
+    @param The ID of the device
+    @param A string with the description of the device
+    @param The type of cart, or CART_NONE to forget the device
+    @returns Whether the cache was updated
+==============================*/
+
+bool cartcache_store(const char* serial, DWORD location, DWORD id, const char* description, int carttype)
+{
+    char  line[LINE_SIZE];
+    char* path = gen_configpath(CARTCACHE_FILENAME);
+    char* temppath;
+    FILE* fp;
+    FILE* tempfp;
+    if (path == NULL)
+        return false;
+
+    // Write the new file next to the old one, so that the old one survives if something goes wrong
+    temppath = (char*) malloc(strlen(path)+5);
+    if (temppath == NULL)
+    {
+        free(path);
+        return false;
+    }
+    sprintf(temppath, "%s.tmp", path);
+    tempfp = fopen(temppath, "w");
+    if (tempfp == NULL)
+    {
+        free(temppath);
+        free(path);
+        return false;
+    }
+
+    // Copy over the other devices
+    fp = fopen(path, "r");
+    if (fp != NULL)
+    {
+        while (fgets(line, LINE_SIZE, fp) != NULL)
+        {
+            char name[LINE_SIZE];
+            unsigned int readlocation;
+            if (sscanf(line, "%255s %x", name, &readlocation) == 2 && !cartcache_matches(name, readlocation, serial, location))
+                fputs(line, tempfp);
+        }
+        fclose(fp);
+    }
+
+    // Add ours, and replace the old file
+    if (carttype != CART_NONE)
+        fprintf(tempfp, "%s %x %d %x %s\n", (serial[0] != '\0') ? serial : "-", (unsigned int)location, carttype, (unsigned int)id, description);
+    fclose(tempfp);
+    if (!replace_file(temppath, path))
+    {
+        free(temppath);
+        free(path);
+        return false;
+    }
+    free(temppath);
+    free(path);
+    return true;
+}
@@ -0,0 +1,19 @@
+#ifndef __CARTCACHE_HEADER
+#define __CARTCACHE_HEADER
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define CARTCACHE_FILENAME "carts.txt"
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    int  cartcache_lookup(const char* serial, DWORD location, DWORD id, const char* description);
+    bool cartcache_store(const char* serial, DWORD location, DWORD id, const char* description, int carttype);
+
+#endif
@@ -0,0 +1,340 @@
+/***************************************************************
+                           checksum.cpp
+
+Calculates the CRC1 and CRC2 checksums that the bootcode checks
+before running a ROM, while the ROM goes through the upload
+pipeline. The bytes are swapped and rotated eight words at a time
+with AVX2 when the CPU supports it. The rest of the algorithm
+depends on the running sums of every previous word, so it stays
+serial.
+***************************************************************/
+
+#include "main.h"
+#include "helper.h"
+#include "checksum.h"
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define CHECKSUM_X86
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #define TARGET(isa)
+    #else
+        #define TARGET(isa) __attribute__((target(isa)))
+    #endif
+#endif
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define BATCH_WORDS 256 // How many words to swap and rotate at a time
+
+// The CIC values returned by cic_from_hash that have a known checksum
+#define CIC_X103 4
+#define CIC_X105 5
+#define CIC_X106 6
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef void (*checksum_func)(const u8* data, u32 count, u32* words, u32* rotated);
+
+
+/*==============================
+    checksum_be32
+    Reads a big endian word
+    @param A pointer to the word
+    @returns The word
+==============================*/
+
+static u32 checksum_be32(const u8* data)
+{
+    return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+
+/*==============================
+    checksum_words_scalar
+    Reads big endian words, and rotates each one left
+    by its own lowest five bits
+    @param A pointer to the data
+    @param The number of words
+    @param An array to store the words in
+    @param An array to store the rotated words in
+==============================*/
+
+static void checksum_words_scalar(const u8* data, u32 count, u32* words, u32* rotated)
+{
+    u32 i;
+    for (i=0; i<count; i++)
+    {
+        u32 word = checksum_be32(data+i*4);
+        u32 shift = word & 0x1F;
+        words[i] = word;
+        rotated[i] = (shift == 0) ? word : (word << shift) | (word >> (32-shift));
+    }
+}
+
+
+#ifdef CHECKSUM_X86
+
+/*==============================
+    checksum_words_avx2
+    AVX2 version of checksum_words_scalar
+==============================*/
+
+TARGET("avx2") static void checksum_words_avx2(const u8* data, u32 count, u32* words, u32* rotated)
+{
+    u32 i;
+    const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i mask = _mm256_set1_epi32(0x1F);
+    const __m256i bits = _mm256_set1_epi32(32);
+    for (i=0; i+8<=count; i+=8)
+    {
+        __m256i word = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(data+i*4)), swap);
+        __m256i shift = _mm256_and_si256(word, mask);
+
+        // Shifting right by 32 gives zero, so a rotation by 0 works out
+        __m256i rotate = _mm256_or_si256(_mm256_sllv_epi32(word, shift), _mm256_srlv_epi32(word, _mm256_sub_epi32(bits, shift)));
+        _mm256_storeu_si256((__m256i*)(words+i), word);
+        _mm256_storeu_si256((__m256i*)(rotated+i), rotate);
+    }
+    checksum_words_scalar(data+i*4, count-i, words+i, rotated+i);
+}
+
+#endif
+
+
+/*==============================
+    checksum_pick
+    Picks the fastest word kernel this CPU supports
+    @returns A pointer to the kernel
+==============================*/
+
+static checksum_func checksum_pick()
+{
+    #ifdef CHECKSUM_X86
+        if (cpu_has_avx2())
+            return checksum_words_avx2;
+    #endif
+    return checksum_words_scalar;
+}
+
+
+/*==============================
+    checksum_process
+    Runs the checksum over words of the ROM
+    @param A pointer to the checksum state
+    @param A pointer to the words, or NULL for zeroes
+    @param The offset of the words in the ROM
+    @param The number of words
+==============================*/
+
+static void checksum_process(checksum_t* checksum, const u8* data, u32 offset, u32 count)
+{
+    static const checksum_func kernel = checksum_pick();
+    u32 words[BATCH_WORDS], rotated[BATCH_WORDS];
+    u32 t1 = checksum->state[0], t2 = checksum->state[1], t3 = checksum->state[2];
+    u32 t4 = checksum->state[3], t5 = checksum->state[4], t6 = checksum->state[5];
+    if (data == NULL)
+    {
+        memset(words, 0, sizeof(words));
+        memset(rotated, 0, sizeof(rotated));
+    }
+
+    while (count > 0)
+    {
+        u32 i, batch = (count < BATCH_WORDS) ? count : BATCH_WORDS;
+        if (data != NULL)
+        {
+            kernel(data, batch, words, rotated);
+            data += batch*4;
+        }
+
+        // Each step depends on the sums of all the words before it
+        for (i=0; i<batch; i++, offset+=4)
+        {
+            u32 word = words[i];
+            if (t6+word < t6)
+                t4++;
+            t6 += word;
+            t3 ^= word;
+            t5 += rotated[i];
+            if (t2 > word)
+                t2 ^= rotated[i];
+            else
+                t2 ^= t6 ^ word;
+            if (checksum->cic == CIC_X105)
+                t1 += checksum_be32(checksum->boot+0x750+(offset & 0xFF)) ^ word;
+            else
+                t1 += t5 ^ word;
+        }
+        count -= batch;
+    }
+
+    checksum->state[0] = t1; checksum->state[1] = t2; checksum->state[2] = t3;
+    checksum->state[3] = t4; checksum->state[4] = t5; checksum->state[5] = t6;
+}
+
+
+/*==============================
+    checksum_start
+    Prepares for a new ROM
+    @param A pointer to the checksum state
+==============================*/
+
+void checksum_start(checksum_t* checksum)
+{
+    checksum->cic = -1;
+    checksum->offset = 0;
+    checksum->complete = false;
+    checksum->fixed = false;
+}
+
+
+/*==============================
+    checksum_update
+    Feeds the next part of the ROM to the checksum
+    @param A pointer to the checksum state
+    @param A pointer to the (big endian) data
+    @param The offset of the data in the ROM
+    @param The number of bytes
+==============================*/
+
+void checksum_update(checksum_t* checksum, const u8* data, u32 offset, u32 size)
+{
+    u32 start, end;
+
+    // Parts of the ROM must come in order, otherwise the checksum can't be known
+    if (checksum->complete)
+        return;
+    if (offset != checksum->offset)
+    {
+        checksum->cic = -1;
+        return;
+    }
+    checksum->offset = offset+size;
+
+    // Keep the header and bootcode, and use them to find out which CIC the ROM is for
+    if (offset < CHECKSUM_START)
+    {
+        u32 count = CHECKSUM_START-offset;
+        if (count > size)
+            count = size;
+        memcpy(checksum->boot+offset, data, count);
+        if (offset+count == CHECKSUM_START)
+        {
+            u32 seed;
+            checksum->cic = cic_from_hash(romhash(checksum->boot+0x40, 4032));
+            switch (checksum->cic)
+            {
+                case 0:
+                case 1:
+                case 2:
+                case 3:        seed = 0xF8CA4DDC; break;
+                case CIC_X103: seed = 0xA3886759; break;
+                case CIC_X105: seed = 0xDF26F436; break;
+                case CIC_X106: seed = 0x1FEA617A; break;
+                default:       checksum->cic = -1; return;
+            }
+            for (int i=0; i<6; i++)
+                checksum->state[i] = seed;
+        }
+    }
+    if (checksum->cic == -1)
+        return;
+
+    // Run the checksum over the part of the data that's in the checksummed area
+    start = (offset > CHECKSUM_START) ? offset : CHECKSUM_START;
+    end = offset+size;
+    if (end > CHECKSUM_START+CHECKSUM_LENGTH)
+        end = CHECKSUM_START+CHECKSUM_LENGTH;
+    if (start >= end)
+        return;
+    checksum_process(checksum, data+(start-offset), start, (end-start)/4);
+
+    // The ROM can only end in the middle of a word, so pad the last word with zeroes
+    if ((end-start) % 4 != 0)
+    {
+        u8 last[4] = {0, 0, 0, 0};
+        memcpy(last, data+(end-offset)-((end-start) % 4), (end-start) % 4);
+        checksum_process(checksum, last, end-((end-start) % 4), 1);
+        checksum->offset += 4-((end-start) % 4);
+    }
+}
+
+
+/*==============================
+    checksum_finish
+    Calculates the CRCs once the whole ROM was seen.
+    ROMs that end early are padded with zeroes
+    @param A pointer to the checksum state
+==============================*/
+
+void checksum_finish(checksum_t* checksum)
+{
+    u32 t1, t2, t3, t4, t5, t6;
+    if (checksum->complete || checksum->cic == -1)
+        return;
+
+    // Pad the ROM up to the end of the checksummed area
+    if (checksum->offset < CHECKSUM_START+CHECKSUM_LENGTH)
+        checksum_process(checksum, NULL, checksum->offset, (CHECKSUM_START+CHECKSUM_LENGTH-checksum->offset)/4);
+
+    // Combine the sums the way the bootcode does
+    t1 = checksum->state[0]; t2 = checksum->state[1]; t3 = checksum->state[2];
+    t4 = checksum->state[3]; t5 = checksum->state[4]; t6 = checksum->state[5];
+    switch (checksum->cic)
+    {
+        case CIC_X103:
+            checksum->crc[0] = (t6 ^ t4) + t3;
+            checksum->crc[1] = (t5 ^ t2) + t1;
+            break;
+        case CIC_X106:
+            checksum->crc[0] = (t6 * t4) + t3;
+            checksum->crc[1] = (t5 * t2) + t1;
+            break;
+        default:
+            checksum->crc[0] = t6 ^ t4 ^ t3;
+            checksum->crc[1] = t5 ^ t2 ^ t1;
+    }
+    checksum->complete = true;
+}
+
+
+/*==============================
+    checksum_wrong
+    Checks if the CRCs in the ROM header are wrong
+    @param A pointer to the checksum state
+    @returns Whether the CRCs are known and don't match the header
+==============================*/
+
+bool checksum_wrong(checksum_t* checksum)
+{
+    if (!checksum->complete || checksum->fixed)
+        return false;
+    return checksum_be32(checksum->boot+0x10) != checksum->crc[0] || checksum_be32(checksum->boot+0x14) != checksum->crc[1];
+}
+
+
+/*==============================
+    checksum_fixheader
+    Puts the correct CRCs in the copy of the ROM header
+    @param A pointer to the checksum state
+    @returns A pointer to the first CHECKSUM_HEADER bytes of
+             the ROM, with the correct CRCs
+==============================*/
+
+u8* checksum_fixheader(checksum_t* checksum)
+{
+    int i;
+    for (i=0; i<4; i++)
+    {
+        checksum->boot[0x10+i] = (checksum->crc[0] >> (24-i*8)) & 0xFF;
+        checksum->boot[0x14+i] = (checksum->crc[1] >> (24-i*8)) & 0xFF;
+    }
+    return checksum->boot;
+}
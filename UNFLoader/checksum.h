@@ -0,0 +1,39 @@
+#ifndef __CHECKSUM_HEADER
+#define __CHECKSUM_HEADER
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define CHECKSUM_START   0x1000   // Where the checksummed area of the ROM starts
+    #define CHECKSUM_LENGTH  0x100000 // How many bytes the checksum covers
+    #define CHECKSUM_HEADER  512      // How many bytes to resend when the checksum is fixed
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct {
+        int  cic;       // The CIC the checksum is calculated for, or -1 if it's unknown
+        u32  offset;    // How much of the ROM was processed so far
+        u32  state[6];
+        u32  crc[2];    // The correct CRC1 and CRC2
+        bool complete;  // Whether the CRCs were calculated
+        bool fixed;     // Whether the correct CRCs were sent to the cart
+        u8   boot[CHECKSUM_START]; // The header and bootcode
+    } checksum_t;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    void checksum_start(checksum_t* checksum);
+    void checksum_update(checksum_t* checksum, const u8* data, u32 offset, u32 size);
+    void checksum_finish(checksum_t* checksum);
+    bool checksum_wrong(checksum_t* checksum);
+    u8*  checksum_fixheader(checksum_t* checksum);
+
+#endif
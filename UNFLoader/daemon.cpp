@@ -0,0 +1,635 @@
+/***************************************************************
+                           daemon.cpp
+
+Keeps the flashcarts open between uploads, so that each one
+doesn't pay for setting up the console and the USB link again.
+The daemon listens on a Unix socket in the config folder, and
+instances of UNFLoader started with -remote send it requests,
+one per line:
+
+    upload <path>   Uploads a ROM
+    send <command>  Sends a command to the carts, like debug mode
+    capture         Sends the client everything that's printed
+    stop            Stops the daemon
+
+Everything that's printed while a request is handled is sent
+to the client that made it, followed by DAEMON_DONE and '0' or
+'1'. The carts' debug output is handled between requests. The
+client turns the paths it sends into absolute ones, since the
+daemon's working directory is its own.
+***************************************************************/
+
+#include "main.h"
+#include "helper.h"
+#include "device.h"
+#include "debug.h"
+#include "daemon.h"
+#include "usbreader.h"
+#ifdef LINUX
+    #include <poll.h>
+    #include <errno.h>
+    #include <signal.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <limits.h>
+#endif
+
+
+#ifdef LINUX
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef struct {
+    int  fd;
+    char line[DAEMON_LINE]; // The request being received
+    u32  linesize;
+    bool capture;           // Whether the client wants everything that's printed
+    char* out;              // Output that's waiting for the client to read it
+    u32  outsize;
+    u32  outcap;
+} daemon_conn_t;
+
+
+/*********************************
+             Globals
+*********************************/
+
+static daemon_conn_t  local_conns[DAEMON_CLIENTS];
+static int            local_conncount = 0;
+static daemon_conn_t* local_requester = NULL; // The client whose request is being handled
+
+
+/*==============================
+    daemon_address
+    Finds where the daemon's socket goes
+    @param A pointer to the address to fill in
+    @returns Whether there's a place for the socket
+==============================*/
+
+static bool daemon_address(struct sockaddr_un* address)
+{
+    char* path = gen_configpath(DAEMON_SOCKET);
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (path == NULL || strlen(path) >= sizeof(address->sun_path))
+    {
+        free(path);
+        return false;
+    }
+    strcpy(address->sun_path, path);
+    free(path);
+    return true;
+}
+
+
+/*==============================
+    daemon_disconnect
+    Disconnects a client, throwing away its waiting output
+    @param A pointer to the client
+==============================*/
+
+static void daemon_disconnect(daemon_conn_t* conn)
+{
+    if (conn->fd >= 0)
+        close(conn->fd);
+    conn->fd = -1;
+    free(conn->out);
+    conn->out = NULL;
+    conn->outsize = 0;
+    conn->outcap = 0;
+}
+
+
+/*==============================
+    daemon_flush
+    Sends as much of a client's waiting output as it can
+    take without blocking
+    @param A pointer to the client
+==============================*/
+
+static void daemon_flush(daemon_conn_t* conn)
+{
+    u32 done = 0;
+    while (conn->fd >= 0 && done < conn->outsize)
+    {
+        ssize_t sent = send(conn->fd, conn->out+done, conn->outsize-done, MSG_DONTWAIT);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            break;
+        if (sent <= 0)
+        {
+            daemon_disconnect(conn);
+            return;
+        }
+        done += (u32)sent;
+    }
+    if (done > 0)
+    {
+        memmove(conn->out, conn->out+done, conn->outsize-done);
+        conn->outsize -= done;
+    }
+}
+
+
+/*==============================
+    daemon_write
+    Queues bytes for a client and sends what it can take
+    right away. A client that stops reading is disconnected
+    once DAEMON_OUTMAX bytes are waiting for it, so that it
+    can't hold up printing
+    @param A pointer to the client
+    @param The bytes to send
+    @param The number of bytes
+==============================*/
+
+static void daemon_write(daemon_conn_t* conn, const char* data, u32 size)
+{
+    if (conn->fd < 0)
+        return;
+    if (conn->outsize+size > DAEMON_OUTMAX)
+    {
+        daemon_disconnect(conn);
+        return;
+    }
+
+    // Make room for it
+    if (conn->outsize+size > conn->outcap)
+    {
+        u32 cap = (conn->outcap == 0) ? 4096 : conn->outcap;
+        char* out;
+        while (cap < conn->outsize+size)
+            cap *= 2;
+        out = (char*) realloc(conn->out, cap);
+        if (out == NULL)
+        {
+            daemon_disconnect(conn);
+            return;
+        }
+        conn->out = out;
+        conn->outcap = cap;
+    }
+    memcpy(conn->out+conn->outsize, data, size);
+    conn->outsize += size;
+    daemon_flush(conn);
+}
+
+
+/*==============================
+    daemon_mirror
+    Sends what was printed to the client that made the
+    current request, and to the ones that are capturing
+    @param A string with the text that was printed
+==============================*/
+
+static void daemon_mirror(const char* text)
+{
+    int i;
+    u32 size = (u32)strlen(text);
+    for (i=0; i<local_conncount; i++)
+        if (&local_conns[i] == local_requester || local_conns[i].capture)
+            daemon_write(&local_conns[i], text, size);
+}
+
+
+/*==============================
+    daemon_request
+    Handles a request from a client
+    @param A pointer to the client
+    @param A string with the request
+    @param A pointer to a bool to set if the daemon should stop
+==============================*/
+
+static void daemon_request(daemon_conn_t* conn, char* request, bool* stop)
+{
+    char reply[2] = {DAEMON_DONE, '0'};
+    char* arg = strchr(request, ' ');
+    bool success = true;
+    if (arg != NULL)
+        *arg++ = '\0';
+    else
+        arg = request+strlen(request);
+
+    // Capturing clients get output until they disconnect, so they don't get a reply
+    if (!strcmp(request, "capture"))
+    {
+        conn->capture = true;
+        return;
+    }
+
+    // Handle the request, sending what's printed to the client
+    local_requester = conn;
+    if (!strcmp(request, "upload"))
+    {
+        usbreader_pause(); // The upload needs the link to itself
+        success = device_uploadfile(arg);
+        usbreader_resume();
+        if (!success)
+            pdprint("Unable to open file '%s'.\n", CRDEF_ERROR, arg);
+    }
+    else if (!strcmp(request, "send"))
+        debug_send(arg);
+    else if (!strcmp(request, "stop"))
+        *stop = true;
+    else
+    {
+        pdprint("Unknown request '%s'.\n", CRDEF_ERROR, request);
+        success = false;
+    }
+    local_requester = NULL;
+
+    // Say that it's done
+    if (!success)
+        reply[1] = '1';
+    daemon_write(conn, reply, 2);
+}
+
+
+/*==============================
+    daemon_receive
+    Reads from a client, handling the requests that
+    are complete
+    @param A pointer to the client
+    @param A pointer to a bool to set if the daemon should stop
+==============================*/
+
+static void daemon_receive(daemon_conn_t* conn, bool* stop)
+{
+    char* end;
+    ssize_t got = recv(conn->fd, conn->line+conn->linesize, DAEMON_LINE-1-conn->linesize, MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (got <= 0)
+    {
+        daemon_disconnect(conn);
+        return;
+    }
+    conn->linesize += (u32)got;
+
+    // Handle every line that arrived
+    while (conn->fd >= 0 && !(*stop) && (end = (char*)memchr(conn->line, '\n', conn->linesize)) != NULL)
+    {
+        u32 size = (u32)(end-conn->line)+1;
+        *end = '\0';
+        daemon_request(conn, conn->line, stop);
+        memmove(conn->line, conn->line+size, conn->linesize-size);
+        conn->linesize -= size;
+    }
+
+    // Drop clients whose requests don't fit
+    if (conn->fd >= 0 && conn->linesize == DAEMON_LINE-1)
+        daemon_disconnect(conn);
+}
+
+
+/*==============================
+    daemon_main
+    Handles requests from other instances of UNFLoader,
+    and the carts' debug output, until it's stopped
+    @param A pointer to the cart contexts
+    @param The number of carts
+==============================*/
+
+void daemon_main(ftdi_context_t* carts, int count)
+{
+    int  i, listener;
+    bool stop = false;
+    struct sockaddr_un address;
+
+    // Make sure there isn't already a daemon, and replace the socket of one that didn't stop cleanly
+    if (!daemon_address(&address))
+        terminate("Unable to find a place for the daemon's socket.");
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        terminate("Unable to create the daemon's socket.");
+    if (connect(listener, (struct sockaddr*)&address, sizeof(address)) == 0)
+        terminate("Another daemon is already running.");
+    close(listener);
+    unlink(address.sun_path);
+
+    // Start listening
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, DAEMON_CLIENTS) != 0)
+        terminate("Unable to listen on '%s'.", address.sun_path);
+    signal(SIGPIPE, SIG_IGN); // Clients that go away are noticed when sending to them fails
+    pdprint_mirror(daemon_mirror);
+    debug_openoutput(count);
+    usbreader_start(carts, count);
+    pdprint("Daemon started. Send it requests with -remote. Press ESC to stop.\n", CRDEF_INPUT);
+    timeout(0);
+    curs_set(0);
+
+    // Handle requests and debug output
+    while (!stop)
+    {
+        struct pollfd fds[DAEMON_CLIENTS+3];
+        bool busy;
+        int ch;
+
+        // Handle the carts' packets, and sleep until there's a request, a key press, or more packets
+        busy = debug_poll(carts, count);
+        if (usbreader_drain())
+            busy = true;
+        pdprint_flush(false);
+        fds[0].fd = listener;
+        fds[1].fd = STDIN_FILENO;
+        fds[2].fd = usbreader_wakefd();
+        for (i=0; i<local_conncount+3; i++)
+            fds[i].events = POLLIN;
+        for (i=0; i<local_conncount; i++)
+        {
+            fds[i+3].fd = local_conns[i].fd;
+            if (local_conns[i].outsize > 0)
+                fds[i+3].events |= POLLOUT;
+        }
+        if (poll(fds, local_conncount+3, busy ? 0 : pdprint_waittime(DEBUG_IDLEWAIT)) <= 0)
+            continue;
+
+        // Only read keys when there are some, since getch draws the screen
+        if (fds[1].revents != 0)
+        {
+            while ((ch = getch()) != ERR && ch != CH_ESCAPE)
+                ;
+            if (ch == CH_ESCAPE)
+                break;
+        }
+
+        // Send the waiting output to the clients that can take more, and read the requests
+        for (i=0; i<local_conncount && !stop; i++)
+        {
+            if (fds[i+3].revents & POLLOUT)
+                daemon_flush(&local_conns[i]);
+            if (local_conns[i].fd >= 0 && (fds[i+3].revents & ~POLLOUT) != 0)
+                daemon_receive(&local_conns[i], &stop);
+        }
+
+        // Forget the clients that went away
+        for (i=0; i<local_conncount; )
+        {
+            if (local_conns[i].fd < 0)
+                local_conns[i] = local_conns[--local_conncount];
+            else
+                i++;
+        }
+
+        // Accept new clients, if there's room for them
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(listener, NULL, NULL);
+            if (fd >= 0 && local_conncount == DAEMON_CLIENTS)
+                close(fd);
+            else if (fd >= 0)
+            {
+                daemon_conn_t* conn = &local_conns[local_conncount++];
+                memset(conn, 0, sizeof(daemon_conn_t));
+                conn->fd = fd;
+            }
+        }
+    }
+
+    // Clean up
+    pdprint("Daemon stopped.\n", CRDEF_INPUT);
+    pdprint_mirror(NULL);
+    for (i=0; i<local_conncount; i++)
+    {
+        daemon_flush(&local_conns[i]);
+        daemon_disconnect(&local_conns[i]);
+    }
+    local_conncount = 0;
+    close(listener);
+    unlink(address.sun_path);
+    usbreader_stop();
+    debug_reportscreenshots(carts, count, true);
+    debug_closeoutput();
+}
+
+
+/*==============================
+    daemon_sendrequest
+    Sends a request to the daemon
+    @param The socket connected to the daemon
+    @param A string with the request
+    @param A string with the request's argument, or NULL
+    @returns Whether the request was sent
+==============================*/
+
+static bool daemon_sendrequest(int fd, const char* request, const char* arg)
+{
+    char line[DAEMON_LINE];
+    int  size;
+    if (arg != NULL)
+        size = snprintf(line, DAEMON_LINE, "%s %s\n", request, arg);
+    else
+        size = snprintf(line, DAEMON_LINE, "%s\n", request);
+    if (size < 0 || size >= DAEMON_LINE || strchr(line, '\n') != line+size-1)
+    {
+        fprintf(stderr, "The '%s' request is too long, or has more than one line.\n", request);
+        return false;
+    }
+    return (send(fd, line, size, 0) == size);
+}
+
+
+/*==============================
+    daemon_abspath
+    Turns a path into an absolute one, so that the daemon
+    finds it no matter where it was started from
+    @param A string with the path
+    @param The buffer to store the absolute path in
+    @param The size of the buffer
+    @returns Whether the absolute path fit in the buffer
+==============================*/
+
+static bool daemon_abspath(const char* path, char* out, u32 size)
+{
+    char resolved[PATH_MAX];
+    char cwd[PATH_MAX];
+    int  written;
+
+    // Paths that don't exist yet are joined to the working directory instead, so the daemon can report them
+    if (realpath(path, resolved) != NULL)
+        written = snprintf(out, size, "%s", resolved);
+    else if (path[0] == '/' || getcwd(cwd, sizeof(cwd)) == NULL)
+        written = snprintf(out, size, "%s", path);
+    else
+        written = snprintf(out, size, "%s/%s", cwd, path);
+    return (written >= 0 && (u32)written < size);
+}
+
+
+/*==============================
+    daemon_abscommand
+    Turns the files in a debug mode command, which are
+    between '@'s, into absolute paths
+    @param A string with the command
+    @param The buffer to store the new command in
+    @param The size of the buffer
+    @returns Whether the new command fit in the buffer
+==============================*/
+
+static bool daemon_abscommand(const char* command, char* out, u32 size)
+{
+    u32 used = 0, length;
+    char path[PATH_MAX];
+    while (*command != '\0')
+    {
+        const char* end;
+        if (*command != '@' || (end = strchr(command+1, '@')) == NULL || end == command+1)
+        {
+            // Copy everything that isn't a file as it is
+            if (used+1 >= size)
+                return false;
+            out[used++] = *command++;
+            continue;
+        }
+
+        // Resolve the file between the '@'s
+        length = (u32)(end-command-1);
+        if (length >= sizeof(path) || used+1 >= size)
+            return false;
+        memcpy(path, command+1, length);
+        path[length] = '\0';
+        out[used++] = '@';
+        if (!daemon_abspath(path, out+used, size-used))
+            return false;
+        used += (u32)strlen(out+used);
+        if (used+1 >= size)
+            return false;
+        out[used++] = '@';
+        command = end+1;
+    }
+    out[used] = '\0';
+    return true;
+}
+
+
+/*==============================
+    daemon_client
+    Sends the requests in the arguments to the daemon,
+    and prints its replies. Doesn't touch the console or
+    the flashcart, so it can run without setting them up
+    @param The number of extra arguments
+    @param An array with the arguments
+    @returns 0 if every request succeeded, or 1 otherwise
+==============================*/
+
+int daemon_client(int argc, char* argv[])
+{
+    int  i, fd;
+    int  pending = 0, status = 0;
+    bool capture = false, sent = true, getstatus = false;
+    char path[DAEMON_LINE];
+    struct sockaddr_un address;
+
+    // Connect to the daemon
+    if (!daemon_address(&address))
+    {
+        fprintf(stderr, "Unable to find the daemon's socket.\n");
+        return 1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+    {
+        fprintf(stderr, "The daemon isn't running. Start it with -daemon.\n");
+        return 1;
+    }
+
+    // Send the requests, with paths starting from where we are
+    for (i=1; i<argc && sent; i++)
+    {
+        if (!strcmp(argv[i], "-remote"))
+            continue;
+        else if (!strcmp(argv[i], "-r") && i+1 < argc)
+        {
+            sent = daemon_abspath(argv[++i], path, DAEMON_LINE);
+            if (sent)
+                sent = daemon_sendrequest(fd, "upload", path);
+            else
+                fprintf(stderr, "The path '%s' is too long.\n", argv[i]);
+        }
+        else if (!strcmp(argv[i], "-send") && i+1 < argc)
+        {
+            sent = daemon_abscommand(argv[++i], path, DAEMON_LINE);
+            if (sent)
+                sent = daemon_sendrequest(fd, "send", path);
+            else
+                fprintf(stderr, "The command '%s' is too long.\n", argv[i]);
+        }
+        else if (!strcmp(argv[i], "-stop"))
+            sent = daemon_sendrequest(fd, "stop", NULL);
+        else if (!strcmp(argv[i], "-capture"))
+        {
+            capture = true;
+            continue;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown remote request '%s'.\n", argv[i]);
+            sent = false;
+        }
+        pending++;
+    }
+    if (sent && capture)
+        sent = daemon_sendrequest(fd, "capture", NULL);
+    if (!sent)
+    {
+        close(fd);
+        return 1;
+    }
+
+    // Print the replies until every request is done, or forever if we're capturing
+    while (pending > 0 || capture)
+    {
+        char buffer[4096];
+        ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+        if (got <= 0)
+            break;
+        for (i=0; i<got; i++)
+        {
+            if (getstatus)
+            {
+                if (buffer[i] != '0')
+                    status = 1;
+                getstatus = false;
+                pending--;
+            }
+            else if (buffer[i] == DAEMON_DONE)
+                getstatus = true;
+            else
+                putchar(buffer[i]);
+        }
+        fflush(stdout);
+    }
+    close(fd);
+
+    // If the daemon went away before finishing, something went wrong
+    if (pending > 0)
+        status = 1;
+    return status;
+}
+
+#else
+
+/*==============================
+    daemon_main
+    Unix sockets are needed for the daemon
+==============================*/
+
+void daemon_main(ftdi_context_t* carts, int count)
+{
+    terminate("The daemon isn't supported on this platform.");
+}
+
+
+/*==============================
+    daemon_client
+    Unix sockets are needed for the daemon
+==============================*/
+
+int daemon_client(int argc, char* argv[])
+{
+    fprintf(stderr, "The daemon isn't supported on this platform.\n");
+    return 1;
+}
+
+#endif
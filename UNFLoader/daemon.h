@@ -0,0 +1,27 @@
+#ifndef __DAEMON_HEADER
+#define __DAEMON_HEADER
+
+    #include "device.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define DAEMON_SOCKET  "daemon.sock" // The name of the socket in the config folder
+    #define DAEMON_CLIENTS 8             // How many clients can be connected at once
+    #define DAEMON_LINE    1024          // The longest request that can be sent
+    #define DAEMON_OUTMAX  (4*1024*1024) // How much output can wait for a client that isn't reading before it's disconnected
+
+    // The byte that ends the reply to a request, followed by '0' if it succeeded or '1' if it failed
+    #define DAEMON_DONE    '\0'
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    void daemon_main(ftdi_context_t* carts, int count);
+    int  daemon_client(int argc, char* argv[]);
+
+#endif
@@ -10,6 +10,13 @@ Handles USB I/O.
 #include "helper.h"
 #include "device.h"
 #include "debug.h"
+#include "usbreader.h"
+#include "scrollback.h"
+#include "logwriter.h"
+#include "session.h"
+#include "screenshot.h"
+#include "video.h"
+#include <chrono>
 
 
 /*********************************
@@ -18,10 +25,10 @@ Handles USB I/O.
 
 #define VERBOSE     0
 #define BUFFER_SIZE 512
-#define HEADER_SIZE 16
 #define BLINKRATE   0.5
 #define PATH_SIZE   256
 #define HISTORY_SIZE 100
+#define POLL_BATCH  16 // How many packets to handle from each cart before checking the keyboard
 
 
 /*********************************
@@ -31,35 +38,228 @@ Handles USB I/O.
 void debug_textinput(WINDOW* inputwin, char* buffer, u16* cursorpos, int ch);
 void debug_appendfilesend(char* data, u32 size);
 void debug_filesend(const char* filename);
-void debug_decidedata(ftdi_context_t* cart, u32 info, char* buffer, u32* read);
-void debug_handle_text(ftdi_context_t* cart, u32 size, char* buffer, u32* read);
-void debug_handle_rawbinary(ftdi_context_t* cart, u32 size, char* buffer, u32* read);
-void debug_handle_header(ftdi_context_t* cart, u32 size, char* buffer, u32* read);
-void debug_handle_screenshot(ftdi_context_t* cart, u32 size, char* buffer, u32* read);
+void debug_decidedata(usbpacket_t* packet);
+void debug_handle_text(u8* data, u32 size);
+void debug_handle_rawbinary(usbpacket_t* packet);
+void debug_handle_header(u8* data, u32 size);
+void debug_handle_screenshot(usbpacket_t* packet);
 
 
 /*********************************
          Global Variables
 *********************************/
 
-static int debug_headerdata[HEADER_SIZE];
+static int debug_headerdata[DEVICE_MAX][HEADER_SIZE]; // The last data header from each cart
+static logfile_t* local_cartoutptr[DEVICE_MAX] = {NULL, };
+static int local_currentcart = 0; // The cart whose packet is being handled
 static char** cmd_history;
 static int cmd_count = 0;
 
 
+/*==============================
+    debug_openoutput
+    Opens the files for debug output, if one was requested
+    @param The number of carts. If there's more than one,
+           each cart's output is written to a file of its own
+==============================*/
+
+void debug_openoutput(int count)
+{
+    int i;
+    session_open();
+    video_open(count);
+    if (global_debugout == NULL)
+        return;
+
+    // Open file for debug output
+    global_debugoutptr = logwriter_open(global_debugout, false);
+    if (global_debugoutptr == NULL)
+    {
+        pdprint("\n", CRDEF_ERROR);
+        terminate("Unable to open %s for writing debug output.", global_debugout);
+    }
+
+    // Give every cart a file of its own, named after the one that was requested
+    for (i=0; i<count && count>1; i++)
+    {
+        char* path = (char*) malloc(strlen(global_debugout)+8);
+        if (path == NULL)
+            terminate("Unable to allocate memory for the debug output path.");
+        sprintf(path, "%s.%d", global_debugout, i+1);
+        local_cartoutptr[i] = logwriter_open(path, false);
+        if (local_cartoutptr[i] == NULL)
+        {
+            pdprint("\n", CRDEF_ERROR);
+            terminate("Unable to open %s for writing debug output.", path);
+        }
+        free(path);
+    }
+}
+
+
+/*==============================
+    debug_closeoutput
+    Closes the files for debug output
+==============================*/
+
+void debug_closeoutput()
+{
+    int i;
+    logfile_t* mainoutptr = global_debugoutptr;
+    global_debugoutptr = NULL; // So that errors from closing them aren't written to them
+    session_close();
+    video_close();
+    logwriter_close(mainoutptr);
+    for (i=0; i<DEVICE_MAX; i++)
+    {
+        logwriter_close(local_cartoutptr[i]);
+        local_cartoutptr[i] = NULL;
+    }
+}
+
+
+/*==============================
+    debug_startcart
+    Sends what's printed to a cart's own output, when
+    there's several carts
+    @param A pointer to the cart contexts
+    @param The number of carts
+    @param The index of the cart
+    @returns The main output, to give to debug_endcart
+==============================*/
+
+static logfile_t* debug_startcart(ftdi_context_t *carts, int count, int index)
+{
+    logfile_t* mainoutptr = global_debugoutptr;
+    local_currentcart = index;
+    if (count > 1)
+    {
+        pdprint_prefix(carts[index].prefix);
+        if (local_cartoutptr[index] != NULL)
+            global_debugoutptr = local_cartoutptr[index];
+    }
+    return mainoutptr;
+}
+
+
+/*==============================
+    debug_endcart
+    Goes back to printing to the main output
+    @param The number of carts
+    @param The main output that debug_startcart returned
+==============================*/
+
+static void debug_endcart(int count, logfile_t* mainoutptr)
+{
+    global_debugoutptr = mainoutptr;
+    if (count > 1)
+        pdprint_prefix(NULL);
+}
+
+
+/*==============================
+    debug_reportscreenshots
+    Prints which screenshots were saved since last time
+    @param A pointer to the cart contexts
+    @param The number of carts
+    @param Whether to wait for the ones that are still
+           being saved
+==============================*/
+
+void debug_reportscreenshots(ftdi_context_t *carts, int count, bool wait)
+{
+    int cart;
+    short color;
+    char* message;
+    if (wait)
+        screenshot_wait();
+    while (screenshot_finished(&cart, &color, &message))
+    {
+        logfile_t* mainoutptr = debug_startcart(carts, count, cart);
+        pdprint("%s", color, message);
+        debug_endcart(count, mainoutptr);
+        free(message);
+    }
+}
+
+
+/*==============================
+    debug_poll
+    Handles the packets that the carts sent
+    @param A pointer to the cart contexts
+    @param The number of carts. If there's more than one,
+           each cart's output is prefixed with its number
+    @returns Whether any of the carts have more packets waiting
+==============================*/
+
+bool debug_poll(ftdi_context_t *carts, int count)
+{
+    int i;
+    bool more = false;
+
+    // Handle the packets that the carts' reader threads received, a few at a time
+    for (i=0; i<count; i++)
+    {
+        int handled;
+        usbpacket_t packet;
+        logfile_t* mainoutptr;
+        for (handled=0; handled<POLL_BATCH && usbreader_pop(i, &packet); handled++)
+        {
+            #if VERBOSE
+                pdprint("Receiving %d bytes\n", CRDEF_INFO, packet.info & 0xFFFFFF);
+            #endif
+
+            session_record(i, (packet.info >> 24) & 0xFF, packet.data, packet.info & 0xFFFFFF);
+
+            // Send the packet to the cart's own output when there's several
+            mainoutptr = debug_startcart(carts, count, i);
+            debug_decidedata(&packet);
+            debug_endcart(count, mainoutptr);
+            usbreader_release(i, &packet);
+        }
+        if (handled == POLL_BATCH)
+            more = true;
+    }
+    debug_reportscreenshots(carts, count, false);
+    return more;
+}
+
+
+/*==============================
+    debug_send
+    Sends a command to the carts, as if it was typed in
+    @param A string with the command. Parts of it wrapped
+           in '@' are treated as files to append
+==============================*/
+
+void debug_send(char* command)
+{
+    u32 size = (u32)strlen(command);
+    if (size == 0)
+        return;
+
+    // Check if we're only sending a file or text (and potentially a file appended)
+    if (command[0] == '@' && command[size-1] == '@')
+        debug_filesend(command);
+    else
+        debug_appendfilesend(command, size+1);
+}
+
+
 /*==============================
     debug_main
     The main debug loop for input/output
-    @param A pointer to the cart context
+    @param A pointer to the cart contexts
+    @param The number of carts. If there's more than one,
+           each cart's output is prefixed with its number
+           and written to a debug output file of its own
 ==============================*/
 
-void debug_main(ftdi_context_t *cart)
+void debug_main(ftdi_context_t *carts, int count)
 {
     int i;
-    int alignment;
-    char *outbuff, *inbuff;
+    char *inbuff;
     u16 cursorpos = 0;
-    DWORD pending = 0;
     WINDOW* inputwin = newwin(1, getmaxx(stdscr), getmaxy(stdscr)-1, 0);
 
     // Initialize debug mode keyboard input
@@ -67,12 +267,12 @@ void debug_main(ftdi_context_t *cart)
         pdprint("Debug mode started. Press ESC to stop or wait for timeout.\n\n", CRDEF_INPUT, global_timeout);
     else
         pdprint("Debug mode started. Press ESC to stop.\n\n", CRDEF_INPUT);
-    timeout(0);
+    nodelay(inputwin, TRUE); // Keys are read from the input bar, as reading from stdscr would draw it every time
     curs_set(0);
-    keypad(stdscr, TRUE);
+    keypad(inputwin, TRUE);
+    pdprint_overlay(inputwin);
 
     // Initialize our buffers
-    outbuff = (char*) malloc(BUFFER_SIZE);
     inbuff = (char*) malloc(BUFFER_SIZE);
     if (cmd_history == NULL)
     {
@@ -82,95 +282,46 @@ void debug_main(ftdi_context_t *cart)
     }
     memset(inbuff, 0, BUFFER_SIZE);
 
-    // Open file for debug output
-    if (global_debugout != NULL)
-    {
-        global_debugoutptr = fopen(global_debugout, "w+");
-        if (global_debugoutptr == NULL)
-        {
-            pdprint("\n", CRDEF_ERROR);
-            terminate("Unable to open %s for writing debug output.", global_debugout);
-        }
-    }
-
-    // Decide the alignment based off the cart that's connected
-    switch (cart->carttype)
-    {
-        case CART_EVERDRIVE: alignment = 16; break;
-        case CART_SC64: alignment = 4; break;
-        default: alignment = 0;
-    }
+    // Open file for debug output, and start receiving packets
+    debug_openoutput(count);
+    usbreader_start(carts, count);
 
     // Start the debug server loop
     for ( ; ; ) 
 	{
-        int ch = getch();
-
-        // If ESC is pressed, stop the loop
-		if (ch == 27 || (global_timeout != 0 && global_timeouttime < time(NULL)))
-			break;
-        debug_textinput(inputwin, inbuff, &cursorpos, ch);
+        int ch;
 
-        // Check if we have pending data
-        FT_GetQueueStatus(cart->handle, &pending);
-        if (pending > 0)
+        // Handle every key that was pressed, and stop the loop if ESC was one of them. The scrollback viewer gets them first
+        while ((ch = wgetch(inputwin)) != ERR)
         {
-            u32 info, read = 0;
-            #if VERBOSE
-                pdprint("Receiving %d bytes\n", CRDEF_INFO, pending);
-            #endif
-
-            // Ensure we have valid data by reading the header
-            FT_Read(cart->handle, outbuff, 4, &cart->bytes_read);
-            read += cart->bytes_read;
-            if (outbuff[0] != 'D' || outbuff[1] != 'M' || outbuff[2] != 'A' || outbuff[3] != '@')
-                terminate("Unexpected DMA header: %c %c %c %c.", outbuff[0], outbuff[1], outbuff[2], outbuff[3]);
-
-            // Get information about the incoming data
-            FT_Read(cart->handle, outbuff, 4, &cart->bytes_read);
-            read += cart->bytes_read;
-            info = swap_endian(outbuff[3] << 24 | outbuff[2] << 16 | outbuff[1] << 8 | outbuff[0]);
-
-            // Decide what to do with the received data
-            debug_decidedata(cart, info, outbuff, &read);
-
-            // Read the completion signal
-            FT_Read(cart->handle, outbuff, 4, &cart->bytes_read);
-            read += cart->bytes_read;
-            if (outbuff[0] != 'C' || outbuff[1] != 'M' || outbuff[2] != 'P' || outbuff[3] != 'H')
-                terminate("Did not receive completion signal: %c %c %c %c.", outbuff[0], outbuff[1], outbuff[2], outbuff[3]);
-
-            // Ensure byte alignment by reading X amount of bytes needed
-            if (alignment != 0 && (read % alignment) != 0)
-            {
-                int left = alignment - (read % alignment);
-                FT_Read(cart->handle, outbuff, left, &cart->bytes_read);
-            }
+            if (scrollback_key(ch))
+                continue;
+            if (ch == 27)
+                break;
+            debug_textinput(inputwin, inbuff, &cursorpos, ch);
         }
+		if (ch == 27 || (global_timeout != 0 && global_timeouttime < time(NULL)))
+			break;
+        debug_textinput(inputwin, inbuff, &cursorpos, ERR); // Keep the blinker going
 
-        // If we got no more data, sleep a bit to be kind to the CPU
-        FT_GetQueueStatus(cart->handle, &pending);
-        if (pending == 0)
+        // If we got no more packets, draw what was printed and sleep until there's more or a key is pressed
+        if (!debug_poll(carts, count))
         {
-            #ifndef LINUX
-                Sleep(10);
-            #else
-                usleep(10);
-            #endif
+            pdprint_flush(false);
+            usbreader_wait(pdprint_waittime(DEBUG_IDLEWAIT));
         }
     }
 
-    // Close the debug output file if it exists
-    if (global_debugoutptr != NULL)
-    {
-        fclose(global_debugoutptr);
-        global_debugoutptr = NULL;
-    }
+    // Close the debug output files if they exist, once the screenshots are saved
+    usbreader_stop();
+    debug_reportscreenshots(carts, count, true);
+    debug_closeoutput();
 
     // Clean up everything
-    free(outbuff);
     free(inbuff);
 
+    scrollback_close();
+    pdprint_overlay(NULL);
     wclear(inputwin);
     wrefresh(inputwin);
     delwin(inputwin);
@@ -190,8 +341,9 @@ void debug_main(ftdi_context_t *cart)
 void debug_textinput(WINDOW* inputwin, char* buffer, u16* cursorpos, int ch)
 {
     char cmd_changed = 0;
+    bool redraw = (ch != ERR);
     static char blinkerstate = 1;
-    static clock_t blinkertime = 0;
+    static std::chrono::steady_clock::time_point blinkertime;
     static int size = 0;
     static int curcmd = 0;
 
@@ -247,11 +399,7 @@ void debug_textinput(WINDOW* inputwin, char* buffer, u16* cursorpos, int ch)
             size = BUFFER_SIZE-1;
         buffer[size] = '\0';
 
-        // Check if we're only sending a file or text (and potentially a file appended)
-        if (buffer[0] == '@' && buffer[size-1] == '@')
-            debug_filesend(buffer);
-        else
-            debug_appendfilesend(buffer, size+1);
+        debug_send(buffer);
 
         // Add the command to the command history
         if (curcmd == 0)
@@ -319,16 +467,23 @@ void debug_textinput(WINDOW* inputwin, char* buffer, u16* cursorpos, int ch)
         blinkerstate = 1;
     }
 
+    // Toggle the blinker
+    if (blinkertime < std::chrono::steady_clock::now())
+    {
+        blinkerstate = !blinkerstate;
+        blinkertime = std::chrono::steady_clock::now() + std::chrono::milliseconds((int)(1000*BLINKRATE));
+        redraw = true;
+    }
+
+    // Only touch the input bar if it changed, since drawing the terminal is slow
+    if (!redraw)
+        return;
+
     // Display what we've written
     werase(inputwin);
     pdprintw_nolog(inputwin, buffer, CRDEF_INPUT);
     
     // Draw the blinker
-    if (blinkertime < clock())
-    {
-        blinkerstate = !blinkerstate;
-        blinkertime = clock() + (clock_t)((float)CLOCKS_PER_SEC*BLINKRATE);
-    }
     if (blinkerstate)
     {
         int x, y;
@@ -336,7 +491,7 @@ void debug_textinput(WINDOW* inputwin, char* buffer, u16* cursorpos, int ch)
         mvwaddch(inputwin, y, (*cursorpos), ACS_BLOCK);
         wmove(inputwin, y, x);
     }
-    wrefresh(inputwin);
+    wnoutrefresh(inputwin); // The terminal gets drawn by pdprint_flush
 }
 
 
@@ -508,24 +663,21 @@ void debug_filesend(const char* filename)
 /*==============================
     debug_decidedata
     Decides what function to call based on the command type stored in the info
-    @param A pointer to the cart context
-    @param 4 bytes with the info and size (from the cartridge)
-    @param The buffer to use
-    @param A pointer to a variable that stores the number of bytes read
+    @param A pointer to the packet
 ==============================*/
 
-void debug_decidedata(ftdi_context_t* cart, u32 info, char* buffer, u32* read)
+void debug_decidedata(usbpacket_t* packet)
 {
-    u8 command = (info >> 24) & 0xFF;
-    u32 size = info & 0xFFFFFF;
+    u8 command = (packet->info >> 24) & 0xFF;
+    u32 size = packet->info & 0xFFFFFF;
 
     // Decide what to do with the data based off the command type
     switch (command)
     {
-        case DATATYPE_TEXT:       debug_handle_text(cart, size, buffer, read); break;
-        case DATATYPE_RAWBINARY:  debug_handle_rawbinary(cart, size, buffer, read); break;
-        case DATATYPE_HEADER:     debug_handle_header(cart, size, buffer, read); break;
-        case DATATYPE_SCREENSHOT: debug_handle_screenshot(cart, size, buffer, read); break;
+        case DATATYPE_TEXT:       debug_handle_text(packet->data, size); break;
+        case DATATYPE_RAWBINARY:  debug_handle_rawbinary(packet); break;
+        case DATATYPE_HEADER:     debug_handle_header(packet->data, size); break;
+        case DATATYPE_SCREENSHOT: debug_handle_screenshot(packet); break;
         default:                  terminate("Unknown data type.");
     }
 }
@@ -534,76 +686,83 @@ void debug_decidedata(ftdi_context_t* cart, u32 info, char* buffer, u32* read)
 /*==============================
     debug_handle_text
     Handles DATATYPE_TEXT
-    @param A pointer to the cart context
+    @param The incoming data
     @param The size of the incoming data
-    @param The buffer to use
-    @param A pointer to a variable that stores the number of bytes read
 ==============================*/
 
-void debug_handle_text(ftdi_context_t* cart, u32 size, char* buffer, u32* read)
+void debug_handle_text(u8* data, u32 size)
 {
-    int total = 0;
-    int left = size;
-
-    // Ensure the data fits within our buffer
-    if (left > BUFFER_SIZE)
-        left = BUFFER_SIZE;
-
-    // Read bytes until we finished
-    while (left != 0)
-    {
-        // Read from the USB and print it
-        FT_Read(cart->handle, buffer, left, &cart->bytes_read);
-        pdprint("%.*s", CRDEF_PRINT, cart->bytes_read, buffer);
-
-        // Store the amount of bytes read
-        (*read) += cart->bytes_read;
-        total += cart->bytes_read;
-
-        // Ensure the data fits within our buffer
-        left = size - total;
-        if (left > BUFFER_SIZE)
-            left = BUFFER_SIZE;
-    }
+    pdprint("%.*s", CRDEF_PRINT, size, data);
 }
 
 
 /*==============================
-    debug_handle_rawbinary
-    Handles DATATYPE_RAWBINARY
-    @param A pointer to the cart context
-    @param The size of the incoming data
-    @param The buffer to use
-    @param A pointer to a variable that stores the number of bytes read
+    debug_filename
+    Makes the path of a file to export received data to.
+    Safe to call from the USB reader threads
+    @param What to start the file's name with
+    @param The file's extension, including the dot
+    @returns The path, which needs to be freed, or NULL
 ==============================*/
 
-void debug_handle_rawbinary(ftdi_context_t* cart, u32 size, char* buffer, u32* read)
+char* debug_filename(const char* prefix, const char* extension)
 {
-    int total = 0;
-    int left = size;
     char* filename = (char*) malloc(PATH_SIZE);
     char* extraname = gen_filename();
-    FILE* fp; 
-
-    // Ensure we malloced successfully
     if (filename == NULL || extraname == NULL)
-        terminate("Unable to allocate memory for binary file.");
+    {
+        free(filename);
+        free(extraname);
+        return NULL;
+    }
 
-    // Create the binary file to save data to
+    // Put the export path, the prefix, the unique ending and the extension together
     memset(filename, 0, PATH_SIZE);
     #ifndef LINUX
         if (global_exportpath != NULL)
-                strcat_s(filename, PATH_SIZE, global_exportpath);
-        strcat_s(filename, PATH_SIZE, "binaryout-");
+            strcat_s(filename, PATH_SIZE, global_exportpath);
+        strcat_s(filename, PATH_SIZE, prefix);
         strcat_s(filename, PATH_SIZE, extraname);
-        strcat_s(filename, PATH_SIZE, ".bin");
-        fopen_s(&fp, filename, "wb+");
+        strcat_s(filename, PATH_SIZE, extension);
     #else
         if (global_exportpath != NULL)
             strcat(filename, global_exportpath);
-        strcat(filename, "binaryout-");
+        strcat(filename, prefix);
         strcat(filename, extraname);
-        strcat(filename, ".bin");
+        strcat(filename, extension);
+    #endif
+    free(extraname);
+    return filename;
+}
+
+
+/*==============================
+    debug_handle_rawbinary
+    Handles DATATYPE_RAWBINARY. Big binaries were already
+    written to a file by the cart's reader
+    @param A pointer to the packet
+==============================*/
+
+void debug_handle_rawbinary(usbpacket_t* packet)
+{
+    u32 size = packet->info & 0xFFFFFF;
+    char* filename;
+    FILE* fp;
+
+    // If the reader streamed it to a file, the packet holds the file's path
+    if (packet->streamed)
+    {
+        pdprint("Wrote %d bytes to %s.\n", CRDEF_INFO, size, (char*)packet->data);
+        return;
+    }
+
+    // Create the binary file to save data to
+    filename = debug_filename("binaryout-", ".bin");
+    if (filename == NULL)
+        terminate("Unable to allocate memory for binary file.");
+    #ifndef LINUX
+        fopen_s(&fp, filename, "wb+");
+    #else
         fp = fopen(filename, "wb+");
     #endif
 
@@ -611,169 +770,71 @@ void debug_handle_rawbinary(ftdi_context_t* cart, u32 size, char* buffer, u32* r
     if (fp == NULL)
         terminate("Unable to create binary file.");
 
-    // Ensure the data fits within our buffer
-    if (left > BUFFER_SIZE)
-        left = BUFFER_SIZE;
-
-    // Read bytes until we finished
-    while (left != 0)
-    {
-        // Read from the USB and save it to our binary file
-        FT_Read(cart->handle, buffer, left, &cart->bytes_read);
-        fwrite(buffer, 1, left, fp);
-
-        // Store the amount of bytes read
-        (*read) += cart->bytes_read;
-        total += cart->bytes_read;
-
-        // Ensure the data fits within our buffer
-        left = size - total;
-        if (left > BUFFER_SIZE)
-            left = BUFFER_SIZE;
-    }
+    // Save the data to our binary file
+    fwrite(packet->data, 1, size, fp);
 
     // Close the file and free the memory used for the filename
     pdprint("Wrote %d bytes to %s.\n", CRDEF_INFO, size, filename);
     fclose(fp);
     free(filename);
-    free(extraname);
 }
 
 
 /*==============================
     debug_handle_header
     Handles DATATYPE_HEADER
-    @param A pointer to the cart context
+    @param The incoming data
     @param The size of the incoming data
-    @param The buffer to use
-    @param A pointer to a variable that stores the number of bytes read
 ==============================*/
 
-void debug_handle_header(ftdi_context_t* cart, u32 size, char* buffer, u32* read)
+void debug_handle_header(u8* data, u32 size)
 {
-    int total = 0;
-    int left = size;
+    debug_parseheader(data, size, debug_headerdata[local_currentcart]);
+}
 
-    // Ensure the data fits within our buffer
-    if (left > HEADER_SIZE)
-        left = HEADER_SIZE;
 
-    // Read bytes until we finished
-    while (left != 0)
-    {
-        // Read from the USB and save it to the global headerdata
-        FT_Read(cart->handle, buffer, left, &cart->bytes_read);
-        for (int i=0; i<(int)cart->bytes_read; i+=4)
-            debug_headerdata[i/4] = swap_endian(buffer[i + 3] << 24 | buffer[i + 2] << 16 | buffer[i + 1] << 8 | buffer[i]);
-
-        // Store the amount of bytes read
-        (*read) += cart->bytes_read;
-        total += cart->bytes_read;
-
-        // Ensure the data fits within our buffer
-        left = size - total;
-        if (left > HEADER_SIZE)
-            left = HEADER_SIZE;
-    }
+/*==============================
+    debug_parseheader
+    Reads the words in a data header
+    @param The data header
+    @param The size of the data header
+    @param An array of HEADER_SIZE words to store it in
+==============================*/
+
+void debug_parseheader(u8* data, u32 size, int* header)
+{
+    u32 i;
+    for (i=0; i+4<=size && i/4<HEADER_SIZE; i+=4)
+        header[i/4] = swap_endian(data[i + 3] << 24 | data[i + 2] << 16 | data[i + 1] << 8 | data[i]);
 }
 
 
 /*==============================
     debug_handle_screenshot
-    Handles DATATYPE_SCREENSHOT
-    @param A pointer to the cart context
-    @param The size of the incoming data
-    @param The buffer to use
-    @param A pointer to a variable that stores the number of bytes read
+    Handles DATATYPE_SCREENSHOT. The packet's buffer is
+    handed over to be saved in the background
+    @param A pointer to the packet
 ==============================*/
 
-void debug_handle_screenshot(ftdi_context_t* cart, u32 size, char* buffer, u32* read)
+void debug_handle_screenshot(usbpacket_t* packet)
 {
-    int total = 0;
-    int left = size;
-    int j=0;
-    u8* image;
-    int w = debug_headerdata[2], h = debug_headerdata[3];
-    char* filename = (char*) malloc(PATH_SIZE);
-    char* extraname = gen_filename();
+    char* filename;
 
     // Ensure we got a data header of type screenshot
-    if (debug_headerdata[0] != DATATYPE_SCREENSHOT)
+    if (debug_headerdata[local_currentcart][0] != DATATYPE_SCREENSHOT)
         terminate("Unexpected data header for screenshot.");
 
-    // Allocate space for the image
-    image = (u8*) malloc(4*w*h);
+    // If a video is being recorded, the frame goes there instead
+    if (video_frame(local_currentcart, debug_headerdata[local_currentcart], packet->data, packet->info & 0xFFFFFF))
+        return;
 
-    // Ensure we malloced successfully
-    if (filename == NULL || extraname == NULL || image == NULL)
+    // Create the name of the file to save it to
+    filename = debug_filename("screenshot-", screenshot_extension());
+    if (filename == NULL)
         terminate("Unable to allocate memory for binary file.");
 
-    // Create the binary file to save data to
-    memset(filename, 0, PATH_SIZE);
-    #ifndef LINUX
-        if (global_exportpath != NULL)
-            strcat_s(filename, PATH_SIZE, global_exportpath);
-        strcat_s(filename, PATH_SIZE, "screenshot-");
-        strcat_s(filename, PATH_SIZE, extraname);
-        strcat_s(filename, PATH_SIZE, ".png");
-    #else
-        if (global_exportpath != NULL)
-            strcat(filename, global_exportpath);
-        strcat(filename, "screenshot-");
-        strcat(filename, extraname);
-        strcat(filename, ".png");
-    #endif
-
-    // Ensure the data fits within our buffer
-    if (left > BUFFER_SIZE)
-        left = BUFFER_SIZE;
-
-    // Read bytes until we finished
-    while (left != 0)
-    {
-        // Read from the USB and save it to our binary file
-        FT_Read(cart->handle, buffer, left, &cart->bytes_read);
-        for (int i=0; i<(int)cart->bytes_read; i+=4)
-        {
-            int texel = swap_endian((buffer[i+3]<<24)&0xFF000000 | (buffer[i+2]<<16)&0xFF0000 | (buffer[i+1]<<8)&0xFF00 | buffer[i]&0xFF);
-            if (debug_headerdata[1] == 2) 
-            {
-                short pixel1 = (texel&0xFFFF0000)>>16;
-                short pixel2 = (texel&0x0000FFFF);
-                image[j++] = 0x08*((pixel1>>11) & 0x001F); // R1
-                image[j++] = 0x08*((pixel1>>6) & 0x001F);  // G1
-                image[j++] = 0x08*((pixel1>>1) & 0x001F);  // B1
-                image[j++] = 0xFF;
-
-                image[j++] = 0x08*((pixel2>>11) & 0x001F); // R2
-                image[j++] = 0x08*((pixel2>>6) & 0x001F);  // G2
-                image[j++] = 0x08*((pixel2>>1) & 0x001F);  // B2
-                image[j++] = 0xFF;
-            }
-            else
-            {
-                // TODO: Test this because I sure as hell didn't >:V
-                image[j++] = (texel>>24) & 0xFF; // R
-                image[j++] = (texel>>16) & 0xFF; // G
-                image[j++] = (texel>>8)  & 0xFF; // B
-                image[j++] = (texel>>0)  & 0xFF; // Alpha
-            }
-        }
-
-        // Store the amount of bytes read
-        (*read) += cart->bytes_read;
-        total += cart->bytes_read;
-
-        // Ensure the data fits within our buffer
-        left = size - total;
-        if (left > BUFFER_SIZE)
-            left = BUFFER_SIZE;
-    }
-
-    // Close the file and free the dynamic memory used
-    lodepng_encode32_file(filename, image, w, h);
-    pdprint("Wrote %dx%d pixels to %s.\n", CRDEF_INFO, w, h, filename);
-    free(image);
-    free(filename);
-    free(extraname);
+    // Save it in the background, and let the reader allocate a new buffer for the next packet
+    screenshot_save(local_currentcart, debug_headerdata[local_currentcart], packet->data, packet->info & 0xFFFFFF, filename);
+    packet->data = NULL;
+    packet->capacity = 0;
 }
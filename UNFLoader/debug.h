@@ -9,6 +9,19 @@
     #define DATATYPE_HEADER     0x03
     #define DATATYPE_SCREENSHOT 0x04
 
-    void debug_main(ftdi_context_t *cart);
+    // How many words a data header holds
+    #define HEADER_SIZE 16
+
+    // How long to sleep when nothing happens, in milliseconds
+    #define DEBUG_IDLEWAIT 100
+
+    void debug_main(ftdi_context_t *carts, int count);
+    void debug_openoutput(int count);
+    void debug_closeoutput();
+    bool debug_poll(ftdi_context_t *carts, int count);
+    void debug_send(char* command);
+    void debug_parseheader(u8* data, u32 size, int* header);
+    char* debug_filename(const char* prefix, const char* extension);
+    void debug_reportscreenshots(ftdi_context_t *carts, int count, bool wait);
 
 #endif
\ No newline at end of file
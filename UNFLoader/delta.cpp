@@ -0,0 +1,198 @@
+/***************************************************************
+                            delta.cpp
+
+Remembers a hash of every block of the ROM that was last put in
+the cart's SDRAM, so that listen mode only needs to resend the
+blocks that changed when the ROM is rebuilt.
+***************************************************************/
+
+#include "main.h"
+#include "helper.h"
+#include "delta.h"
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64-(r))))
+
+
+/*==============================
+    delta_hash
+    Hashes a block of the ROM. Four independent lanes
+    are used so the CPU can work on them in parallel
+    @param A pointer to the data
+    @param The number of bytes
+    @returns The 64-bit hash
+==============================*/
+
+u64 delta_hash(const u8* data, u32 size)
+{
+    u32 i, j;
+    u64 hash;
+    u64 lanes[4] = {PRIME1+PRIME2, PRIME2, 0, 0-PRIME1};
+
+    // Mix 32 bytes at a time
+    for (i=0; i+32<=size; i+=32)
+    {
+        for (j=0; j<4; j++)
+        {
+            u64 word;
+            memcpy(&word, data+i+j*8, 8);
+            lanes[j] += word*PRIME2;
+            lanes[j] = ROTL(lanes[j], 31)*PRIME1;
+        }
+    }
+    hash = ROTL(lanes[0], 1) + ROTL(lanes[1], 7) + ROTL(lanes[2], 12) + ROTL(lanes[3], 18) + size;
+
+    // Mix in whatever is left
+    for (; i<size; i++)
+        hash = ROTL(hash ^ (data[i]*PRIME3), 11)*PRIME1;
+
+    // Make sure every bit of the input affects every bit of the hash
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+
+/*==============================
+    delta_changed
+    Checks if a block of a chunk changed since the last upload,
+    and remembers its new hash
+    @param A pointer to the delta state
+    @param A pointer to the chunk
+    @param The offset of the block in the chunk
+    @returns Whether the block needs to be sent
+==============================*/
+
+static bool delta_changed(delta_t* delta, pipeline_chunk_t* chunk, u32 offset)
+{
+    u32 block = (chunk->offset+offset)/delta->blocksize;
+    u32 size = chunk->size-offset;
+    u64 hash;
+    bool changed;
+    if (size > delta->blocksize)
+        size = delta->blocksize;
+
+    // Without the hashes, every block has to be sent
+    if (delta->hashes == NULL)
+        return true;
+
+    // Compare the hash and store the new one
+    hash = delta_hash(chunk->data+offset, size);
+    changed = !delta->partial || delta->hashes[block] != hash;
+    delta->hashes[block] = hash;
+    return changed;
+}
+
+
+/*==============================
+    delta_start
+    Prepares for a new upload
+    @param A pointer to the delta state
+    @param How many bytes are going to be uploaded
+    @param The size of the chunks the upload uses
+    @returns Whether only the blocks that changed need to be sent
+==============================*/
+
+bool delta_start(delta_t* delta, u32 romsize, u32 chunksize)
+{
+    u32 blocksize = DELTA_BLOCKSIZE;
+    if (blocksize > chunksize)
+        blocksize = chunksize;
+
+    // We can only skip blocks if the last upload finished and was laid out the same way
+    delta->partial = delta->valid && delta->romsize == romsize && delta->blocksize == blocksize;
+    delta->valid = false;
+    delta->sent = 0;
+
+    // Otherwise, start over
+    if (!delta->partial)
+    {
+        free(delta->hashes);
+        delta->romsize = romsize;
+        delta->blocksize = blocksize;
+        delta->hashes = (u64*) malloc(sizeof(u64)*((romsize+blocksize-1)/blocksize)); // If this fails, the next upload sends the whole ROM again
+    }
+    return delta->partial;
+}
+
+
+/*==============================
+    delta_dirty
+    Finds the next range of a chunk that needs to be sent
+    @param A pointer to the delta state
+    @param A pointer to the chunk
+    @param A pointer to the offset in the chunk to start looking
+           from. It is moved to the start of the range
+    @returns The size of the range, or 0 if the rest of the chunk
+             didn't change
+==============================*/
+
+u32 delta_dirty(delta_t* delta, pipeline_chunk_t* chunk, u32* offset)
+{
+    u32 size = 0;
+
+    // Skip the blocks that didn't change
+    while (*offset < chunk->size && !delta_changed(delta, chunk, *offset))
+        *offset += delta->blocksize;
+    if (*offset >= chunk->size)
+        return 0;
+
+    // Grow the range until we find a block that didn't change
+    do
+        size += delta->blocksize;
+    while (*offset+size < chunk->size && delta_changed(delta, chunk, *offset+size));
+    if (*offset+size > chunk->size)
+        size = chunk->size-*offset;
+    delta->sent += size;
+    return size;
+}
+
+
+/*==============================
+    delta_finish
+    Marks the upload as finished, so the next one
+    can skip the blocks that don't change
+    @param A pointer to the delta state
+==============================*/
+
+void delta_finish(delta_t* delta)
+{
+    delta->valid = (delta->hashes != NULL);
+}
+
+
+/*==============================
+    delta_invalidate
+    Forces the next upload to send the whole ROM
+    @param A pointer to the delta state
+==============================*/
+
+void delta_invalidate(delta_t* delta)
+{
+    delta->valid = false;
+}
+
+
+/*==============================
+    delta_free
+    Frees the memory used by the hashes
+    @param A pointer to the delta state
+==============================*/
+
+void delta_free(delta_t* delta)
+{
+    free(delta->hashes);
+    delta->hashes = NULL;
+    delta->valid = false;
+}
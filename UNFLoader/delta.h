@@ -0,0 +1,39 @@
+#ifndef __DELTA_HEADER
+#define __DELTA_HEADER
+
+    #include "pipeline.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define DELTA_BLOCKSIZE 64*1024 // How many bytes each hash covers (at most)
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct {
+        bool valid;     // Whether the hashes describe what's in the cart's SDRAM
+        bool partial;   // Whether the current upload only sends the blocks that changed
+        u32  romsize;   // How many bytes the hashes cover
+        u32  blocksize; // How many bytes each hash covers
+        u32  sent;      // How many bytes the current upload actually sent
+        u64* hashes;
+    } delta_t;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    bool delta_start(delta_t* delta, u32 romsize, u32 chunksize);
+    u32  delta_dirty(delta_t* delta, pipeline_chunk_t* chunk, u32* offset);
+    void delta_finish(delta_t* delta);
+    void delta_invalidate(delta_t* delta);
+    void delta_free(delta_t* delta);
+    u64  delta_hash(const u8* data, u32 size);
+
+#endif
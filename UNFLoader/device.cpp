@@ -4,7 +4,6 @@
 Passes flashcart communication to more specific functions
 ***************************************************************/
 
-#include <sys/stat.h>
 #include "main.h"
 #include "helper.h"
 #include "debug.h"
@@ -13,92 +12,212 @@ Passes flashcart communication to more specific functions
 #include "device_everdrive.h"
 #include "device_sc64.h"
 #include "network.h"
+#include "byteorder.h"
+#include "romcache.h"
+#include "watcher.h"
+#include "cartcache.h"
+#include "daemon.h"
+#include "usbreader.h"
+#include "session.h"
+#include <chrono>
+#include <thread>
 
 
 /*********************************
-        Function Pointers
+              Macros
 *********************************/
 
-void (*funcPointer_open)(ftdi_context_t*);
-void (*funcPointer_sendrom)(ftdi_context_t*, FILE *file, u32 size);
-void (*funcPointer_senddata)(ftdi_context_t*, int datatype, char *data, u32 size);
-void (*funcPointer_close)(ftdi_context_t*);
+#define CALIBRATE_SIZE 8*1024*1024 // How many bytes to upload to test each group of settings
 
 
 /*********************************
              Globals
 *********************************/
 
-static ftdi_context_t local_usb = {0, };
+static ftdi_context_t local_carts[DEVICE_MAX];
+static int local_cartcount = 0;
+
+
+/*==============================
+    device_probe
+    Checks what kind of flashcart a USB device is. If the
+    device couldn't be talked to, the reason is stored in
+    the context
+    @param A pointer to the context to probe with, which has
+           the list of USB devices
+    @param The index of the device to check
+    @param The cart to check for (CART_NONE for automatic checking)
+    @param A pointer to store the type of cart in (CART_NONE if it isn't one)
+==============================*/
+
+static void device_probe(ftdi_context_t* cart, int index, int automode, int* carttype)
+{
+    // Look for 64drive HW1 (FT2232H Asynchronous FIFO mode)
+    if ((automode == CART_NONE || automode == CART_64DRIVE1) && device_test_64drive1(cart, index))
+        *carttype = CART_64DRIVE1;
+
+    // Look for 64drive HW2 (FT232H Synchronous FIFO mode)
+    else if ((automode == CART_NONE || automode == CART_64DRIVE2) && device_test_64drive2(cart, index))
+        *carttype = CART_64DRIVE2;
+
+    // Look for an EverDrive
+    else if ((automode == CART_NONE || automode == CART_EVERDRIVE) && device_test_everdrive(cart, index))
+        *carttype = CART_EVERDRIVE;
+
+    // Look for SummerCart64
+    else if ((automode == CART_NONE || automode == CART_SC64) && device_test_sc64(cart, index))
+        *carttype = CART_SC64;
+    else
+        *carttype = CART_NONE;
+}
+
+
+/*==============================
+    device_reopen
+    Checks that a device that was a flashcart before
+    can still be opened, without talking to it
+    @param The index of the device
+    @returns Whether the device could be opened
+==============================*/
+
+static bool device_reopen(int index)
+{
+    FT_HANDLE handle = NULL;
+    if (FT_Open(index, &handle) != FT_OK || handle == NULL)
+        return false;
+    FT_Close(handle);
+    return true;
+}
+
+
+/*==============================
+    device_settype
+    Marks the cart as being a specific type
+    @param A pointer to the cart context
+    @param The type of cart
+    @param The index of the cart
+    @returns A string with the name of the cart
+==============================*/
+
+static const char* device_settype(ftdi_context_t* cart, int carttype, int index)
+{
+    switch (carttype)
+    {
+        case CART_64DRIVE1: device_set_64drive1(cart, index); return "64Drive HW1";
+        case CART_64DRIVE2: device_set_64drive2(cart, index); return "64Drive HW2";
+        case CART_EVERDRIVE: device_set_everdrive(cart, index); return "EverDrive";
+        default: device_set_sc64(cart, index); return "SummerCart64";
+    }
+}
 
 
 /*==============================
     device_find
-    Finds the flashcart plugged in to USB
+    Finds the flashcarts plugged in to USB
     @param The cart to check for (CART_NONE for automatic checking)
+    @param Whether to use every cart that's found, rather than
+           just the first one
 ==============================*/
 
-void device_find(int automode)
+void device_find(int automode, bool all)
 {
-    int i;
-    ftdi_context_t *cart = &local_usb;
+    u32 i;
+    DWORD devices;
+    bool  cachehit = false;
+    int*  cached;
+    int*  found;
+    std::thread* probes;
+    ftdi_context_t* probecarts;
+    FT_DEVICE_LIST_INFO_NODE* dev_info;
 
     // Initialize FTD
     if (automode == CART_NONE)
         pdprint("Attempting flashcart autodetection.\n", CRDEF_PROGRAM);
-    testcommand(FT_CreateDeviceInfoList(&cart->devices), "USB Device not ready.");
+    testcommand(FT_CreateDeviceInfoList(&devices), "USB Device not ready.");
 
     // Check if the device exists
-    if (cart->devices == 0)
+    if (devices == 0)
         terminate("No devices found.");
 
     // Allocate storage and get device info list
-    cart->dev_info = (FT_DEVICE_LIST_INFO_NODE*) malloc(sizeof(FT_DEVICE_LIST_INFO_NODE)*cart->devices);
-    FT_GetDeviceInfoList(cart->dev_info, &cart->devices);
-
-    // Search the devices
-    for(i=0; (unsigned)i < cart->devices; i++)
+    dev_info = (FT_DEVICE_LIST_INFO_NODE*) malloc(sizeof(FT_DEVICE_LIST_INFO_NODE)*devices);
+    cached = (int*) malloc(sizeof(int)*devices);
+    found = (int*) malloc(sizeof(int)*devices);
+    probecarts = (ftdi_context_t*) calloc(devices, sizeof(ftdi_context_t));
+    if (dev_info == NULL || cached == NULL || found == NULL || probecarts == NULL)
+        terminate("Unable to allocate memory for the device list.");
+    FT_GetDeviceInfoList(dev_info, &devices);
+    probes = new std::thread[devices];
+
+    // Devices that were flashcarts before, and still describe themselves the same way, only need to be opened to check that they're still there
+    for (i=0; i<devices; i++)
     {
-        // Look for 64drive HW1 (FT2232H Asynchronous FIFO mode)
-        if ((automode == CART_NONE || automode == CART_64DRIVE1) && device_test_64drive1(cart, i))
+        dev_info[i].SerialNumber[sizeof(dev_info[i].SerialNumber)-1] = '\0';
+        dev_info[i].Description[sizeof(dev_info[i].Description)-1] = '\0';
+        cached[i] = cartcache_lookup(dev_info[i].SerialNumber, dev_info[i].LocId, dev_info[i].ID, dev_info[i].Description);
+        found[i] = CART_NONE;
+        probecarts[i].devices = devices;
+        probecarts[i].dev_info = dev_info;
+        if (cached[i] != CART_NONE && (automode == CART_NONE || automode == cached[i]) && device_reopen(i))
         {
-            device_set_64drive1(cart, i);
-            if (automode == CART_NONE) 
-                pdprint_replace("64Drive HW1 autodetected!\n", CRDEF_PROGRAM);
-            break;
+            found[i] = cached[i];
+            cachehit = true;
         }
+    }
 
-        // Look for 64drive HW2 (FT232H Synchronous FIFO mode)
-        if ((automode == CART_NONE || automode == CART_64DRIVE2) && device_test_64drive2(cart, i))
+    // Probe the other devices all at once, so that the ones that don't answer don't hold up the rest
+    if (all || !cachehit)
+    {
+        for (i=0; i<devices; i++)
+            if (found[i] == CART_NONE)
+                probes[i] = std::thread(device_probe, &probecarts[i], (int)i, automode, &found[i]);
+        for (i=0; i<devices; i++)
         {
-            device_set_64drive2(cart, i);
-            if (automode == CART_NONE) 
-                pdprint_replace("64Drive HW2 autodetected!\n", CRDEF_PROGRAM);
-            break;
-        }
+            if (!probes[i].joinable())
+                continue;
+            probes[i].join();
 
-        // Look for an EverDrive
-        if ((automode == CART_NONE || automode == CART_EVERDRIVE) && device_test_everdrive(cart, i))
-        {
-            device_set_everdrive(cart, i);
-            if (automode == CART_NONE)
-                pdprint_replace("EverDrive autodetected!\n", CRDEF_PROGRAM);
-            break;
+            // Say if the device couldn't be checked
+            if (probecarts[i].error[0] != '\0')
+                pdprint("Unable to check USB device %d: %s\n", CRDEF_ERROR, i, probecarts[i].error);
+
+            // Remember what the device turned out to be, for next time
+            if (automode == CART_NONE && found[i] != cached[i])
+                cartcache_store(dev_info[i].SerialNumber, dev_info[i].LocId, dev_info[i].ID, dev_info[i].Description, found[i]);
         }
+    }
 
-        // Look for SummerCart64
-        if ((automode == CART_NONE || automode == CART_SC64) && device_test_sc64(cart, i))
-        {
-            device_set_sc64(cart, i);
-            if (automode == CART_NONE)
-                pdprint_replace("SummerCart64 autodetected!\n", CRDEF_PROGRAM);
+    // Use the carts in the order they're plugged in
+    for (i=0; i<devices && local_cartcount<DEVICE_MAX; i++)
+    {
+        ftdi_context_t* cart = &local_carts[local_cartcount];
+        const char* name;
+        if (found[i] == CART_NONE)
+            continue;
+        name = device_settype(cart, found[i], i);
+
+        // Remember the serial number of the cart we found, since the device list is about to be freed
+        memcpy(cart->serial, dev_info[i].SerialNumber, sizeof(cart->serial));
+        cart->serial[sizeof(cart->serial)-1] = '\0';
+        local_cartcount++;
+        sprintf(cart->prefix, "[%d] ", local_cartcount);
+
+        // Say what was found
+        if (all)
+            pdprint("%s%s found.\n", CRDEF_PROGRAM, cart->prefix, name);
+        else if (automode == CART_NONE)
+            pdprint_replace("%s autodetected!\n", CRDEF_PROGRAM, name);
+        if (!all)
             break;
-        }
     }
 
     // Finish
-    free(cart->dev_info);
-    if (cart->carttype == CART_NONE)
+    delete[] probes;
+    free(probecarts);
+    free(found);
+    free(cached);
+    free(dev_info);
+    if (local_cartcount == 0)
     {
         if (automode == CART_NONE)
         {
@@ -129,10 +248,11 @@ void device_set_64drive1(ftdi_context_t* cart, int index)
     cart->carttype = CART_64DRIVE1;
 
     // Set function pointers
-    funcPointer_open = &device_open_64drive;
-    funcPointer_sendrom = &device_sendrom_64drive;
-    funcPointer_senddata = &device_senddata_64drive;
-    funcPointer_close = &device_close_64drive;
+    cart->open = &device_open_64drive;
+    cart->sendrom = &device_sendrom_64drive;
+    cart->writerom = &device_writerom_64drive;
+    cart->senddata = &device_senddata_64drive;
+    cart->close = &device_close_64drive;
 }
 
 
@@ -168,10 +288,11 @@ void device_set_everdrive(ftdi_context_t* cart, int index)
     cart->carttype = CART_EVERDRIVE;
 
     // Set function pointers
-    funcPointer_open = &device_open_everdrive;
-    funcPointer_sendrom = &device_sendrom_everdrive;
-    funcPointer_senddata = &device_senddata_everdrive;
-    funcPointer_close = &device_close_everdrive;
+    cart->open = &device_open_everdrive;
+    cart->sendrom = &device_sendrom_everdrive;
+    cart->writerom = &device_writerom_everdrive;
+    cart->senddata = &device_senddata_everdrive;
+    cart->close = &device_close_everdrive;
 }
 
 
@@ -189,140 +310,371 @@ void device_set_sc64(ftdi_context_t* cart, int index)
     cart->carttype = CART_SC64;
 
     // Set function pointers
-    funcPointer_open = &device_open_sc64;
-    funcPointer_sendrom = &device_sendrom_sc64;
-    funcPointer_senddata = &device_senddata_sc64;
-    funcPointer_close = &device_close_sc64;
+    cart->open = &device_open_sc64;
+    cart->sendrom = &device_sendrom_sc64;
+    cart->writerom = &device_writerom_sc64;
+    cart->senddata = &device_senddata_sc64;
+    cart->close = &device_close_sc64;
 }
 
 
 /*==============================
-    device_open
-    Calls the function to open the flashcart
+    device_serial
+    Gets the serial number of the flashcart's USB chip
+    @param A pointer to the cart context
+    @returns A string with the serial number, or NULL if it doesn't have one
 ==============================*/
 
-void device_open()
+static const char* device_serial(ftdi_context_t* cart)
 {
-    funcPointer_open(&local_usb);
-    pdprint("USB connection opened.\n", CRDEF_PROGRAM);
+    if (cart->serial[0] == '\0')
+        return NULL;
+    return cart->serial;
 }
 
 
 /*==============================
-    device_sendrom
-    Opens the ROM and calls the function to send it to the flashcart
-    @param A string with the path to the ROM
+    device_useprefix
+    Makes the current thread's lines start with the cart's
+    prefix, if there's more than one cart
+    @param A pointer to the cart context, or NULL to stop
 ==============================*/
 
-void device_sendrom(char* rompath)
+static void device_useprefix(ftdi_context_t* cart)
 {
-    bool escignore = false;
-    bool resend = false;
-    FILE *file;
-    int  filesize = 0; // I could use finfo, but it doesn't work in WinXP (more info below)
-    time_t lastmod = 0;
-    struct stat finfo;
+    if (local_cartcount > 1)
+        pdprint_prefix((cart != NULL) ? cart->prefix : NULL);
+}
 
-    for ( ; ; )
-    {
-        unsigned char rom_header[4];
 
-        // Open the ROM and get info about it 
-        file = fopen(rompath, "rb");
-        if (file == NULL)
+/*==============================
+    device_fail
+    Stores why a cart's upload failed. Uploads can run in
+    several threads at once, so they report errors this way
+    and the program is only ended once they all stopped
+    @param A pointer to the cart context
+    @param The reason, as a printf style format string
+    @param Variadic arguments to use in the string
+    @returns false, so it can be returned straight away
+==============================*/
+
+bool device_fail(ftdi_context_t* cart, const char* reason, ...)
+{
+    va_list args;
+    va_start(args, reason);
+    vsnprintf(cart->error, sizeof(cart->error), reason, args);
+    va_end(args);
+    return false;
+}
+
+
+/*==============================
+    device_applyprofile
+    Gives the cart's transfer settings to the USB driver
+    @param A pointer to the cart context
+==============================*/
+
+static void device_applyprofile(ftdi_context_t* cart)
+{
+    if (cart->profile.transfersize != 0)
+        testcommand(FT_SetUSBParameters(cart->handle, cart->profile.transfersize, cart->profile.transfersize), "Unable to set USB transfer size.");
+    if (cart->profile.latency != 0)
+        testcommand(FT_SetLatencyTimer(cart->handle, (UCHAR)cart->profile.latency), "Unable to set latency timer.");
+}
+
+
+/*==============================
+    device_open
+    Calls the function to open the flashcarts
+==============================*/
+
+void device_open()
+{
+    int i;
+    for (i=0; i<local_cartcount; i++)
+    {
+        ftdi_context_t* cart = &local_carts[i];
+        const char* serial;
+        device_useprefix(cart);
+        if (!cart->open(cart))
+            terminate("%s", cart->error);
+        pdprint("USB connection opened.\n", CRDEF_PROGRAM);
+
+        // Use the transfer settings that were calibrated for this cart, if there are any
+        serial = device_serial(cart);
+        if (serial != NULL && profile_load(serial, &cart->profile))
         {
-            device_close();
-            terminate("Unable to open file '%s'.\n", rompath);
+            device_applyprofile(cart);
+            pdprint("Using the calibrated transfer settings.\n", CRDEF_PROGRAM);
         }
-	    stat(rompath, &finfo);
-        global_filename = rompath;
-
-        // Read the ROM header to check if its byteswapped
-        fread(rom_header, 4, 1, file);
-        if (!(rom_header[0] == 0x80 && rom_header[1] == 0x37 && rom_header[2] == 0x12 && rom_header[3] == 0x40))
-            global_z64 = true;
-
-        // Get the filesize and reset the position
-        // Workaround for https://stackoverflow.com/questions/32452777/visual-c-2015-express-stat-not-working-on-windows-xp
-        fseek(file, 0, SEEK_END);
-        filesize = ftell(file);
-        fseek(file, 0, SEEK_SET);
-
-        // If the file was not modified
-        if (!resend && lastmod != 0 && lastmod == finfo.st_mtime)
-        {
-            int count = 0;
+    }
+    device_useprefix(NULL);
+}
 
-            // Close the file and wait for three seconds
-            fclose(file);
-            while (count < 30)
-            {
-                int ch;
-                #ifndef LINUX
-                    Sleep(100);
-                #else
-                    usleep(100);
-                #endif
-                count++;
-                ch = getch();
-
-                // Disable ESC ignore if the key was released
-                if (ch == CH_ESCAPE && escignore)
-                    escignore = false;
-
-                // Check if ESC was pressed
-                if (ch == CH_ESCAPE && !escignore)
-                {
-                    pdprint("\nExiting listen mode.\n", CRDEF_PROGRAM);
-                    return;
-                }
 
-                // Check if R was pressed
-                if (ch == 'r')
+/*==============================
+    device_calibratecart
+    Uploads test data to a flashcart with different
+    transfer settings, and remembers the fastest ones
+    @param A pointer to the cart context
+==============================*/
+
+static void device_calibratecart(ftdi_context_t* cart)
+{
+    const u32 transfersizes[] = {4096, 16384, 65536};
+    const u32 latencies[] = {2, 16};
+    const u32 chunksizes[] = {32*1024, 128*1024, 512*1024, 2*1024*1024};
+    const char* serial = device_serial(cart);
+    profile_t best = {0, 0, 0};
+    double bestspeed = 0;
+    u32 i, j, k;
+    u8* data = (u8*) malloc(CALIBRATE_SIZE);
+    if (data == NULL)
+        terminate("Unable to allocate memory for calibration buffer.");
+
+    // Fill the buffer with something that isn't trivially compressible
+    for (i=0; i<CALIBRATE_SIZE; i++)
+        data[i] = (u8)((i*2654435761u) >> 24);
+
+    // Try every combination of settings
+    pdprint("Calibrating transfer settings. This overwrites what's in the cart's memory.\n", CRDEF_PROGRAM);
+    for (i=0; i<sizeof(transfersizes)/sizeof(transfersizes[0]); i++)
+    {
+        for (j=0; j<sizeof(latencies)/sizeof(latencies[0]); j++)
+        {
+            profile_t test = {0, transfersizes[i], latencies[j]};
+            cart->profile = test;
+            device_applyprofile(cart);
+            for (k=0; k<sizeof(chunksizes)/sizeof(chunksizes[0]); k++)
+            {
+                u32 offset;
+                double seconds, speed;
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+                // Upload the test data and see how long it took
+                for (offset=0; offset<CALIBRATE_SIZE; offset+=chunksizes[k])
+                    if (!cart->writerom(cart, offset, data+offset, chunksizes[k]))
+                        terminate("Flashcart timed out during calibration.");
+                seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+                speed = (CALIBRATE_SIZE/(1024.0*1024.0))/seconds;
+                pdprint("  %4d KB chunks, %5d byte transfers, %2dms latency: %.2f MB/s\n", CRDEF_PROGRAM, chunksizes[k]/1024, transfersizes[i], latencies[j], speed);
+
+                // Keep track of the fastest
+                if (speed > bestspeed)
                 {
-                    resend = true;
-                    pdprint("\nReuploading ROM by request.\n", CRDEF_PROGRAM);
-                    break;
+                    bestspeed = speed;
+                    best = test;
+                    best.chunksize = chunksizes[k];
                 }
             }
+        }
+    }
+    free(data);
+    delta_invalidate(&cart->delta);
+
+    // Use the fastest settings from now on
+    cart->profile = best;
+    device_applyprofile(cart);
+    pdprint("Fastest settings: %d KB chunks, %d byte transfers, %dms latency (%.2f MB/s).\n", CRDEF_PROGRAM, best.chunksize/1024, best.transfersize, best.latency, bestspeed);
+    if (serial != NULL && profile_save(serial, &best))
+        pdprint("Settings stored for cart '%s'.\n", CRDEF_PROGRAM, serial);
+    else
+        pdprint("Unable to store the calibrated settings.\n", CRDEF_ERROR);
+}
 
-            // Restart the while loop
-            if (!resend)
-                clearerr(file);
-            continue;
+
+/*==============================
+    device_calibrate
+    Calibrates the transfer settings of every flashcart
+==============================*/
+
+void device_calibrate()
+{
+    int i;
+    for (i=0; i<local_cartcount; i++)
+    {
+        device_useprefix(&local_carts[i]);
+        device_calibratecart(&local_carts[i]);
+    }
+    device_useprefix(NULL);
+}
+
+
+/*==============================
+    device_upload
+    Sends a ROM to a flashcart, and says how it went
+    @param A pointer to the cart context
+    @param A pointer to the ROM
+    @param The size of the ROM
+    @param A pointer to store whether the upload worked in
+==============================*/
+
+static void device_upload(ftdi_context_t* cart, romfile_t* rom, u32 size, bool* success)
+{
+    device_useprefix(cart);
+    cart->error[0] = '\0';
+    *success = cart->sendrom(cart, rom, size);
+    if (!*success)
+    {
+        delta_invalidate(&cart->delta);
+        device_useprefix(NULL);
+        return;
+    }
+
+    // Say how much of the ROM actually changed
+    if (cart->delta.partial)
+        pdprint("Only %d KB of the ROM changed.\n", CRDEF_PROGRAM, cart->delta.sent/1024);
+
+    // Say if the ROM's checksum is wrong, since the bootcode won't run it
+    if (cart->checksum.fixed)
+        pdprint("Fixed the ROM's checksum.\n", CRDEF_PROGRAM);
+    else if (checksum_wrong(&cart->checksum))
+        pdprint("The ROM's checksum is wrong, it might not boot. Use -fixcrc to fix it.\n", CRDEF_PROGRAM);
+    device_useprefix(NULL);
+}
+
+
+/*==============================
+    device_uploadfile
+    Opens a ROM and sends it to the flashcarts
+    @param A string with the path to the ROM
+    @returns Whether the ROM could be opened
+==============================*/
+
+bool device_uploadfile(char* rompath)
+{
+    int  i;
+    int  failed = 0;
+    bool success[DEVICE_MAX];
+    romfile_t* rom;
+    int  filesize = 0; // I could use stat, but it doesn't work in WinXP (more info in romfile_open)
+    unsigned char rom_header[4];
+
+    // Open the ROM and get info about it 
+    rom = romfile_open(rompath);
+    if (rom == NULL)
+        return false;
+    global_filename = rompath;
+    filesize = rom->size;
+
+    // Read the ROM header to check its byte order
+    romfile_read(rom, 0, rom_header, 4);
+    global_byteorder = byteorder_detect(rom_header);
+
+    // Word swapped ROMs whose size isn't a multiple of 4 end in half a word, which only lines up once it's padded
+    if (global_byteorder == BYTEORDER_N64 && filesize % 4 != 0)
+        filesize += 4 - filesize % 4;
+
+    // Complain if the ROM is too small
+    if (filesize < 1052672)
+        pdprint("ROM is smaller than 1MB, it might not boot properly.\n", CRDEF_PROGRAM);
+
+    // Swap the ROM for a copy that was already prepared for this cart
+    if (global_romcache && local_cartcount == 1)
+    {
+        rom = romcache_open(rom, local_carts[0].carttype);
+        if (rom->prepared)
+        {
+            global_byteorder = BYTEORDER_Z64;
+            filesize = rom->size;
         }
-        else if (lastmod != 0)
+    }
+
+    // Say if the ROM needs to be converted
+    if (global_byteorder != BYTEORDER_Z64)
+        pdprint("Converting %s ROM to big endian (%s).\n", CRDEF_PROGRAM, byteorder_name(global_byteorder), byteorder_kernel());
+
+    // Send the ROM
+    if (local_cartcount == 1)
+        device_upload(&local_carts[0], rom, filesize, &success[0]);
+    else
+    {
+        std::thread workers[DEVICE_MAX];
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        // Convert the ROM once, rather than once per cart
+        if (global_byteorder != BYTEORDER_Z64)
         {
-            pdprint("\nFile change detected. Reuploading ROM.\n", CRDEF_PROGRAM);
-            lastmod = finfo.st_mtime;
+            rom = romfile_convert(rom, global_byteorder);
+            if (rom == NULL)
+            {
+                device_close();
+                terminate("Unable to read '%s' into memory.\n", rompath);
+            }
+            global_byteorder = BYTEORDER_Z64;
         }
 
-        // Initialize lastmod
-        if (lastmod == 0)
-            lastmod = finfo.st_mtime;
+        // Upload it to every cart at the same time
+        pdprint("Uploading to %d flashcarts.\n", CRDEF_PROGRAM, local_cartcount);
+        for (i=0; i<local_cartcount; i++)
+            workers[i] = std::thread(device_upload, &local_carts[i], rom, (u32)filesize, &success[i]);
+        for (i=0; i<local_cartcount; i++)
+            workers[i].join();
+        for (i=0; i<local_cartcount; i++)
+            failed += !success[i];
+        if (failed == 0)
+            pdprint("Uploaded to every flashcart in %.2f seconds.\n", CRDEF_PROGRAM, std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count());
+    }
+    romfile_close(rom);
+
+    // Now that no cart is being used by another thread, end the program if any of the uploads failed
+    if (local_cartcount == 1 && !success[0])
+        terminate("%s", local_carts[0].error);
+    if (failed > 0)
+    {
+        for (i=0; i<local_cartcount; i++)
+        {
+            if (success[i])
+                continue;
+            device_useprefix(&local_carts[i]);
+            pdprint("%s\n", CRDEF_ERROR, local_carts[i].error);
+        }
+        device_useprefix(NULL);
+        terminate("Unable to upload the ROM to %d of the flashcarts.", failed);
+    }
+    return true;
+}
 
-        // Complain if the ROM is too small
-        if (filesize < 1052672)
-            pdprint("ROM is smaller than 1MB, it might not boot properly.\n", CRDEF_PROGRAM);
 
+/*==============================
+    device_sendrom
+    Opens the ROM and calls the function to send it to the flashcart
+    @param A string with the path to the ROM
+==============================*/
+
+void device_sendrom(char* rompath)
+{
+    int  i;
+    bool escignore = false;
+    watcher_t* watcher = NULL;
+
+    // Start watching the ROM before the first upload, so that changes made during debug mode aren't missed
+    if (global_listenmode)
+        watcher = watcher_start(rompath);
+
+    for ( ; ; )
+    {
         // Send the ROM
-        funcPointer_sendrom(&local_usb, file, filesize);
+        if (!device_uploadfile(rompath))
+        {
+            device_close();
+            terminate("Unable to open file '%s'.\n", rompath);
+        }
 
-        // Close the file pipe and start the timeout
-        fclose(file);
+        // Start the timeout
         global_timeouttime = global_timeout + time(NULL);
 
         // Start Debug Mode
         if (global_debugmode) 
         {
-            debug_main(&local_usb);
+            debug_main(local_carts, local_cartcount);
             escignore = true;
         }
 
         // Start Network Mode
         if (global_networkmode)
         {
-            network_main(&local_usb);
+            network_main(&local_carts[0]);
             escignore = true;
         }
 
@@ -332,14 +684,59 @@ void device_sendrom(char* rompath)
 
         // Print that we're waiting for changes
         pdprint("Waiting for file changes. Press ESC to stop. Press R to resend.\n", CRDEF_INPUT);
-        resend = false;
+
+        // Wait for the file to change or for a key to be pressed
+        for ( ; ; )
+        {
+            int ch = watcher_wait(watcher);
+
+            // Check if the file was changed
+            if (ch == WATCHER_CHANGED)
+            {
+                pdprint("\nFile change detected. Reuploading ROM.\n", CRDEF_PROGRAM);
+                break;
+            }
+
+            // Disable ESC ignore if the key was released
+            if (ch == CH_ESCAPE && escignore)
+                escignore = false;
+
+            // Check if ESC was pressed
+            if (ch == CH_ESCAPE && !escignore)
+            {
+                pdprint("\nExiting listen mode.\n", CRDEF_PROGRAM);
+                watcher_stop(watcher);
+                return;
+            }
+
+            // Check if R was pressed
+            if (ch == 'r')
+            {
+                for (i=0; i<local_cartcount; i++)
+                    delta_invalidate(&local_carts[i].delta);
+                pdprint("\nReuploading ROM by request.\n", CRDEF_PROGRAM);
+                break;
+            }
+        }
     }
 }
 
 
+/*==============================
+    device_daemon
+    Keeps the flashcarts open, and handles requests from
+    other instances of UNFLoader until it's stopped
+==============================*/
+
+void device_daemon()
+{
+    daemon_main(local_carts, local_cartcount);
+}
+
+
 /*==============================
     device_senddata
-    Sends data to the flashcart via USB
+    Sends data to every flashcart via USB
     @param The data to send
     @param The number of bytes in the data
     @returns 1 if success, 0 if failure
@@ -347,49 +744,69 @@ void device_sendrom(char* rompath)
 
 void device_senddata(int datatype, char* data, u32 size)
 {
-    funcPointer_senddata(&local_usb, datatype, data, size);
+    int i;
+    session_record(SESSION_HOST, datatype, data, size);
+
+    // Some carts reply to the data, so the reader threads have to let go of the link
+    usbreader_pause();
+    for (i=0; i<local_cartcount; i++)
+        local_carts[i].senddata(&local_carts[i], datatype, data, size);
+    usbreader_resume();
 }
 
 
 /*==============================
     device_isopen
-    Checks if the device is open
-    @returns Whether the device is open
+    Checks if any of the devices are open
+    @returns Whether a device is open
 ==============================*/
 
 bool device_isopen()
 {
-    ftdi_context_t* cart = &local_usb;
-    return (cart->handle != NULL);
+    int i;
+    for (i=0; i<local_cartcount; i++)
+        if (local_carts[i].handle != NULL)
+            return true;
+    return false;
 }
 
 
 /*==============================
     device_getcarttype
     Returns the type of the connected cart
-    @returns The cart type
+    @returns The cart type of the first cart
 ==============================*/
 
 DWORD device_getcarttype()
 {
-    ftdi_context_t* cart = &local_usb;
-    return cart->carttype;
+    if (local_cartcount == 0)
+        return CART_NONE;
+    return local_carts[0].carttype;
 }
 
 
 /*==============================
     device_close
-    Calls the function to close the flashcart
+    Calls the function to close the flashcarts
 ==============================*/
 
 void device_close()
 {
-    // Should never happen, but just in case...
-    if (local_usb.handle == NULL)
-        return;
+    int i;
+    for (i=0; i<local_cartcount; i++)
+    {
+        ftdi_context_t* cart = &local_carts[i];
 
-    // Close the device
-    funcPointer_close(&local_usb);
-    pdprint("USB connection closed.\n", CRDEF_PROGRAM);
+        // Should never happen, but just in case...
+        if (cart->handle == NULL)
+            continue;
+
+        // Close the device
+        device_useprefix(cart);
+        cart->close(cart);
+        delta_free(&cart->delta);
+        pdprint("USB connection closed.\n", CRDEF_PROGRAM);
+    }
+    device_useprefix(NULL);
 }
 
@@ -1,6 +1,11 @@
 #ifndef __DEVICE_HEADER
 #define __DEVICE_HEADER
 
+    #include "romfile.h"
+    #include "delta.h"
+    #include "profile.h"
+    #include "checksum.h"
+
 
     /*********************************
                   Macros
@@ -12,12 +17,14 @@
     #define CART_EVERDRIVE 3
     #define CART_SC64      4
 
+    #define DEVICE_MAX 8 // The most flashcarts that can be used at once
+
 
     /*********************************
                  Typedefs
     *********************************/
 
-    typedef struct {
+    typedef struct ftdi_context_s {
         DWORD        devices;
         int          device_index;
         FT_STATUS    status;
@@ -28,6 +35,19 @@
         DWORD        bytes_read;
         DWORD        carttype;
         DWORD        cictype;
+        char         serial[16]; // The serial number of the cart's USB chip
+        delta_t      delta;   // What was last uploaded to the cart
+        profile_t    profile; // The calibrated transfer settings of the cart
+        checksum_t   checksum; // The checksum of the last uploaded ROM
+        char         prefix[8]; // What to print before this cart's lines when several are in use
+        char         error[128]; // Why the last open or upload failed, since those can't end the program from their own thread
+
+        // The backend's functions
+        bool (*open)(struct ftdi_context_s* cart);
+        bool (*sendrom)(struct ftdi_context_s* cart, romfile_t* rom, u32 size);
+        bool (*writerom)(struct ftdi_context_s* cart, u32 address, u8* data, u32 size);
+        void (*senddata)(struct ftdi_context_s* cart, int datatype, char* data, u32 size);
+        void (*close)(struct ftdi_context_s* cart);
     } ftdi_context_t;
     #ifdef LINUX
         typedef int errno_t;
@@ -38,13 +58,17 @@
             Function Prototypes
     *********************************/
 
-    void  device_find(int automode);
+    void  device_find(int automode, bool all);
     void  device_set_64drive1(ftdi_context_t* cart, int index);
     void  device_set_64drive2(ftdi_context_t* cart, int index);
     void  device_set_everdrive(ftdi_context_t* cart, int index);
     void  device_set_sc64(ftdi_context_t* cart, int index);
     void  device_open();
+    void  device_calibrate();
+    bool  device_fail(ftdi_context_t* cart, const char* reason, ...);
     void  device_sendrom(char* rompath);
+    bool  device_uploadfile(char* rompath);
+    void  device_daemon();
     void  device_senddata(int datatype, char* data, u32 size);
     bool  device_isopen();
     DWORD device_getcarttype();
@@ -9,13 +9,16 @@ http://64drive.retroactive.be/support.php
 #include "main.h"
 #include "helper.h"
 #include "device_64drive.h"
+#include "pipeline.h"
+#include "byteorder.h"
+#include "verify.h"
 
 
 /*********************************
         Function Prototypes
 *********************************/
 
-void device_sendcmd_64drive(ftdi_context_t* cart, u8 command, bool reply, u32 numparams, ...);
+bool device_sendcmd_64drive(ftdi_context_t* cart, u8 command, bool reply, u32 numparams, ...);
 
 
 /*==============================
@@ -50,28 +53,36 @@ bool device_test_64drive2(ftdi_context_t* cart, int index)
     device_open_64drive
     Opens the USB pipe
     @param A pointer to the cart context
+    @returns Whether the cart was opened, with the reason stored in
+             the cart context if it wasn't
 ==============================*/
 
-void device_open_64drive(ftdi_context_t* cart)
+bool device_open_64drive(ftdi_context_t* cart)
 {
     // Open the cart
     cart->status = FT_Open(cart->device_index, &cart->handle);
     if (cart->status != FT_OK || !cart->handle)
-        terminate("Unable to open flashcart.");
+        return device_fail(cart, "Unable to open flashcart.");
 
     // Reset the cart and set its timeouts
-    testcommand(FT_ResetDevice(cart->handle), "Unable to reset flashcart.");
-    testcommand(FT_SetTimeouts(cart->handle, 5000, 5000), "Unable to set flashcart timeouts.");
+    if (FT_ResetDevice(cart->handle) != FT_OK)
+        return device_fail(cart, "Unable to reset flashcart.");
+    if (FT_SetTimeouts(cart->handle, 5000, 5000) != FT_OK)
+        return device_fail(cart, "Unable to set flashcart timeouts.");
 
     // If the cart is in synchronous mode, enable the bits
     if (cart->synchronous)
     {
-        testcommand(FT_SetBitMode(cart->handle, 0xff, FT_BITMODE_RESET), "Unable to set bitmode %d.", FT_BITMODE_RESET);
-        testcommand(FT_SetBitMode(cart->handle, 0xff, FT_BITMODE_SYNC_FIFO), "Unable to set bitmode %d.", FT_BITMODE_SYNC_FIFO);
+        if (FT_SetBitMode(cart->handle, 0xff, FT_BITMODE_RESET) != FT_OK)
+            return device_fail(cart, "Unable to set bitmode %d.", FT_BITMODE_RESET);
+        if (FT_SetBitMode(cart->handle, 0xff, FT_BITMODE_SYNC_FIFO) != FT_OK)
+            return device_fail(cart, "Unable to set bitmode %d.", FT_BITMODE_SYNC_FIFO);
     }
 
     // Purge USB contents
-    testcommand(FT_Purge(cart->handle, FT_PURGE_RX | FT_PURGE_TX), "Unable to purge USB contents.");
+    if (FT_Purge(cart->handle, FT_PURGE_RX | FT_PURGE_TX) != FT_OK)
+        return device_fail(cart, "Unable to purge USB contents.");
+    return true;
 }
 
 
@@ -83,9 +94,11 @@ void device_open_64drive(ftdi_context_t* cart)
     @param A bool stating whether a reply should be expected
     @param The number of extra params to send
     @param The extra variadic commands to send
+    @returns Whether the command was sent, with the reason stored in
+             the cart context if it wasn't
 ==============================*/
 
-void device_sendcmd_64drive(ftdi_context_t* cart, u8 command, bool reply, u32 numparams, ...)
+bool device_sendcmd_64drive(ftdi_context_t* cart, u8 command, bool reply, u32 numparams, ...)
 {
     u8  send_buff[32];
     u32 recv_buff[32];
@@ -110,76 +123,154 @@ void device_sendcmd_64drive(ftdi_context_t* cart, u8 command, bool reply, u32 nu
     va_end(params);
 
     // Write to the cart
-    testcommand(FT_Write(cart->handle, send_buff, 4+(numparams*4), &cart->bytes_written), "Unable to write to 64Drive.");
+    if (FT_Write(cart->handle, send_buff, 4+(numparams*4), &cart->bytes_written) != FT_OK)
+        return device_fail(cart, "Unable to write to 64Drive.");
     if (cart->bytes_written == 0)
-        terminate("No bytes were written to 64Drive.");
+        return device_fail(cart, "No bytes were written to 64Drive.");
 
     // If the command expects a response
     if (reply)
     {
         // These two instructions do not return a success, so ignore them
         if (command == DEV_CMD_PI_WR_BL || command == DEV_CMD_PI_WR_BL_LONG)
-            return;
+            return true;
 
         // Check that we received the signal that the operation completed
-        testcommand(FT_Read(cart->handle, recv_buff, 4, &cart->bytes_read), "Unable to read completion signal.");
+        if (FT_Read(cart->handle, recv_buff, 4, &cart->bytes_read) != FT_OK)
+            return device_fail(cart, "Unable to read completion signal.");
         recv_buff[1] = command << 24 | 0x504D43;
         if (memcmp(recv_buff, &recv_buff[1], 4) != 0)
-            terminate("Did not receive completion signal.");
+            return device_fail(cart, "Did not receive completion signal.");
     }
+    return true;
 }
 
+/*==============================
+    device_writerom_64drive
+    Writes data to the cart's SDRAM
+    @param A pointer to the cart context
+    @param The address in SDRAM to write to
+    @param A pointer to the data to write
+    @param The number of bytes to write
+    @returns Whether the data was written
+==============================*/
+
+bool device_writerom_64drive(ftdi_context_t* cart, u32 address, u8* data, u32 size)
+{
+    int i;
+    u8  cmp_buffer[4];
+
+    // Try to send the data
+    for (i=0; i<2; i++)
+    {
+        // If we failed the first time, clear the USB and try again
+        if (i == 1)
+        {
+            FT_ResetPort(cart->handle);
+            FT_ResetDevice(cart->handle);
+            FT_Purge(cart->handle, FT_PURGE_RX | FT_PURGE_TX);
+        }
+
+        // Send the data to RAM
+        cart->bytes_written = 0;
+        if (device_sendcmd_64drive(cart, DEV_CMD_LOADRAM, false, 2, address, (size & 0xffffff) | 0 << 24))
+            FT_Write(cart->handle, data, size, &cart->bytes_written);
+
+        // If we managed to write, don't try again
+        if (cart->bytes_written)
+            break;
+    }
+
+    // Check for a timeout
+    if (cart->bytes_written == 0)
+        return false;
+
+    // Ignore the success response
+    cart->status = FT_Read(cart->handle, cmp_buffer, 4, &cart->bytes_read);
+    return true;
+}
+
+
+/*==============================
+    device_readrom_64drive
+    Reads data from the cart's SDRAM
+    @param A pointer to the cart context
+    @param The address in SDRAM to read from
+    @param A pointer to store the data in
+    @param The number of bytes to read
+    @returns Whether the data was read
+==============================*/
+
+bool device_readrom_64drive(ftdi_context_t* cart, u32 address, u8* data, u32 size)
+{
+    u8 cmp_buffer[4];
+
+    // Ask for the data and read it
+    if (!device_sendcmd_64drive(cart, DEV_CMD_DUMPRAM, false, 2, address, (size & 0xffffff) | 0 << 24))
+        return false;
+    FT_Read(cart->handle, data, size, &cart->bytes_read);
+    if (cart->bytes_read != size)
+        return false;
+
+    // Check the success response
+    FT_Read(cart->handle, cmp_buffer, 4, &cart->bytes_read);
+    return (cart->bytes_read == 4 && cmp_buffer[0] == 'C' && cmp_buffer[1] == 'M' && cmp_buffer[2] == 'P' && cmp_buffer[3] == DEV_CMD_DUMPRAM);
+}
+
+
 /*==============================
     device_sendrom_64drive
     Sends the ROM to the flashcart
     @param A pointer to the cart context
     @param A pointer to the ROM to send
     @param The size of the ROM
+    @returns Whether the ROM was sent
 ==============================*/
 
-void device_sendrom_64drive(ftdi_context_t* cart, FILE *file, u32 size)
+bool device_sendrom_64drive(ftdi_context_t* cart, romfile_t* rom, u32 size)
 {
-    u32    ram_addr = 0x0;
-    int	   bytes_left = size;
     int	   bytes_done = 0;
-    int	   bytes_do;
     int	   chunk = 0;
-    u8*    rom_buffer = (u8*) malloc(sizeof(u8) * 4*1024*1024);
+    u8     cmp_buffer[4];
     time_t upload_time = clock();
     DWORD  cmps;
-
-    // Check we managed to malloc
-    if (rom_buffer == NULL)
-        terminate("Unable to allocate memory for buffer.");
+    pipeline_t* pipe;
+    pipeline_chunk_t* romchunk;
 
     // Handle CIC
     if (global_cictype == -1)
     {
         int cic = -1;
-        int j;
         u8* bootcode = (u8*)malloc(4032);
         if (bootcode == NULL)
-            terminate("Unable to allocate memory for bootcode buffer.");
+            return device_fail(cart, "Unable to allocate memory for bootcode buffer.");
 
-        // Read the bootcode and store it
-        fseek(file, 0x40, SEEK_SET);
-        fread(bootcode, 1, 4032, file);
-        fseek(file, 0, SEEK_SET);
-
-        // Byteswap if needed
-        if (global_z64)
-            for (j=0; j<4032; j+=2)
-                SWAP(bootcode[j], bootcode[j+1]);
+        // Pick the CIC from the bootcode, unless the ROM cache already did
+        if (rom->prepared)
+            cic = rom->cic;
+        else
+        {
+            // Read the bootcode and store it
+            romfile_read(rom, 0x40, bootcode, 4032);
 
-        // Pick the CIC from the bootcode
-        cic = cic_from_hash(romhash(bootcode, 4032));
+            // Convert it to big endian if needed
+            byteorder_convert(bootcode, bootcode, 4032, global_byteorder);
+            cic = cic_from_hash(romhash(bootcode, 4032));
+        }
         if (cic != -1)
         {
             // Set the CIC and print it
             cart->cictype = global_cictype;
-            device_sendcmd_64drive(cart, DEV_CMD_SETCIC, false, 1, (1 << 31) | cic, 0);
+            if (!device_sendcmd_64drive(cart, DEV_CMD_SETCIC, false, 1, (1 << 31) | cic, 0))
+            {
+                free(bootcode);
+                return false;
+            }
             if (cic == 303)
-                terminate("The 8303 CIC is not supported through USB");
+            {
+                free(bootcode);
+                return device_fail(cart, "The 8303 CIC is not supported through USB");
+            }
             pdprint("CIC set to ", CRDEF_PROGRAM);
             switch (cic)
             {
@@ -229,97 +320,79 @@ void device_sendrom_64drive(ftdi_context_t* cart, FILE *file, u32 size)
             case 7106: cic = 6; break;
             case 7:
             case 5101: cic = 7; break;
-            case 303: terminate("This CIC is not supported through USB");
-            default: terminate("Unknown CIC type '%d'.", global_cictype);
+            case 303: return device_fail(cart, "This CIC is not supported through USB");
+            default: return device_fail(cart, "Unknown CIC type '%d'.", global_cictype);
         }
 
         // Set the CIC
         cart->cictype = global_cictype;
-        device_sendcmd_64drive(cart, DEV_CMD_SETCIC, false, 1, (1 << 31) | cic, 0);
+        if (!device_sendcmd_64drive(cart, DEV_CMD_SETCIC, false, 1, (1 << 31) | cic, 0))
+            return false;
         pdprint("CIC set to %d.\n", CRDEF_PROGRAM, global_cictype);
     }
 
     // Set Savetype
     if (global_savetype != 0)
     {
-        device_sendcmd_64drive(cart, DEV_CMD_SETSAVE, false, 1, global_savetype, 0);
+        if (!device_sendcmd_64drive(cart, DEV_CMD_SETSAVE, false, 1, global_savetype, 0))
+            return false;
         pdprint("Save type set to %d.\n", CRDEF_PROGRAM, global_savetype);
     }
 
-    // Decide a better, more optimized chunk size
-    if (size > 16 * 1024 * 1024)
-        chunk = 32;
-    else if ( size > 2 * 1024 * 1024)
-        chunk = 16;
+    // Decide a better, more optimized chunk size, unless the cart was calibrated
+    if (cart->profile.chunksize != 0)
+        chunk = cart->profile.chunksize;
     else
-        chunk = 4;
-    chunk *= 128 * 1024; // Convert to megabytes
+    {
+        if (size > 16 * 1024 * 1024)
+            chunk = 32;
+        else if ( size > 2 * 1024 * 1024)
+            chunk = 16;
+        else
+            chunk = 4;
+        chunk *= 128 * 1024; // Convert to megabytes
+    }
+
+    // Start reading the ROM in the background. Uneven bytes at the end are not sent
+    pipe = pipeline_start(rom, size - (size%4), chunk, global_byteorder, &cart->checksum);
+    delta_start(&cart->delta, size - (size%4), chunk);
 
     // Send chunks to the cart
     pdprint("\n", CRDEF_PROGRAM);
     progressbar_draw("Uploading ROM", CRDEF_PROGRAM, 0);
-    for ( ; ; )
+    while ((romchunk = pipeline_next(pipe)) != NULL)
     {
-        int i;
-
-        // Decide how many bytes to send
-        if (bytes_left >= chunk)
-            bytes_do = chunk;
-        else
-            bytes_do = bytes_left;
+        u32 offset = 0;
+        u32 dirty;
 
-        // If we have an uneven number of bytes, fix that
-        if (bytes_do%4 != 0)
-            bytes_do -= bytes_do%4;
-
-        // End if we've got nothing else to send
-        if (bytes_do <= 0)
-            break;
-
-        // Try to send chunks
-        for (i=0; i<2; i++)
+        // Send the parts of the chunk that changed since the last upload
+        while ((dirty = delta_dirty(&cart->delta, romchunk, &offset)) > 0)
         {
-            int j;
-
-            // If we failed the first time, clear the USB and try again
-            if (i == 1)
+            if (!device_writerom_64drive(cart, romchunk->offset+offset, romchunk->data+offset, dirty))
             {
-                FT_ResetPort(cart->handle);
-                FT_ResetDevice(cart->handle);
-                FT_Purge(cart->handle, FT_PURGE_RX | FT_PURGE_TX);
+                pipeline_stop(pipe);
+                return device_fail(cart, "64Drive timed out.");
             }
-
-            // Send the chunk to RAM
-            device_sendcmd_64drive(cart, DEV_CMD_LOADRAM, false, 2, ram_addr, (bytes_do & 0xffffff) | 0 << 24);
-            fread(rom_buffer, bytes_do, 1, file);
-                  if (global_z64)
-                      for (j=0; j<bytes_do; j+=2)
-                          SWAP(rom_buffer[j], rom_buffer[j+1]);
-            FT_Write(cart->handle, rom_buffer, bytes_do, &cart->bytes_written);
-
-            // If we managed to write, don't try again
-            if (cart->bytes_written)
-                break;
+            offset += dirty;
         }
 
-        // Check for a timeout
-        if (cart->bytes_written == 0)
-        {
-            free(rom_buffer);
-            terminate("64Drive timed out.");
-        }
-
-        // Ignore the success response
-        cart->status = FT_Read(cart->handle, rom_buffer, 4, &cart->bytes_read);
-
-        // Keep track of how many bytes were uploaded
-        bytes_left -= bytes_do;
-        bytes_done += bytes_do;
-        ram_addr += bytes_do;
+        // Keep track of how many bytes were uploaded and give the buffer back to the reader
+        bytes_done += romchunk->size;
+        pipeline_release(pipe, romchunk);
 
         // Draw the progress bar
         progressbar_draw("Uploading ROM", CRDEF_PROGRAM, (float)bytes_done/size);
     }
+    if (!pipeline_stop(pipe))
+        return device_fail(cart, "Unable to read the ROM file.");
+
+    // The header went out before the checksum was known, so send it again if the checksum needs fixing
+    if (global_fixcrc && checksum_wrong(&cart->checksum))
+    {
+        if (!device_writerom_64drive(cart, 0, checksum_fixheader(&cart->checksum), CHECKSUM_HEADER))
+            return device_fail(cart, "64Drive timed out.");
+        cart->checksum.fixed = true;
+    }
 
     // Wait for the CMP signal
     #ifndef LINUX
@@ -328,14 +401,14 @@ void device_sendrom_64drive(ftdi_context_t* cart, FILE *file, u32 size)
         usleep(50);
     #endif
 
-    // Read the incoming CMP signals to ensure everything's fine
+    // Read the incoming CMP signals to ensure everything's fine (SETCIC and SETSAVE reply too, so they aren't all from LOADRAM)
     FT_GetQueueStatus(cart->handle, &cmps);
     while (cmps > 0)
     {
         // Read the CMP signal and ensure it's correct
-        FT_Read(cart->handle, rom_buffer, 4, &cart->bytes_read);
-        if (rom_buffer[0] != 'C' || rom_buffer[1] != 'M' || rom_buffer[2] != 'P' || rom_buffer[3] != 0x20)
-            terminate("Received wrong CMPlete signal: %c %c %c %02x.", rom_buffer[0], rom_buffer[1], rom_buffer[2], rom_buffer[3]);
+        FT_Read(cart->handle, cmp_buffer, 4, &cart->bytes_read);
+        if (cmp_buffer[0] != 'C' || cmp_buffer[1] != 'M' || cmp_buffer[2] != 'P')
+            return device_fail(cart, "Received wrong CMPlete signal: %c %c %c %02x.", cmp_buffer[0], cmp_buffer[1], cmp_buffer[2], cmp_buffer[3]);
 
         // Wait a little bit before reading the next CMP signal
         #ifndef LINUX
@@ -345,10 +418,15 @@ void device_sendrom_64drive(ftdi_context_t* cart, FILE *file, u32 size)
         #endif
         FT_GetQueueStatus(cart->handle, &cmps);
     }
+    delta_finish(&cart->delta);
 
     // Print that we've finished
     pdprint_replace("ROM successfully uploaded in %.2f seconds!\n", CRDEF_PROGRAM, ((double)(clock()-upload_time))/CLOCKS_PER_SEC);
-    free(rom_buffer);
+
+    // Read the ROM back to make sure it arrived intact
+    if (global_verify)
+        return verify_rom(cart, rom, size - (size%4), device_readrom_64drive, device_writerom_64drive);
+    return true;
 }
 
 
@@ -382,7 +460,8 @@ void device_senddata_64drive(ftdi_context_t* cart, int datatype, char* data, u32
     progressbar_draw("Uploading data", CRDEF_INFO, 0.0);
 
     // Send this block of data
-    device_sendcmd_64drive(cart, DEV_CMD_USBRECV, false, 1, (newsize & 0x00FFFFFF) | datatype << 24, 0);
+    if (!device_sendcmd_64drive(cart, DEV_CMD_USBRECV, false, 1, (newsize & 0x00FFFFFF) | datatype << 24, 0))
+        terminate("%s", cart->error);
     cart->status = FT_Write(cart->handle, datacopy, newsize, &cart->bytes_written);
 
     // Read the CMP signal
@@ -35,8 +35,10 @@
 
     bool device_test_64drive1(ftdi_context_t* cart, int index);
     bool device_test_64drive2(ftdi_context_t* cart, int index);
-    void device_open_64drive(ftdi_context_t* cart);
-    void device_sendrom_64drive(ftdi_context_t* cart, FILE *file, u32 size);
+    bool device_open_64drive(ftdi_context_t* cart);
+    bool device_sendrom_64drive(ftdi_context_t* cart, romfile_t* rom, u32 size);
+    bool device_writerom_64drive(ftdi_context_t* cart, u32 address, u8* data, u32 size);
+    bool device_readrom_64drive(ftdi_context_t* cart, u32 address, u8* data, u32 size);
     void device_senddata_64drive(ftdi_context_t* cart, int datatype, char* data, u32 size);
     void device_close_64drive(ftdi_context_t* cart);
 
@@ -9,6 +9,8 @@ http://krikzz.com/pub/support/everdrive-64/x-series/dev/
 #include "main.h"
 #include "helper.h"
 #include "device_everdrive.h"
+#include "pipeline.h"
+#include "verify.h"
 
 
 /*==============================
@@ -16,7 +18,9 @@ http://krikzz.com/pub/support/everdrive-64/x-series/dev/
     Checks whether the device passed as an argument is EverDrive
     @param A pointer to the cart context
     @param The index of the cart
-    @returns true if the cart is an EverDrive, or false otherwise
+    @returns true if the cart is an EverDrive, or false otherwise. If
+             the device couldn't be talked to, the reason is stored
+             in the cart context
 ==============================*/
 
 bool device_test_everdrive(ftdi_context_t* cart, int index)
@@ -34,24 +38,27 @@ bool device_test_everdrive(ftdi_context_t* cart, int index)
         send_buff[2] = 'd';
         send_buff[3] = 't';
 
-        // Open the device
+        // Open the device. This runs in a thread of its own, so problems are stored rather than ending the program
         cart->status = FT_Open(index, &cart->handle);
         if (cart->status != FT_OK || !cart->handle)
-        {
-            free(cart->dev_info);
-            terminate("Could not open device.");
-        }
-
-        // Initialize the USB
-        testcommand(FT_ResetDevice(cart->handle), "Unable to reset flashcart.");
-        testcommand(FT_SetTimeouts(cart->handle, 500, 500), "Unable to set flashcart timeouts.");
-        testcommand(FT_Purge(cart->handle, FT_PURGE_RX | FT_PURGE_TX), "Unable to purge USB contents.");
-
-        // Send the test command
-        testcommand(FT_Write(cart->handle, send_buff, 16, &cart->bytes_written), "Unable to write to flashcart.");
-        testcommand(FT_Read(cart->handle, recv_buff, 16, &cart->bytes_read), "Unable to read from flashcart.");
-        testcommand(FT_Close(cart->handle), "Unable to close flashcart.");
+            return device_fail(cart, "Could not open device.");
+
+        // Initialize the USB, and send the test command
+        if (FT_ResetDevice(cart->handle) != FT_OK)
+            device_fail(cart, "Unable to reset flashcart.");
+        else if (FT_SetTimeouts(cart->handle, 500, 500) != FT_OK)
+            device_fail(cart, "Unable to set flashcart timeouts.");
+        else if (FT_Purge(cart->handle, FT_PURGE_RX | FT_PURGE_TX) != FT_OK)
+            device_fail(cart, "Unable to purge USB contents.");
+        else if (FT_Write(cart->handle, send_buff, 16, &cart->bytes_written) != FT_OK)
+            device_fail(cart, "Unable to write to flashcart.");
+        else if (FT_Read(cart->handle, recv_buff, 16, &cart->bytes_read) != FT_OK)
+            device_fail(cart, "Unable to read from flashcart.");
+        if (FT_Close(cart->handle) != FT_OK && cart->error[0] == '\0')
+            device_fail(cart, "Unable to close flashcart.");
         cart->handle = 0;
+        if (cart->error[0] != '\0')
+            return false;
 
         // Check if the EverDrive responded correctly
         return recv_buff[3] == 'r';
@@ -64,19 +71,25 @@ bool device_test_everdrive(ftdi_context_t* cart, int index)
     device_open_everdrive
     Opens the USB pipe
     @param A pointer to the cart context
+    @returns Whether the cart was opened, with the reason stored in
+             the cart context if it wasn't
 ==============================*/
 
-void device_open_everdrive(ftdi_context_t* cart)
+bool device_open_everdrive(ftdi_context_t* cart)
 {
     // Open the cart
     cart->status = FT_Open(cart->device_index, &cart->handle);
     if (cart->status != FT_OK || !cart->handle)
-        terminate("Unable to open flashcart.");
+        return device_fail(cart, "Unable to open flashcart.");
 
     // Reset the cart
-    testcommand(FT_ResetDevice(cart->handle), "Unable to reset flashcart.");
-    testcommand(FT_SetTimeouts(cart->handle, 500, 500), "Unable to set flashcart timeouts.");
-    testcommand(FT_Purge(cart->handle, FT_PURGE_RX | FT_PURGE_TX), "Unable to purge USB contents.");
+    if (FT_ResetDevice(cart->handle) != FT_OK)
+        return device_fail(cart, "Unable to reset flashcart.");
+    if (FT_SetTimeouts(cart->handle, 500, 500) != FT_OK)
+        return device_fail(cart, "Unable to set flashcart timeouts.");
+    if (FT_Purge(cart->handle, FT_PURGE_RX | FT_PURGE_TX) != FT_OK)
+        return device_fail(cart, "Unable to purge USB contents.");
+    return true;
 }
 
 /*==============================
@@ -91,13 +104,9 @@ void device_open_everdrive(ftdi_context_t* cart)
 
 void device_sendcmd_everdrive(ftdi_context_t* cart, char command, int address, int size, int arg)
 {
-    char* cmd_buffer = (char*) malloc(sizeof(char) * 16);
+    char cmd_buffer[16];
     size /= 512;
 
-    // Check we managed to malloc
-    if (cmd_buffer == NULL)
-        terminate("Unable to allocate memory for buffer.");
-
     // Define the command and send it
     cmd_buffer[0] = 'c';
     cmd_buffer[1] = 'm';
@@ -116,9 +125,29 @@ void device_sendcmd_everdrive(ftdi_context_t* cart, char command, int address, i
     cmd_buffer[14]= (char) (arg >> 8);
     cmd_buffer[15]= (char) (arg);
     FT_Write(cart->handle, cmd_buffer, 16, &cart->bytes_written);
+}
+
 
-    // Free the allocated memory
-    free(cmd_buffer);
+/*==============================
+    device_patchrom_everdrive
+    Stores the save type in the ROM header, where
+    the EverDrive's menu looks for it
+    @param A pointer to the (big endian) ROM header
+==============================*/
+
+void device_patchrom_everdrive(u8* header)
+{
+    header[0x3C] = 'E';
+    header[0x3D] = 'D';
+    switch (global_savetype)
+    {
+        case 1: header[0x3F] = 0x10; break;
+        case 2: header[0x3F] = 0x20; break;
+        case 3: header[0x3F] = 0x30; break;
+        case 4: header[0x3F] = 0x50; break;
+        case 5: header[0x3F] = 0x40; break;
+        case 6: header[0x3F] = 0x60; break;
+    }
 }
 
 
@@ -128,23 +157,26 @@ void device_sendcmd_everdrive(ftdi_context_t* cart, char command, int address, i
     @param A pointer to the cart context
     @param A pointer to the ROM to send
     @param The size of the ROM
+    @returns Whether the ROM was sent
 ==============================*/
 
-void device_sendrom_everdrive(ftdi_context_t* cart, FILE *file, u32 size)
+bool device_sendrom_everdrive(ftdi_context_t* cart, romfile_t* rom, u32 size)
 {
     int	   bytes_done = 0;
-    int	   bytes_left;
-    int	   bytes_do;
-    char*  rom_buffer = (char*) malloc(sizeof(int) * 32*1024);
     int    crc_area = 0x100000 + 4096;
     time_t upload_time = clock();
-
-    // Check we managed to malloc
-    if (rom_buffer == NULL)
-        terminate("Unable to allocate memory for buffer.");
-
-    // Fill memory if the file is too small
-    if ((int)size < crc_area)
+    bool   partial;
+    u32    chunk = 0x8000;
+    pipeline_t* pipe;
+    pipeline_chunk_t* romchunk;
+
+    // Check if only the parts of the ROM that changed need to be sent
+    if (cart->profile.chunksize != 0)
+        chunk = cart->profile.chunksize;
+    partial = delta_start(&cart->delta, calc_padsize(size), chunk);
+
+    // Fill memory if the file is too small. If the ROM was already uploaded, the memory is already filled
+    if ((int)size < crc_area && !partial)
     {
         char recv_buff[16];
         pdprint("Filling ROM.\n", CRDEF_PROGRAM);
@@ -159,85 +191,107 @@ void device_sendrom_everdrive(ftdi_context_t* cart, FILE *file, u32 size)
 
     // Get the correctly padded ROM size
     size = calc_padsize(size);
-    bytes_left = size;
+
+    // Start reading the ROM in the background. The padding is filled with zeroes
+    pipe = pipeline_start(rom, size, chunk, global_byteorder, &cart->checksum);
 
     // Initialize the progress bar
     pdprint("\n", CRDEF_PROGRAM);
     progressbar_draw("Uploading ROM", CRDEF_PROGRAM, 0);
 
-    // Send a command saying we're about to write to the cart
-    device_sendcmd_everdrive(cart, 'W', 0x10000000, size, 0);
+    // Send a command saying we're about to write to the cart. If only some parts of the ROM changed, each part gets its own command instead
+    if (!partial)
+        device_sendcmd_everdrive(cart, 'W', 0x10000000, size, 0);
 
     // Upload the ROM
-    for ( ; ; )
+    while ((romchunk = pipeline_next(pipe)) != NULL)
     {
         int i;
+        u32 offset = 0;
+        u32 dirty;
+        u8* rom_buffer;
+        u8* header = NULL;
 
-        // Decide how many bytes to send
-        if (bytes_left >= 0x8000)
-            bytes_do = 0x8000;
-        else
-            bytes_do = bytes_left;
-
-        // End if we've got nothing else to send
-        if (bytes_do <= 0)
-            break;
-
-        // Try to send chunks
-        for (i=0; i<2; i++)
+        // Set Savetype if this is the first chunk. It's patched on a copy, since other carts might be sending the same memory. Images from the ROM cache already have it
+        if (global_savetype != 0 && romchunk->offset == 0 && !rom->prepared)
         {
-            int j;
-
-            // If we failed the first time, clear the USB and try again
-            if (i == 1)
+            header = (u8*) malloc(romchunk->size);
+            if (header == NULL)
             {
-                FT_ResetPort(cart->handle);
-                FT_ResetDevice(cart->handle);
-                FT_Purge(cart->handle, FT_PURGE_RX | FT_PURGE_TX);
+                pipeline_stop(pipe);
+                return device_fail(cart, "Unable to allocate memory for the ROM header.");
             }
+            memcpy(header, romchunk->data, romchunk->size);
+            device_patchrom_everdrive(header);
+            romchunk->data = header;
+        }
+        rom_buffer = romchunk->data;
 
-            // Read the ROM to the buffer and byteswap it if needed
-            fread(rom_buffer, bytes_do, 1, file);
-            if (global_z64)
-                for (j=0; j<bytes_do; j+=2)
-                    SWAP(rom_buffer[j], rom_buffer[j+1]);
+        // Send the parts of the chunk that changed since the last upload
+        while ((dirty = delta_dirty(&cart->delta, romchunk, &offset)) > 0)
+        {
+            if (partial)
+                device_sendcmd_everdrive(cart, 'W', 0x10000000 + romchunk->offset + offset, dirty, 0);
 
-            // Set Savetype if first time sending data
-            if (global_savetype != 0 && bytes_done == 0)
+            // Try to send chunks
+            for (i=0; i<2; i++)
             {
-                rom_buffer[0x3C] = 'E';
-                rom_buffer[0x3D] = 'D';
-                switch (global_savetype)
+                // If we failed the first time, clear the USB and try again
+                if (i == 1)
                 {
-                    case 1: rom_buffer[0x3F] = 0x10; break;
-                    case 2: rom_buffer[0x3F] = 0x20; break;
-                    case 3: rom_buffer[0x3F] = 0x30; break;
-                    case 4: rom_buffer[0x3F] = 0x50; break;
-                    case 5: rom_buffer[0x3F] = 0x40; break;
-                    case 6: rom_buffer[0x3F] = 0x60; break;
+                    FT_ResetPort(cart->handle);
+                    FT_ResetDevice(cart->handle);
+                    FT_Purge(cart->handle, FT_PURGE_RX | FT_PURGE_TX);
                 }
-            }
 
-            // Send the chunk to RAM. If we reached EOF it doesn't matter what we send
-            // TODO: Send 0's when EOF is reached
-            FT_Write(cart->handle, rom_buffer, bytes_do, &cart->bytes_written);
+                // Send the chunk to RAM
+                FT_Write(cart->handle, rom_buffer + offset, dirty, &cart->bytes_written);
 
-            // If we managed to write, don't try again
-            if (cart->bytes_written)
-                break;
-        }
+                // If we managed to write, don't try again
+                if (cart->bytes_written)
+                    break;
+            }
 
-        // Check for a timeout
-        if (cart->bytes_written == 0)
-            terminate("Everdrive timed out.");
+            // Check for a timeout
+            if (cart->bytes_written == 0)
+            {
+                pipeline_stop(pipe);
+                free(header);
+                return device_fail(cart, "Everdrive timed out.");
+            }
+            offset += dirty;
+        }
 
-         // Keep track of how many bytes were uploaded
-        bytes_left -= bytes_do;
-        bytes_done += bytes_do;
+        // Keep track of how many bytes were uploaded and give the buffer back to the reader
+        bytes_done += romchunk->size;
+        pipeline_release(pipe, romchunk);
+        free(header);
 
         // Draw the progress bar
         progressbar_draw("Uploading ROM", CRDEF_PROGRAM, (float)bytes_done/size);
     }
+    if (!pipeline_stop(pipe))
+        return device_fail(cart, "Unable to read the ROM file.");
+    delta_finish(&cart->delta);
+
+    // The header went out before the checksum was known, so send it again if the checksum needs fixing
+    if (global_fixcrc && checksum_wrong(&cart->checksum))
+    {
+        u8* header = checksum_fixheader(&cart->checksum);
+        if (global_savetype != 0)
+            device_patchrom_everdrive(header);
+        if (!device_writerom_everdrive(cart, 0, header, CHECKSUM_HEADER))
+            return device_fail(cart, "Everdrive timed out.");
+        cart->checksum.fixed = true;
+    }
+
+    // Read the ROM back to make sure it arrived intact, before it starts running
+    if (global_verify)
+    {
+        if (!verify_rom(cart, rom, size, device_readrom_everdrive, device_writerom_everdrive))
+            return false;
+        pdprint("\n", CRDEF_PROGRAM);
+    }
 
     // Send the PIFboot command
     #ifndef LINUX // Delay is needed or it won't boot properly
@@ -274,7 +328,43 @@ void device_sendrom_everdrive(ftdi_context_t* cart, FILE *file, u32 size)
 
     // Print that we've finished
     pdprint_replace("ROM successfully uploaded in %.2f seconds!\n", CRDEF_PROGRAM, ((double)(clock()-upload_time))/CLOCKS_PER_SEC);
-    free(rom_buffer);
+    return true;
+}
+
+
+/*==============================
+    device_writerom_everdrive
+    Writes data to the cart's SDRAM
+    @param A pointer to the cart context
+    @param The address in SDRAM to write to
+    @param A pointer to the data to write
+    @param The number of bytes to write (must be a multiple of 512)
+    @returns Whether the data was written
+==============================*/
+
+bool device_writerom_everdrive(ftdi_context_t* cart, u32 address, u8* data, u32 size)
+{
+    device_sendcmd_everdrive(cart, 'W', 0x10000000 + address, size, 0);
+    FT_Write(cart->handle, data, size, &cart->bytes_written);
+    return (cart->bytes_written == size);
+}
+
+
+/*==============================
+    device_readrom_everdrive
+    Reads data from the cart's SDRAM
+    @param A pointer to the cart context
+    @param The address in SDRAM to read from
+    @param A pointer to store the data in
+    @param The number of bytes to read (must be a multiple of 512)
+    @returns Whether the data was read
+==============================*/
+
+bool device_readrom_everdrive(ftdi_context_t* cart, u32 address, u8* data, u32 size)
+{
+    device_sendcmd_everdrive(cart, 'R', 0x10000000 + address, size, 0);
+    FT_Read(cart->handle, data, size, &cart->bytes_read);
+    return (cart->bytes_read == size);
 }
 
 
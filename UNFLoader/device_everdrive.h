@@ -9,8 +9,11 @@
     *********************************/
 
     bool device_test_everdrive(ftdi_context_t* cart, int index);
-    void device_open_everdrive(ftdi_context_t* cart);
-    void device_sendrom_everdrive(ftdi_context_t* cart, FILE *file, u32 size);
+    bool device_open_everdrive(ftdi_context_t* cart);
+    void device_patchrom_everdrive(u8* header);
+    bool device_sendrom_everdrive(ftdi_context_t* cart, romfile_t* rom, u32 size);
+    bool device_writerom_everdrive(ftdi_context_t* cart, u32 address, u8* data, u32 size);
+    bool device_readrom_everdrive(ftdi_context_t* cart, u32 address, u8* data, u32 size);
     void device_senddata_everdrive(ftdi_context_t* cart, int datatype, char *data, u32 size);
     void device_close_everdrive(ftdi_context_t* cart);
 
@@ -9,14 +9,15 @@ https://github.com/Polprzewodnikowy/SummerCollection
 #include "main.h"
 #include "helper.h"
 #include "device_sc64.h"
+#include "pipeline.h"
 
 
 /*********************************
         Function Prototypes
 *********************************/
 
-static void device_send_cmd_sc64(ftdi_context_t* cart, u8 cmd, u32 arg1, u32 arg2, bool reply);
-static void device_check_reply_sc64(ftdi_context_t* cart, u8 cmd);
+static bool device_send_cmd_sc64(ftdi_context_t* cart, u8 cmd, u32 arg1, u32 arg2, bool reply);
+static bool device_check_reply_sc64(ftdi_context_t* cart, u8 cmd);
 
 
 /*==============================
@@ -26,9 +27,11 @@ static void device_check_reply_sc64(ftdi_context_t* cart, u8 cmd);
     @param Command value
     @param First argument value
     @param Second argument value
+    @returns Whether the command was sent, with the reason stored in
+             the cart context if it wasn't
 ==============================*/
 
-static void device_send_cmd_sc64(ftdi_context_t* cart, u8 cmd, u32 arg1, u32 arg2, bool reply) {
+static bool device_send_cmd_sc64(ftdi_context_t* cart, u8 cmd, u32 arg1, u32 arg2, bool reply) {
     u8 buff[12];
     DWORD bytes_processed;
 
@@ -41,15 +44,18 @@ static void device_send_cmd_sc64(ftdi_context_t* cart, u8 cmd, u32 arg1, u32 arg
     *(u32 *)(&buff[8]) = swap_endian(arg2);
 
     // Send command and parameters
-    testcommand(FT_Write(cart->handle, buff, sizeof(buff), &bytes_processed), "Error: Unable to write command to SummerCart64.\n");
+    if (FT_Write(cart->handle, buff, sizeof(buff), &bytes_processed) != FT_OK) {
+        return device_fail(cart, "Unable to write command to SummerCart64.");
+    }
     if (bytes_processed != sizeof(buff)) {
-        terminate("Error: Actual bytes written amount is different than desired.\n");
+        return device_fail(cart, "Actual bytes written amount is different than desired.");
     }
 
     // Check reply if command doesn't require any data
     if (reply) {
-        device_check_reply_sc64(cart, cmd);
+        return device_check_reply_sc64(cart, cmd);
     }
+    return true;
 }
 
 
@@ -58,16 +64,21 @@ static void device_send_cmd_sc64(ftdi_context_t* cart, u8 cmd, u32 arg1, u32 arg
     Checks if last command was successful
     @param A pointer to the cart context
     @param Command value to be checked
+    @returns Whether the command succeeded, with the reason stored in
+             the cart context if it didn't
 ==============================*/
 
-static void device_check_reply_sc64(ftdi_context_t* cart, u8 cmd) {
+static bool device_check_reply_sc64(ftdi_context_t* cart, u8 cmd) {
     u8 buff[4];
     DWORD bytes_processed;
 
-    testcommand(FT_Read(cart->handle, buff, sizeof(buff), &bytes_processed), "Error: Unable to read completion signal.\n");
+    if (FT_Read(cart->handle, buff, sizeof(buff), &bytes_processed) != FT_OK) {
+        return device_fail(cart, "Unable to read completion signal.");
+    }
     if (bytes_processed != sizeof(buff) || memcmp(buff, "CMP", 3) != 0 || buff[3] != cmd) {
-        terminate("Error: Did not receive completion signal.\n");
-    } 
+        return device_fail(cart, "Did not receive completion signal.");
+    }
+    return true;
 }
 
 
@@ -88,21 +99,31 @@ bool device_test_sc64(ftdi_context_t* cart, int index)
     device_open_sc64
     Opens the USB pipe
     @param A pointer to the cart context
+    @returns Whether the cart was opened, with the reason stored in
+             the cart context if it wasn't
 ==============================*/
 
-void device_open_sc64(ftdi_context_t* cart)
+bool device_open_sc64(ftdi_context_t* cart)
 {
     // Open the cart
     cart->status = FT_Open(cart->device_index, &cart->handle);
-    if (cart->status != FT_OK || !cart->handle)
-        terminate("Error: Unable to open flashcart.\n");
+    if (cart->status != FT_OK || !cart->handle) {
+        return device_fail(cart, "Unable to open flashcart.");
+    }
 
     // Reset the cart and set its timeouts and latency timer
-    testcommand(FT_ResetDevice(cart->handle), "Error: Unable to reset flashcart.\n");
-    testcommand(FT_SetTimeouts(cart->handle, 5000, 5000), "Error: Unable to set flashcart timeouts.\n");
+    if (FT_ResetDevice(cart->handle) != FT_OK) {
+        return device_fail(cart, "Unable to reset flashcart.");
+    }
+    if (FT_SetTimeouts(cart->handle, 5000, 5000) != FT_OK) {
+        return device_fail(cart, "Unable to set flashcart timeouts.");
+    }
 
     // Purge USB contents
-    testcommand(FT_Purge(cart->handle, FT_PURGE_RX | FT_PURGE_TX), "Error: Unable to purge USB contents.\n");
+    if (FT_Purge(cart->handle, FT_PURGE_RX | FT_PURGE_TX) != FT_OK) {
+        return device_fail(cart, "Unable to purge USB contents.");
+    }
+    return true;
 }
 
 
@@ -112,17 +133,21 @@ void device_open_sc64(ftdi_context_t* cart)
     @param A pointer to the cart context
     @param A pointer to the ROM to send
     @param The size of the ROM
+    @returns Whether the ROM was sent
 ==============================*/
 
-void device_sendrom_sc64(ftdi_context_t* cart, FILE* file, u32 size)
+bool device_sendrom_sc64(ftdi_context_t* cart, romfile_t* rom, u32 size)
 {
     size_t chunk;
-    u8* rom_buffer;
     size_t bytes_left;
+    pipeline_t* pipe;
+    pipeline_chunk_t* romchunk;
     time_t upload_time_start;
     s32 cic;
     s32 tv;
     s32 skip;
+    bool partial;
+    int savetype = global_savetype; // Not changed in place, since other carts might be using it
     const char* save_names[] = {
         "EEPROM 4k",
         "EEPROM 16k",
@@ -135,13 +160,10 @@ void device_sendrom_sc64(ftdi_context_t* cart, FILE* file, u32 size)
     // Align rom size to 2 bytes
     size = size - (size % 2);
 
-    // 256 kB chunk size
+    // 256 kB chunk size, unless the cart was calibrated
     chunk = 256 * 1024;
-
-    // Allocate ROM buffer
-    rom_buffer = (u8 *)malloc(chunk * sizeof(u8));
-    if (rom_buffer == NULL) {
-        terminate("Error: Unable to allocate memory for buffer.\n");
+    if (cart->profile.chunksize != 0) {
+        chunk = cart->profile.chunksize;
     }
 
     // Set unknown CIC and TV type as default
@@ -176,27 +198,31 @@ void device_sendrom_sc64(ftdi_context_t* cart, FILE* file, u32 size)
             case 5101: cic = 0xAC; tv = 0; break;
             case 8303: cic = 0xDD; tv = 0; break;
             case 1234: skip = 1; break;
-            default: terminate("Unknown or unsupported CIC type '%d'.", global_cictype);
+            default: return device_fail(cart, "Unknown or unsupported CIC type '%d'.", global_cictype);
         }
         cart->cictype = global_cictype;
         pdprint("CIC set to %d (cic_seed = %d, tv_type = %d, skip = %s).\n", CRDEF_PROGRAM, global_cictype, cic, tv, skip ? "yes" : "no");
     }
 
     // Commit CIC and TV settings
-    device_send_cmd_sc64(cart, DEV_CMD_CONFIG, DEV_CONFIG_CIC_SEED, (u32) cic, true);
-    device_send_cmd_sc64(cart, DEV_CMD_CONFIG, DEV_CONFIG_TV_TYPE, (u32) tv, true);
-    device_send_cmd_sc64(cart, DEV_CMD_CONFIG, DEV_CONFIG_SKIP_BOOTLOADER, (u32) skip, true);
+    if (!device_send_cmd_sc64(cart, DEV_CMD_CONFIG, DEV_CONFIG_CIC_SEED, (u32) cic, true) ||
+        !device_send_cmd_sc64(cart, DEV_CMD_CONFIG, DEV_CONFIG_TV_TYPE, (u32) tv, true) ||
+        !device_send_cmd_sc64(cart, DEV_CMD_CONFIG, DEV_CONFIG_SKIP_BOOTLOADER, (u32) skip, true)) {
+        return false;
+    }
 
     // Set savetype if provided
-    if (global_savetype > 0 && global_savetype <= 6) {
-        pdprint("Save type set to %d, %s.\n", CRDEF_PROGRAM, global_savetype, save_names[global_savetype - 1]);
+    if (savetype > 0 && savetype <= 6) {
+        pdprint("Save type set to %d, %s.\n", CRDEF_PROGRAM, savetype, save_names[savetype - 1]);
     } else {
-        global_savetype = 0;
+        savetype = 0;
     }
 
     // Commit save setting
 
-    device_send_cmd_sc64(cart, DEV_CMD_CONFIG, DEV_CONFIG_SAVE_TYPE, global_savetype, true);
+    if (!device_send_cmd_sc64(cart, DEV_CMD_CONFIG, DEV_CONFIG_SAVE_TYPE, savetype, true)) {
+        return false;
+    }
 
     // Init progressbar
     pdprint("\n", CRDEF_PROGRAM);
@@ -208,53 +234,107 @@ void device_sendrom_sc64(ftdi_context_t* cart, FILE* file, u32 size)
     // Get start time
     upload_time_start = clock();
 
-    // Prepare cart for write
-    device_send_cmd_sc64(cart, DEV_CMD_WRITE, 0, size, false);
+    // Start reading the ROM in the background
+    pipe = pipeline_start(rom, size, chunk, global_byteorder, &cart->checksum);
+
+    // Prepare cart for write. If only some parts of the ROM changed, each part gets its own write command instead
+    partial = delta_start(&cart->delta, size, chunk);
+    if (!partial && !device_send_cmd_sc64(cart, DEV_CMD_WRITE, 0, size, false)) {
+        pipeline_stop(pipe);
+        return false;
+    }
 
     // Loop until ROM has been fully written
-    do {
-        // Calculate current chunk size
-        if (bytes_left < chunk) {
-            chunk = bytes_left;
-        }
+    while ((romchunk = pipeline_next(pipe)) != NULL) {
+        u32 offset = 0;
+        u32 dirty;
+
+        // Push the parts of the chunk that changed since the last upload
+        while ((dirty = delta_dirty(&cart->delta, romchunk, &offset)) > 0) {
+            if (partial && !device_send_cmd_sc64(cart, DEV_CMD_WRITE, romchunk->offset + offset, dirty, false)) {
+                pipeline_stop(pipe);
+                return false;
+            }
+            if (FT_Write(cart->handle, romchunk->data + offset, dirty, &cart->bytes_written) != FT_OK) {
+                pipeline_stop(pipe);
+                return device_fail(cart, "Unable to write data to SummerCart64.");
+            }
 
-        // Read ROM from file to buffer
-        fread(rom_buffer, sizeof(u8), chunk, file);
-        if (global_z64) {
-            for (size_t i = 0; i < chunk; i += 2) {
-                SWAP(rom_buffer[i], rom_buffer[i + 1]);
+            // Break from loop if not all bytes has been sent
+            if (cart->bytes_written != dirty) {
+                break;
             }
+            if (partial && !device_check_reply_sc64(cart, DEV_CMD_WRITE)) {
+                pipeline_stop(pipe);
+                return false;
+            }
+            offset += dirty;
         }
-
-        // Push data
-        testcommand(FT_Write(cart->handle, rom_buffer, chunk, &cart->bytes_written), "Error: Unable to write data to SummerCart64.\n");
-
-        // Break from loop if not all bytes has been sent
-        if (cart->bytes_written != chunk) {
+        if (offset < romchunk->size) {
             break;
         }
 
-        // Update bytes left
-        bytes_left -= cart->bytes_written;
+        // Update bytes left and give the buffer back to the reader
+        bytes_left -= romchunk->size;
+        pipeline_release(pipe, romchunk);
 
         // Update progressbar
         progressbar_draw("Uploading ROM", CRDEF_PROGRAM, (size - bytes_left) / (float)size);
-    } while (bytes_left > 0);
+    }
 
-    // Free ROM buffer
-    free(rom_buffer);
+    // Stop the reader
+    if (!pipeline_stop(pipe)) {
+        return device_fail(cart, "Unable to read the ROM file.");
+    }
 
     if (bytes_left > 0) {
         // Throw error if upload was unsuccessful
-        terminate("Error: SummerCart64 timed out");
+        return device_fail(cart, "SummerCart64 timed out");
     }
 
     // Check if write was successful
-    device_check_reply_sc64(cart, DEV_CMD_WRITE);
+    if (!partial && !device_check_reply_sc64(cart, DEV_CMD_WRITE)) {
+        return false;
+    }
+
+    // The header went out before the checksum was known, so send it again if the checksum needs fixing
+    if (global_fixcrc && checksum_wrong(&cart->checksum)) {
+        if (!device_writerom_sc64(cart, 0, checksum_fixheader(&cart->checksum), CHECKSUM_HEADER)) {
+            return device_fail(cart, "SummerCart64 timed out");
+        }
+        cart->checksum.fixed = true;
+    }
+    delta_finish(&cart->delta);
 
     // Print that we've finished
     double upload_time = (double)(clock() - upload_time_start) / CLOCKS_PER_SEC;
     pdprint_replace("ROM successfully uploaded in %.2f seconds!\n", CRDEF_PROGRAM, upload_time);
+    if (global_verify) {
+        pdprint("SummerCart64 can't read its SDRAM back, so the ROM wasn't verified.\n", CRDEF_PROGRAM);
+    }
+    return true;
+}
+
+
+/*==============================
+    device_writerom_sc64
+    Writes data to the cart's SDRAM
+    @param A pointer to the cart context
+    @param The address in SDRAM to write to
+    @param A pointer to the data to write
+    @param The number of bytes to write
+    @returns Whether the data was written
+==============================*/
+
+bool device_writerom_sc64(ftdi_context_t* cart, u32 address, u8* data, u32 size)
+{
+    if (!device_send_cmd_sc64(cart, DEV_CMD_WRITE, address, size, false)) {
+        return false;
+    }
+    if (FT_Write(cart->handle, data, size, &cart->bytes_written) != FT_OK || cart->bytes_written != size) {
+        return false;
+    }
+    return device_check_reply_sc64(cart, DEV_CMD_WRITE);
 }
 
 
@@ -275,7 +355,9 @@ void device_senddata_sc64(ftdi_context_t* cart, int datatype, char* data, u32 si
     transfer_size = size + size % 2;
 
     // Prepare cart for transfer
-    device_send_cmd_sc64(cart, DEV_CMD_DEBUG_WRITE, ((datatype & 0xFF) << 24) | size, transfer_size, false);
+    if (!device_send_cmd_sc64(cart, DEV_CMD_DEBUG_WRITE, ((datatype & 0xFF) << 24) | size, transfer_size, false)) {
+        terminate("%s", cart->error);
+    }
 
     // Push data
     testcommand(FT_Write(cart->handle, data, transfer_size, &cart->bytes_written), "Error: Unable to write data to SummerCart64.\n");
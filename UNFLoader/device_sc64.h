@@ -23,8 +23,9 @@
     *********************************/
 
     bool device_test_sc64(ftdi_context_t* cart, int index);
-    void device_open_sc64(ftdi_context_t* cart);
-    void device_sendrom_sc64(ftdi_context_t* cart, FILE *file, u32 size);
+    bool device_open_sc64(ftdi_context_t* cart);
+    bool device_sendrom_sc64(ftdi_context_t* cart, romfile_t* rom, u32 size);
+    bool device_writerom_sc64(ftdi_context_t* cart, u32 address, u8* data, u32 size);
     void device_senddata_sc64(ftdi_context_t* cart, int datatype, char* data, u32 size);
     void device_close_sc64(ftdi_context_t* cart);
 
@@ -4,31 +4,254 @@
 Useful functions to use in conjunction with the program
 ***************************************************************/
 
+#include <mutex>
+#include <chrono>
 #include "main.h"
 #include "device.h"
 #include "helper.h"
+#include "scrollback.h"
+#include "logwriter.h"
+#ifdef LINUX
+    #include <sys/stat.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define HELPER_X86
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #include <immintrin.h>
+    #endif
+#endif
 
 
 /*********************************
              Globals
 *********************************/
 
-static char* local_printhistory[PRINT_HISTORY_SIZE];
+static std::recursive_mutex local_printlock; // Carts print from their own threads when uploading to several at once
+static thread_local const char* local_prefix = NULL;
+static thread_local bool local_linestart = true;
+static void (*local_mirror)(const char* text) = NULL;
+static bool local_drawingbar = false;
+static const char* local_bartext = NULL; // What the last progress bar showed, so it's only redrawn when it changes
+static int local_barpercent = -1;
+static bool local_dirty = false; // Whether there's printed text that isn't on the terminal yet
+static std::chrono::steady_clock::time_point local_nextflush;
+static WINDOW* local_overlay = NULL;
+static WINDOW* local_cover = NULL;
 
 
 /*==============================
-    __pdprint
-    Prints text using PDCurses. Don't use directly.
+    __pdprint_dirty
+    Marks the screen as changed, and draws it if it
+    hasn't been drawn recently. Don't use directly.
+==============================*/
+
+static void __pdprint_dirty()
+{
+    local_dirty = true;
+    if (!local_drawingbar)
+        local_barpercent = -1;
+    pdprint_flush(false);
+}
+
+
+/*==============================
+    __pdprint_format
+    Formats a string, on the heap if it doesn't fit in the
+    stack buffer. Don't use directly.
+    @param The stack buffer
+    @param The size of the stack buffer
+    @param The string to format
+    @param The arguments to format it with
+    @param A pointer to store the formatted size in
+    @returns The formatted string, which needs to be freed
+             if it isn't the stack buffer, or NULL
+==============================*/
+
+static char* __pdprint_format(char* stackbuff, int stacksize, const char* str, va_list args, int* size)
+{
+    char*   text = stackbuff;
+    va_list copy;
+    va_copy(copy, args);
+    *size = vsnprintf(stackbuff, stacksize, str, copy);
+    va_end(copy);
+    if (*size < 0)
+        return NULL;
+    if (*size >= stacksize)
+    {
+        text = (char*) malloc(*size+1);
+        if (text == NULL)
+            return NULL;
+        va_copy(copy, args);
+        vsnprintf(text, *size+1, str, copy);
+        va_end(copy);
+    }
+    return text;
+}
+
+
+/*==============================
+    __pdprint_prefix
+    Prints the current thread's prefix, if the string
+    starts a new line. Don't use directly.
+    @param The string that's about to be printed
+    @param The color it's printed with
+==============================*/
+
+static void __pdprint_prefix(const char* str, short color)
+{
+    if (str[0] == '\0')
+        return;
+    if (local_prefix != NULL && local_linestart && str[0] != '\n')
+    {
+        printw("%s", local_prefix);
+        scrollback_add(local_prefix, strlen(local_prefix), color);
+        logwriter_write(global_debugoutptr, local_prefix, strlen(local_prefix));
+        if (local_mirror != NULL)
+            local_mirror(local_prefix);
+    }
+    local_linestart = (str[strlen(str)-1] == '\n');
+}
+
+
+/*==============================
+    pdprint_prefix
+    Sets the text to print at the start of every line this
+    thread prints. While it's set, progress bars aren't drawn
+    and replaced lines are printed as new ones, since other
+    threads are printing too
+    @param A string with the prefix, or NULL to stop
+==============================*/
+
+void pdprint_prefix(const char* prefix)
+{
+    local_prefix = prefix;
+    local_linestart = true;
+}
+
+
+/*==============================
+    pdprint_mirror
+    Sets a function that gets a copy of everything that's
+    printed, except for progress bars
+    @param A pointer to the function, or NULL to stop
+==============================*/
+
+void pdprint_mirror(void (*func)(const char* text))
+{
+    std::lock_guard<std::recursive_mutex> guard(local_printlock);
+    local_mirror = func;
+}
+
+
+/*==============================
+    pdprint_overlay
+    Sets a window to draw over the printed text, like
+    debug mode's input bar
+    @param A pointer to the window, or NULL to stop
+==============================*/
+
+void pdprint_overlay(WINDOW* win)
+{
+    std::lock_guard<std::recursive_mutex> guard(local_printlock);
+    local_overlay = win;
+}
+
+
+/*==============================
+    pdprint_cover
+    Sets a window to draw instead of the printed text, like
+    the scrollback viewer. Printing carries on underneath it.
+    Call this again after changing the window to draw it
+    @param A pointer to the window, or NULL to stop
+==============================*/
+
+void pdprint_cover(WINDOW* win)
+{
+    std::lock_guard<std::recursive_mutex> guard(local_printlock);
+    if (win == NULL)
+        touchwin(stdscr);
+    local_cover = win;
+    local_dirty = true;
+    pdprint_flush(false);
+}
+
+
+/*==============================
+    pdprint_flush
+    Draws what was printed since the terminal was last
+    drawn. Printing does this by itself, but at most
+    PRINT_FPS times a second, so anything that waits for
+    a while after printing should call this first
+    @param Whether to draw even if the terminal was
+           drawn recently
+==============================*/
+
+void pdprint_flush(bool force)
+{
+    std::lock_guard<std::recursive_mutex> guard(local_printlock);
+    if (!local_dirty || (!force && std::chrono::steady_clock::now() < local_nextflush))
+        return;
+
+    // Copy the windows to the virtual screen, with the overlay on top, then draw only what changed
+    if (local_cover != NULL)
+    {
+        touchwin(local_cover);
+        wnoutrefresh(local_cover);
+    }
+    else
+        wnoutrefresh(stdscr);
+    if (local_overlay != NULL)
+    {
+        touchwin(local_overlay);
+        wnoutrefresh(local_overlay);
+    }
+    doupdate();
+    local_dirty = false;
+    local_nextflush = std::chrono::steady_clock::now() + std::chrono::milliseconds(1000/PRINT_FPS);
+}
+
+
+/*==============================
+    pdprint_waittime
+    Shortens a timeout so that sleeping for it doesn't
+    keep printed text from being drawn
+    @param The timeout, in milliseconds
+    @returns The timeout to sleep for, in milliseconds
+==============================*/
+
+int pdprint_waittime(int timeout)
+{
+    int left;
+    std::lock_guard<std::recursive_mutex> guard(local_printlock);
+    if (!local_dirty)
+        return timeout;
+    left = (int)std::chrono::duration_cast<std::chrono::milliseconds>(local_nextflush - std::chrono::steady_clock::now()).count();
+    if (left < 0)
+        left = 0;
+    return (timeout < 0 || left < timeout) ? left : timeout;
+}
+
+
+/*==============================
+    __pdprint_v
+    va_list version of pdprint. Don't use directly.
     @param A color pair to use (use the CR_ macros)
     @param A string to print
-    @param Variadic arguments to print as well
+    @param va_list with the arguments to print
 ==============================*/
 
-void __pdprint(short color, const char* str, ...)
+static void __pdprint_v(short color, const char* str, va_list args)
 {
-    int i;
-    va_list args;
-    va_start(args, str);
+    int   i, size;
+    char  stackbuff[256];
+    char* text;
+    std::lock_guard<std::recursive_mutex> guard(local_printlock);
+
+    // Format the string once, for the screen and everything that keeps a copy of it
+    text = __pdprint_format(stackbuff, sizeof(stackbuff), str, args, &size);
+    if (text == NULL)
+        return;
 
     // Disable all the colors
     for (i=0; i<TOTAL_COLORS; i++)
@@ -39,12 +262,36 @@ void __pdprint(short color, const char* str, ...)
         attron(COLOR_PAIR(color));
 
     // Print the string
-    vw_printw(stdscr, str, args);
-    refresh();
+    __pdprint_prefix(text, color);
+    waddnstr(stdscr, text, size);
+    __pdprint_dirty();
+    if (!local_drawingbar)
+    {
+        scrollback_add(text, size, color);
+        if (local_mirror != NULL)
+            local_mirror(text);
+    }
 
     // Print to the output debug file if it exists
-    if (global_debugoutptr != NULL)
-        vfprintf(global_debugoutptr, str, args);
+    logwriter_write(global_debugoutptr, text, size);
+    if (text != stackbuff)
+        free(text);
+}
+
+
+/*==============================
+    __pdprint
+    Prints text using PDCurses. Don't use directly.
+    @param A color pair to use (use the CR_ macros)
+    @param A string to print
+    @param Variadic arguments to print as well
+==============================*/
+
+void __pdprint(short color, const char* str, ...)
+{
+    va_list args;
+    va_start(args, str);
+    __pdprint_v(color, str, args);
     va_end(args);
 }
 
@@ -62,7 +309,8 @@ void __pdprint(short color, const char* str, ...)
 void __pdprintw(WINDOW *win, short color, char log, const char* str, ...)
 {
     int i;
-    va_list args;
+    va_list args, fileargs;
+    std::lock_guard<std::recursive_mutex> guard(local_printlock);
     va_start(args, str);
 
     // Disable all the colors
@@ -74,50 +322,30 @@ void __pdprintw(WINDOW *win, short color, char log, const char* str, ...)
         wattron(win, COLOR_PAIR(color));
 
     // Print the string
+    va_copy(fileargs, args); // vw_printw uses up args
     vw_printw(win, str, args);
+    wnoutrefresh(win);
     if (log)
-    {
-        refresh();
-        wrefresh(win);
-    }
+        __pdprint_dirty();
+    else
+        local_dirty = true; // Leave drawing it to whoever's handling the window
 
     // Print to the output debug file if it exists
     if (log && global_debugoutptr != NULL)
-        vfprintf(global_debugoutptr, str, args);
+    {
+        char  stackbuff[256];
+        int   size;
+        char* text = __pdprint_format(stackbuff, sizeof(stackbuff), str, fileargs, &size);
+        if (text != NULL)
+            logwriter_write(global_debugoutptr, text, size);
+        if (text != stackbuff)
+            free(text);
+    }
+    va_end(fileargs);
     va_end(args);
 }
 
 
-/*==============================
-    __pdprint_v
-    va_list version of pdprint. Don't use directly.
-    @param A color pair to use (use the CR_ macros)
-    @param A string to print
-    @param va_list with the arguments to print
-==============================*/
-
-static void __pdprint_v(short color, const char* str, va_list args)
-{
-    int i;
-
-    // Disable all the colors
-    for (i=0; i<TOTAL_COLORS; i++)
-        attroff(COLOR_PAIR(i+1));
-
-    // If a color is specified, use it
-    if (global_usecolors && color != CR_NONE)
-        attron(COLOR_PAIR(color));
-
-    // Print the string
-    vw_printw(stdscr, str, args);
-    refresh();
-
-    // Print to the output debug file if it exists
-    if (global_debugoutptr != NULL)
-        vfprintf(global_debugoutptr, str, args);
-}
-
-
 /*==============================
     __pdprint_replace
     Same as pdprint but overwrites the previous line. Don't use directly.
@@ -128,29 +356,20 @@ static void __pdprint_v(short color, const char* str, va_list args)
 
 void __pdprint_replace(short color, const char* str, ...)
 {
-    int i, xpos, ypos;
+    int xpos = 0, ypos = 0;
     va_list args;
+    std::lock_guard<std::recursive_mutex> guard(local_printlock);
     va_start(args, str);
 
-    // Disable all the colors
-    for (i=0; i<TOTAL_COLORS; i++)
-        attroff(COLOR_PAIR(i+1));
-
-    // If a color is specified, use it
-    if (global_usecolors && color != CR_NONE)
-        attron(COLOR_PAIR(color));
-
-    // Move the cursor back a line
-    getsyx(ypos, xpos);
-    move(ypos-1, 0);
+    // Move the cursor back a line, unless other threads could have printed since
+    if (local_prefix == NULL)
+    {
+        getyx(stdscr, ypos, xpos); // Not getsyx, as the screen's cursor isn't where ours is until it's drawn
+        move(ypos-1, 0);
+    }
 
     // Print the string
-    vw_printw(stdscr, str, args);
-    refresh();
-
-    // Print to the output debug file if it exists
-    if (global_debugoutptr != NULL)
-        vfprintf(global_debugoutptr, str, args);
+    __pdprint_v(color, str, args);
     va_end(args);
 }
 
@@ -177,12 +396,9 @@ void terminate(const char* reason, ...)
     pdprint("\n\n", CRDEF_ERROR);
     va_end(args);
 
-    // Close output debug file if it exists
-    if (global_debugoutptr != NULL)
-    {
-        fclose(global_debugoutptr);
-        global_debugoutptr = NULL;
-    }
+    // Close the output debug files if they exist
+    global_debugoutptr = NULL;
+    logwriter_closeall();
 
     // Close the device if it's open
     if (device_isopen() && !global_closefail)
@@ -195,6 +411,7 @@ void terminate(const char* reason, ...)
     if (global_timeout == 0)
     {
         pdprint("Press any key to continue...", CRDEF_INPUT);
+        pdprint_flush(true);
         getchar();
     }
     else
@@ -227,12 +444,9 @@ static void terminate_v(const char* reason, va_list args)
     }
     pdprint("\n\n", CRDEF_ERROR);
 
-    // Close output debug file if it exists
-    if (global_debugoutptr != NULL)
-    {
-        fclose(global_debugoutptr);
-        global_debugoutptr = NULL;
-    }
+    // Close the output debug files if they exist
+    global_debugoutptr = NULL;
+    logwriter_closeall();
 
     // Close the device if it's open
     if (device_isopen() && !global_closefail)
@@ -245,6 +459,7 @@ static void terminate_v(const char* reason, va_list args)
     if (global_timeout == 0)
     {
         pdprint("Press any key to continue...", CRDEF_INPUT);
+        pdprint_flush(true);
         getchar();
     }
     else
@@ -306,6 +521,16 @@ void progressbar_draw(const char* text, short color, float percent)
     int i;
     int prog_size = 16;
 	int blocks_done = (int)(percent*prog_size);
+    std::lock_guard<std::recursive_mutex> guard(local_printlock);
+    if (local_prefix != NULL)
+        return;
+
+    // Don't redraw the bar if it would look the same
+    if (text == local_bartext && (int)(percent*100.0f) == local_barpercent)
+        return;
+    local_bartext = text;
+    local_barpercent = (int)(percent*100.0f);
+    local_drawingbar = true;
 
     // Print the head of the progress bar
     pdprint_replace("%s [", color, text);
@@ -318,6 +543,11 @@ void progressbar_draw(const char* text, short color, float percent)
 
     // Print the butt of the progress bar
     pdprint("] %d%%\n", color, (int)(percent*100.0f));
+    local_drawingbar = false;
+
+    // Make sure the finished bar is shown, in case nothing's printed for a while
+    if (percent >= 1.0f)
+        pdprint_flush(true);
 }
 
 
@@ -354,6 +584,8 @@ char* gen_filename()
 {
     static int increment = 0;
     static int lasttime = 0;
+    static std::mutex lock; // The USB reader threads name files too
+    std::lock_guard<std::mutex> guard(lock);
     char* str = (char*) malloc(DATESIZE);
     int curtime = 0;
     time_t t = time(NULL);
@@ -380,6 +612,179 @@ char* gen_filename()
 }
 
 
+/*==============================
+    gen_configpath
+    Generates the path to a file in UNFLoader's config
+    folder, creating the folder if it doesn't exist
+    Remember to free the memory when finished!
+    @param The name of the file
+    @returns The path to the file, or NULL if there is no
+             place to store it
+==============================*/
+
+#define CONFIGPATH_SIZE 512
+char* gen_configpath(const char* filename)
+{
+    char* path = (char*) malloc(CONFIGPATH_SIZE);
+    if (path == NULL)
+        return NULL;
+
+    // Find and create the config folder
+    #ifndef LINUX
+        const char* appdata = getenv("APPDATA");
+        if (appdata == NULL || strlen(appdata) > CONFIGPATH_SIZE-32)
+        {
+            free(path);
+            return NULL;
+        }
+        snprintf(path, CONFIGPATH_SIZE, "%s\\UNFLoader", appdata);
+        CreateDirectoryA(path, NULL);
+        strcat(path, "\\");
+    #else
+        const char* config = getenv("XDG_CONFIG_HOME");
+        const char* home = getenv("HOME");
+        if (config != NULL && config[0] != '\0')
+            snprintf(path, CONFIGPATH_SIZE, "%s", config);
+        else if (home != NULL)
+            snprintf(path, CONFIGPATH_SIZE, "%s/.config", home);
+        else
+            path[0] = '\0';
+        if (path[0] == '\0' || strlen(path) > CONFIGPATH_SIZE-32)
+        {
+            free(path);
+            return NULL;
+        }
+        mkdir(path, 0755);
+        strcat(path, "/unfloader");
+        mkdir(path, 0755);
+        strcat(path, "/");
+    #endif
+
+    // Add the filename
+    if (strlen(path)+strlen(filename) >= CONFIGPATH_SIZE)
+    {
+        free(path);
+        return NULL;
+    }
+    strcat(path, filename);
+    return path;
+}
+
+
+/*==============================
+    replace_file
+    Moves a file that was written next to another one into
+    its place. If it can't, the new file is deleted
+    @param The path of the new file
+    @param The path of the file to replace
+    @returns Whether the file was replaced
+==============================*/
+
+bool replace_file(const char* newpath, const char* path)
+{
+    // rename replaces the old file in one step on POSIX, but Windows won't rename over an existing file
+    #ifndef LINUX
+        remove(path);
+    #endif
+    if (rename(newpath, path) != 0)
+    {
+        remove(newpath);
+        return false;
+    }
+    return true;
+}
+
+
+/*==============================
+    cpu_detect
+    Asks the CPU which vector instruction sets it supports
+    @returns A mask of CPU_ flags
+==============================*/
+
+#define CPU_SSE2  0x01
+#define CPU_SSSE3 0x02
+#define CPU_AVX2  0x04
+static int cpu_detect()
+{
+    int features = 0;
+    #ifdef HELPER_X86
+        #ifdef _MSC_VER
+            int info[4];
+            __cpuid(info, 1);
+            if (info[3] & (1 << 26))
+                features |= CPU_SSE2;
+            if (info[2] & (1 << 9))
+                features |= CPU_SSSE3;
+            if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6) // OSXSAVE, AVX, and the OS saves YMM registers
+            {
+                __cpuidex(info, 7, 0);
+                if (info[1] & (1 << 5))
+                    features |= CPU_AVX2;
+            }
+        #else
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("sse2"))
+                features |= CPU_SSE2;
+            if (__builtin_cpu_supports("ssse3"))
+                features |= CPU_SSSE3;
+            if (__builtin_cpu_supports("avx2"))
+                features |= CPU_AVX2;
+        #endif
+    #endif
+    return features;
+}
+
+
+/*==============================
+    cpu_features
+    Gets the vector instruction sets the CPU supports,
+    only asking it the first time
+    @returns A mask of CPU_ flags
+==============================*/
+
+static int cpu_features()
+{
+    static const int features = cpu_detect();
+    return features;
+}
+
+
+/*==============================
+    cpu_has_sse2
+    Checks if the CPU supports SSE2
+    @returns Whether SSE2 instructions can be used
+==============================*/
+
+bool cpu_has_sse2()
+{
+    return (cpu_features() & CPU_SSE2) != 0;
+}
+
+
+/*==============================
+    cpu_has_ssse3
+    Checks if the CPU supports SSSE3
+    @returns Whether SSSE3 instructions can be used
+==============================*/
+
+bool cpu_has_ssse3()
+{
+    return (cpu_features() & CPU_SSSE3) != 0;
+}
+
+
+/*==============================
+    cpu_has_avx2
+    Checks if the CPU and the OS support AVX2
+    @returns Whether AVX2 instructions can be used
+==============================*/
+
+bool cpu_has_avx2()
+{
+    return (cpu_features() & CPU_AVX2) != 0;
+}
+
+
 /*==============================
     romhash
     Returns an int with a simple hash of the inputted data
@@ -432,6 +837,7 @@ void handle_timeout()
     if (global_timeouttime == 0)
         global_timeouttime = time(NULL) + global_timeout;
     pdprint("\nPress any key to continue, or wait for timeout.\n", CRDEF_INPUT);
+    pdprint_flush(true);
     while (getch() < 2 && global_timeouttime > time(NULL))
         ;
 }
\ No newline at end of file
@@ -8,7 +8,7 @@
                   Macros
     *********************************/
 
-    #define PRINT_HISTORY_SIZE 512
+    #define PRINT_FPS 30 // How many times a second the terminal can be redrawn, at most
 
     // Color macros
     #define TOTAL_COLORS 4
@@ -35,6 +35,12 @@
     #define pdprintw(window, string, color, ...) __pdprintw(window, color, 1, string, ##__VA_ARGS__)
     #define pdprintw_nolog(window, string, color, ...) __pdprintw(window, color, 0, string, ##__VA_ARGS__)
     #define pdprint_replace(string, color, ...) __pdprint_replace(color, string, ##__VA_ARGS__)
+    void pdprint_prefix(const char* prefix);
+    void pdprint_mirror(void (*func)(const char* text));
+    void pdprint_overlay(WINDOW* win);
+    void pdprint_cover(WINDOW* win);
+    void pdprint_flush(bool force);
+    int  pdprint_waittime(int timeout);
     void terminate(const char* reason, ...);
     void progressbar_draw(const char* text, short color, float percent);
 
@@ -43,7 +49,12 @@
     u32   swap_endian(u32 val);
     u32   calc_padsize(u32 size);
     char* gen_filename();
+    char* gen_configpath(const char* filename);
+    bool  replace_file(const char* newpath, const char* path);
     #define SWAP(a, b) (((a) ^= (b)), ((b) ^= (a)), ((a) ^= (b))) // From https://graphics.stanford.edu/~seander/bithacks.html#SwappingValuesXOR
+    bool cpu_has_sse2();
+    bool cpu_has_ssse3();
+    bool cpu_has_avx2();
     u32 romhash(u8 *buff, u32 len);
     s16 cic_from_hash(u32 hash);
     void handle_timeout();
@@ -0,0 +1,583 @@
+/***************************************************************
+                          logwriter.cpp
+
+Writes the debug output files on threads of their own, so that
+printing never waits for the disk. Printed text is copied into
+a buffer, which the file's writer thread swaps for an empty one
+and writes out in one go. Depending on the -log options, the
+file is synced to the disk every so often, and once it gets too
+big or too old it's renamed after the time it was rotated (and
+optionally gzipped on another thread) and a new one is started.
+***************************************************************/
+
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <stdarg.h>
+#include <sys/stat.h>
+#pragma warning(push, 0)
+    #include "Include/lodepng.h"
+#pragma warning(pop)
+#include "main.h"
+#include "helper.h"
+#include "logwriter.h"
+#ifndef LINUX
+    #include <io.h>
+#endif
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+struct logfile {
+    char*        path;
+    FILE*        fp;
+    char*        back;     // Where printed text goes, only touched with the lock held
+    u32          backsize;
+    u32          backcap;
+    char*        front;    // What the writer thread is writing out
+    u32          frontcap;
+    std::mutex   lock;
+    std::condition_variable wake;    // Wakes up the writer thread
+    std::condition_variable drained; // Wakes up printing that's waiting for the writer to catch up
+    bool         binary;       // Binary files are never rotated, so that offsets into them stay valid
+    bool         stop;
+    bool         unsynced;     // Whether anything was written since the file was last synced
+    u64          segmentsize;  // How much was written since the file was last rotated
+    time_t       segmentstart; // When the file was last rotated
+    time_t       lastsync;
+    std::thread* thread;
+    std::thread* compressor;   // Gzips the last file that was rotated
+    char         error[128];   // The first thing that went wrong, reported when the file is closed
+    logfile_t*   next;
+};
+
+
+/*********************************
+             Globals
+*********************************/
+
+static std::mutex local_listlock;
+static logfile_t* local_logs = NULL; // Every open file, so they can be closed if the program has to stop
+
+
+/*==============================
+    logwriter_fail
+    Remembers why writing a file failed, unless something
+    went wrong already. Don't call with the lock held
+    @param A pointer to the file
+    @param A string with the reason
+    @param Variadic arguments to print as well
+==============================*/
+
+static void logwriter_fail(logfile_t* log, const char* reason, ...)
+{
+    va_list args;
+    std::lock_guard<std::mutex> guard(log->lock);
+    if (log->error[0] != '\0')
+        return;
+    va_start(args, reason);
+    vsnprintf(log->error, sizeof(log->error), reason, args);
+    va_end(args);
+}
+
+
+/*==============================
+    logwriter_sync
+    Makes sure what was written is on the disk
+    @param The file to sync
+==============================*/
+
+static void logwriter_sync(FILE* fp)
+{
+    fflush(fp);
+    #ifndef LINUX
+        _commit(_fileno(fp));
+    #else
+        fsync(fileno(fp));
+    #endif
+}
+
+
+/*==============================
+    logwriter_exists
+    Checks whether a file exists
+    @param The path to check
+    @returns Whether the file exists
+==============================*/
+
+static bool logwriter_exists(const char* path)
+{
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+
+/*==============================
+    logwriter_taken
+    Checks whether a name for a rotated file is taken,
+    either by a file or by a gzipped one
+    @param The name to check, with room for ".gz" after it
+    @returns Whether the name is taken
+==============================*/
+
+static bool logwriter_taken(char* name)
+{
+    size_t len = strlen(name);
+    bool taken = logwriter_exists(name);
+    strcpy(name+len, ".gz");
+    taken = taken || logwriter_exists(name);
+    name[len] = '\0';
+    return taken;
+}
+
+
+/*==============================
+    logwriter_gzipmember
+    Compresses data into a gzip member. Gzip files can hold
+    several members one after the other, so a rotated file
+    is compressed a piece at a time without loading it whole
+    @param The file to write the member to
+    @param The data to compress
+    @param The size of the data
+    @param The time to store in the member's header
+    @returns Whether the member was written
+==============================*/
+
+static bool logwriter_gzipmember(FILE* fp, const u8* data, u32 size, time_t mtime)
+{
+    u8 header[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 255};
+    u8 trailer[8];
+    u8* deflated = NULL;
+    size_t deflatedsize = 0;
+    u32 crc = lodepng_crc32(data, size);
+    bool ok;
+    int i;
+
+    // Deflate the data
+    if (lodepng_deflate(&deflated, &deflatedsize, data, size, &lodepng_default_compress_settings) != 0)
+    {
+        free(deflated);
+        return false;
+    }
+
+    // Wrap it with a header and a trailer with the CRC and size, both little endian
+    for (i=0; i<4; i++)
+    {
+        header[4+i]  = (u8)(((u32)mtime) >> (i*8));
+        trailer[i]   = (u8)(crc >> (i*8));
+        trailer[4+i] = (u8)(size >> (i*8));
+    }
+    ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header) &&
+         fwrite(deflated, 1, deflatedsize, fp) == deflatedsize &&
+         fwrite(trailer, 1, sizeof(trailer), fp) == sizeof(trailer);
+    free(deflated);
+    return ok;
+}
+
+
+/*==============================
+    logwriter_gzip
+    Gzips a rotated file, and removes the original once it's
+    compressed. Runs on a thread of its own
+    @param A pointer to the file that was rotated
+    @param The path the rotated file was renamed to, which
+           is freed once it's compressed
+==============================*/
+
+static void logwriter_gzip(logfile_t* log, char* path)
+{
+    FILE* in;
+    FILE* out;
+    u8* buffer;
+    size_t read;
+    bool ok = true;
+    time_t mtime = time(NULL);
+    char* outpath = (char*) malloc(strlen(path)+4);
+
+    // Open the files
+    buffer = (u8*) malloc(LOGWRITER_ZIPCHUNK);
+    if (outpath == NULL || buffer == NULL)
+    {
+        logwriter_fail(log, "Unable to allocate memory to compress %s.", path);
+        free(outpath);
+        free(buffer);
+        free(path);
+        return;
+    }
+    sprintf(outpath, "%s.gz", path);
+    in = fopen(path, "rb");
+    out = (in != NULL) ? fopen(outpath, "wb") : NULL;
+    if (out == NULL)
+    {
+        logwriter_fail(log, "Unable to open %s for compressing.", (in == NULL) ? path : outpath);
+        if (in != NULL)
+            fclose(in);
+        free(outpath);
+        free(buffer);
+        free(path);
+        return;
+    }
+
+    // Compress it a piece at a time
+    while (ok && (read = fread(buffer, 1, LOGWRITER_ZIPCHUNK, in)) > 0)
+        ok = logwriter_gzipmember(out, buffer, (u32)read, mtime);
+    if (ferror(in))
+        ok = false;
+    fclose(in);
+    if (fclose(out) != 0)
+        ok = false;
+
+    // Only keep one of the two
+    if (ok)
+        remove(path);
+    else
+    {
+        remove(outpath);
+        logwriter_fail(log, "Unable to compress %s.", path);
+    }
+    free(outpath);
+    free(buffer);
+    free(path);
+}
+
+
+/*==============================
+    logwriter_rotate
+    Renames the file after the current time, and starts a
+    new one in its place
+    @param A pointer to the file to rotate
+==============================*/
+
+static void logwriter_rotate(logfile_t* log)
+{
+    int i;
+    char stamp[32];
+    time_t now = time(NULL);
+    size_t size = strlen(log->path)+sizeof(stamp)+16;
+    char* name = (char*) malloc(size);
+    const char* mode = "w";
+
+    // Close the current file
+    if (log->fp != NULL)
+    {
+        if (global_logsync >= 0)
+            logwriter_sync(log->fp);
+        fclose(log->fp);
+        log->fp = NULL;
+    }
+
+    // Pick a name that isn't taken, in case it was rotated twice in a second
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+    if (name != NULL)
+    {
+        snprintf(name, size, "%s.%s", log->path, stamp);
+        for (i=2; logwriter_taken(name); i++)
+            snprintf(name, size, "%s.%s-%d", log->path, stamp, i);
+    }
+
+    // Move it out of the way, and compress it if asked to
+    if (name == NULL || rename(log->path, name) != 0)
+    {
+        logwriter_fail(log, "Unable to rotate %s.", log->path);
+        mode = "a"; // Don't lose what's in it
+        free(name);
+    }
+    else if (global_logzip)
+    {
+        if (log->compressor != NULL)
+        {
+            log->compressor->join();
+            delete log->compressor;
+        }
+        log->compressor = new std::thread(logwriter_gzip, log, name);
+    }
+    else
+        free(name);
+
+    // Start a new file
+    log->fp = fopen(log->path, mode);
+    if (log->fp == NULL)
+        logwriter_fail(log, "Unable to open %s for writing debug output.", log->path);
+    log->segmentsize = 0;
+    log->segmentstart = now;
+}
+
+
+/*==============================
+    logwriter_output
+    Writes text to the file, rotating it if it gets too big.
+    Files are only rotated between lines, unless a single
+    line is bigger than a whole file
+    @param A pointer to the file
+    @param The text to write
+    @param The size of the text
+==============================*/
+
+static void logwriter_output(logfile_t* log, const char* text, u32 size)
+{
+    while (size > 0)
+    {
+        u32 chunk = size;
+
+        // End the file at the last line that fits
+        if (!log->binary && global_logsize != 0 && log->segmentsize + size > global_logsize)
+        {
+            chunk = (global_logsize > log->segmentsize) ? (u32)(global_logsize - log->segmentsize) : 0;
+            while (chunk > 0 && text[chunk-1] != '\n')
+                chunk--;
+            if (chunk == 0 && log->segmentsize == 0) // A line bigger than a whole file gets one to itself
+            {
+                while (chunk < size && text[chunk] != '\n')
+                    chunk++;
+                if (chunk < size)
+                    chunk++;
+            }
+        }
+
+        // Write what fits, and start a new file for the rest
+        if (chunk > 0 && log->fp != NULL)
+        {
+            if (fwrite(text, 1, chunk, log->fp) != chunk)
+                logwriter_fail(log, "Unable to write to %s.", log->path);
+            log->unsynced = true;
+        }
+        log->segmentsize += chunk;
+        text += chunk;
+        size -= chunk;
+        if (size > 0)
+            logwriter_rotate(log);
+    }
+}
+
+
+/*==============================
+    logwriter_thread
+    Writes out the printed text every so often, or as soon
+    as enough of it builds up
+    @param A pointer to the file
+==============================*/
+
+static void logwriter_thread(logfile_t* log)
+{
+    std::unique_lock<std::mutex> guard(log->lock);
+    while (true)
+    {
+        char* text;
+        u32 size, cap;
+        bool stop;
+        time_t now;
+        log->wake.wait_for(guard, std::chrono::milliseconds(LOGWRITER_FLUSHWAIT), [log]{return log->stop || log->backsize >= LOGWRITER_BUFFER;});
+
+        // Take the printed text, and give printing the buffer that was written last time
+        text = log->back;
+        size = log->backsize;
+        cap = log->backcap;
+        log->back = log->front;
+        log->backcap = log->frontcap;
+        log->backsize = 0;
+        log->front = text;
+        log->frontcap = cap;
+        stop = log->stop;
+        log->drained.notify_all();
+        guard.unlock();
+
+        // Write it out
+        if (size > 0)
+        {
+            logwriter_output(log, text, size);
+            if (log->fp != NULL)
+                fflush(log->fp);
+        }
+
+        // Rotate the file if it's too old, and sync it if it's time to
+        now = time(NULL);
+        if (!log->binary && global_logtime != 0 && log->segmentsize > 0 && now - log->segmentstart >= global_logtime)
+            logwriter_rotate(log);
+        if (global_logsync >= 0 && log->unsynced && log->fp != NULL && now - log->lastsync >= global_logsync)
+        {
+            logwriter_sync(log->fp);
+            log->unsynced = false;
+            log->lastsync = now;
+        }
+        guard.lock();
+        if (stop)
+            break;
+    }
+}
+
+
+/*==============================
+    logwriter_open
+    Opens a file for debug output and starts its writer
+    thread. If the file is rotated, an old one is rotated
+    instead of being overwritten
+    @param The path of the file
+    @param Whether the file is binary, rather than text
+    @returns A pointer to the file, or NULL if it couldn't
+             be opened
+==============================*/
+
+logfile_t* logwriter_open(const char* path, bool binary)
+{
+    logfile_t* log = new logfile_t();
+    log->path = (char*) malloc(strlen(path)+1);
+    if (log->path == NULL)
+    {
+        delete log;
+        return NULL;
+    }
+    strcpy(log->path, path);
+    log->binary = binary;
+    log->segmentstart = time(NULL);
+    log->lastsync = log->segmentstart;
+
+    // Keep the last session's output if the file is rotated
+    if (!binary && (global_logsize != 0 || global_logtime != 0) && logwriter_exists(path))
+        logwriter_rotate(log);
+    else
+        log->fp = fopen(path, binary ? "wb" : "w");
+    if (log->fp == NULL)
+    {
+        if (log->compressor != NULL)
+        {
+            log->compressor->join();
+            delete log->compressor;
+        }
+        free(log->path);
+        delete log;
+        return NULL;
+    }
+
+    // Start writing
+    log->thread = new std::thread(logwriter_thread, log);
+    std::lock_guard<std::mutex> guard(local_listlock);
+    log->next = local_logs;
+    local_logs = log;
+    return log;
+}
+
+
+/*==============================
+    logwriter_write
+    Queues text to be written to a file. Only waits if the
+    disk is so far behind that the queue is full
+    @param A pointer to the file, or NULL to do nothing
+    @param The text to write
+    @param The size of the text
+==============================*/
+
+void logwriter_write(logfile_t* log, const char* text, int size)
+{
+    if (log == NULL || size <= 0)
+        return;
+    std::unique_lock<std::mutex> guard(log->lock);
+
+    // If the disk can't keep up, wait for it rather than using up all the memory
+    while (log->backsize > 0 && log->backsize + size > LOGWRITER_MAXQUEUE && !log->stop)
+        log->drained.wait(guard);
+
+    // Make room for the text
+    if (log->backsize + size > log->backcap)
+    {
+        u32 cap = (log->backcap != 0) ? log->backcap : LOGWRITER_BUFFER;
+        char* grown;
+        while (cap < log->backsize + size)
+            cap *= 2;
+        grown = (char*) realloc(log->back, cap);
+        if (grown == NULL)
+        {
+            if (log->error[0] == '\0')
+                snprintf(log->error, sizeof(log->error), "Unable to allocate memory for %s.", log->path);
+            return;
+        }
+        log->back = grown;
+        log->backcap = cap;
+    }
+    memcpy(log->back + log->backsize, text, size);
+    log->backsize += size;
+    if (log->backsize >= LOGWRITER_BUFFER)
+        log->wake.notify_one();
+}
+
+
+/*==============================
+    logwriter_close
+    Writes out everything that's left and closes a file.
+    Don't close the file that's being printed to, set
+    global_debugoutptr to something else first
+    @param A pointer to the file, or NULL to do nothing
+==============================*/
+
+void logwriter_close(logfile_t* log)
+{
+    logfile_t** entry;
+    if (log == NULL)
+        return;
+
+    // Take it off the list
+    {
+        std::lock_guard<std::mutex> guard(local_listlock);
+        for (entry = &local_logs; *entry != NULL; entry = &(*entry)->next)
+        {
+            if (*entry == log)
+            {
+                *entry = log->next;
+                break;
+            }
+        }
+    }
+
+    // Stop the threads once they're done
+    {
+        std::lock_guard<std::mutex> guard(log->lock);
+        log->stop = true;
+        log->wake.notify_one();
+        log->drained.notify_all();
+    }
+    log->thread->join();
+    delete log->thread;
+    if (log->compressor != NULL)
+    {
+        log->compressor->join();
+        delete log->compressor;
+    }
+
+    // Close the file, and say if anything went wrong with it
+    if (log->fp != NULL)
+    {
+        if (global_logsync >= 0)
+            logwriter_sync(log->fp);
+        if (fclose(log->fp) != 0 && log->error[0] == '\0')
+            snprintf(log->error, sizeof(log->error), "Unable to write to %s.", log->path);
+    }
+    if (log->error[0] != '\0')
+        pdprint("%s\n", CRDEF_ERROR, log->error);
+    free(log->back);
+    free(log->front);
+    free(log->path);
+    delete log;
+}
+
+
+/*==============================
+    logwriter_closeall
+    Closes every open file, for when the program has to stop
+==============================*/
+
+void logwriter_closeall()
+{
+    while (true)
+    {
+        logfile_t* log;
+        {
+            std::lock_guard<std::mutex> guard(local_listlock);
+            log = local_logs;
+        }
+        if (log == NULL)
+            break;
+        logwriter_close(log);
+    }
+}
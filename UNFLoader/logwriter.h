@@ -0,0 +1,26 @@
+#ifndef __LOGWRITER_HEADER
+#define __LOGWRITER_HEADER
+
+    #include "main.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define LOGWRITER_BUFFER    (64*1024)          // How much text builds up before the writer is woken up early
+    #define LOGWRITER_MAXQUEUE  (64*1024*1024)     // How much text can wait for the disk before printing has to wait too
+    #define LOGWRITER_FLUSHWAIT 200                // How long text can wait in memory before it's written, in milliseconds
+    #define LOGWRITER_ZIPCHUNK  (4*1024*1024)      // How much of a rotated log is compressed at a time
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    logfile_t* logwriter_open(const char* path, bool binary);
+    void       logwriter_write(logfile_t* log, const char* text, int size);
+    void       logwriter_close(logfile_t* log);
+    void       logwriter_closeall();
+
+#endif
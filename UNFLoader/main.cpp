@@ -7,6 +7,9 @@ UNFLoader Entrypoint
 #include "main.h"
 #include "helper.h"
 #include "device.h"
+#include "daemon.h"
+#include "session.h"
+#include "screenshot.h"
 #pragma comment(lib, "Include/FTD2XX.lib")
 
 
@@ -40,19 +43,32 @@ u32     global_savetype    = 0;
 bool    global_listenmode  = false;
 bool    global_debugmode   = false;
 bool    global_networkmode = false;
-bool    global_z64         = false;
+int     global_byteorder   = 0;
+bool    global_romcache    = false;
+bool    global_fixcrc      = false;
+bool    global_verify      = false;
 char*   global_debugout    = NULL;
-FILE*   global_debugoutptr = NULL;
+logfile_t* global_debugoutptr = NULL;
+u64     global_logsize     = 0;
+time_t  global_logtime     = 0;
+int     global_logsync     = -1;
+bool    global_logzip      = false;
+char*   global_sessionout  = NULL;
+char*   global_videoout    = NULL;
+int     global_screenshotformat = SCREENSHOT_PNG;
+int     global_pnglevel    = -1;
 char*   global_exportpath  = NULL;
 time_t  global_timeout     = 0;
 time_t  global_timeouttime = 0;
 bool    global_closefail   = false;
 char*   global_filename    = NULL;
-WINDOW* global_window      = NULL;
 
 // Local globals
 static int   local_flashcart = CART_NONE;
 static char* local_rom = NULL;
+static bool  local_calibrate = false;
+static bool  local_multicart = false;
+static bool  local_daemon = false;
 
 
 
@@ -67,6 +83,16 @@ int main(int argc, char* argv[])
 {
     int i;
 
+    // Requests for the daemon are sent without touching the console or the flashcart
+    for (i=1; i<argc; i++)
+        if (!strcmp(argv[i], "-remote"))
+            return daemon_client(argc, argv);
+
+    // So are queries of session logs
+    for (i=1; i<argc; i++)
+        if (!strcmp(argv[i], "-query"))
+            return session_query(argc, argv);
+
     // Initialize PDCurses
     #ifdef LINUX
         setlocale(LC_ALL, "");
@@ -80,7 +106,6 @@ int main(int argc, char* argv[])
     scrollok(stdscr, 1);
     idlok(stdscr, 1);
     resize_term(40, 80);
-    global_window = newpad(1000, 80);
 
     // Initialize the colors
     init_pair(CR_RED, COLOR_RED, -1);
@@ -92,19 +117,25 @@ int main(int argc, char* argv[])
     show_title();
     parse_args(argc, argv);
 
-    if (local_rom == NULL)
+    if (local_rom == NULL && !local_calibrate && !local_daemon)
         terminate("Missing ROM argument (-r <ROM NAME HERE>)\n");
 
     // Upload the ROM and start debug mode if necessary
-    device_find(local_flashcart);
+    device_find(local_flashcart, local_multicart);
     device_open();
-    device_sendrom(local_rom);
+    if (local_calibrate)
+        device_calibrate();
+    if (local_rom != NULL && !local_daemon)
+        device_sendrom(local_rom);
+    if (local_daemon)
+        device_daemon();
     device_close();
 
     // End the program
     if (global_timeout == 0)
     {
         pdprint("\nPress any key to continue.\n", CRDEF_INPUT);
+        pdprint_flush(true);
         getchar();
     }
     else
@@ -228,6 +259,18 @@ void parse_args(int argc, char* argv[])
             else
                 terminate("Missing parameter(s) for command '%s'.", command);
         }
+        else if (!strcmp(command, "-calibrate")) // Calibrate transfer settings
+            local_calibrate = true;
+        else if (!strcmp(command, "-cache")) // Cache prepared ROMs
+            global_romcache = true;
+        else if (!strcmp(command, "-fixcrc")) // Fix the ROM's checksum
+            global_fixcrc = true;
+        else if (!strcmp(command, "-verify")) // Read the ROM back after uploading
+            global_verify = true;
+        else if (!strcmp(command, "-multi")) // Use every cart that's plugged in
+            local_multicart = true;
+        else if (!strcmp(command, "-daemon")) // Keep the cart open and take requests
+            local_daemon = true;
         else if (!strcmp(command, "-l")) // Listen mode
         {
             global_listenmode = true;
@@ -279,6 +322,95 @@ void parse_args(int argc, char* argv[])
             }
             pdprint("\n", CRDEF_PROGRAM);
         }
+        else if (!strcmp(command, "-logsize") || !strcmp(command, "-logtime") || !strcmp(command, "-logsync")) // Debug output rotation and syncing
+        {
+            i++;
+
+            // If we have an argument after this one, then set the option, otherwise terminate
+            if (i<argc && isdigit(argv[i][0]))
+            {
+                if (!strcmp(command, "-logsize"))
+                    global_logsize = strtoull(argv[i], NULL, 0)*1024*1024;
+                else if (!strcmp(command, "-logtime"))
+                    global_logtime = atoi(argv[i])*60;
+                else
+                    global_logsync = atoi(argv[i]);
+            }
+            else 
+                terminate("Missing parameter(s) for command '%s'.", command);
+        }
+        else if (!strcmp(command, "-logzip")) // Gzip rotated debug output
+            global_logzip = true;
+        else if (!strcmp(command, "-session")) // Binary session log
+        {
+            i++;
+
+            // If we have an argument after this one, then set the session log, otherwise terminate
+            if (i<argc && argv[i][0] != '-')
+            {
+                if (global_exportpath != NULL)
+                {
+                    char* filepath = (char*)malloc(256);
+                    memset(filepath, 0 ,256);
+                    strcat(filepath, global_exportpath);
+                    strcat(filepath, argv[i]);
+                    global_sessionout = filepath;
+                }
+                else
+                    global_sessionout = argv[i];
+            }
+            else 
+                terminate("Missing parameter(s) for command '%s'.", command);
+        }
+        else if (!strcmp(command, "-screenshot")) // Screenshot file format
+        {
+            i++;
+
+            // If we have an argument after this one, then set the format, otherwise terminate
+            if (i<argc && argv[i][0] != '-')
+            {
+                global_screenshotformat = screenshot_format(argv[i]);
+                if (global_screenshotformat == -1)
+                    terminate("Unknown screenshot format '%s'.", argv[i]);
+            }
+            else 
+                terminate("Missing parameter(s) for command '%s'.", command);
+        }
+        else if (!strcmp(command, "-pnglevel")) // PNG compression level
+        {
+            i++;
+
+            // If we have an argument after this one, then set the level, otherwise terminate
+            if (i<argc && isdigit(argv[i][0]))
+            {
+                global_pnglevel = atoi(argv[i]);
+                if (global_pnglevel > 9)
+                    terminate("The PNG compression level must be between 0 and 9.");
+            }
+            else 
+                terminate("Missing parameter(s) for command '%s'.", command);
+        }
+        else if (!strcmp(command, "-video")) // Screenshots to a video stream
+        {
+            i++;
+
+            // If we have an argument after this one, then set the video file, otherwise terminate
+            if (i<argc && argv[i][0] != '-')
+            {
+                if (global_exportpath != NULL)
+                {
+                    char* filepath = (char*)malloc(256);
+                    memset(filepath, 0 ,256);
+                    strcat(filepath, global_exportpath);
+                    strcat(filepath, argv[i]);
+                    global_videoout = filepath;
+                }
+                else
+                    global_videoout = argv[i];
+            }
+            else 
+                terminate("Missing parameter(s) for command '%s'.", command);
+        }
         else if (!strcmp(command, "-t")) // Timeout command
         {
             i++;
@@ -348,7 +480,24 @@ void list_args()
     pdprint("  \t 3 - %s\t 4 - %s\n", CRDEF_PROGRAM, "SRAM 256Kbit", "FlashRAM 1Mbit");
     pdprint("  \t 5 - %s\t 6 - %s\n", CRDEF_PROGRAM, "SRAM 768Kbit", "FlashRAM 1Mbit (PokeStdm2)");
     pdprint("  -d [filename]\t\t   Debug mode. Optionally write output to a file.\n", CRDEF_PROGRAM);
+    pdprint("  -logsize <megabytes>\t   Start a new output file once it gets this big, keeping the old one.\n", CRDEF_PROGRAM);
+    pdprint("  -logtime <minutes>\t   Start a new output file once it gets this old, keeping the old one.\n", CRDEF_PROGRAM);
+    pdprint("  -logsync <seconds>\t   Sync the output file to the disk this often (0 for every write).\n", CRDEF_PROGRAM);
+    pdprint("  -logzip\t\t   Gzip the output files that were kept.\n", CRDEF_PROGRAM);
+    pdprint("  -session <filename>\t   Keep a binary log of everything sent and received in debug mode.\n", CRDEF_PROGRAM);
+    pdprint("  -screenshot <format>\t   Save screenshots as png (default), qoi, bmp or ppm.\n", CRDEF_PROGRAM);
+    pdprint("  -pnglevel <0-9>\t   PNG compression level. Lower is faster but bigger.\n", CRDEF_PROGRAM);
+    pdprint("  -video <filename>\t   Record screenshots to a Y4M video instead of PNG files.\n", CRDEF_PROGRAM);
+    pdprint("  -query <filename>\t   Read a session log: -from <seconds>, -to <seconds>, -list,\n", CRDEF_PROGRAM);
+    pdprint(            "\t\t\t   -type <text|binary|screenshot|sent>, -e <directory>.\n", CRDEF_PROGRAM);
     pdprint("  -l\t\t\t   Listen mode (reupload ROM when changed).\n", CRDEF_PROGRAM);
+    pdprint("  -calibrate\t\t   Find and store the fastest transfer settings for the cart.\n", CRDEF_PROGRAM);
+    pdprint("  -cache\t\t   Cache prepared ROMs, so uploading them again skips preprocessing.\n", CRDEF_PROGRAM);
+    pdprint("  -fixcrc\t\t   Fix the ROM's checksum if it's wrong.\n", CRDEF_PROGRAM);
+    pdprint("  -verify\t\t   Read the ROM back after uploading, and resend the parts that differ.\n", CRDEF_PROGRAM);
+    pdprint("  -multi\t\t   Use every flashcart that's plugged in, uploading to all of them at once.\n", CRDEF_PROGRAM);
+    pdprint("  -daemon\t\t   Keep the flashcart open, and take requests from -remote.\n", CRDEF_PROGRAM);
+    pdprint("  -remote <requests>\t   Send requests to the daemon: -r <file>, -send <command>, -capture, -stop.\n", CRDEF_PROGRAM);
     pdprint("  -e <directory>\t   File export directory (Folder must exist!).\n", CRDEF_PROGRAM);
     pdprint(            "\t\t\t   Example:  'folder/path/' or 'c:/folder/path'.\n", CRDEF_PROGRAM);
     pdprint("  -h <int>\t\t   Force terminal height (number of rows).\n", CRDEF_PROGRAM);
@@ -381,6 +530,7 @@ void show_help()
 
     // Get the category
     pdprint("\nCategory: ", CRDEF_INPUT);
+    pdprint_flush(true);
     category = getchar();
     pdprint("%c\n\n", CRDEF_INPUT, category);
 
@@ -418,7 +568,10 @@ void show_help()
                     "saves you the trouble of having to restart this program every recompile of your\n"
                     "homebrew. It is on YOU to ensure the cart is prepared to receive another ROM.\n"
                     "That means that the console must be switched OFF if you're using the 64Drive or\n"
-                    "the SummerCart64, or be in the menu if you're using an EverDrive.\n", CRDEF_PROGRAM);
+                    "the SummerCart64, or be in the menu if you're using an EverDrive.\n\n"
+                    "Only the parts of the ROM that changed since the last upload are sent again. If\n"
+                    "the cart lost what was in its memory (for instance, if it was unplugged), press\n"
+                    "R to resend the whole ROM.\n", CRDEF_PROGRAM);
             break;
         case '5':
             pdprint("In order to use the debug mode, the N64 ROM that you are executing must already\n"
@@ -433,6 +586,8 @@ void show_help()
                     "screenshots, or change things in the game. If you wrap a part of your command\n"
                     "with the '@' symbol, the tool will treat that part as a file and will upload it\n"
                     "along with the rest of the data.\n\n", CRDEF_PROGRAM);
+            pdprint("Everything that was printed is kept, and PAGE UP scrolls back through it. CTRL+F\n"
+                    "searches it as you type, and ENTER jumps to the next match. ESC goes back.\n\n", CRDEF_PROGRAM);
             pdprint("During execution, the ROM is free to print things to the console where this\n"
                     "program is running. Messages from the console will appear in ", CRDEF_PROGRAM);
             pdprint(                                                              "yellow", CRDEF_PRINT);
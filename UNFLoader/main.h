@@ -44,10 +44,13 @@
     typedef unsigned char  u8;
     typedef unsigned short u16;
     typedef unsigned int   u32;
+    typedef unsigned long long u64;
     typedef char           s8;
     typedef short          s16;
     typedef int            s32;
 
+    typedef struct logfile logfile_t; // Defined in logwriter.cpp
+
 
     /*********************************
                  Globals
@@ -59,14 +62,24 @@
     extern bool    global_listenmode;
     extern bool    global_debugmode;
     extern bool    global_networkmode;
-    extern bool    global_z64;
+    extern int     global_byteorder;
+    extern bool    global_romcache;
+    extern bool    global_fixcrc;
+    extern bool    global_verify;
     extern char*   global_debugout;
-    extern FILE*   global_debugoutptr;
+    extern logfile_t* global_debugoutptr;
+    extern u64     global_logsize;
+    extern time_t  global_logtime;
+    extern int     global_logsync;
+    extern bool    global_logzip;
+    extern char*   global_sessionout;
+    extern char*   global_videoout;
+    extern int     global_screenshotformat;
+    extern int     global_pnglevel;
     extern char*   global_exportpath;
     extern time_t  global_timeout;
     extern time_t  global_timeouttime;
     extern bool    global_closefail;
     extern char*   global_filename;
-    extern WINDOW* global_window;
 
 #endif
\ No newline at end of file
@@ -10,6 +10,8 @@ Handles USB I/O for networking.
 #include "helper.h"
 #include "device.h"
 #include "network.h"
+#include "usbreader.h"
+#include "logwriter.h"
 
 #include <curl/curl.h>
 #include <enet/enet.h>
@@ -31,14 +33,14 @@ Handles USB I/O for networking.
        Function Prototypes
 *********************************/
 
-void network_decidedata(ftdi_context_t* cart, u32 info, char* buffer, u32* read);
-void network_handle_udp_start_server(ftdi_context_t* cart, u32 size, char* buffer, u32* read);
-void network_handle_udp_connect(ftdi_context_t* cart, u32 size, char* buffer, u32* read);
-void network_handle_udp_disconnect(ftdi_context_t* cart, u32 size, char* buffer, u32* read);
-void network_handle_udp_send(ftdi_context_t* cart, u32 size, char* buffer, u32* read);
-void network_handle_url_fetch(ftdi_context_t* cart, u32 size, char* buffer, u32* read);
-void network_handle_url_post(ftdi_context_t* cart, u32 size, char* buffer, u32* read);
-void network_handle_text(ftdi_context_t* cart, u32 size, char* buffer, u32* read);
+void network_decidedata(usbpacket_t* packet);
+void network_handle_udp_start_server(u8* data, u32 size);
+void network_handle_udp_connect(u8* data, u32 size);
+void network_handle_udp_disconnect(u8* data, u32 size);
+void network_handle_udp_send(u8* data, u32 size);
+void network_handle_url_fetch(u8* data, u32 size);
+void network_handle_url_post(u8* data, u32 size);
+void network_handle_text(u8* data, u32 size);
 size_t network_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
 
 typedef struct MemoryWriteCallback {
@@ -75,10 +77,8 @@ NetworkType network_type;
 void network_main(ftdi_context_t *cart)
 {
     int i;
-    int alignment;
-    char *outbuff, *inbuff;
+    char *inbuff;
     u16 cursorpos = 0;
-    DWORD pending = 0;
     WINDOW* inputwin = newwin(1, getmaxx(stdscr), getmaxy(stdscr)-1, 0);
 
     network_type = NT_NOTHING;
@@ -88,19 +88,18 @@ void network_main(ftdi_context_t *cart)
         pdprint("Network mode started. Press ESC to stop or wait for timeout.\n\n", CRDEF_INPUT, global_timeout);
     else
         pdprint("Network mode started. Press ESC to stop.\n\n", CRDEF_INPUT);
-    timeout(0);
+    nodelay(inputwin, TRUE); // Keys are read from the input bar, as reading from stdscr would draw it every time
     curs_set(0);
-    keypad(stdscr, TRUE);
+    keypad(inputwin, TRUE);
 
     // Initialize our buffers
-    outbuff = (char*) malloc(BUFFER_SIZE);
     inbuff = (char*) malloc(BUFFER_SIZE);
     memset(inbuff, 0, BUFFER_SIZE);
 
     // Open file for debug output
     if (global_debugout != NULL)
     {
-        global_debugoutptr = fopen(global_debugout, "w+");
+        global_debugoutptr = logwriter_open(global_debugout, false);
         if (global_debugoutptr == NULL)
         {
             pdprint("\n", CRDEF_ERROR);
@@ -108,14 +107,6 @@ void network_main(ftdi_context_t *cart)
         }
     }
 
-    // Decide the alignment based off the cart that's connected
-    switch (cart->carttype)
-    {
-        case CART_EVERDRIVE: alignment = 16; break;
-        case CART_SC64: alignment = 4; break;
-        default: alignment = 0;
-    }
-
     // init cURL for URL fetch
     curl_global_init(CURL_GLOBAL_DEFAULT);
 
@@ -123,64 +114,37 @@ void network_main(ftdi_context_t *cart)
     if (enet_initialize () != 0)
         terminate("Error initializing ENet");
 
+    // Start receiving packets
+    usbreader_start(cart, 1);
+
     // Start the network server loop
     for ( ; ; ) 
 	{
-        int ch = getch();
+        int ch = wgetch(inputwin);
 
         // If ESC is pressed, stop the loop
 		if (ch == 27 || (global_timeout != 0 && global_timeouttime < time(NULL)))
 			break;
 
-        // Check if we have pending data
-        FT_GetQueueStatus(cart->handle, &pending);
-        if (pending > 0)
+        // Check if we have a packet
+        usbpacket_t packet;
+        if (usbreader_pop(0, &packet))
         {
-            u32 info, read = 0;
             #if VERBOSE
-                pdprint("\nReceiving %d bytes\n", CRDEF_INFO, pending);
+                pdprint("\nReceiving %d bytes\n", CRDEF_INFO, packet.info & 0xFFFFFF);
             #endif
 
-            // Ensure we have valid data by reading the header
-            FT_Read(cart->handle, outbuff, 4, &cart->bytes_read);
-            read += cart->bytes_read;
-            if (outbuff[0] != 'D' || outbuff[1] != 'M' || outbuff[2] != 'A' || outbuff[3] != '@')
-                terminate("Unexpected DMA header: %c %c %c %c.", outbuff[0], outbuff[1], outbuff[2], outbuff[3]);
-
-            // Get information about the incoming data
-            FT_Read(cart->handle, outbuff, 4, &cart->bytes_read);
-            read += cart->bytes_read;
-            info = swap_endian(outbuff[3] << 24 | outbuff[2] << 16 | outbuff[1] << 8 | outbuff[0]);
-
             // Decide what to do with the received data
-            network_decidedata(cart, info, outbuff, &read);
-
-            // Read the completion signal
-            FT_Read(cart->handle, outbuff, 4, &cart->bytes_read);
-            read += cart->bytes_read;
-            if (outbuff[0] != 'C' || outbuff[1] != 'M' || outbuff[2] != 'P' || outbuff[3] != 'H')
-                terminate("Did not receive completion signal: %c %c %c %c.", outbuff[0], outbuff[1], outbuff[2], outbuff[3]);
-
-            // Ensure byte alignment by reading X amount of bytes needed
-            if (alignment != 0 && (read % alignment) != 0)
-            {
-                int left = alignment - (read % alignment);
-                FT_Read(cart->handle, outbuff, left, &cart->bytes_read);
-            }
+            network_decidedata(&packet);
+            usbreader_release(0, &packet);
         }
 
-        // If we got no more data, sleep a bit to be kind to the CPU
-        FT_GetQueueStatus(cart->handle, &pending);
-        if (pending == 0)
+        // If we got no more data, draw what was printed and wait for more, or for the network
+        else
         {
+            pdprint_flush(false);
             if (network_type == NT_NOTHING)
-            {
-                #ifndef LINUX
-                    Sleep(10);
-                #else
-                    usleep(10);
-                #endif
-            }
+                usbreader_wait(pdprint_waittime(USBREADER_IDLEWAIT));
             else
             {
                 ENetEvent event;
@@ -219,19 +183,17 @@ void network_main(ftdi_context_t *cart)
         }
     }
 
+    usbreader_stop();
     curl_global_cleanup();
 
     enet_deinitialize();
 
     // Close the debug output file if it exists
-    if (global_debugoutptr != NULL)
-    {
-        fclose(global_debugoutptr);
-        global_debugoutptr = NULL;
-    }
+    logfile_t* outptr = global_debugoutptr;
+    global_debugoutptr = NULL;
+    logwriter_close(outptr);
 
     // Clean up everything
-    free(outbuff);
     free(inbuff);
 
     wclear(inputwin);
@@ -244,27 +206,24 @@ void network_main(ftdi_context_t *cart)
 /*==============================
     network_decidedata
     Decides what function to call based on the command type stored in the info
-    @param A pointer to the cart context
-    @param 4 bytes with the info and size (from the cartridge)
-    @param The buffer to use
-    @param A pointer to a variable that stores the number of bytes read
+    @param A pointer to the packet
 ==============================*/
 
-void network_decidedata(ftdi_context_t* cart, u32 info, char* buffer, u32* read)
+void network_decidedata(usbpacket_t* packet)
 {
-    u8 command = (info >> 24) & 0xFF;
-    u32 size = info & 0xFFFFFF;
+    u8 command = (packet->info >> 24) & 0xFF;
+    u32 size = packet->info & 0xFFFFFF;
 
     // Decide what to do with the data based off the command type
     switch (command)
     {
-        case NETTYPE_TEXT:             network_handle_text(cart, size, buffer, read); break;
-        case NETTYPE_UDP_START_SERVER: network_handle_udp_start_server(cart, size, buffer, read); break;
-        case NETTYPE_UDP_CONNECT:      network_handle_udp_connect(cart, size, buffer, read); break;
-        case NETTYPE_UDP_DISCONNECT:   network_handle_udp_disconnect(cart, size, buffer, read); break;
-        case NETTYPE_UDP_SEND:         network_handle_udp_send(cart, size, buffer, read); break;
-        case NETTYPE_URL_FETCH:        network_handle_url_fetch(cart, size, buffer, read); break;
-        case NETTYPE_URL_POST:         network_handle_url_post(cart, size, buffer, read); break;
+        case NETTYPE_TEXT:             network_handle_text(packet->data, size); break;
+        case NETTYPE_UDP_START_SERVER: network_handle_udp_start_server(packet->data, size); break;
+        case NETTYPE_UDP_CONNECT:      network_handle_udp_connect(packet->data, size); break;
+        case NETTYPE_UDP_DISCONNECT:   network_handle_udp_disconnect(packet->data, size); break;
+        case NETTYPE_UDP_SEND:         network_handle_udp_send(packet->data, size); break;
+        case NETTYPE_URL_FETCH:        network_handle_url_fetch(packet->data, size); break;
+        case NETTYPE_URL_POST:         network_handle_url_post(packet->data, size); break;
         default:                       printf("Unknown data type: %d", command);
     }
 }
@@ -273,39 +232,15 @@ void network_decidedata(ftdi_context_t* cart, u32 info, char* buffer, u32* read)
 /*==============================
     network_handle_url_fetch
     Handles NETTYPE_URL_FETCH
-    @param A pointer to the cart context
+    @param The incoming data
     @param The size of the incoming data
-    @param The buffer to use
-    @param A pointer to a variable that stores the number of bytes read
 ==============================*/
 
-void network_handle_url_fetch(ftdi_context_t* cart, u32 size, char* buffer, u32* read)
+void network_handle_url_fetch(u8* data, u32 size)
 {
-    int total = 0;
-    int left = size;
-
-    // Ensure the data fits within our buffer
-    if (left > BUFFER_SIZE)
-        left = BUFFER_SIZE;
-
-    // Read bytes until we finished
-    while (left != 0)
-    {
-        // Read from the USB and print it
-        FT_Read(cart->handle, buffer, left, &cart->bytes_read);
-        #if VERBOSE
-        pdprint("%.*s", CRDEF_PRINT, cart->bytes_read, buffer);
-        #endif
-
-        // Store the amount of bytes read
-        (*read) += cart->bytes_read;
-        total += cart->bytes_read;
-
-        // Ensure the data fits within our buffer
-        left = size - total;
-        if (left > BUFFER_SIZE)
-            left = BUFFER_SIZE;
-    }
+    #if VERBOSE
+    pdprint("%.*s", CRDEF_PRINT, size, data);
+    #endif
 
     CURLcode res;
     MemoryWriteCallback data_buffer;
@@ -316,7 +251,7 @@ void network_handle_url_fetch(ftdi_context_t* cart, u32 size, char* buffer, u32*
     if (!curl)
         terminate("Error loading cURL");
 
-    std::string url(buffer, 0, size);
+    std::string url((char*)data, size);
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, network_write_callback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&data_buffer);
@@ -353,45 +288,21 @@ size_t network_write_callback(char *contents, size_t size, size_t nmemb, void *u
 /*==============================
     network_handle_url_post
     Handles NETTYPE_URL_POST
-    @param A pointer to the cart context
+    @param The incoming data
     @param The size of the incoming data
-    @param The buffer to use
-    @param A pointer to a variable that stores the number of bytes read
 ==============================*/
 
-void network_handle_url_post(ftdi_context_t* cart, u32 size, char* buffer, u32* read)
+void network_handle_url_post(u8* data, u32 size)
 {
-    int total = 0;
-    int left = size;
-
-    // Ensure the data fits within our buffer
-    if (left > BUFFER_SIZE)
-        left = BUFFER_SIZE;
-
-    // Read bytes until we finished
-    while (left != 0)
-    {
-        // Read from the USB and print it
-        FT_Read(cart->handle, buffer, left, &cart->bytes_read);
-        #if VERBOSE
-        pdprint("%.*s", CRDEF_PRINT, cart->bytes_read, buffer);
-        #endif
-
-        // Store the amount of bytes read
-        (*read) += cart->bytes_read;
-        total += cart->bytes_read;
-
-        // Ensure the data fits within our buffer
-        left = size - total;
-        if (left > BUFFER_SIZE)
-            left = BUFFER_SIZE;
-    }
+    #if VERBOSE
+    pdprint("%.*s", CRDEF_PRINT, size, data);
+    #endif
 
     curl = curl_easy_init();
     if (!curl)
         terminate("Error loading cURL");
 
-    std::string url(buffer, 0, size);
+    std::string url((char*)data, size);
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
     curl_easy_setopt(curl, CURLOPT_POST, 1);
     curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, 0);
@@ -419,76 +330,28 @@ void network_handle_url_post(ftdi_context_t* cart, u32 size, char* buffer, u32*
 /*==============================
     network_handle_text
     Handles NETTYPE_TEXT
-    @param A pointer to the cart context
+    @param The incoming data
     @param The size of the incoming data
-    @param The buffer to use
-    @param A pointer to a variable that stores the number of bytes read
 ==============================*/
 
-void network_handle_text(ftdi_context_t* cart, u32 size, char* buffer, u32* read)
+void network_handle_text(u8* data, u32 size)
 {
-    int total = 0;
-    int left = size;
-
-    // Ensure the data fits within our buffer
-    if (left > BUFFER_SIZE)
-        left = BUFFER_SIZE;
-
-    // Read bytes until we finished
-    while (left != 0)
-    {
-        // Read from the USB and print it
-        FT_Read(cart->handle, buffer, left, &cart->bytes_read);
-        pdprint("%.*s", CRDEF_PRINT, cart->bytes_read, buffer);
-
-        // Store the amount of bytes read
-        (*read) += cart->bytes_read;
-        total += cart->bytes_read;
-
-        // Ensure the data fits within our buffer
-        left = size - total;
-        if (left > BUFFER_SIZE)
-            left = BUFFER_SIZE;
-    }
+    pdprint("%.*s", CRDEF_PRINT, size, data);
 }
 
 
 /*==============================
     network_handle_udp_start_server
     Handles NETTYPE_UDP_START_SERVER
-    @param A pointer to the cart context
+    @param The incoming data
     @param The size of the incoming data
-    @param The buffer to use
-    @param A pointer to a variable that stores the number of bytes read
 ==============================*/
 
-void network_handle_udp_start_server(ftdi_context_t* cart, u32 size, char* buffer, u32* read)
+void network_handle_udp_start_server(u8* data, u32 size)
 {
-    int total = 0;
-    int left = size;
-
-    // Ensure the data fits within our buffer
-    if (left > BUFFER_SIZE)
-        left = BUFFER_SIZE;
-
-    // Read bytes until we finished
-    while (left != 0)
-    {
-        // Read from the USB and print it
-        FT_Read(cart->handle, buffer, left, &cart->bytes_read);
-        #if VERBOSE
-        pdprint("%.*s", CRDEF_PRINT, cart->bytes_read, buffer);
-        #endif
-
-        // Store the amount of bytes read
-        (*read) += cart->bytes_read;
-        total += cart->bytes_read;
-
-        // Ensure the data fits within our buffer
-        left = size - total;
-        if (left > BUFFER_SIZE)
-            left = BUFFER_SIZE;
-    }
+    #if VERBOSE
+    pdprint("%.*s", CRDEF_PRINT, size, data);
+    #endif
 
     if (network_type != NT_NOTHING)
     {
@@ -497,7 +360,7 @@ void network_handle_udp_start_server(ftdi_context_t* cart, u32 size, char* buffe
     }
 
     address.host = ENET_HOST_ANY;
-    address.port = std::stoi(std::string(buffer));
+    address.port = std::stoi(std::string((char*)data));
     network_type = NT_SERVER;
 
     #if VERBOSE
@@ -519,39 +382,15 @@ void network_handle_udp_start_server(ftdi_context_t* cart, u32 size, char* buffe
 /*==============================
     network_handle_udp_connect
     Handles NETTYPE_UDP_CONNECT
-    @param A pointer to the cart context
+    @param The incoming data
     @param The size of the incoming data
-    @param The buffer to use
-    @param A pointer to a variable that stores the number of bytes read
 ==============================*/
 
-void network_handle_udp_connect(ftdi_context_t* cart, u32 size, char* buffer, u32* read)
+void network_handle_udp_connect(u8* data, u32 size)
 {
-    int total = 0;
-    int left = size;
-
-    // Ensure the data fits within our buffer
-    if (left > BUFFER_SIZE)
-        left = BUFFER_SIZE;
-
-    // Read bytes until we finished
-    while (left != 0)
-    {
-        // Read from the USB and print it
-        FT_Read(cart->handle, buffer, left, &cart->bytes_read);
-        #if VERBOSE
-        pdprint("%.*s", CRDEF_PRINT, cart->bytes_read, buffer);
-        #endif
-
-        // Store the amount of bytes read
-        (*read) += cart->bytes_read;
-        total += cart->bytes_read;
-
-        // Ensure the data fits within our buffer
-        left = size - total;
-        if (left > BUFFER_SIZE)
-            left = BUFFER_SIZE;
-    }
+    #if VERBOSE
+    pdprint("%.*s", CRDEF_PRINT, size, data);
+    #endif
 
     if (network_type != NT_NOTHING)
     {
@@ -559,7 +398,7 @@ void network_handle_udp_connect(ftdi_context_t* cart, u32 size, char* buffer, u3
         return;
     }
 
-    std::string full_address(buffer);
+    std::string full_address((char*)data);
     int colon_pos = full_address.find(":");
 
     enet_address_set_host(&address, full_address.substr(0, colon_pos).c_str());
@@ -608,13 +447,11 @@ void network_handle_udp_connect(ftdi_context_t* cart, u32 size, char* buffer, u3
 /*==============================
     network_handle_udp_disconnect
     Handles NETTYPE_UDP_DISCONNECT
-    @param A pointer to the cart context
+    @param The incoming data
     @param The size of the incoming data
-    @param The buffer to use
-    @param A pointer to a variable that stores the number of bytes read
 ==============================*/
 
-void network_handle_udp_disconnect(ftdi_context_t* cart, u32 size, char* buffer, u32* read)
+void network_handle_udp_disconnect(u8* data, u32 size)
 {
     if (network_type == NT_SERVER)
     {
@@ -667,39 +504,15 @@ void network_handle_udp_disconnect(ftdi_context_t* cart, u32 size, char* buffer,
 /*==============================
     network_handle_udp_send
     Handles NETTYPE_UDP_SEND
-    @param A pointer to the cart context
+    @param The incoming data
     @param The size of the incoming data
-    @param The buffer to use
-    @param A pointer to a variable that stores the number of bytes read
 ==============================*/
 
-void network_handle_udp_send(ftdi_context_t* cart, u32 size, char* buffer, u32* read)
+void network_handle_udp_send(u8* data, u32 size)
 {
-    int total = 0;
-    int left = size;
-
-    // Ensure the data fits within our buffer
-    if (left > BUFFER_SIZE)
-        left = BUFFER_SIZE;
-
-    // Read bytes until we finished
-    while (left != 0)
-    {
-        // Read from the USB and print it
-        FT_Read(cart->handle, buffer, left, &cart->bytes_read);
-        #if VERBOSE
-        pdprint("%.*s", CRDEF_PRINT, cart->bytes_read, buffer);
-        #endif
-
-        // Store the amount of bytes read
-        (*read) += cart->bytes_read;
-        total += cart->bytes_read;
-
-        // Ensure the data fits within our buffer
-        left = size - total;
-        if (left > BUFFER_SIZE)
-            left = BUFFER_SIZE;
-    }
+    #if VERBOSE
+    pdprint("%.*s", CRDEF_PRINT, size, data);
+    #endif
 
     if (network_type == NT_NOTHING)
     {
@@ -707,11 +520,11 @@ void network_handle_udp_send(ftdi_context_t* cart, u32 size, char* buffer, u32*
         return;
     }
 
-    ENetPacket* packet = enet_packet_create(buffer, size, 0);
+    ENetPacket* enetpacket = enet_packet_create(data, size, 0);
     if (network_type == NT_SERVER)
-        enet_host_broadcast(host, 0, packet);
+        enet_host_broadcast(host, 0, enetpacket);
     else
-        enet_peer_send(peer, 0, packet);
+        enet_peer_send(peer, 0, enetpacket);
         
     #if VERBOSE
     pdprint("Data sent", CRDEF_INFO);
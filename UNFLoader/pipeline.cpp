@@ -0,0 +1,314 @@
+/***************************************************************
+                          pipeline.cpp
+
+Overlaps reading the ROM, converting its byte order and writing
+it to the flashcart. A reader thread fills buffers from disk, a
+conversion thread converts them to big endian, and the flashcart
+backend drains them, so the disk, the CPU and the USB link all
+stay busy at the same time. If the ROM is memory mapped, chunks
+are converted straight out of the mapping, or point into it if
+no conversion is needed. The conversion thread also calculates
+the ROM's checksum as the chunks go by.
+***************************************************************/
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "main.h"
+#include "helper.h"
+#include "romfile.h"
+#include "pipeline.h"
+#include "byteorder.h"
+#include "checksum.h"
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define QUEUE_END   -1 // Pushed after the last chunk
+#define QUEUE_ABORT -2 // Returned when the pipeline is being torn down
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef struct {
+    int items[PIPELINE_BUFFERS+1];
+    int head;
+    int count;
+} pipeline_queue_t;
+
+struct pipeline_s {
+    romfile_t* rom;
+    u32   romsize;
+    u32   chunksize;
+    int   byteorder;
+    bool  zerocopy;
+    bool  readfail;
+    bool  stopping;
+    checksum_t* checksum;
+    pipeline_chunk_t chunks[PIPELINE_BUFFERS];
+    u8*   buffers[PIPELINE_BUFFERS];
+    const u8* sources[PIPELINE_BUFFERS]; // Where the converter reads each chunk from
+    pipeline_queue_t freequeue;  // Buffers waiting to be filled by the reader
+    pipeline_queue_t readqueue;  // Buffers waiting to be converted
+    pipeline_queue_t readyqueue; // Buffers waiting to be sent to the cart
+    std::mutex lock;
+    std::condition_variable signal;
+    std::thread reader;
+    std::thread converter;
+};
+
+
+/*==============================
+    pipeline_push
+    Adds a buffer index to one of the pipeline's queues
+    @param A pointer to the pipeline
+    @param The queue to push to
+    @param The buffer index (or QUEUE_END)
+==============================*/
+
+static void pipeline_push(pipeline_t* pipe, pipeline_queue_t* queue, int item)
+{
+    std::lock_guard<std::mutex> guard(pipe->lock);
+    queue->items[(queue->head+queue->count)%(PIPELINE_BUFFERS+1)] = item;
+    queue->count++;
+    pipe->signal.notify_all();
+}
+
+
+/*==============================
+    pipeline_pop
+    Waits for a buffer index to show up in one of the pipeline's queues
+    @param A pointer to the pipeline
+    @param The queue to pop from
+    @returns The buffer index, QUEUE_END, or QUEUE_ABORT
+==============================*/
+
+static int pipeline_pop(pipeline_t* pipe, pipeline_queue_t* queue)
+{
+    int item;
+    std::unique_lock<std::mutex> guard(pipe->lock);
+    pipe->signal.wait(guard, [&]{return queue->count > 0 || pipe->stopping;});
+    if (pipe->stopping)
+        return QUEUE_ABORT;
+    item = queue->items[queue->head];
+    queue->head = (queue->head+1)%(PIPELINE_BUFFERS+1);
+    queue->count--;
+    return item;
+}
+
+
+/*==============================
+    pipeline_thread_reader
+    Reads the ROM from disk into free buffers
+    @param A pointer to the pipeline
+==============================*/
+
+static void pipeline_thread_reader(pipeline_t* pipe)
+{
+    u32 offset;
+
+    for (offset=0; offset<pipe->romsize; offset+=pipe->chunksize)
+    {
+        int index = pipeline_pop(pipe, &pipe->freequeue);
+        pipeline_chunk_t* chunk;
+        u32 filebytes = 0;
+        if (index == QUEUE_ABORT)
+            return;
+        chunk = &pipe->chunks[index];
+
+        // Decide how many bytes go in this chunk
+        chunk->offset = offset;
+        chunk->size = pipe->romsize-offset;
+        if (chunk->size > pipe->chunksize)
+            chunk->size = pipe->chunksize;
+        if (offset < pipe->rom->size)
+        {
+            filebytes = pipe->rom->size-offset;
+            if (filebytes > chunk->size)
+                filebytes = chunk->size;
+        }
+
+        // If the chunk is entirely inside the mapped file, have the OS start paging it in
+        if (pipe->rom->data != NULL && filebytes == chunk->size)
+        {
+            pipe->sources[index] = pipe->rom->data+offset;
+            romfile_prefetch(pipe->rom, offset, chunk->size);
+
+            // If it doesn't need converting, we can just point to it
+            if (pipe->zerocopy)
+            {
+                chunk->data = pipe->rom->data+offset;
+                pipeline_push(pipe, &pipe->readqueue, index);
+                continue;
+            }
+        }
+        else
+            pipe->sources[index] = NULL;
+
+        // Otherwise, the chunk needs a buffer of its own
+        if (pipe->buffers[index] == NULL)
+        {
+            pipe->buffers[index] = (u8*) malloc(pipe->chunksize);
+            if (pipe->buffers[index] == NULL)
+            {
+                pipe->readfail = true;
+                pipeline_push(pipe, &pipe->readqueue, QUEUE_END);
+                return;
+            }
+        }
+        chunk->data = pipe->buffers[index];
+
+        // The converter reads mapped chunks directly, so only copy the ones that aren't
+        if (pipe->sources[index] == NULL)
+        {
+            // Read what's left of the file, and pad the rest of the chunk with zeroes
+            if (romfile_read(pipe->rom, offset, chunk->data, filebytes) != filebytes)
+                pipe->readfail = true;
+            if (filebytes < chunk->size)
+                memset(chunk->data+filebytes, 0, chunk->size-filebytes);
+            pipe->sources[index] = chunk->data;
+        }
+        pipeline_push(pipe, &pipe->readqueue, index);
+    }
+    pipeline_push(pipe, &pipe->readqueue, QUEUE_END);
+}
+
+
+/*==============================
+    pipeline_thread_converter
+    Converts the byte order of the buffers that were read,
+    and runs the checksum over them
+    @param A pointer to the pipeline
+==============================*/
+
+static void pipeline_thread_converter(pipeline_t* pipe)
+{
+    for ( ; ; )
+    {
+        int index = pipeline_pop(pipe, &pipe->readqueue);
+        if (index == QUEUE_ABORT)
+            return;
+
+        // Convert the chunk if needed, and pass it to the writer
+        if (index != QUEUE_END)
+        {
+            pipeline_chunk_t* chunk = &pipe->chunks[index];
+            if (!pipe->zerocopy)
+                byteorder_convert(chunk->data, pipe->sources[index], chunk->size, pipe->byteorder);
+            if (pipe->checksum != NULL)
+                checksum_update(pipe->checksum, chunk->data, chunk->offset, chunk->size);
+        }
+        else if (pipe->checksum != NULL)
+            checksum_finish(pipe->checksum);
+        pipeline_push(pipe, &pipe->readyqueue, index);
+        if (index == QUEUE_END)
+            return;
+    }
+}
+
+
+/*==============================
+    pipeline_start
+    Starts reading and converting the ROM in the background
+    @param A pointer to the ROM
+    @param How many bytes to send in total (padded with zeroes past the file size)
+    @param The size of each chunk
+    @param The BYTEORDER_ value of the ROM
+    @param A pointer to the checksum to calculate, or NULL
+    @returns A pointer to the new pipeline
+==============================*/
+
+pipeline_t* pipeline_start(romfile_t* rom, u32 romsize, u32 chunksize, int byteorder, checksum_t* checksum)
+{
+    int i;
+    pipeline_t* pipe = new pipeline_t();
+
+    // Initialize the pipeline
+    pipe->rom = rom;
+    pipe->romsize = romsize;
+    pipe->chunksize = chunksize;
+    pipe->byteorder = byteorder;
+    pipe->zerocopy = (rom->data != NULL && byteorder == BYTEORDER_Z64);
+    pipe->readfail = false;
+    pipe->stopping = false;
+    pipe->checksum = checksum;
+    if (checksum != NULL)
+        checksum_start(checksum);
+
+    // All buffers start out as free. Their memory is only allocated if the chunks need to be copied
+    for (i=0; i<PIPELINE_BUFFERS; i++)
+    {
+        pipe->buffers[i] = NULL;
+        pipe->freequeue.items[i] = i;
+    }
+    pipe->freequeue.count = PIPELINE_BUFFERS;
+
+    // Start the worker threads
+    pipe->reader = std::thread(pipeline_thread_reader, pipe);
+    pipe->converter = std::thread(pipeline_thread_converter, pipe);
+    return pipe;
+}
+
+
+/*==============================
+    pipeline_next
+    Waits for the next chunk to be ready to send
+    @param A pointer to the pipeline
+    @returns A pointer to the chunk, or NULL if the whole ROM was
+             sent or it couldn't be read
+==============================*/
+
+pipeline_chunk_t* pipeline_next(pipeline_t* pipe)
+{
+    int index = pipeline_pop(pipe, &pipe->readyqueue);
+    if (index < 0 || pipe->readfail)
+        return NULL;
+    return &pipe->chunks[index];
+}
+
+
+/*==============================
+    pipeline_release
+    Gives a chunk back to the reader once it was sent
+    @param A pointer to the pipeline
+    @param A pointer to the chunk returned by pipeline_next
+==============================*/
+
+void pipeline_release(pipeline_t* pipe, pipeline_chunk_t* chunk)
+{
+    pipeline_push(pipe, &pipe->freequeue, (int)(chunk-pipe->chunks));
+}
+
+
+/*==============================
+    pipeline_stop
+    Stops the worker threads and frees the pipeline
+    @param A pointer to the pipeline
+    @returns Whether the ROM could be read
+==============================*/
+
+bool pipeline_stop(pipeline_t* pipe)
+{
+    int i;
+    bool success;
+
+    // Wake up and wait for the workers
+    {
+        std::lock_guard<std::mutex> guard(pipe->lock);
+        pipe->stopping = true;
+        pipe->signal.notify_all();
+    }
+    pipe->reader.join();
+    pipe->converter.join();
+    success = !pipe->readfail;
+
+    // Free the buffers
+    for (i=0; i<PIPELINE_BUFFERS; i++)
+        free(pipe->buffers[i]);
+    delete pipe;
+    return success;
+}
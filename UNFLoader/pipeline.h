@@ -0,0 +1,37 @@
+#ifndef __PIPELINE_HEADER
+#define __PIPELINE_HEADER
+
+    #include "romfile.h"
+    #include "checksum.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define PIPELINE_BUFFERS 3
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct {
+        u8* data;   // The (already converted) bytes of this chunk
+        u32 size;   // How many bytes are in this chunk
+        u32 offset; // Where this chunk starts in the ROM
+    } pipeline_chunk_t;
+
+    typedef struct pipeline_s pipeline_t;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    pipeline_t*       pipeline_start(romfile_t* rom, u32 romsize, u32 chunksize, int byteorder, checksum_t* checksum);
+    pipeline_chunk_t* pipeline_next(pipeline_t* pipe);
+    void              pipeline_release(pipeline_t* pipe, pipeline_chunk_t* chunk);
+    bool              pipeline_stop(pipeline_t* pipe);
+
+#endif
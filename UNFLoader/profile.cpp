@@ -0,0 +1,121 @@
+/***************************************************************
+                           profile.cpp
+
+Stores the transfer settings that were found to be the fastest
+for each flashcart, keyed by the serial number of its USB chip.
+Each line of the profile file has the serial number, followed by
+the chunk size, USB transfer size, and latency timer.
+***************************************************************/
+
+#include "main.h"
+#include "helper.h"
+#include "profile.h"
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define LINE_SIZE 256
+
+
+/*==============================
+    profile_load
+    Looks for the transfer settings of a cart
+    @param A string with the serial number of the cart
+    @param A pointer to the profile to fill in
+    @returns Whether the cart had any settings stored
+==============================*/
+
+bool profile_load(const char* serial, profile_t* profile)
+{
+    char  line[LINE_SIZE];
+    char* path = gen_configpath(PROFILE_FILENAME);
+    FILE* fp;
+    bool  found = false;
+    if (path == NULL)
+        return false;
+
+    // Open the profile file, if there is one
+    fp = fopen(path, "r");
+    free(path);
+    if (fp == NULL)
+        return false;
+
+    // Look for the line with our serial number
+    while (!found && fgets(line, LINE_SIZE, fp) != NULL)
+    {
+        char name[LINE_SIZE];
+        profile_t read;
+        if (sscanf(line, "%255s %u %u %u", name, &read.chunksize, &read.transfersize, &read.latency) == 4 && !strcmp(name, serial))
+        {
+            *profile = read;
+            found = true;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+
+/*==============================
+    profile_save
+    Stores the transfer settings of a cart, replacing
+    the ones that were there before
+    @param A string with the serial number of the cart
+    @param A pointer to the profile to store
+    @returns Whether the settings were stored
+==============================*/
+
+bool profile_save(const char* serial, profile_t* profile)
+{
+    char  line[LINE_SIZE];
+    char* path = gen_configpath(PROFILE_FILENAME);
+    char* temppath;
+    FILE* fp;
+    FILE* tempfp;
+    if (path == NULL)
+        return false;
+
+    // Write the new file next to the old one, so that the old one survives if something goes wrong
+    temppath = (char*) malloc(strlen(path)+5);
+    if (temppath == NULL)
+    {
+        free(path);
+        return false;
+    }
+    sprintf(temppath, "%s.tmp", path);
+    tempfp = fopen(temppath, "w");
+    if (tempfp == NULL)
+    {
+        free(temppath);
+        free(path);
+        return false;
+    }
+
+    // Copy over the settings of the other carts
+    fp = fopen(path, "r");
+    if (fp != NULL)
+    {
+        while (fgets(line, LINE_SIZE, fp) != NULL)
+        {
+            char name[LINE_SIZE];
+            if (sscanf(line, "%255s", name) == 1 && strcmp(name, serial) != 0)
+                fputs(line, tempfp);
+        }
+        fclose(fp);
+    }
+
+    // Add ours, and replace the old file
+    fprintf(tempfp, "%s %u %u %u\n", serial, profile->chunksize, profile->transfersize, profile->latency);
+    fclose(tempfp);
+    if (!replace_file(temppath, path))
+    {
+        free(temppath);
+        free(path);
+        return false;
+    }
+    free(temppath);
+    free(path);
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef __PROFILE_HEADER
+#define __PROFILE_HEADER
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define PROFILE_FILENAME "profiles.txt"
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct {
+        u32 chunksize;    // How many bytes to upload at a time (0 to use the backend's default)
+        u32 transfersize; // The USB transfer size given to FT_SetUSBParameters (0 to leave it alone)
+        u32 latency;      // The latency timer given to FT_SetLatencyTimer, in milliseconds (0 to leave it alone)
+    } profile_t;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    bool profile_load(const char* serial, profile_t* profile);
+    bool profile_save(const char* serial, profile_t* profile);
+
+#endif
@@ -0,0 +1,353 @@
+/***************************************************************
+                           romcache.cpp
+
+Keeps copies of ROMs that were already prepared for a flashcart
+(converted to big endian, padded and patched) in UNFLoader's
+config folder, along with the CIC that was detected in them.
+They're looked up by a hash of the ROM's contents and of the
+settings that change the image, so uploading the same build
+again, to another cart or after reconnecting, skips all the
+preprocessing. The index file lists the images from least to
+most recently used, with the CIC of each one.
+***************************************************************/
+
+#include "main.h"
+#include "helper.h"
+#include "device.h"
+#include "device_everdrive.h"
+#include "byteorder.h"
+#include "delta.h"
+#include "romcache.h"
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define LINE_SIZE      256
+#define NAME_SIZE      64
+#define MAX_INDEX      64          // How many index lines to read at most
+#define ROMCACHE_BLOCK 1024*1024   // How many bytes to hash or convert at a time
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef struct {
+    char name[NAME_SIZE];
+    int  cic;
+} romcache_entry_t;
+
+
+/*==============================
+    romcache_hash
+    Hashes the contents of a ROM
+    @param A pointer to the ROM
+    @param A pointer to store the hash in
+    @returns Whether the whole ROM could be read
+==============================*/
+
+static bool romcache_hash(romfile_t* rom, u64* hash)
+{
+    u32 offset;
+    u64 blockhashes[2];
+    u8* buffer = NULL;
+
+    // Hash the ROM a block at a time, and chain the block hashes together
+    blockhashes[0] = rom->size;
+    if (rom->data == NULL)
+    {
+        buffer = (u8*) malloc(ROMCACHE_BLOCK);
+        if (buffer == NULL)
+            return false;
+    }
+    for (offset=0; offset<rom->size; offset+=ROMCACHE_BLOCK)
+    {
+        u32 size = rom->size-offset;
+        if (size > ROMCACHE_BLOCK)
+            size = ROMCACHE_BLOCK;
+        if (rom->data != NULL)
+            blockhashes[1] = delta_hash(rom->data+offset, size);
+        else if (romfile_read(rom, offset, buffer, size) == size)
+            blockhashes[1] = delta_hash(buffer, size);
+        else
+        {
+            free(buffer);
+            return false;
+        }
+        blockhashes[0] = delta_hash((u8*)blockhashes, sizeof(blockhashes));
+    }
+    free(buffer);
+    *hash = blockhashes[0];
+    return true;
+}
+
+
+/*==============================
+    romcache_readindex
+    Reads the list of cached images
+    @param An array to store the entries in
+    @returns The number of entries that were read
+==============================*/
+
+static int romcache_readindex(romcache_entry_t* entries)
+{
+    char  line[LINE_SIZE];
+    char* path = gen_configpath(ROMCACHE_INDEX);
+    FILE* fp;
+    int   count = 0;
+    if (path == NULL)
+        return 0;
+
+    // Open the index file, if there is one
+    fp = fopen(path, "r");
+    free(path);
+    if (fp == NULL)
+        return 0;
+
+    // Read the entries in order
+    while (count < MAX_INDEX && fgets(line, LINE_SIZE, fp) != NULL)
+        if (sscanf(line, "%63s %d", entries[count].name, &entries[count].cic) == 2)
+            count++;
+    fclose(fp);
+    return count;
+}
+
+
+/*==============================
+    romcache_writeindex
+    Replaces the list of cached images
+    @param An array with the entries
+    @param The number of entries
+==============================*/
+
+static void romcache_writeindex(romcache_entry_t* entries, int count)
+{
+    int   i;
+    char* path = gen_configpath(ROMCACHE_INDEX);
+    char* temppath;
+    FILE* fp;
+    if (path == NULL)
+        return;
+
+    // Write the new file next to the old one, so that the old one survives if something goes wrong
+    temppath = (char*) malloc(strlen(path)+5);
+    if (temppath == NULL)
+    {
+        free(path);
+        return;
+    }
+    sprintf(temppath, "%s.tmp", path);
+    fp = fopen(temppath, "w");
+    if (fp != NULL)
+    {
+        for (i=0; i<count; i++)
+            fprintf(fp, "%s %d\n", entries[i].name, entries[i].cic);
+        fclose(fp);
+        replace_file(temppath, path);
+    }
+    free(temppath);
+    free(path);
+}
+
+
+/*==============================
+    romcache_use
+    Marks an image as the most recently used one, adding it
+    to the index if asked to. The least recently used images
+    are deleted if there are too many
+    @param The filename of the image
+    @param A pointer to the CIC of the image. It's filled in
+           if the image is already in the index
+    @param Whether to add the image if it isn't in the index
+    @returns Whether the image is in the index now
+==============================*/
+
+static bool romcache_use(const char* name, int* cic, bool add)
+{
+    int  i, count;
+    bool found = false;
+    romcache_entry_t* entries = (romcache_entry_t*) malloc(sizeof(romcache_entry_t)*(MAX_INDEX+1));
+    if (entries == NULL)
+        return false;
+
+    // Take our image out of the list
+    count = romcache_readindex(entries);
+    for (i=0; i<count; i++)
+    {
+        if (!strcmp(entries[i].name, name))
+        {
+            if (!add)
+                *cic = entries[i].cic;
+            memmove(&entries[i], &entries[i+1], sizeof(romcache_entry_t)*(count-i-1));
+            count--;
+            found = true;
+            break;
+        }
+    }
+    if (!found && !add)
+    {
+        free(entries);
+        return false;
+    }
+
+    // Put it back at the end, and forget about the oldest images
+    strcpy(entries[count].name, name);
+    entries[count].cic = *cic;
+    count++;
+    while (count > ROMCACHE_ENTRIES)
+    {
+        char* path = gen_configpath(entries[0].name);
+        if (path != NULL)
+        {
+            remove(path);
+            free(path);
+        }
+        memmove(&entries[0], &entries[1], sizeof(romcache_entry_t)*(count-1));
+        count--;
+    }
+    romcache_writeindex(entries, count);
+    free(entries);
+    return true;
+}
+
+
+/*==============================
+    romcache_prepare
+    Writes a prepared copy of a ROM
+    @param A pointer to the ROM
+    @param A string with the path to write the image to
+    @param The size of the image
+    @param The CART_ value of the flashcart
+    @param A pointer to store the detected CIC in
+    @returns Whether the image was written
+==============================*/
+
+static bool romcache_prepare(romfile_t* rom, const char* path, u32 size, int carttype, int* cic)
+{
+    u32   offset;
+    bool  success = true;
+    char* temppath = (char*) malloc(strlen(path)+5);
+    u8*   buffer = (u8*) malloc(ROMCACHE_BLOCK);
+    FILE* fp = NULL;
+    if (temppath != NULL)
+    {
+        sprintf(temppath, "%s.tmp", path);
+        fp = fopen(temppath, "wb");
+    }
+    if (buffer == NULL || fp == NULL)
+    {
+        if (fp != NULL)
+            fclose(fp);
+        free(temppath);
+        free(buffer);
+        return false;
+    }
+
+    // Convert the ROM a block at a time, padding it with zeroes
+    *cic = -1;
+    for (offset=0; offset<size && success; offset+=ROMCACHE_BLOCK)
+    {
+        u32 count = size-offset;
+        u32 filebytes;
+        if (count > ROMCACHE_BLOCK)
+            count = ROMCACHE_BLOCK;
+        filebytes = romfile_read(rom, offset, buffer, count);
+        if (filebytes < count)
+            memset(buffer+filebytes, 0, count-filebytes);
+        byteorder_convert(buffer, buffer, count, global_byteorder);
+
+        // Patch the header and find out the CIC
+        if (offset == 0)
+        {
+            if (carttype == CART_EVERDRIVE && global_savetype != 0)
+                device_patchrom_everdrive(buffer);
+            if (count >= 0x1000)
+                *cic = cic_from_hash(romhash(buffer+0x40, 4032));
+        }
+        success = (fwrite(buffer, 1, count, fp) == count);
+    }
+    if (fclose(fp) != 0)
+        success = false;
+
+    // Put the image in place once it's complete
+    if (success)
+        success = replace_file(temppath, path);
+    else
+        remove(temppath);
+    free(temppath);
+    free(buffer);
+    return success;
+}
+
+
+/*==============================
+    romcache_open
+    Swaps a ROM for its prepared copy from the cache,
+    preparing and storing it if it isn't there yet
+    @param A pointer to the ROM. If it's swapped, it's closed
+    @param The CART_ value of the flashcart
+    @returns A pointer to the prepared ROM, or the original one
+             if it couldn't be cached
+==============================*/
+
+romfile_t* romcache_open(romfile_t* rom, int carttype)
+{
+    char  name[NAME_SIZE];
+    char* path;
+    u64   hash;
+    u32   size = rom->size;
+    u32   savetype = 0;
+    int   cic = -1;
+    bool  cached;
+    romfile_t* prepared = NULL;
+
+    // The EverDrive gets a padded ROM with the save type in its header
+    if (carttype == CART_EVERDRIVE)
+    {
+        size = calc_padsize(size);
+        savetype = global_savetype;
+    }
+    else if (global_byteorder == BYTEORDER_N64 && size % 4 != 0)
+        size += 4 - size % 4; // Same as device_uploadfile, so the last half word ends up in place
+
+    // Find where the image would be stored
+    if (!romcache_hash(rom, &hash))
+        return rom;
+    snprintf(name, NAME_SIZE, "romcache-%016llx-%d-%u.z64", hash, carttype, savetype);
+    path = gen_configpath(name);
+    if (path == NULL)
+        return rom;
+
+    // Use the image if it's there, otherwise make it
+    cached = romcache_use(name, &cic, false);
+    if (cached)
+    {
+        prepared = romfile_open(path);
+        if (prepared != NULL && prepared->size != size)
+        {
+            romfile_close(prepared);
+            prepared = NULL;
+        }
+    }
+    if (prepared == NULL && romcache_prepare(rom, path, size, carttype, &cic))
+    {
+        romcache_use(name, &cic, true);
+        prepared = romfile_open(path);
+        cached = false;
+    }
+    free(path);
+    if (prepared == NULL)
+        return rom;
+
+    // Swap the ROMs
+    if (cached)
+        pdprint("Using the prepared ROM from the cache.\n", CRDEF_PROGRAM);
+    else
+        pdprint("Stored the prepared ROM in the cache.\n", CRDEF_PROGRAM);
+    romfile_close(rom);
+    prepared->prepared = true;
+    prepared->cic = cic;
+    return prepared;
+}
@@ -0,0 +1,21 @@
+#ifndef __ROMCACHE_HEADER
+#define __ROMCACHE_HEADER
+
+    #include "romfile.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define ROMCACHE_INDEX   "romcache.txt"
+    #define ROMCACHE_ENTRIES 8 // How many prepared images to keep around
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    romfile_t* romcache_open(romfile_t* rom, int carttype);
+
+#endif
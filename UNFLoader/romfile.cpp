@@ -0,0 +1,213 @@
+/***************************************************************
+                           romfile.cpp
+
+Gives the flashcart backends access to the ROM. Where possible
+the file is memory mapped, so unconverted ROMs go from the page
+cache straight to USB without being copied. Otherwise, it falls
+back to buffered reads. In listen mode, the ROM is read into
+memory instead, since the build can rewrite it mid upload.
+***************************************************************/
+
+#include "main.h"
+#include "helper.h"
+#include "romfile.h"
+#include "byteorder.h"
+#ifdef LINUX
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+
+/*==============================
+    romfile_open
+    Opens a ROM for uploading
+    @param A string with the path to the ROM
+    @returns A pointer to the opened ROM, or NULL if it couldn't be opened
+==============================*/
+
+romfile_t* romfile_open(const char* path)
+{
+    romfile_t* rom = (romfile_t*) calloc(1, sizeof(romfile_t));
+    if (rom == NULL)
+        return NULL;
+    rom->path = strdup(path);
+    rom->cic = -1;
+    if (rom->path == NULL)
+    {
+        free(rom);
+        return NULL;
+    }
+
+    // Try to memory map the file. It's mapped privately so that backends can patch the header without touching the file
+    // A private mapping still faults if the file is truncated, so listen mode, where the linker rewrites the ROM, doesn't map it
+    #ifdef LINUX
+        rom->fd = global_listenmode ? -1 : open(path, O_RDONLY);
+        if (rom->fd >= 0)
+        {
+            struct stat finfo;
+            if (fstat(rom->fd, &finfo) == 0 && finfo.st_size > 0)
+            {
+                void* map = mmap(NULL, finfo.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, rom->fd, 0);
+                rom->size = (u32)finfo.st_size;
+                if (map != MAP_FAILED)
+                {
+                    madvise(map, finfo.st_size, MADV_SEQUENTIAL);
+                    rom->data = (u8*)map;
+                    return rom;
+                }
+            }
+            close(rom->fd);
+            rom->fd = -1;
+        }
+    #endif
+
+    // Fall back to buffered reads
+    rom->file = fopen(path, "rb");
+    if (rom->file == NULL)
+    {
+        free(rom->path);
+        free(rom);
+        return NULL;
+    }
+
+    // Get the filesize and reset the position
+    // Workaround for https://stackoverflow.com/questions/32452777/visual-c-2015-express-stat-not-working-on-windows-xp
+    fseek(rom->file, 0, SEEK_END);
+    rom->size = ftell(rom->file);
+    fseek(rom->file, 0, SEEK_SET);
+
+    // In listen mode, take a snapshot of the ROM so that a rebuild can't change it while it's being sent
+    if (global_listenmode && rom->size > 0)
+    {
+        rom->data = (u8*) malloc(rom->size);
+        if (rom->data != NULL)
+        {
+            rom->size = (u32)fread(rom->data, 1, rom->size, rom->file); // If the build truncated it meanwhile, the watcher will see it change again
+            rom->allocated = true;
+            fclose(rom->file);
+            rom->file = NULL;
+        }
+    }
+    return rom;
+}
+
+
+/*==============================
+    romfile_convert
+    Reads a whole ROM into memory and converts it to big endian,
+    so that several uploads can share it without converting it
+    again. The original ROM is closed
+    @param A pointer to the ROM
+    @param The byte order of the ROM
+    @returns A pointer to the ROM in memory, or NULL if it couldn't be read
+==============================*/
+
+romfile_t* romfile_convert(romfile_t* rom, int byteorder)
+{
+    romfile_t* copy = (romfile_t*) calloc(1, sizeof(romfile_t));
+    u32 padded = rom->size+(4-rom->size%4)%4;
+    if (copy == NULL)
+    {
+        romfile_close(rom);
+        return NULL;
+    }
+    copy->path = strdup(rom->path);
+    copy->size = (byteorder == BYTEORDER_N64) ? padded : rom->size; // The last half word of a word swapped ROM only lines up once padded
+    copy->cic = -1;
+    copy->allocated = true;
+    #ifdef LINUX
+        copy->fd = -1;
+    #endif
+
+    // Read the ROM, with the last word padded with zeroes
+    copy->data = (u8*) calloc(1, padded);
+    if (copy->path == NULL || copy->data == NULL || romfile_read(rom, 0, copy->data, rom->size) != rom->size)
+    {
+        romfile_close(copy);
+        romfile_close(rom);
+        return NULL;
+    }
+    romfile_close(rom);
+
+    // Convert it where it is
+    byteorder_convert(copy->data, copy->data, padded, byteorder);
+    return copy;
+}
+
+
+/*==============================
+    romfile_read
+    Copies part of the ROM into a buffer
+    @param A pointer to the ROM
+    @param The offset to start reading from
+    @param The buffer to copy to
+    @param The number of bytes to copy
+    @returns The number of bytes that were copied
+==============================*/
+
+u32 romfile_read(romfile_t* rom, u32 offset, u8* dest, u32 size)
+{
+    // Don't read past the end of the file
+    if (offset >= rom->size)
+        return 0;
+    if (size > rom->size-offset)
+        size = rom->size-offset;
+
+    // Copy the data
+    if (rom->data != NULL)
+    {
+        memcpy(dest, rom->data+offset, size);
+        return size;
+    }
+    if (ftell(rom->file) != (long)offset)
+        fseek(rom->file, offset, SEEK_SET);
+    return (u32)fread(dest, 1, size, rom->file);
+}
+
+
+/*==============================
+    romfile_prefetch
+    Hints that part of a memory mapped ROM will be needed soon
+    @param A pointer to the ROM
+    @param The offset of the data
+    @param The number of bytes
+==============================*/
+
+void romfile_prefetch(romfile_t* rom, u32 offset, u32 size)
+{
+    #ifdef LINUX
+        if (rom->data != NULL && offset < rom->size)
+        {
+            u32 pagemask = (u32)sysconf(_SC_PAGESIZE)-1;
+            u32 start = offset & ~pagemask;
+            if (size > rom->size-offset)
+                size = rom->size-offset;
+            madvise(rom->data+start, size+(offset-start), MADV_WILLNEED);
+        }
+    #endif
+}
+
+
+/*==============================
+    romfile_close
+    Closes the ROM
+    @param A pointer to the ROM
+==============================*/
+
+void romfile_close(romfile_t* rom)
+{
+    if (rom->allocated)
+        free(rom->data);
+    #ifdef LINUX
+        if (!rom->allocated && rom->data != NULL)
+        {
+            munmap(rom->data, rom->size);
+            close(rom->fd);
+        }
+    #endif
+    if (rom->file != NULL)
+        fclose(rom->file);
+    free(rom->path);
+    free(rom);
+}
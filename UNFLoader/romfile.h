@@ -0,0 +1,33 @@
+#ifndef __ROMFILE_HEADER
+#define __ROMFILE_HEADER
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct {
+        char* path;
+        u8*   data;  // The memory mapped ROM, or NULL if we're reading with file
+        FILE* file;  // Used when the ROM could not be memory mapped
+        u32   size;
+        bool  prepared; // Whether this is an image from the ROM cache, which needs no more preprocessing
+        s16   cic;      // The CIC detected when the image was prepared
+        bool  allocated; // Whether the data is a converted copy in memory, rather than memory mapped
+        #ifdef LINUX
+            int fd;
+        #endif
+    } romfile_t;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    romfile_t* romfile_open(const char* path);
+    romfile_t* romfile_convert(romfile_t* rom, int byteorder);
+    u32        romfile_read(romfile_t* rom, u32 offset, u8* dest, u32 size);
+    void       romfile_prefetch(romfile_t* rom, u32 offset, u32 size);
+    void       romfile_close(romfile_t* rom);
+
+#endif
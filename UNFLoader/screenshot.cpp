@@ -0,0 +1,746 @@
+/***************************************************************
+                          screenshot.cpp
+
+Turns the framebuffers that the carts send into image files on
+a pool of worker threads, so that debug mode only has to hand the
+framebuffer over and can go straight back to reading USB. The
+16-bit pixel conversion kernel (AVX2, SSE2 or plain C) is picked
+at runtime based on what the CPU supports. The images can be
+saved as PNG (with a tunable compression level), QOI, BMP or PPM,
+trading disk space for speed. Debug mode prints which screenshots
+were saved once they're done, so that the messages go to the
+right cart's output.
+***************************************************************/
+
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <stdarg.h>
+#pragma warning(push, 0)
+    #include "Include/lodepng.h"
+#pragma warning(pop)
+#include "main.h"
+#include "helper.h"
+#include "debug.h"
+#include "screenshot.h"
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define SCREENSHOT_X86
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #define TARGET(isa)
+    #else
+        #define TARGET(isa) __attribute__((target(isa)))
+    #endif
+#endif
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef void (*screenshot_func)(u8* dest, const u8* src, u32 pixels);
+
+typedef struct {
+    const char*     name;
+    screenshot_func convert16;
+} screenshot_kernel_t;
+
+typedef struct {
+    LodePNGState png; // Set up once per worker, so the PNG settings aren't redone for every screenshot
+    u8*  buffer;      // Where the other formats build the file
+    u32  capacity;
+} screenshotstate_t;
+
+typedef bool (*screenshot_writer)(screenshotstate_t* state, const char* path, const u8* image, u32 w, u32 h);
+
+typedef struct {
+    const char*       name;
+    const char*       extension;
+    screenshot_writer write;
+} screenshot_format_t;
+
+typedef struct {
+    int   cart;
+    int   header[HEADER_SIZE];
+    u8*   data; // The framebuffer, which the worker frees
+    u32   size;
+    char* path;
+} screenshotjob_t;
+
+typedef struct screenshotdone {
+    int    cart;
+    short  color;
+    char*  message;
+    struct screenshotdone* next;
+} screenshotdone_t;
+
+
+/*********************************
+             Globals
+*********************************/
+
+static std::mutex local_lock;
+static std::condition_variable local_wake;  // Wakes up the workers when there's a screenshot to encode
+static std::condition_variable local_room;  // Wakes up debug mode when there's room in the queue
+static screenshotjob_t local_jobs[SCREENSHOT_QUEUE];
+static u32  local_jobhead = 0; // Where the next screenshot goes
+static u32  local_jobtail = 0; // The next screenshot to encode
+static bool local_stop = false;
+static std::thread* local_workers[SCREENSHOT_WORKERS];
+static int  local_workercount = 0;
+static screenshotdone_t* local_donehead = NULL; // The screenshots that are done, oldest first
+static screenshotdone_t* local_donetail = NULL;
+
+
+/*==============================
+    screenshot_convert16_scalar
+    Converts RGBA5551 pixels, stored big endian, to RGBA8888
+    @param The buffer to write to
+    @param The buffer to read from
+    @param The number of pixels
+==============================*/
+
+static void screenshot_convert16_scalar(u8* dest, const u8* src, u32 pixels)
+{
+    u32 i;
+    for (i=0; i<pixels; i++)
+    {
+        u16 pixel = (src[2*i] << 8) | src[2*i+1];
+        dest[4*i]   = (pixel >> 8) & 0xF8; // R
+        dest[4*i+1] = (pixel >> 3) & 0xF8; // G
+        dest[4*i+2] = (pixel << 2) & 0xF8; // B
+        dest[4*i+3] = 0xFF;
+    }
+}
+
+
+#ifdef SCREENSHOT_X86
+
+/*==============================
+    screenshot_convert16_sse2
+    SSE2 version of screenshot_convert16_scalar
+==============================*/
+
+TARGET("sse2") static void screenshot_convert16_sse2(u8* dest, const u8* src, u32 pixels)
+{
+    u32 i;
+    const __m128i mask = _mm_set1_epi16(0xF8);
+    const __m128i alpha = _mm_set1_epi16((short)0xFF00);
+    for (i=0; i+8<=pixels; i+=8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src+2*i));
+        __m128i pixel = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        __m128i r = _mm_and_si128(_mm_srli_epi16(pixel, 8), mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(pixel, 3), mask);
+        __m128i b = _mm_and_si128(_mm_slli_epi16(pixel, 2), mask);
+        __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+        __m128i ba = _mm_or_si128(b, alpha);
+        _mm_storeu_si128((__m128i*)(dest+4*i), _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i*)(dest+4*i+16), _mm_unpackhi_epi16(rg, ba));
+    }
+    screenshot_convert16_scalar(dest+4*i, src+2*i, pixels-i);
+}
+
+
+/*==============================
+    screenshot_convert16_avx2
+    AVX2 version of screenshot_convert16_scalar
+==============================*/
+
+TARGET("avx2") static void screenshot_convert16_avx2(u8* dest, const u8* src, u32 pixels)
+{
+    u32 i;
+    const __m256i mask = _mm256_set1_epi16(0xF8);
+    const __m256i alpha = _mm256_set1_epi16((short)0xFF00);
+    for (i=0; i+16<=pixels; i+=16)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src+2*i));
+        __m256i pixel = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+        __m256i r = _mm256_and_si256(_mm256_srli_epi16(pixel, 8), mask);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi16(pixel, 3), mask);
+        __m256i b = _mm256_and_si256(_mm256_slli_epi16(pixel, 2), mask);
+        __m256i rg = _mm256_or_si256(r, _mm256_slli_epi16(g, 8));
+        __m256i ba = _mm256_or_si256(b, alpha);
+        __m256i lo = _mm256_unpacklo_epi16(rg, ba); // Pixels 0-3 and 8-11, as unpacking stays within each half
+        __m256i hi = _mm256_unpackhi_epi16(rg, ba); // Pixels 4-7 and 12-15
+        _mm256_storeu_si256((__m256i*)(dest+4*i), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i*)(dest+4*i+32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    screenshot_convert16_scalar(dest+4*i, src+2*i, pixels-i);
+}
+
+#endif
+
+
+/*==============================
+    screenshot_pick
+    Picks the fastest conversion kernel this CPU supports
+    @returns A pointer to the kernel
+==============================*/
+
+static const screenshot_kernel_t* screenshot_pick()
+{
+    static const screenshot_kernel_t scalar = {"scalar", screenshot_convert16_scalar};
+    #ifdef SCREENSHOT_X86
+        static const screenshot_kernel_t sse2 = {"SSE2", screenshot_convert16_sse2};
+        static const screenshot_kernel_t avx2 = {"AVX2", screenshot_convert16_avx2};
+        if (cpu_has_avx2())
+            return &avx2;
+        if (cpu_has_sse2())
+            return &sse2;
+    #endif
+    return &scalar;
+}
+
+
+/*==============================
+    screenshot_convertto
+    Converts a framebuffer to an RGBA image, in a buffer that
+    was already allocated. Pixels the cart didn't send are
+    left black
+    @param The buffer to store the image in, which needs to
+           fit 4 bytes per pixel
+    @param The data header that came before the framebuffer
+    @param The framebuffer
+    @param The size of the framebuffer
+==============================*/
+
+void screenshot_convertto(u8* image, int* header, const u8* data, u32 size)
+{
+    static const screenshot_kernel_t* kernel = screenshot_pick();
+    u32 w = header[2], h = header[3];
+    u32 total = w*h, pixels;
+
+    // Convert the framebuffer, stopping if the cart sent more than fits in the image
+    if (header[1] == 2)
+    {
+        pixels = (size/4 < total/2) ? (size/4)*2 : (total/2)*2; // The cart sends pixels in pairs
+        kernel->convert16(image, data, pixels);
+    }
+    else
+    {
+        pixels = (size/4 < total) ? size/4 : total;
+        memcpy(image, data, 4*pixels); // Already RGBA8888, in the right order
+    }
+    memset(image+4*pixels, 0, 4*(total-pixels));
+}
+
+
+/*==============================
+    screenshot_convert
+    Converts a framebuffer to an RGBA image
+    @param The data header that came before the framebuffer
+    @param The framebuffer
+    @param The size of the framebuffer
+    @returns The image, which needs to be freed, or NULL
+==============================*/
+
+u8* screenshot_convert(int* header, const u8* data, u32 size)
+{
+    u8* image = (u8*) malloc(4*header[2]*header[3]);
+    if (image == NULL)
+        return NULL;
+    screenshot_convertto(image, header, data, size);
+    return image;
+}
+
+
+/*==============================
+    screenshot_put
+    Stores a number in a file's header
+    @param Where to store it
+    @param The number to store
+    @param How many bytes to store it in
+    @param Whether to store it big endian instead of
+           little endian
+==============================*/
+
+static void screenshot_put(u8* buffer, u32 value, int size, bool bigendian)
+{
+    int i;
+    for (i=0; i<size; i++)
+        buffer[bigendian ? size-1-i : i] = (u8)(value >> (i*8));
+}
+
+
+/*==============================
+    screenshot_reserve
+    Makes sure a worker's buffer is big enough for a file
+    @param A pointer to the worker's state
+    @param The most the file can take up
+    @returns The buffer, or NULL if it couldn't be grown
+==============================*/
+
+static u8* screenshot_reserve(screenshotstate_t* state, u32 size)
+{
+    if (state->capacity < size)
+    {
+        u8* buffer = (u8*) realloc(state->buffer, size);
+        if (buffer == NULL)
+            return NULL;
+        state->buffer = buffer;
+        state->capacity = size;
+    }
+    return state->buffer;
+}
+
+
+/*==============================
+    screenshot_savefile
+    Writes a file in one go
+    @param The path to write it to
+    @param The file's contents
+    @param The size of the file
+    @returns Whether it was written
+==============================*/
+
+static bool screenshot_savefile(const char* path, const u8* data, u32 size)
+{
+    FILE* fp = fopen(path, "wb");
+    bool written;
+    if (fp == NULL)
+        return false;
+    written = (fwrite(data, 1, size, fp) == size);
+    return (fclose(fp) == 0) && written;
+}
+
+
+/*==============================
+    screenshot_writepng
+    Saves an image as a PNG, with the worker's encoder
+    settings
+    @param A pointer to the worker's state
+    @param The path to save it to
+    @param The RGBA image
+    @param The width of the image
+    @param The height of the image
+    @returns Whether it was saved
+==============================*/
+
+static bool screenshot_writepng(screenshotstate_t* state, const char* path, const u8* image, u32 w, u32 h)
+{
+    u8* png;
+    size_t size;
+    bool written;
+    if (lodepng_encode(&png, &size, image, w, h, &state->png) != 0)
+        return false;
+    written = screenshot_savefile(path, png, size);
+    free(png);
+    return written;
+}
+
+
+/*==============================
+    screenshot_writeqoi
+    Saves an image as a QOI, which is lossless like PNG but
+    much faster to encode
+    @param A pointer to the worker's state
+    @param The path to save it to
+    @param The RGBA image
+    @param The width of the image
+    @param The height of the image
+    @returns Whether it was saved
+==============================*/
+
+static bool screenshot_writeqoi(screenshotstate_t* state, const char* path, const u8* image, u32 w, u32 h)
+{
+    u8 seen[64*4]; // The colors that were seen recently, by their hash
+    u8 prev[4] = {0, 0, 0, 0xFF};
+    u32 i, pixels = w*h, pos = 14;
+    int run = 0;
+    u8* out = screenshot_reserve(state, 14 + 5*pixels + 8);
+    if (out == NULL)
+        return false;
+    memset(seen, 0, sizeof(seen));
+
+    // Write the header
+    memcpy(out, "qoif", 4);
+    screenshot_put(out+4, w, 4, true);
+    screenshot_put(out+8, h, 4, true);
+    out[12] = 4; // RGBA
+    out[13] = 0; // sRGB
+
+    // Encode every pixel as a run, a recently seen color, a difference from the last one, or the color itself
+    for (i=0; i<pixels; i++)
+    {
+        const u8* px = image + 4*i;
+        int hash;
+        if (!memcmp(px, prev, 4))
+        {
+            run++;
+            if (run == 62 || i == pixels-1)
+            {
+                out[pos++] = 0xC0 | (run-1);
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0)
+        {
+            out[pos++] = 0xC0 | (run-1);
+            run = 0;
+        }
+        hash = (px[0]*3 + px[1]*5 + px[2]*7 + px[3]*11) % 64;
+        if (!memcmp(seen+4*hash, px, 4))
+            out[pos++] = hash;
+        else
+        {
+            memcpy(seen+4*hash, px, 4);
+            if (px[3] == prev[3])
+            {
+                signed char dr = px[0]-prev[0], dg = px[1]-prev[1], db = px[2]-prev[2];
+                signed char dgr = dr-dg, dgb = db-dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                    out[pos++] = 0x40 | (dr+2)<<4 | (dg+2)<<2 | (db+2);
+                else if (dgr >= -8 && dgr <= 7 && dg >= -32 && dg <= 31 && dgb >= -8 && dgb <= 7)
+                {
+                    out[pos++] = 0x80 | (dg+32);
+                    out[pos++] = (dgr+8)<<4 | (dgb+8);
+                }
+                else
+                {
+                    out[pos++] = 0xFE;
+                    memcpy(out+pos, px, 3);
+                    pos += 3;
+                }
+            }
+            else
+            {
+                out[pos++] = 0xFF;
+                memcpy(out+pos, px, 4);
+                pos += 4;
+            }
+        }
+        memcpy(prev, px, 4);
+    }
+
+    // Finish with the end marker
+    memset(out+pos, 0, 7);
+    out[pos+7] = 1;
+    return screenshot_savefile(path, out, pos+8);
+}
+
+
+/*==============================
+    screenshot_writebmp
+    Saves an image as an uncompressed 24-bit BMP
+    @param A pointer to the worker's state
+    @param The path to save it to
+    @param The RGBA image
+    @param The width of the image
+    @param The height of the image
+    @returns Whether it was saved
+==============================*/
+
+static bool screenshot_writebmp(screenshotstate_t* state, const char* path, const u8* image, u32 w, u32 h)
+{
+    u32 x, y;
+    u32 stride = (3*w + 3) & ~3; // Rows are padded to 4 bytes
+    u8* out = screenshot_reserve(state, 54 + stride*h);
+    if (out == NULL)
+        return false;
+
+    // Write the file header and the info header
+    memset(out, 0, 54);
+    memcpy(out, "BM", 2);
+    screenshot_put(out+2, 54 + stride*h, 4, false);
+    screenshot_put(out+10, 54, 4, false);
+    screenshot_put(out+14, 40, 4, false);
+    screenshot_put(out+18, w, 4, false);
+    screenshot_put(out+22, h, 4, false);
+    screenshot_put(out+26, 1, 2, false);  // Planes
+    screenshot_put(out+28, 24, 2, false); // Bits per pixel
+    screenshot_put(out+34, stride*h, 4, false);
+
+    // The rows go from the bottom up, as BGR
+    for (y=0; y<h; y++)
+    {
+        u8* row = out + 54 + (h-1-y)*stride;
+        const u8* px = image + 4*w*y;
+        for (x=0; x<w; x++)
+        {
+            row[3*x]   = px[4*x+2];
+            row[3*x+1] = px[4*x+1];
+            row[3*x+2] = px[4*x];
+        }
+        memset(row+3*w, 0, stride-3*w);
+    }
+    return screenshot_savefile(path, out, 54 + stride*h);
+}
+
+
+/*==============================
+    screenshot_writeppm
+    Saves an image as a binary PPM
+    @param A pointer to the worker's state
+    @param The path to save it to
+    @param The RGBA image
+    @param The width of the image
+    @param The height of the image
+    @returns Whether it was saved
+==============================*/
+
+static bool screenshot_writeppm(screenshotstate_t* state, const char* path, const u8* image, u32 w, u32 h)
+{
+    u32 i, header;
+    u8* out = screenshot_reserve(state, 32 + 3*w*h);
+    if (out == NULL)
+        return false;
+    header = sprintf((char*)out, "P6\n%u %u\n255\n", w, h);
+    for (i=0; i<w*h; i++)
+        memcpy(out + header + 3*i, image + 4*i, 3);
+    return screenshot_savefile(path, out, header + 3*w*h);
+}
+
+
+// The formats screenshots can be saved in, in the order of the SCREENSHOT_ macros
+static const screenshot_format_t local_formats[] = {
+    {"png", ".png", screenshot_writepng},
+    {"qoi", ".qoi", screenshot_writeqoi},
+    {"bmp", ".bmp", screenshot_writebmp},
+    {"ppm", ".ppm", screenshot_writeppm},
+};
+
+
+/*==============================
+    screenshot_format
+    Finds a format screenshots can be saved in
+    @param The name of the format
+    @returns The format's SCREENSHOT_ number, or -1 if
+             there's no format with that name
+==============================*/
+
+int screenshot_format(const char* name)
+{
+    int i;
+    for (i=0; i<(int)(sizeof(local_formats)/sizeof(local_formats[0])); i++)
+        if (!strcmp(local_formats[i].name, name))
+            return i;
+    return -1;
+}
+
+
+/*==============================
+    screenshot_extension
+    Gets the file extension of the format screenshots are
+    being saved in
+    @returns The extension, including the dot
+==============================*/
+
+const char* screenshot_extension()
+{
+    return local_formats[global_screenshotformat].extension;
+}
+
+
+/*==============================
+    screenshot_pngsettings
+    Sets up a PNG encoder for a compression level. Higher
+    levels search further back for repeats, at the cost of
+    speed. Without a level, lodepng's defaults are used
+    @param A pointer to the encoder's state
+    @param The compression level, from 0 (uncompressed) to
+           9, or -1 for the defaults
+==============================*/
+
+static void screenshot_pngsettings(LodePNGState* state, int level)
+{
+    LodePNGCompressSettings* zlib = &state->encoder.zlibsettings;
+    lodepng_state_init(state);
+    if (level < 0)
+        return;
+    state->encoder.filter_strategy = (level < 3) ? LFS_ZERO : LFS_MINSUM;
+    if (level == 0)
+    {
+        zlib->btype = 0;
+        return;
+    }
+    zlib->windowsize = (level >= 8) ? 32768 : (128 << level);
+    zlib->nicematch = (level < 4) ? 32 : (level < 9) ? 128 : 258;
+    zlib->lazymatching = (level >= 4);
+}
+
+
+/*==============================
+    screenshot_done
+    Adds a message for debug mode to print
+    @param The cart that sent the screenshot
+    @param The color to print the message with
+    @param A string to print
+    @param Variadic arguments to print as well
+==============================*/
+
+static void screenshot_done(int cart, short color, const char* str, ...)
+{
+    va_list args;
+    int size;
+    screenshotdone_t* done = (screenshotdone_t*) malloc(sizeof(screenshotdone_t));
+    if (done == NULL)
+        return;
+
+    // Format the message
+    va_start(args, str);
+    size = vsnprintf(NULL, 0, str, args);
+    va_end(args);
+    done->message = (char*) malloc(size+1);
+    if (done->message == NULL)
+    {
+        free(done);
+        return;
+    }
+    va_start(args, str);
+    vsnprintf(done->message, size+1, str, args);
+    va_end(args);
+    done->cart = cart;
+    done->color = color;
+    done->next = NULL;
+
+    // Put it at the end of the list
+    std::lock_guard<std::mutex> guard(local_lock);
+    if (local_donetail != NULL)
+        local_donetail->next = done;
+    else
+        local_donehead = done;
+    local_donetail = done;
+}
+
+
+/*==============================
+    screenshot_worker
+    Encodes screenshots until told to stop and there are
+    none left
+==============================*/
+
+static void screenshot_worker()
+{
+    screenshotstate_t state;
+    screenshot_pngsettings(&state.png, global_pnglevel);
+    state.buffer = NULL;
+    state.capacity = 0;
+    while (true)
+    {
+        screenshotjob_t job;
+        u8* image;
+
+        // Take the next screenshot off the queue
+        {
+            std::unique_lock<std::mutex> guard(local_lock);
+            local_wake.wait(guard, []{return local_stop || local_jobhead != local_jobtail;});
+            if (local_jobhead == local_jobtail)
+                break;
+            job = local_jobs[local_jobtail & (SCREENSHOT_QUEUE-1)];
+            local_jobtail++;
+            local_room.notify_one();
+        }
+
+        // Convert and encode it
+        image = screenshot_convert(job.header, job.data, job.size);
+        free(job.data);
+        if (image == NULL)
+            screenshot_done(job.cart, CRDEF_ERROR, "Unable to allocate memory for %s.\n", job.path);
+        else if (!local_formats[global_screenshotformat].write(&state, job.path, image, job.header[2], job.header[3]))
+            screenshot_done(job.cart, CRDEF_ERROR, "Unable to write %s.\n", job.path);
+        else
+            screenshot_done(job.cart, CRDEF_INFO, "Wrote %dx%d pixels to %s.\n", job.header[2], job.header[3], job.path);
+        free(image);
+        free(job.path);
+    }
+    lodepng_state_cleanup(&state.png);
+    free(state.buffer);
+}
+
+
+/*==============================
+    screenshot_save
+    Queues a framebuffer to be saved as an image. Only waits
+    if the queue is full
+    @param The cart that sent the screenshot
+    @param The data header that came before the framebuffer
+    @param The framebuffer, which is freed once it's saved
+    @param The size of the framebuffer
+    @param The path to save the image to, which is freed too
+==============================*/
+
+void screenshot_save(int cart, int* header, u8* data, u32 size, char* path)
+{
+    screenshotjob_t* job;
+    std::unique_lock<std::mutex> guard(local_lock);
+
+    // Start the workers the first time
+    if (local_workercount == 0)
+    {
+        int count = (int)std::thread::hardware_concurrency();
+        if (count < 1)
+            count = 1;
+        if (count > SCREENSHOT_WORKERS)
+            count = SCREENSHOT_WORKERS;
+        local_stop = false;
+        for (local_workercount=0; local_workercount<count; local_workercount++)
+            local_workers[local_workercount] = new std::thread(screenshot_worker);
+    }
+
+    // Wait for room, then hand it over
+    local_room.wait(guard, []{return local_jobhead - local_jobtail < SCREENSHOT_QUEUE;});
+    job = &local_jobs[local_jobhead & (SCREENSHOT_QUEUE-1)];
+    job->cart = cart;
+    memcpy(job->header, header, sizeof(job->header));
+    job->data = data;
+    job->size = size;
+    job->path = path;
+    local_jobhead++;
+    local_wake.notify_one();
+}
+
+
+/*==============================
+    screenshot_finished
+    Gets the message of a screenshot that's done
+    @param A pointer to store the cart that sent it in
+    @param A pointer to store the color to print with in
+    @param A pointer to store the message in, which needs
+           to be freed
+    @returns Whether there was a screenshot that's done
+==============================*/
+
+bool screenshot_finished(int* cart, short* color, char** message)
+{
+    screenshotdone_t* done;
+    {
+        std::lock_guard<std::mutex> guard(local_lock);
+        done = local_donehead;
+        if (done == NULL)
+            return false;
+        local_donehead = done->next;
+        if (local_donehead == NULL)
+            local_donetail = NULL;
+    }
+    *cart = done->cart;
+    *color = done->color;
+    *message = done->message;
+    free(done);
+    return true;
+}
+
+
+/*==============================
+    screenshot_wait
+    Waits for every queued screenshot to be saved, and stops
+    the workers
+==============================*/
+
+void screenshot_wait()
+{
+    int i;
+    {
+        std::lock_guard<std::mutex> guard(local_lock);
+        local_stop = true;
+        local_wake.notify_all();
+    }
+    for (i=0; i<local_workercount; i++)
+    {
+        local_workers[i]->join();
+        delete local_workers[i];
+    }
+    local_workercount = 0;
+}
+
@@ -0,0 +1,33 @@
+#ifndef __SCREENSHOT_HEADER
+#define __SCREENSHOT_HEADER
+
+    #include "main.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define SCREENSHOT_WORKERS 4  // The most threads that encode screenshots at once
+    #define SCREENSHOT_QUEUE   16 // How many screenshots can wait to be encoded before debug mode has to wait too. Must be a power of two
+
+    // Formats screenshots can be saved in
+    #define SCREENSHOT_PNG 0
+    #define SCREENSHOT_QOI 1
+    #define SCREENSHOT_BMP 2
+    #define SCREENSHOT_PPM 3
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    void screenshot_convertto(u8* image, int* header, const u8* data, u32 size);
+    u8*  screenshot_convert(int* header, const u8* data, u32 size);
+    int  screenshot_format(const char* name);
+    const char* screenshot_extension();
+    void screenshot_save(int cart, int* header, u8* data, u32 size, char* path);
+    bool screenshot_finished(int* cart, short* color, char** message);
+    void screenshot_wait();
+
+#endif
@@ -0,0 +1,482 @@
+/***************************************************************
+                          scrollback.cpp
+
+Keeps everything that's printed, so that debug mode can scroll
+back through it and search it. Lines are appended to big blocks
+of text with an index of where each one starts, so storing a
+line is a copy and nothing more. Once the blocks in memory pass
+SCROLLBACK_MEMORY, new ones are mapped from a temporary file
+instead, leaving it to the OS to decide what stays in memory.
+***************************************************************/
+
+#include <mutex>
+#include "main.h"
+#include "helper.h"
+#include "scrollback.h"
+#ifdef LINUX
+    #include <sys/mman.h>
+#endif
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef struct {
+    u32 block;  // Which block the line is in
+    u32 offset; // Where in the block the line starts
+    u32 info;   // The color (top 8 bits) and size (bottom 24 bits) of the line
+} scrollline_t;
+
+
+/*********************************
+             Globals
+*********************************/
+
+static std::mutex local_lock;
+
+// The stored text
+static u8**          local_blocks = NULL;
+static u32           local_blockcount = 0;
+static u32           local_blocksize = 0;  // How many blocks local_blocks has room for
+static u32           local_blockused = SCROLLBACK_BLOCK; // How much of the last block is used
+static scrollline_t* local_lines = NULL;
+static u32           local_linecount = 0;
+static u32           local_linesize = 0;   // How many lines local_lines has room for
+static bool          local_linestart = true;
+static bool          local_full = false;   // Whether we ran out of memory, and stopped storing lines
+#ifdef LINUX
+    static int local_spillfd = -1;
+    static u32 local_spilled = 0; // How many blocks are in the file
+#endif
+
+// The viewer
+static WINDOW* local_view = NULL;
+static u32     local_bottom = 0;           // The line after the last one shown
+static bool    local_searching = false;
+static char    local_search[SCROLLBACK_SEARCH+1];
+static int     local_searchlen = 0;
+static u32     local_searchfrom = 0;       // The line after the last one the search looks at
+static u32     local_match = 0xFFFFFFFF;   // The line that matched the search
+
+
+/*==============================
+    scrollback_spill
+    Maps a block from the temporary file
+    @returns A pointer to the block, or NULL if it couldn't be mapped
+==============================*/
+
+static u8* scrollback_spill()
+{
+    #ifdef LINUX
+        void* map;
+
+        // Create the file, and delete it straight away so it goes away with us
+        if (local_spillfd == -1)
+        {
+            const char* tmpdir = getenv("TMPDIR");
+            char path[256];
+            snprintf(path, sizeof(path), "%s/unfloader-XXXXXX", (tmpdir != NULL && tmpdir[0] != '\0') ? tmpdir : "/tmp");
+            local_spillfd = mkstemp(path);
+            if (local_spillfd == -1)
+                return NULL;
+            unlink(path);
+        }
+
+        // Grow the file and map the new block
+        if (ftruncate(local_spillfd, (off_t)(local_spilled+1)*SCROLLBACK_BLOCK) != 0)
+            return NULL;
+        map = mmap(NULL, SCROLLBACK_BLOCK, PROT_READ | PROT_WRITE, MAP_SHARED, local_spillfd, (off_t)local_spilled*SCROLLBACK_BLOCK);
+        if (map == MAP_FAILED)
+            return NULL;
+        local_spilled++;
+        return (u8*)map;
+    #else
+        return NULL;
+    #endif
+}
+
+
+/*==============================
+    scrollback_newblock
+    Adds a block to store lines in
+    @returns Whether the block was added
+==============================*/
+
+static bool scrollback_newblock()
+{
+    u8* block = NULL;
+
+    // Make room for the block's pointer
+    if (local_blockcount == local_blocksize)
+    {
+        u32 size = (local_blocksize == 0) ? 64 : local_blocksize*2;
+        u8** blocks = (u8**) realloc(local_blocks, size*sizeof(u8*));
+        if (blocks == NULL)
+            return false;
+        local_blocks = blocks;
+        local_blocksize = size;
+    }
+
+    // Once there's too much in memory, try the file first
+    if ((u64)local_blockcount*SCROLLBACK_BLOCK >= SCROLLBACK_MEMORY)
+        block = scrollback_spill();
+    if (block == NULL)
+        block = (u8*) malloc(SCROLLBACK_BLOCK);
+    if (block == NULL)
+        return false;
+    local_blocks[local_blockcount++] = block;
+    local_blockused = 0;
+    return true;
+}
+
+
+/*==============================
+    scrollback_newline
+    Starts a new line at the end of the last block
+    @param The color of the line
+    @returns Whether the line was started
+==============================*/
+
+static bool scrollback_newline(short color)
+{
+    scrollline_t* line;
+    if (local_linecount == local_linesize)
+    {
+        u32 size = (local_linesize == 0) ? 4096 : local_linesize*2;
+        scrollline_t* lines = (scrollline_t*) realloc(local_lines, size*sizeof(scrollline_t));
+        if (lines == NULL)
+            return false;
+        local_lines = lines;
+        local_linesize = size;
+    }
+    if (local_blockused == SCROLLBACK_BLOCK && !scrollback_newblock())
+        return false;
+    line = &local_lines[local_linecount++];
+    line->block = local_blockcount-1;
+    line->offset = local_blockused;
+    line->info = ((u32)color << 24);
+    return true;
+}
+
+
+/*==============================
+    scrollback_append
+    Adds text to the end of the last line
+    @param The text to add
+    @param The size of the text
+    @returns Whether the text was added
+==============================*/
+
+static bool scrollback_append(const char* text, u32 size)
+{
+    while (size > 0)
+    {
+        scrollline_t* line = &local_lines[local_linecount-1];
+        u32 linesize = line->info & 0xFFFFFF;
+        u32 space = SCROLLBACK_BLOCK - local_blockused;
+        u32 count;
+
+        // If the block is full, move the line to a new one, or split it if it would fill a block by itself
+        if (space == 0)
+        {
+            if (line->offset != 0)
+            {
+                u8* old = local_blocks[line->block] + line->offset;
+                if (!scrollback_newblock())
+                    return false;
+                memcpy(local_blocks[local_blockcount-1], old, linesize);
+                line->block = local_blockcount-1;
+                line->offset = 0;
+                local_blockused = linesize;
+            }
+            else if (!scrollback_newline((short)(line->info >> 24)))
+                return false;
+            continue;
+        }
+
+        // Copy as much as fits
+        count = (size < space) ? size : space;
+        memcpy(local_blocks[local_blockcount-1] + local_blockused, text, count);
+        local_blockused += count;
+        line->info += count;
+        text += count;
+        size -= count;
+    }
+    return true;
+}
+
+
+/*==============================
+    scrollback_add
+    Stores printed text
+    @param The text
+    @param The size of the text
+    @param The color the text was printed with
+==============================*/
+
+void scrollback_add(const char* text, int size, short color)
+{
+    std::lock_guard<std::mutex> guard(local_lock);
+    while (size > 0 && !local_full)
+    {
+        const char* end = (const char*) memchr(text, '\n', size);
+        int count = (end != NULL) ? (int)(end-text) : size;
+
+        // Store the text up to the end of the line
+        if ((local_linestart && !scrollback_newline(color)) || !scrollback_append(text, count))
+        {
+            local_full = true;
+            return;
+        }
+        local_linestart = (end != NULL);
+        if (end != NULL)
+            count++;
+        text += count;
+        size -= count;
+    }
+}
+
+
+/*==============================
+    scrollback_count
+    Gets how many lines are stored
+    @returns The number of lines
+==============================*/
+
+u32 scrollback_count()
+{
+    std::lock_guard<std::mutex> guard(local_lock);
+    return local_linecount;
+}
+
+
+/*==============================
+    scrollback_find
+    Finds the last line before the given one that contains
+    the search text
+    @param The line after the last one to look at
+    @returns The line that matched, or 0xFFFFFFFF
+==============================*/
+
+static u32 scrollback_find(u32 before)
+{
+    std::lock_guard<std::mutex> guard(local_lock);
+    if (local_searchlen == 0)
+        return 0xFFFFFFFF;
+    while (before > 0)
+    {
+        scrollline_t* line = &local_lines[--before];
+        const u8* text = local_blocks[line->block] + line->offset;
+        const u8* end = text + (line->info & 0xFFFFFF);
+
+        // Look for the first character, then check the rest
+        while (end - text >= local_searchlen)
+        {
+            text = (const u8*) memchr(text, local_search[0], (end - text) - local_searchlen + 1);
+            if (text == NULL)
+                break;
+            if (memcmp(text, local_search, local_searchlen) == 0)
+                return before;
+            text++;
+        }
+    }
+    return 0xFFFFFFFF;
+}
+
+
+/*==============================
+    scrollback_draw
+    Draws the lines that are being viewed, and the status bar
+==============================*/
+
+static void scrollback_draw()
+{
+    int i, rows = getmaxy(local_view)-1, cols = getmaxx(local_view);
+    u32 first = (local_bottom > (u32)rows) ? local_bottom - rows : 0, total;
+
+    // Draw the lines
+    std::unique_lock<std::mutex> guard(local_lock);
+    total = local_linecount;
+    for (i=0; i<rows; i++)
+    {
+        u32 index = first + i;
+        wmove(local_view, i, 0);
+        wclrtoeol(local_view);
+        if (index < local_bottom)
+        {
+            scrollline_t* line = &local_lines[index];
+            const char* text = (const char*)local_blocks[line->block] + line->offset;
+            int size = line->info & 0xFFFFFF;
+            short color = (short)(line->info >> 24);
+            if (size > cols)
+                size = cols;
+            wattrset(local_view, (global_usecolors && color != CR_NONE) ? COLOR_PAIR(color) : A_NORMAL);
+            waddnstr(local_view, text, size);
+
+            // Highlight the match
+            if (index == local_match)
+            {
+                const char* found = NULL;
+                int j;
+                for (j=0; j+local_searchlen<=size && found == NULL; j++)
+                    if (memcmp(text+j, local_search, local_searchlen) == 0)
+                        found = text+j;
+                if (found != NULL)
+                    mvwchgat(local_view, i, (int)(found-text), local_searchlen, A_REVERSE, (global_usecolors && color != CR_NONE) ? color : 0, NULL);
+            }
+        }
+    }
+    guard.unlock();
+
+    // Draw the status bar
+    wmove(local_view, rows, 0);
+    wclrtoeol(local_view);
+    wattrset(local_view, A_REVERSE);
+    if (local_searching)
+        wprintw(local_view, "Search: %s%s", local_search, (local_searchlen > 0 && local_match == 0xFFFFFFFF) ? " (not found)" : "");
+    else
+        wprintw(local_view, "Line %u of %u. PgUp/PgDn to scroll, CTRL+F to search, ESC to return.", local_bottom, total);
+    wattrset(local_view, A_NORMAL);
+    pdprint_cover(local_view);
+}
+
+
+/*==============================
+    scrollback_show
+    Scrolls the viewer so that a line can be seen
+    @param The line to show
+==============================*/
+
+static void scrollback_show(u32 index)
+{
+    u32 rows = getmaxy(local_view)-1, count = scrollback_count();
+    if (index >= local_bottom || index + rows < local_bottom)
+        local_bottom = index + rows/2 + 1;
+    if (local_bottom > count)
+        local_bottom = count;
+    if (local_bottom < rows)
+        local_bottom = (count < rows) ? count : rows;
+}
+
+
+/*==============================
+    scrollback_close
+    Closes the viewer, if it's open, and goes back to the
+    printed text
+==============================*/
+
+void scrollback_close()
+{
+    if (local_view == NULL)
+        return;
+    pdprint_cover(NULL);
+    delwin(local_view);
+    local_view = NULL;
+}
+
+
+/*==============================
+    scrollback_key
+    Handles a key press meant for the viewer. PgUp or
+    CTRL+F open it
+    @param The key that was pressed
+    @returns Whether the key was used
+==============================*/
+
+bool scrollback_key(int ch)
+{
+    u32 page, least, count = scrollback_count();
+
+    // Open the viewer at the latest line
+    if (local_view == NULL)
+    {
+        if (ch != KEY_PPAGE && ch != CH_SEARCH)
+            return false;
+        local_view = newwin(LINES-1, COLS, 0, 0);
+        if (local_view == NULL)
+            return false;
+        local_bottom = count;
+        local_searching = false;
+        local_match = 0xFFFFFFFF;
+    }
+    page = getmaxy(local_view)-1;
+    least = (count < page) ? count : page; // Where the bottom is when the first line is at the top
+
+    // Typing a search jumps to the closest line above that matches, and Enter or CTRL+F go to the next one
+    if (local_searching)
+    {
+        bool typed = true;
+        if (isascii(ch) && ch > 0x1F && ch != 0x7F && local_searchlen < SCROLLBACK_SEARCH)
+        {
+            local_search[local_searchlen++] = (char)ch;
+            local_search[local_searchlen] = '\0';
+            local_match = scrollback_find(local_searchfrom);
+        }
+        else if (ch == CH_BACKSPACE || ch == KEY_BACKSPACE || ch == 0x7F)
+        {
+            if (local_searchlen > 0)
+                local_search[--local_searchlen] = '\0';
+            local_match = scrollback_find(local_searchfrom);
+        }
+        else if (ch == CH_ENTER || ch == '\r' || ch == CH_SEARCH)
+        {
+            u32 next = (local_match != 0xFFFFFFFF) ? scrollback_find(local_match) : 0xFFFFFFFF;
+            if (next != 0xFFFFFFFF)
+                local_match = next;
+        }
+        else if (ch == CH_ESCAPE)
+            local_searching = false;
+        else
+            typed = false;
+        if (typed)
+        {
+            if (local_match != 0xFFFFFFFF)
+                scrollback_show(local_match);
+            scrollback_draw();
+            return true;
+        }
+    }
+
+    // Move around
+    switch (ch)
+    {
+        case KEY_PPAGE: local_bottom = (local_bottom > least + page) ? local_bottom - page : least; break;
+        case KEY_NPAGE: local_bottom += page; break;
+        case KEY_UP:    if (local_bottom > least) local_bottom--; break;
+        case KEY_DOWN:  local_bottom++; break;
+        case KEY_HOME:  local_bottom = least; break;
+        case CH_SEARCH:
+            local_searching = true;
+            local_searchfrom = local_bottom;
+            local_searchlen = 0;
+            local_search[0] = '\0';
+            local_match = 0xFFFFFFFF;
+            break;
+        case KEY_END:
+        case CH_ESCAPE:
+            scrollback_close();
+            return true;
+        default:
+            return false;
+    }
+
+    // Scrolling past the latest line goes back to the printed text
+    if (local_bottom > count)
+        scrollback_close();
+    else
+        scrollback_draw();
+    return true;
+}
+
+
+/*==============================
+    scrollback_viewing
+    Checks whether the viewer is open
+    @returns Whether the viewer is open
+==============================*/
+
+bool scrollback_viewing()
+{
+    return local_view != NULL;
+}
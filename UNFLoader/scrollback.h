@@ -0,0 +1,27 @@
+#ifndef __SCROLLBACK_HEADER
+#define __SCROLLBACK_HEADER
+
+    #include "main.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define SCROLLBACK_BLOCK  (1024*1024)      // How big the blocks that lines are stored in are. Longer lines are split
+    #define SCROLLBACK_MEMORY (64*1024*1024)   // How much text is kept in memory before the rest goes to a file
+    #define SCROLLBACK_SEARCH 64               // The longest text that can be searched for
+    #define CH_SEARCH         6                  // CTRL+F, which opens the viewer and starts a search
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    void scrollback_add(const char* text, int size, short color);
+    u32  scrollback_count();
+    bool scrollback_key(int ch);
+    bool scrollback_viewing();
+    void scrollback_close();
+
+#endif
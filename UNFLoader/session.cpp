@@ -0,0 +1,545 @@
+/***************************************************************
+                           session.cpp
+
+Keeps a binary log of a debug session, with a record for every
+packet the carts sent and everything that was sent to them, so
+that a long session can be looked through afterwards without
+grepping the text output. The log is only ever appended to, and
+is written in the background like the text output. Running
+UNFLoader with -query indexes the log (saving the index next to
+it, so the next query only has to index what was added since),
+and then prints the text or exports the binaries and screenshots
+that were received in a range of time.
+***************************************************************/
+
+#include <mutex>
+#include <chrono>
+#pragma warning(push, 0)
+    #include "Include/lodepng.h"
+#pragma warning(pop)
+#include "main.h"
+#include "helper.h"
+#include "debug.h"
+#include "logwriter.h"
+#include "screenshot.h"
+#include "session.h"
+
+
+/*********************************
+              Macros
+*********************************/
+
+#ifndef LINUX
+    #define session_seek(fp, offset) _fseeki64(fp, offset, SEEK_SET)
+#else
+    #define session_seek(fp, offset) fseeko(fp, offset, SEEK_SET)
+#endif
+
+#define INDEX_HEADERSIZE 32 // The magic, when the log's session started, how much of it was indexed, and how many records that was
+#define INDEX_ENTRYSIZE  24
+
+#define QUERY_TEXT       0x01
+#define QUERY_BINARY     0x02
+#define QUERY_SCREENSHOT 0x04
+#define QUERY_SENT       0x08
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef struct {
+    u64 time;   // The time of the first record after the offset
+    u64 offset; // Where in the log the record is
+    u64 record; // The number of the record
+} sessionindex_t;
+
+
+/*********************************
+             Globals
+*********************************/
+
+static logfile_t* local_session = NULL;
+static std::mutex local_sessionlock; // Keeps each record's header and data together
+static std::chrono::steady_clock::time_point local_sessionstart;
+
+
+/*==============================
+    session_put
+    Stores a number little endian
+    @param Where to store it
+    @param The number to store
+    @param How many bytes to store it in
+==============================*/
+
+static void session_put(u8* buffer, u64 value, int size)
+{
+    int i;
+    for (i=0; i<size; i++)
+        buffer[i] = (u8)(value >> (i*8));
+}
+
+
+/*==============================
+    session_get
+    Reads a little endian number
+    @param Where to read it from
+    @param How many bytes it's stored in
+    @returns The number
+==============================*/
+
+static u64 session_get(const u8* buffer, int size)
+{
+    int i;
+    u64 value = 0;
+    for (i=size-1; i>=0; i--)
+        value = (value << 8) | buffer[i];
+    return value;
+}
+
+
+/*==============================
+    session_open
+    Starts the session log, if one was requested
+==============================*/
+
+void session_open()
+{
+    u8 header[SESSION_HEADERSIZE];
+    std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+    if (global_sessionout == NULL)
+        return;
+
+    // Open the file
+    local_session = logwriter_open(global_sessionout, true);
+    if (local_session == NULL)
+    {
+        pdprint("\n", CRDEF_ERROR);
+        terminate("Unable to open %s for writing the session log.", global_sessionout);
+    }
+
+    // Start it with the time the session started
+    local_sessionstart = std::chrono::steady_clock::now();
+    memcpy(header, SESSION_MAGIC, 8);
+    session_put(header+8, std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count(), 8);
+    logwriter_write(local_session, (const char*)header, sizeof(header));
+}
+
+
+/*==============================
+    session_record
+    Adds a record to the session log, if one is open
+    @param The number of the cart that sent the data, or
+           SESSION_HOST if it was sent to the carts
+    @param The DATATYPE_ the data was sent with
+    @param The data
+    @param The size of the data
+==============================*/
+
+void session_record(u8 cart, u8 type, const void* data, u32 size)
+{
+    u8 header[SESSION_RECORDSIZE];
+    if (local_session == NULL)
+        return;
+    std::lock_guard<std::mutex> guard(local_sessionlock);
+    u64 time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - local_sessionstart).count();
+
+    // Write the record's header, followed by the data
+    session_put(header, time, 8);
+    session_put(header+8, size, 4);
+    header[12] = type;
+    header[13] = cart;
+    session_put(header+14, 0, 2);
+    logwriter_write(local_session, (const char*)header, sizeof(header));
+    logwriter_write(local_session, (const char*)data, size);
+}
+
+
+/*==============================
+    session_close
+    Finishes writing the session log
+==============================*/
+
+void session_close()
+{
+    logfile_t* session = local_session;
+    {
+        std::lock_guard<std::mutex> guard(local_sessionlock);
+        local_session = NULL;
+    }
+    logwriter_close(session);
+}
+
+
+/*==============================
+    session_readrecord
+    Reads a record's header from a session log
+    @param The session log
+    @param A pointer to the record to fill in
+    @returns Whether a whole header was read
+==============================*/
+
+static bool session_readrecord(FILE* fp, sessionrecord_t* record)
+{
+    u8 header[SESSION_RECORDSIZE];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header))
+        return false;
+    record->time = session_get(header, 8);
+    record->size = (u32)session_get(header+8, 4);
+    record->type = header[12];
+    record->cart = header[13];
+    record->reserved = (u16)session_get(header+14, 2);
+    return true;
+}
+
+
+/*==============================
+    session_index
+    Loads a session log's index, adding the records that
+    were logged since it was last saved
+    @param The path of the session log
+    @param The session log
+    @param The size of the session log
+    @param When the session started, to tell it apart
+           from other logs that were saved in its place
+    @param A pointer to store the number of entries in
+    @returns The index, which needs to be freed, or NULL
+==============================*/
+
+static sessionindex_t* session_index(const char* path, FILE* fp, u64 logsize, u64 started, u32* count)
+{
+    u8 buffer[INDEX_HEADERSIZE];
+    u64 end = SESSION_HEADERSIZE, records = 0;
+    u32 capacity = 0;
+    sessionindex_t* index = NULL;
+    sessionrecord_t record;
+    char* indexpath = (char*) malloc(strlen(path)+5);
+    FILE* ip;
+    u32 i;
+
+    // Load the saved index, unless it's for another log
+    *count = 0;
+    if (indexpath == NULL)
+        return NULL;
+    sprintf(indexpath, "%s.idx", path);
+    ip = fopen(indexpath, "rb");
+    if (ip != NULL)
+    {
+        if (fread(buffer, 1, INDEX_HEADERSIZE, ip) == INDEX_HEADERSIZE && !memcmp(buffer, SESSION_INDEXMAGIC, 8) && session_get(buffer+8, 8) == started && session_get(buffer+16, 8) <= logsize)
+        {
+            end = session_get(buffer+16, 8);
+            records = session_get(buffer+24, 8);
+            while (fread(buffer, 1, INDEX_ENTRYSIZE, ip) == INDEX_ENTRYSIZE)
+            {
+                if (*count == capacity)
+                {
+                    sessionindex_t* grown;
+                    capacity = (capacity != 0) ? capacity*2 : 1024;
+                    grown = (sessionindex_t*) realloc(index, capacity*sizeof(sessionindex_t));
+                    if (grown == NULL)
+                        break;
+                    index = grown;
+                }
+                index[*count].time = session_get(buffer, 8);
+                index[*count].offset = session_get(buffer+8, 8);
+                index[*count].record = session_get(buffer+16, 8);
+                (*count)++;
+            }
+        }
+        fclose(ip);
+    }
+    if (end == logsize && *count > 0)
+    {
+        free(indexpath);
+        return index;
+    }
+
+    // Index the records that were added since, skipping over their data
+    session_seek(fp, end);
+    while (end + SESSION_RECORDSIZE <= logsize && session_readrecord(fp, &record))
+    {
+        if (end + SESSION_RECORDSIZE + record.size > logsize) // Still being written, or the session was cut short
+            break;
+        if (*count == 0 || end >= index[*count-1].offset + SESSION_INDEXSTEP)
+        {
+            if (*count == capacity)
+            {
+                sessionindex_t* grown;
+                capacity = (capacity != 0) ? capacity*2 : 1024;
+                grown = (sessionindex_t*) realloc(index, capacity*sizeof(sessionindex_t));
+                if (grown == NULL)
+                {
+                    free(index);
+                    free(indexpath);
+                    *count = 0;
+                    return NULL;
+                }
+                index = grown;
+            }
+            index[*count].time = record.time;
+            index[*count].offset = end;
+            index[*count].record = records;
+            (*count)++;
+        }
+        end += SESSION_RECORDSIZE + record.size;
+        records++;
+        session_seek(fp, end);
+    }
+
+    // Save it for next time. It's fine if that fails, it'll just be slower
+    ip = fopen(indexpath, "wb");
+    if (ip != NULL)
+    {
+        memcpy(buffer, SESSION_INDEXMAGIC, 8);
+        session_put(buffer+8, started, 8);
+        session_put(buffer+16, end, 8);
+        session_put(buffer+24, records, 8);
+        fwrite(buffer, 1, INDEX_HEADERSIZE, ip);
+        for (i=0; i<*count; i++)
+        {
+            session_put(buffer, index[i].time, 8);
+            session_put(buffer+8, index[i].offset, 8);
+            session_put(buffer+16, index[i].record, 8);
+            fwrite(buffer, 1, INDEX_ENTRYSIZE, ip);
+        }
+        fclose(ip);
+    }
+    free(indexpath);
+    return index;
+}
+
+
+/*==============================
+    session_export
+    Saves a binary or a screenshot from the session log
+    @param Where to save it, or NULL for the current folder
+    @param What to start the filename with
+    @param The number of the record
+    @param The file extension
+    @param The data to save, or NULL if it's a screenshot
+    @param The size of the data
+    @param The screenshot, if it is one
+    @param The data header that came before the screenshot
+==============================*/
+
+static void session_export(const char* folder, const char* name, u64 record, const char* extension, u8* data, u32 size, u8* image, int* header)
+{
+    FILE* fp;
+    char* path = (char*) malloc((folder != NULL ? strlen(folder) : 0) + strlen(name) + 32);
+    if (path == NULL)
+        return;
+    sprintf(path, "%s%s-%08llu.%s", (folder != NULL) ? folder : "", name, record, extension);
+    if (image != NULL)
+    {
+        if (lodepng_encode32_file(path, image, header[2], header[3]) == 0)
+            fprintf(stderr, "Wrote %dx%d pixels to %s.\n", header[2], header[3], path);
+        else
+            fprintf(stderr, "Unable to write %s.\n", path);
+    }
+    else
+    {
+        fp = fopen(path, "wb");
+        if (fp != NULL && fwrite(data, 1, size, fp) == size)
+            fprintf(stderr, "Wrote %u bytes to %s.\n", size, path);
+        else
+            fprintf(stderr, "Unable to write %s.\n", path);
+        if (fp != NULL)
+            fclose(fp);
+    }
+    free(path);
+}
+
+
+/*==============================
+    session_typename
+    Gets the name of a record's data type
+    @param The DATATYPE_ of the record
+    @returns The name of the type
+==============================*/
+
+static const char* session_typename(u8 type)
+{
+    switch (type)
+    {
+        case DATATYPE_TEXT:       return "text";
+        case DATATYPE_RAWBINARY:  return "binary";
+        case DATATYPE_HEADER:     return "header";
+        case DATATYPE_SCREENSHOT: return "screenshot";
+        default:                  return "unknown";
+    }
+}
+
+
+/*==============================
+    session_query
+    Prints the text and exports the binaries and
+    screenshots from a range of time in a session log.
+    Doesn't touch the console or the flashcart
+    @param The number of extra arguments
+    @param An array with the arguments
+    @returns 0 if the log was read, or 1 otherwise
+==============================*/
+
+int session_query(int argc, char* argv[])
+{
+    int i;
+    FILE* fp;
+    u8 header[SESSION_HEADERSIZE];
+    u64 logsize, offset, recordnum, from = 0, to = (u64)-1;
+    time_t started;
+    const char* path = NULL;
+    const char* folder = NULL;
+    int types = 0;
+    bool list = false;
+    sessionindex_t* index;
+    sessionrecord_t record;
+    u32 count, first;
+    u8* data = NULL;
+    u32 datasize = 0;
+    static int headers[256][HEADER_SIZE]; // The last data header from each cart
+
+    // Read the arguments
+    for (i=1; i<argc; i++)
+    {
+        if (!strcmp(argv[i], "-query") && i+1 < argc)
+            path = argv[++i];
+        else if (!strcmp(argv[i], "-from") && i+1 < argc)
+            from = (u64)(atof(argv[++i])*1000000);
+        else if (!strcmp(argv[i], "-to") && i+1 < argc)
+            to = (u64)(atof(argv[++i])*1000000);
+        else if (!strcmp(argv[i], "-e") && i+1 < argc)
+            folder = argv[++i];
+        else if (!strcmp(argv[i], "-list"))
+            list = true;
+        else if (!strcmp(argv[i], "-type") && i+1 < argc)
+        {
+            i++;
+            if (!strcmp(argv[i], "text"))
+                types |= QUERY_TEXT;
+            else if (!strcmp(argv[i], "binary"))
+                types |= QUERY_BINARY;
+            else if (!strcmp(argv[i], "screenshot"))
+                types |= QUERY_SCREENSHOT;
+            else if (!strcmp(argv[i], "sent"))
+                types |= QUERY_SENT;
+            else
+            {
+                fprintf(stderr, "Unknown record type '%s'.\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Unknown query '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+    if (path == NULL)
+    {
+        fprintf(stderr, "Missing session log (-query <file>).\n");
+        return 1;
+    }
+    if (types == 0)
+        types = QUERY_TEXT | QUERY_BINARY | QUERY_SCREENSHOT;
+
+    // Open the log
+    fp = fopen(path, "rb");
+    if (fp == NULL || fread(header, 1, SESSION_HEADERSIZE, fp) != SESSION_HEADERSIZE || memcmp(header, SESSION_MAGIC, 8))
+    {
+        fprintf(stderr, "%s isn't a session log.\n", path);
+        if (fp != NULL)
+            fclose(fp);
+        return 1;
+    }
+    started = (time_t)(session_get(header+8, 8)/1000000);
+    #ifndef LINUX
+        _fseeki64(fp, 0, SEEK_END);
+        logsize = _ftelli64(fp);
+    #else
+        fseeko(fp, 0, SEEK_END);
+        logsize = ftello(fp);
+    #endif
+
+    // Find where to start reading from. Start an entry early, so the data header before a screenshot isn't missed
+    index = session_index(path, fp, logsize, session_get(header+8, 8), &count);
+    first = 0;
+    while (first+1 < count && index[first+1].time <= from)
+        first++;
+    if (first > 0)
+        first--;
+    offset = (count > 0) ? index[first].offset : SESSION_HEADERSIZE;
+    recordnum = (count > 0) ? index[first].record : 0;
+    free(index);
+    if (list)
+        printf("Session started %s", ctime(&started));
+
+    // Go through the records in the range
+    session_seek(fp, offset);
+    while (offset + SESSION_RECORDSIZE <= logsize && session_readrecord(fp, &record) && record.time <= to)
+    {
+        bool wanted, host = (record.cart == SESSION_HOST);
+        u64 next = offset + SESSION_RECORDSIZE + record.size;
+        if (next > logsize)
+            break;
+        if (host)
+            wanted = (types & QUERY_SENT) != 0;
+        else
+            wanted = (record.type == DATATYPE_TEXT && (types & QUERY_TEXT)) ||
+                     (record.type == DATATYPE_RAWBINARY && (types & QUERY_BINARY)) ||
+                     (record.type == DATATYPE_SCREENSHOT && (types & QUERY_SCREENSHOT));
+        wanted = wanted && record.time >= from;
+
+        // Only read the data if it's needed
+        if ((wanted && !list) || (!host && record.type == DATATYPE_HEADER))
+        {
+            if (record.size+1 > datasize)
+            {
+                free(data);
+                datasize = record.size+1;
+                data = (u8*) malloc(datasize);
+                if (data == NULL)
+                {
+                    fprintf(stderr, "Unable to allocate memory for record %llu.\n", recordnum);
+                    fclose(fp);
+                    return 1;
+                }
+            }
+            if (fread(data, 1, record.size, fp) != record.size)
+                break;
+            data[record.size] = '\0';
+        }
+        if (!host && record.type == DATATYPE_HEADER)
+            debug_parseheader(data, record.size, headers[record.cart]);
+
+        // Print or export it
+        if (wanted && list)
+            printf("%14.6f  %-7s%-11s%u bytes\n", record.time/1000000.0, host ? "sent" : "cart", session_typename(record.type), record.size);
+        else if (wanted && host)
+        {
+            if (record.type == DATATYPE_TEXT)
+                printf("Sent command '%s'\n", (char*)data);
+            else
+                session_export(folder, "sent", recordnum, "bin", data, record.size, NULL, NULL);
+        }
+        else if (wanted && record.type == DATATYPE_TEXT)
+            printf("%.*s", (int)record.size, (char*)data);
+        else if (wanted && record.type == DATATYPE_RAWBINARY)
+            session_export(folder, "binaryout", recordnum, "bin", data, record.size, NULL, NULL);
+        else if (wanted && record.type == DATATYPE_SCREENSHOT)
+        {
+            int* screenheader = headers[record.cart];
+            u8* image = (screenheader[0] == DATATYPE_SCREENSHOT) ? screenshot_convert(screenheader, data, record.size) : NULL;
+            if (image != NULL)
+                session_export(folder, "screenshot", recordnum, "png", NULL, 0, image, screenheader);
+            else
+                fprintf(stderr, "Skipped screenshot %llu, as its data header is missing.\n", recordnum);
+            free(image);
+        }
+        offset = next;
+        recordnum++;
+        session_seek(fp, offset);
+    }
+    free(data);
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef __SESSION_HEADER
+#define __SESSION_HEADER
+
+    #include "main.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define SESSION_MAGIC      "UNFSESS1"    // Starts a session log, followed by the time it started
+    #define SESSION_INDEXMAGIC "UNFSIDX1"    // Starts a session log's index
+    #define SESSION_HEADERSIZE 16            // The magic and the time the session started
+    #define SESSION_RECORDSIZE 16            // The size of a record's header on the disk
+    #define SESSION_INDEXSTEP  (1024*1024)   // How much of the log goes between each entry in the index
+    #define SESSION_HOST       0xFF          // The cart number of data that was sent to the carts
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    // Every record starts with this, stored little endian, followed by the data
+    typedef struct {
+        u64 time; // When it was sent or received, in microseconds since the session started
+        u32 size; // The size of the data
+        u8  type; // The DATATYPE_ the data was sent with
+        u8  cart; // The number of the cart that sent it, or SESSION_HOST
+        u16 reserved;
+    } sessionrecord_t;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    void session_open();
+    void session_record(u8 cart, u8 type, const void* data, u32 size);
+    void session_close();
+    int  session_query(int argc, char* argv[]);
+
+#endif
@@ -0,0 +1,770 @@
+/***************************************************************
+                          usbreader.cpp
+
+Drains the carts' USB links on threads of their own, so that a
+slow terminal or a screenshot being encoded never leaves data
+backed up in a cart's FIFO. Each cart gets a reader thread that
+sleeps until the driver says there's data, splits what arrives
+into packets (the DMA@ header, the data, and the CMPH signal),
+and pushes them onto a single-producer single-consumer ring.
+Debug mode pops the packets off and handles them, and is woken
+up whenever a new one arrives. A packet's data is read with a
+single call sized from its header, into a buffer that debug
+mode handed back through a second ring going the other way.
+Big raw binaries skip debug mode: they're streamed from the cart
+into a file that was preallocated to the size the header says,
+and only the bytes that actually arrived are kept.
+***************************************************************/
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <stdarg.h>
+#include "main.h"
+#include "helper.h"
+#include "device.h"
+#include "debug.h"
+#include "usbreader.h"
+#ifdef LINUX
+    #include <fcntl.h>
+    #include <poll.h>
+#endif
+
+
+/*********************************
+              Macros
+*********************************/
+
+#ifndef LINUX
+    #include <io.h>
+    #define usbreader_reserve(fp, size)  _chsize_s(_fileno(fp), size)
+    #define usbreader_truncate(fp, size) _chsize_s(_fileno(fp), size)
+#else
+    #ifdef __APPLE__
+        #define usbreader_reserve(fp, size) ftruncate(fileno(fp), size)
+    #else
+        #define usbreader_reserve(fp, size) posix_fallocate(fileno(fp), 0, size)
+    #endif
+    #define usbreader_truncate(fp, size) ftruncate(fileno(fp), size)
+#endif
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef struct {
+    ftdi_context_t*   cart;
+    usbpacket_t       ring[USBREADER_PACKETS];
+    std::atomic<u32>  head;   // Where the next packet goes, only moved by the reader thread
+    std::atomic<u32>  tail;   // The next packet to handle, only moved by debug mode
+    usbpacket_t       pool[USBREADER_POOL];
+    std::atomic<u32>  poolhead; // Where the next handled packet's buffer goes, only moved by debug mode
+    std::atomic<u32>  pooltail; // The next buffer to reuse, only moved by the reader thread
+    std::atomic<bool> stop;
+    std::atomic<bool> failed;
+    char              error[128]; // Why the reader thread gave up, if it failed
+    u8*               chunk;      // Where raw binaries that are streamed to a file are read into
+    usbpacket_t       parked;     // A packet that was read but didn't fit on the ring before the reader was paused
+    bool              hasparked;
+    bool              poll;       // Whether the cart can't notify us, so it has to be polled
+    std::thread*      thread;
+    #ifndef LINUX
+        HANDLE event;
+    #else
+        EVENT_HANDLE event;
+    #endif
+} usbreader_t;
+
+
+/*********************************
+             Globals
+*********************************/
+
+static usbreader_t local_readers[DEVICE_MAX];
+static int  local_count = 0;
+static bool local_started = false; // Whether usbreader_start was called
+static bool local_running = false; // Whether the reader threads are running
+
+// Wakes up debug mode when a packet arrives
+#ifndef LINUX
+    static HANDLE local_wake = NULL;
+#else
+    static int local_wakepipe[2] = {-1, -1};
+#endif
+
+
+/*==============================
+    usbreader_fail
+    Stops a reader thread because of an error, which is
+    reported once debug mode handled every packet before it
+    @param A pointer to the reader
+    @param A string with the reason
+    @param Variadic arguments to print as well
+    @returns false
+==============================*/
+
+static bool usbreader_fail(usbreader_t* reader, const char* reason, ...)
+{
+    va_list args;
+    va_start(args, reason);
+    vsnprintf(reader->error, sizeof(reader->error), reason, args);
+    va_end(args);
+    reader->failed = true;
+    return false;
+}
+
+
+/*==============================
+    usbreader_wakeconsumer
+    Wakes up debug mode
+==============================*/
+
+static void usbreader_wakeconsumer()
+{
+    #ifndef LINUX
+        SetEvent(local_wake);
+    #else
+        char wake = 0;
+        if (write(local_wakepipe[1], &wake, 1) < 0)
+            return; // The pipe is full, so there's already a wakeup waiting
+    #endif
+}
+
+
+/*==============================
+    usbreader_sleep
+    Sleeps until the driver says the cart has data, or
+    the reader is told to stop
+    @param A pointer to the reader
+==============================*/
+
+static void usbreader_sleep(usbreader_t* reader)
+{
+    int wait = reader->poll ? USBREADER_POLLWAIT : USBREADER_IDLEWAIT;
+    #ifndef LINUX
+        WaitForSingleObject(reader->event, wait);
+    #else
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait/1000;
+        deadline.tv_nsec += (wait%1000)*1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        // Notifications that come in between checking the cart and sleeping are lost, so don't sleep forever
+        pthread_mutex_lock(&reader->event.eMutex);
+        if (!reader->stop)
+            pthread_cond_timedwait(&reader->event.eCondVar, &reader->event.eMutex, &deadline);
+        pthread_mutex_unlock(&reader->event.eMutex);
+    #endif
+}
+
+
+/*==============================
+    usbreader_wakereader
+    Wakes up a reader thread that's sleeping
+    @param A pointer to the reader
+==============================*/
+
+static void usbreader_wakereader(usbreader_t* reader)
+{
+    #ifndef LINUX
+        SetEvent(reader->event);
+    #else
+        pthread_mutex_lock(&reader->event.eMutex);
+        pthread_cond_signal(&reader->event.eCondVar);
+        pthread_mutex_unlock(&reader->event.eMutex);
+    #endif
+}
+
+
+/*==============================
+    usbreader_read
+    Reads bytes from a cart, waiting for them to arrive
+    until it gets them all, or until the reader is told
+    to stop or fails
+    @param A pointer to the reader
+    @param The buffer to read into
+    @param The number of bytes to read
+    @returns How many bytes were read. If it's not all of
+             them, the reader was told to stop or it failed
+==============================*/
+
+static u32 usbreader_read(usbreader_t* reader, u8* buffer, u32 size)
+{
+    DWORD bytesread;
+    u32 total = 0;
+    while (total < size)
+    {
+        if (FT_Read(reader->cart->handle, buffer+total, size-total, &bytesread) != FT_OK)
+        {
+            usbreader_fail(reader, "Unable to read from the flashcart.");
+            break;
+        }
+        total += bytesread;
+
+        // Give up on the packet if we're stopping and the cart went quiet
+        if (bytesread == 0 && reader->stop)
+            break;
+    }
+    return total;
+}
+
+
+/*==============================
+    usbreader_readall
+    Reads bytes from a cart, waiting until they all arrive
+    @param A pointer to the reader
+    @param The buffer to read into
+    @param The number of bytes to read
+    @returns Whether all the bytes were read. If not, the
+             reader was told to stop or it failed
+==============================*/
+
+static bool usbreader_readall(usbreader_t* reader, u8* buffer, u32 size)
+{
+    return usbreader_read(reader, buffer, size) == size;
+}
+
+
+/*==============================
+    usbreader_stream
+    Reads a raw binary straight into a file, a chunk at a
+    time, instead of into a buffer for debug mode
+    @param A pointer to the reader
+    @param A pointer to the packet, whose data is set to
+           the file's path
+    @param The size the packet's header says the binary is
+    @returns Whether the whole binary was received. If not,
+             the file only has what was, and the reader was
+             told to stop or it failed
+==============================*/
+
+static bool usbreader_stream(usbreader_t* reader, usbpacket_t* packet, u32 size)
+{
+    u32 received = 0;
+    bool written = true;
+    FILE* fp;
+    char* path = debug_filename("binaryout-", ".bin");
+    if (path == NULL)
+        return usbreader_fail(reader, "Unable to allocate memory for binary file.");
+    if (reader->chunk == NULL)
+        reader->chunk = (u8*) malloc(USBREADER_STREAMCHUNK);
+    if (reader->chunk == NULL)
+    {
+        free(path);
+        return usbreader_fail(reader, "Unable to allocate memory for streaming a binary to disk.");
+    }
+
+    // Create the file at its full size first, so that running out of disk space is found out before the data arrives
+    fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        free(path);
+        return usbreader_fail(reader, "Unable to create binary file.");
+    }
+    setvbuf(fp, NULL, _IONBF, 0); // The chunks are big enough to be written as they are
+    if (usbreader_reserve(fp, size) != 0)
+    {
+        fclose(fp);
+        remove(path);
+        usbreader_fail(reader, "Unable to make room for %d bytes in %s.", size, path);
+        free(path);
+        return false;
+    }
+
+    // Write each chunk as soon as it's read, counting what actually arrived
+    while (received < size)
+    {
+        u32 want = (size-received < USBREADER_STREAMCHUNK) ? size-received : USBREADER_STREAMCHUNK;
+        u32 got = usbreader_read(reader, reader->chunk, want);
+        if (fwrite(reader->chunk, 1, got, fp) != got)
+        {
+            written = usbreader_fail(reader, "Unable to write to %s.", path);
+            break;
+        }
+        received += got;
+        if (got < want)
+            break;
+    }
+
+    // If it was cut short, only keep what was received
+    if (received < size)
+        usbreader_truncate(fp, received);
+    if (fclose(fp) != 0 && written)
+        written = usbreader_fail(reader, "Unable to write to %s.", path);
+    if (received < size || !written)
+    {
+        free(path);
+        return false;
+    }
+    packet->data = (u8*)path;
+    packet->capacity = strlen(path)+1;
+    packet->streamed = true;
+    return true;
+}
+
+
+/*==============================
+    usbreader_buffer
+    Gets a buffer for a packet's data, reusing one that
+    debug mode is done with if possible
+    @param A pointer to the reader
+    @param A pointer to the packet to give the buffer to
+    @param The size of the packet's data
+    @returns Whether a buffer was found
+==============================*/
+
+static bool usbreader_buffer(usbreader_t* reader, usbpacket_t* packet, u32 size)
+{
+    u32 tail = reader->pooltail.load(std::memory_order_relaxed);
+    packet->data = NULL;
+    packet->capacity = 0;
+    if (tail != reader->poolhead.load(std::memory_order_acquire))
+    {
+        packet->data = reader->pool[tail & (USBREADER_POOL-1)].data;
+        packet->capacity = reader->pool[tail & (USBREADER_POOL-1)].capacity;
+        reader->pooltail.store(tail+1, std::memory_order_release);
+    }
+
+    // Replace the buffer if it's too small
+    if (packet->capacity < size+1)
+    {
+        free(packet->data);
+        packet->capacity = (size+1 > USBREADER_MINSIZE) ? size+1 : USBREADER_MINSIZE;
+        packet->data = (u8*) malloc(packet->capacity);
+        if (packet->data == NULL)
+            return usbreader_fail(reader, "Unable to allocate memory for a %d byte USB packet.", size);
+    }
+    return true;
+}
+
+
+/*==============================
+    usbreader_push
+    Pushes a packet onto the ring, waiting for room if debug
+    mode is falling behind. The packet was already read off
+    the cart, so if the reader is told to stop before there's
+    room, it's parked and pushed once the reader restarts
+    @param A pointer to the reader
+    @param A pointer to the packet
+    @returns Whether the packet was pushed
+==============================*/
+
+static bool usbreader_push(usbreader_t* reader, usbpacket_t* packet)
+{
+    u32 head = reader->head.load(std::memory_order_relaxed);
+    while (head - reader->tail.load(std::memory_order_acquire) == USBREADER_PACKETS)
+    {
+        if (reader->stop)
+        {
+            reader->parked = *packet;
+            reader->hasparked = true;
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(USBREADER_POLLWAIT));
+    }
+
+    // Hand the packet over
+    reader->ring[head & (USBREADER_PACKETS-1)] = *packet;
+    reader->head.store(head+1, std::memory_order_release);
+    usbreader_wakeconsumer();
+    return true;
+}
+
+
+/*==============================
+    usbreader_packet
+    Reads a packet from a cart and pushes it onto the ring
+    @param A pointer to the reader
+    @returns Whether the packet was read. If not, the
+             reader was told to stop or it failed
+==============================*/
+
+static bool usbreader_packet(usbreader_t* reader)
+{
+    u8  header[16];
+    u32 size, read, alignment;
+    usbpacket_t packet;
+
+    // Decide the alignment based off the cart that's connected
+    switch (reader->cart->carttype)
+    {
+        case CART_EVERDRIVE: alignment = 16; break;
+        case CART_SC64: alignment = 4; break;
+        default: alignment = 0;
+    }
+
+    // Ensure we have valid data by reading the header
+    if (!usbreader_readall(reader, header, 8))
+        return false;
+    if (memcmp(header, "DMA@", 4) != 0)
+        return usbreader_fail(reader, "Unexpected DMA header: %c %c %c %c.", header[0], header[1], header[2], header[3]);
+
+    // Get information about the incoming data. In debug mode, big raw binaries go straight to a file, unless the session log needs them
+    packet.info = swap_endian(header[7] << 24 | header[6] << 16 | header[5] << 8 | header[4]);
+    size = packet.info & 0xFFFFFF;
+    packet.streamed = false;
+    if (!global_networkmode && (packet.info >> 24) == DATATYPE_RAWBINARY && size >= USBREADER_STREAMSIZE && global_sessionout == NULL)
+    {
+        if (!usbreader_stream(reader, &packet, size))
+            return false;
+    }
+    else
+    {
+        // Read all of it at once
+        if (!usbreader_buffer(reader, &packet, size))
+            return false;
+        if (!usbreader_readall(reader, packet.data, size))
+        {
+            free(packet.data);
+            return false;
+        }
+        packet.data[size] = '\0';
+    }
+
+    // Read the completion signal
+    if (!usbreader_readall(reader, header, 4))
+    {
+        free(packet.data);
+        return false;
+    }
+    if (memcmp(header, "CMPH", 4) != 0)
+    {
+        free(packet.data);
+        return usbreader_fail(reader, "Did not receive completion signal: %c %c %c %c.", header[0], header[1], header[2], header[3]);
+    }
+
+    // Ensure byte alignment by reading X amount of bytes needed
+    read = 8+size+4;
+    if (alignment != 0 && (read % alignment) != 0 && !usbreader_readall(reader, header, alignment - (read % alignment)))
+    {
+        free(packet.data);
+        return false;
+    }
+
+    return usbreader_push(reader, &packet);
+}
+
+
+/*==============================
+    usbreader_thread
+    Reads packets from a cart until it's told to stop
+    @param A pointer to the reader
+==============================*/
+
+static void usbreader_thread(usbreader_t* reader)
+{
+    // Hand over the packet that didn't fit before the reader was paused, if there is one
+    if (reader->hasparked)
+    {
+        reader->hasparked = false;
+        if (!usbreader_push(reader, &reader->parked))
+        {
+            usbreader_wakeconsumer();
+            return;
+        }
+    }
+    while (!reader->stop)
+    {
+        DWORD pending = 0;
+        FT_GetQueueStatus(reader->cart->handle, &pending);
+        if (pending == 0)
+            usbreader_sleep(reader);
+        else if (!usbreader_packet(reader))
+            break;
+    }
+
+    // If we failed, debug mode needs to find out
+    usbreader_wakeconsumer();
+}
+
+
+/*==============================
+    usbreader_startthreads
+    Starts a reader thread for every cart
+==============================*/
+
+static void usbreader_startthreads()
+{
+    int i;
+    for (i=0; i<local_count; i++)
+    {
+        local_readers[i].stop = false;
+        local_readers[i].thread = new std::thread(usbreader_thread, &local_readers[i]);
+    }
+    local_running = true;
+}
+
+
+/*==============================
+    usbreader_stopthreads
+    Stops the reader threads. A packet that's being
+    received is finished first, unless the cart went quiet
+==============================*/
+
+static void usbreader_stopthreads()
+{
+    int i;
+    for (i=0; i<local_count; i++)
+    {
+        local_readers[i].stop = true;
+        usbreader_wakereader(&local_readers[i]);
+    }
+    for (i=0; i<local_count; i++)
+    {
+        local_readers[i].thread->join();
+        delete local_readers[i].thread;
+        local_readers[i].thread = NULL;
+    }
+    local_running = false;
+}
+
+
+/*==============================
+    usbreader_start
+    Starts reading packets from the carts
+    @param A pointer to the cart contexts
+    @param The number of carts
+==============================*/
+
+void usbreader_start(ftdi_context_t* carts, int count)
+{
+    int i;
+    local_count = count;
+
+    // Set up the wakeups for debug mode
+    #ifndef LINUX
+        local_wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (local_wake == NULL)
+            terminate("Unable to create the USB reader's event.");
+    #else
+        if (pipe(local_wakepipe) != 0)
+            terminate("Unable to create the USB reader's pipe.");
+        fcntl(local_wakepipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(local_wakepipe[1], F_SETFL, O_NONBLOCK);
+    #endif
+
+    // Ask the carts to tell us when they have data
+    for (i=0; i<count; i++)
+    {
+        usbreader_t* reader = &local_readers[i];
+        reader->cart = &carts[i];
+        reader->head = 0;
+        reader->tail = 0;
+        reader->poolhead = 0;
+        reader->pooltail = 0;
+        reader->failed = false;
+        reader->chunk = NULL;
+        reader->hasparked = false;
+        #ifndef LINUX
+            reader->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+            if (reader->event == NULL)
+                terminate("Unable to create the USB reader's event.");
+            reader->poll = (FT_SetEventNotification(carts[i].handle, FT_EVENT_RXCHAR, reader->event) != FT_OK);
+        #else
+            pthread_mutex_init(&reader->event.eMutex, NULL);
+            pthread_cond_init(&reader->event.eCondVar, NULL);
+            reader->event.iVar = 0;
+            reader->poll = (FT_SetEventNotification(carts[i].handle, FT_EVENT_RXCHAR, (PVOID)&reader->event) != FT_OK);
+        #endif
+    }
+    local_started = true;
+    usbreader_startthreads();
+}
+
+
+/*==============================
+    usbreader_stop
+    Stops reading packets from the carts, and throws away
+    the ones that weren't handled
+==============================*/
+
+void usbreader_stop()
+{
+    int i;
+    if (!local_started)
+        return;
+    if (local_running)
+        usbreader_stopthreads();
+
+    // Clean up the carts' notifications and leftover packets
+    for (i=0; i<local_count; i++)
+    {
+        usbreader_t* reader = &local_readers[i];
+        u32 tail;
+        FT_SetEventNotification(reader->cart->handle, 0, NULL);
+        for (tail=reader->tail; tail!=reader->head; tail++)
+            free(reader->ring[tail & (USBREADER_PACKETS-1)].data);
+        for (tail=reader->pooltail; tail!=reader->poolhead; tail++)
+            free(reader->pool[tail & (USBREADER_POOL-1)].data);
+        if (reader->hasparked)
+            free(reader->parked.data);
+        reader->hasparked = false;
+        free(reader->chunk);
+        reader->chunk = NULL;
+        #ifndef LINUX
+            CloseHandle(reader->event);
+        #else
+            pthread_cond_destroy(&reader->event.eCondVar);
+            pthread_mutex_destroy(&reader->event.eMutex);
+        #endif
+    }
+    #ifndef LINUX
+        CloseHandle(local_wake);
+        local_wake = NULL;
+    #else
+        close(local_wakepipe[0]);
+        close(local_wakepipe[1]);
+        local_wakepipe[0] = local_wakepipe[1] = -1;
+    #endif
+    local_started = false;
+}
+
+
+/*==============================
+    usbreader_pause
+    Stops the reader threads, so that something else can
+    talk to the carts. Packets that were already read stay
+    on the ring
+==============================*/
+
+void usbreader_pause()
+{
+    if (local_running)
+        usbreader_stopthreads();
+}
+
+
+/*==============================
+    usbreader_resume
+    Restarts the reader threads after usbreader_pause
+==============================*/
+
+void usbreader_resume()
+{
+    if (local_started && !local_running)
+        usbreader_startthreads();
+}
+
+
+/*==============================
+    usbreader_pop
+    Takes the next packet that a cart sent off the ring.
+    If the cart's reader failed, this terminates once the
+    packets before the failure were handled
+    @param The index of the cart
+    @param A pointer to the packet to fill in
+    @returns Whether there was a packet
+==============================*/
+
+bool usbreader_pop(int index, usbpacket_t* packet)
+{
+    usbreader_t* reader = &local_readers[index];
+    u32 tail = reader->tail.load(std::memory_order_relaxed);
+    if (reader->head.load(std::memory_order_acquire) == tail)
+    {
+        if (reader->failed)
+            terminate("%s", reader->error);
+        return false;
+    }
+    *packet = reader->ring[tail & (USBREADER_PACKETS-1)];
+    reader->tail.store(tail+1, std::memory_order_release);
+    return true;
+}
+
+
+/*==============================
+    usbreader_drain
+    Forgets the wakeups that are waiting, then checks every
+    cart's ring. The wakeups are shared by all the carts, so
+    this is only done right before sleeping, as otherwise a
+    cart's wakeup could be lost while handling another's
+    packets
+    @returns Whether any cart has packets waiting
+==============================*/
+
+bool usbreader_drain()
+{
+    int i;
+    #ifdef LINUX
+        char drain[64];
+        while (read(local_wakepipe[0], drain, sizeof(drain)) > 0)
+            ;
+    #endif
+    for (i=0; i<local_count; i++)
+    {
+        usbreader_t* reader = &local_readers[i];
+        if (reader->head.load(std::memory_order_acquire) != reader->tail.load(std::memory_order_relaxed) || reader->failed)
+            return true;
+    }
+    return false;
+}
+
+
+/*==============================
+    usbreader_wait
+    Sleeps until a key is pressed, a packet arrives, or
+    the timeout runs out
+    @param The timeout, in milliseconds
+==============================*/
+
+void usbreader_wait(int timeout)
+{
+    if (usbreader_drain())
+        return;
+    #ifndef LINUX
+        HANDLE handles[2] = {GetStdHandle(STD_INPUT_HANDLE), local_wake};
+        WaitForMultipleObjects(2, handles, FALSE, timeout);
+    #else
+        struct pollfd fds[2];
+        fds[0].fd = STDIN_FILENO;
+        fds[0].events = POLLIN;
+        fds[1].fd = local_wakepipe[0];
+        fds[1].events = POLLIN;
+        poll(fds, 2, timeout);
+    #endif
+}
+
+
+#ifdef LINUX
+/*==============================
+    usbreader_wakefd
+    Gets a file descriptor that becomes readable when
+    a packet arrives, for use with poll(). Call
+    usbreader_drain before each poll
+    @returns The file descriptor
+==============================*/
+
+int usbreader_wakefd()
+{
+    return local_wakepipe[0];
+}
+#endif
+
+
+/*==============================
+    usbreader_release
+    Hands a packet's buffer back to the cart's reader once
+    it was handled, so that it can be reused
+    @param The index of the cart
+    @param A pointer to the packet
+==============================*/
+
+void usbreader_release(int index, usbpacket_t* packet)
+{
+    usbreader_t* reader = &local_readers[index];
+    u32 head = reader->poolhead.load(std::memory_order_relaxed);
+    if (packet->capacity <= USBREADER_POOLMAX && head - reader->pooltail.load(std::memory_order_acquire) < USBREADER_POOL)
+    {
+        reader->pool[head & (USBREADER_POOL-1)] = *packet;
+        reader->poolhead.store(head+1, std::memory_order_release);
+    }
+    else
+        free(packet->data);
+    packet->data = NULL;
+}
@@ -0,0 +1,49 @@
+#ifndef __USBREADER_HEADER
+#define __USBREADER_HEADER
+
+    #include "device.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define USBREADER_PACKETS  1024        // How many packets can wait to be handled, per cart. Must be a power of two
+    #define USBREADER_POOL     16          // How many buffers each cart keeps for reuse. Must be a power of two
+    #define USBREADER_POOLMAX  (1024*1024) // Buffers bigger than this are freed instead of reused
+    #define USBREADER_MINSIZE  4096        // The smallest buffer to allocate, so that most packets fit in any reused buffer
+    #define USBREADER_IDLEWAIT 100         // How long to sleep between checking for data the driver didn't tell us about, in milliseconds
+    #define USBREADER_POLLWAIT 1           // How often to check carts that can't tell us they have data, in milliseconds
+    #define USBREADER_STREAMSIZE  (1024*1024) // Raw binaries at least this big are written straight to a file by the reader
+    #define USBREADER_STREAMCHUNK (1024*1024) // How much of a raw binary is read before it's written
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct {
+        u32 info;     // The type (top 8 bits) and size (bottom 24 bits) from the packet's header
+        u8* data;     // The packet's data, followed by a zero so that text can be used as a string
+        u32 capacity; // How big the buffer holding the data is
+        bool streamed; // Whether the data was written straight to a file, in which case the data is the file's path
+    } usbpacket_t;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    void usbreader_start(ftdi_context_t* carts, int count);
+    void usbreader_stop();
+    void usbreader_pause();
+    void usbreader_resume();
+    bool usbreader_pop(int index, usbpacket_t* packet);
+    void usbreader_release(int index, usbpacket_t* packet);
+    bool usbreader_drain();
+    void usbreader_wait(int timeout);
+    #ifdef LINUX
+        int usbreader_wakefd();
+    #endif
+
+#endif
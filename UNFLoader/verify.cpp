@@ -0,0 +1,451 @@
+/***************************************************************
+                           verify.cpp
+
+Reads the ROM back from the cart's SDRAM after an upload and
+compares it with the file. The cart is read by a thread of its
+own, a few chunks ahead, while the upload pipeline reads and
+converts the same chunks of the file, so the comparison overlaps
+with both transfers. The exact ranges that don't match are
+reported, and only those are sent again.
+***************************************************************/
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "main.h"
+#include "helper.h"
+#include "device.h"
+#include "device_everdrive.h"
+#include "pipeline.h"
+#include "verify.h"
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define VERIFY_REPORT 16 // How many of the ranges that differ to print at most
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef struct {
+    u32 offset;
+    u32 size;
+    u8* data;   // What the range should contain, if it's going to be sent again
+} verify_range_t;
+
+typedef struct {
+    verify_range_t* items;
+    u32  count;
+    u32  capacity;
+    bool nomemory; // Whether a range couldn't be added
+} verify_list_t;
+
+typedef struct {
+    ftdi_context_t* cart;
+    verify_func readrom;
+    u32  size;
+    u32  readcount; // How many chunks were read from the cart
+    u32  donecount; // How many chunks were compared
+    bool failed;
+    bool stopping;
+    u8*  buffers[VERIFY_BUFFERS];
+    std::mutex lock;
+    std::condition_variable signal;
+} verify_t;
+
+
+/*==============================
+    verify_add
+    Adds a range to a list, merging it with the last one
+    if they touch
+    @param A pointer to the list
+    @param The offset of the range in the ROM
+    @param The size of the range
+    @param A pointer to what the range should contain, or NULL
+           if only the position of the range is needed
+==============================*/
+
+static void verify_add(verify_list_t* list, u32 offset, u32 size, const u8* data)
+{
+    verify_range_t* last = (list->count > 0) ? &list->items[list->count-1] : NULL;
+    if (list->nomemory)
+        return;
+
+    // Grow the last range if this one continues it
+    if (last != NULL && last->offset+last->size >= offset)
+    {
+        u32 end = last->offset+last->size;
+        if (offset+size <= end)
+            return;
+        if (data != NULL)
+        {
+            u8* grown = (u8*) realloc(last->data, offset+size-last->offset);
+            if (grown == NULL)
+            {
+                list->nomemory = true;
+                return;
+            }
+            last->data = grown;
+            memcpy(last->data+(end-last->offset), data+(end-offset), offset+size-end);
+        }
+        last->size = offset+size-last->offset;
+        return;
+    }
+
+    // Otherwise, make a new one
+    if (list->count == list->capacity)
+    {
+        u32 capacity = (list->capacity == 0) ? 16 : list->capacity*2;
+        verify_range_t* items = (verify_range_t*) realloc(list->items, sizeof(verify_range_t)*capacity);
+        if (items == NULL)
+        {
+            list->nomemory = true;
+            return;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    last = &list->items[list->count++];
+    last->offset = offset;
+    last->size = size;
+    last->data = NULL;
+    if (data != NULL)
+    {
+        last->data = (u8*) malloc(size);
+        if (last->data == NULL)
+        {
+            list->nomemory = true;
+            return;
+        }
+        memcpy(last->data, data, size);
+    }
+}
+
+
+/*==============================
+    verify_free
+    Frees a list of ranges
+    @param A pointer to the list
+==============================*/
+
+static void verify_free(verify_list_t* list)
+{
+    u32 i;
+    for (i=0; i<list->count; i++)
+        free(list->items[i].data);
+    free(list->items);
+    list->items = NULL;
+    list->count = list->capacity = 0;
+    list->nomemory = false;
+}
+
+
+/*==============================
+    verify_compare
+    Finds the bytes of a chunk that differ from what
+    was read back from the cart
+    @param A pointer to what the chunk should contain
+    @param A pointer to what was read back
+    @param The offset of the chunk in the ROM
+    @param The size of the chunk
+    @param A pointer to the list of exact ranges that differ
+    @param A pointer to the list of aligned ranges to resend
+==============================*/
+
+static void verify_compare(const u8* expected, const u8* actual, u32 offset, u32 size, verify_list_t* diffs, verify_list_t* resend)
+{
+    u32 i = 0;
+    while (i < size)
+    {
+        u32 start, end, block = VERIFY_ALIGN-(i%VERIFY_ALIGN);
+        if (block > size-i)
+            block = size-i;
+
+        // Skip the blocks that match
+        if (memcmp(expected+i, actual+i, block) == 0)
+        {
+            i += block;
+            continue;
+        }
+
+        // Find exactly where the bytes that differ start and end
+        while (expected[i] == actual[i])
+            i++;
+        start = i;
+        while (i < size && expected[i] != actual[i])
+            i++;
+        end = i;
+        verify_add(diffs, offset+start, end-start, NULL);
+
+        // The cart can only be written to in aligned blocks
+        start -= start%VERIFY_ALIGN;
+        end += (VERIFY_ALIGN-end%VERIFY_ALIGN)%VERIFY_ALIGN;
+        if (end > size)
+            end = size;
+        verify_add(resend, offset+start, end-start, expected+start);
+    }
+}
+
+
+/*==============================
+    verify_patchheader
+    Makes the changes to the header that the cart
+    backends make while uploading
+    @param A pointer to the cart context
+    @param A pointer to the first chunk of the ROM
+    @param The size of the chunk
+    @param A pointer to store the patched copy of the chunk in,
+           or NULL if it doesn't need patching
+    @returns false if there was no memory for the copy
+==============================*/
+
+static bool verify_patchheader(ftdi_context_t* cart, const u8* chunk, u32 size, u8** header)
+{
+    bool savetype = (cart->carttype == CART_EVERDRIVE && global_savetype != 0);
+    bool checksum = (cart->checksum.fixed && size >= CHECKSUM_HEADER);
+    *header = NULL;
+    if (!savetype && !checksum)
+        return true;
+
+    // Other carts might be reading the same memory, so patch a copy
+    *header = (u8*) malloc(size);
+    if (*header == NULL)
+        return false;
+    memcpy(*header, chunk, size);
+    if (savetype)
+        device_patchrom_everdrive(*header);
+    if (checksum)
+        memcpy(*header, cart->checksum.boot, CHECKSUM_HEADER);
+    return true;
+}
+
+
+/*==============================
+    verify_thread_reader
+    Reads the cart's SDRAM into free buffers
+    @param A pointer to the verification state
+==============================*/
+
+static void verify_thread_reader(verify_t* verify)
+{
+    u32 offset;
+    for (offset=0; offset<verify->size; offset+=VERIFY_CHUNK)
+    {
+        u32  index = offset/VERIFY_CHUNK;
+        u32  size = verify->size-offset;
+        bool success;
+        if (size > VERIFY_CHUNK)
+            size = VERIFY_CHUNK;
+
+        // Wait for the buffer to be compared
+        {
+            std::unique_lock<std::mutex> guard(verify->lock);
+            verify->signal.wait(guard, [&]{return index < verify->donecount+VERIFY_BUFFERS || verify->stopping;});
+            if (verify->stopping)
+                return;
+        }
+
+        // Read the chunk and pass it on
+        success = verify->readrom(verify->cart, offset, verify->buffers[index%VERIFY_BUFFERS], size);
+        std::lock_guard<std::mutex> guard(verify->lock);
+        if (success)
+            verify->readcount++;
+        else
+            verify->failed = true;
+        verify->signal.notify_all();
+        if (!success)
+            return;
+    }
+}
+
+
+/*==============================
+    verify_resend
+    Sends ranges of the ROM again until the cart
+    reads them back correctly
+    @param A pointer to the cart context
+    @param A pointer to the list of ranges
+    @param The function that reads from the cart's SDRAM
+    @param The function that writes to the cart's SDRAM
+    @param A pointer to store how many bytes were sent
+    @returns Whether the ranges match now, with the reason stored
+             in the cart context if they don't
+==============================*/
+
+static bool verify_resend(ftdi_context_t* cart, verify_list_t* list, verify_func readrom, verify_func writerom, u32* sent)
+{
+    u32 i, offset;
+    u8* buffer = (u8*) malloc(VERIFY_CHUNK);
+    if (buffer == NULL)
+        return device_fail(cart, "Unable to allocate memory for the verification buffer.");
+    *sent = 0;
+
+    for (i=0; i<list->count; i++)
+    {
+        verify_range_t* range = &list->items[i];
+        for (offset=0; offset<range->size; offset+=VERIFY_CHUNK)
+        {
+            int attempt;
+            u32 size = range->size-offset;
+            u8* data = range->data+offset;
+            if (size > VERIFY_CHUNK)
+                size = VERIFY_CHUNK;
+
+            // Send the part again, and read it back to make sure it arrived this time
+            for (attempt=0; ; attempt++)
+            {
+                if (attempt == VERIFY_RETRIES)
+                {
+                    free(buffer);
+                    return device_fail(cart, "The ROM still doesn't match at 0x%08X after sending it %d times.", range->offset+offset, VERIFY_RETRIES);
+                }
+                if (!writerom(cart, range->offset+offset, data, size) || !readrom(cart, range->offset+offset, buffer, size))
+                {
+                    free(buffer);
+                    return device_fail(cart, "Flashcart timed out.");
+                }
+                *sent += size;
+                if (memcmp(buffer, data, size) == 0)
+                    break;
+            }
+        }
+    }
+    free(buffer);
+    return true;
+}
+
+
+/*==============================
+    verify_rom
+    Reads the uploaded ROM back from the cart, and sends
+    the parts that don't match again
+    @param A pointer to the cart context
+    @param A pointer to the ROM that was sent
+    @param How many bytes were sent
+    @param The function that reads from the cart's SDRAM
+    @param The function that writes to the cart's SDRAM
+    @returns Whether the ROM matches, with the reason stored in the
+             cart context if it doesn't
+==============================*/
+
+bool verify_rom(ftdi_context_t* cart, romfile_t* rom, u32 size, verify_func readrom, verify_func writerom)
+{
+    int  i;
+    bool failed = false;
+    bool readable;
+    time_t verify_time = clock();
+    verify_list_t diffs = {NULL, 0, 0, false};
+    verify_list_t resend = {NULL, 0, 0, false};
+    verify_t* verify = new verify_t();
+    std::thread reader;
+    pipeline_t* pipe;
+    pipeline_chunk_t* romchunk;
+    u8* header;
+
+    // Initialize the verification state
+    verify->cart = cart;
+    verify->readrom = readrom;
+    verify->size = size;
+    verify->readcount = 0;
+    verify->donecount = 0;
+    verify->failed = false;
+    verify->stopping = false;
+    for (i=0; i<VERIFY_BUFFERS; i++)
+        verify->buffers[i] = (u8*) malloc(VERIFY_CHUNK);
+    for (i=0; i<VERIFY_BUFFERS; i++)
+    {
+        if (verify->buffers[i] == NULL)
+        {
+            for (i=0; i<VERIFY_BUFFERS; i++)
+                free(verify->buffers[i]);
+            delete verify;
+            return device_fail(cart, "Unable to allocate memory for the verification buffers.");
+        }
+    }
+
+    // Read the cart in the background while the ROM is read from disk
+    pipe = pipeline_start(rom, size, VERIFY_CHUNK, global_byteorder, NULL);
+    reader = std::thread(verify_thread_reader, verify);
+    pdprint("\n", CRDEF_PROGRAM);
+    progressbar_draw("Verifying ROM", CRDEF_PROGRAM, 0);
+    while ((romchunk = pipeline_next(pipe)) != NULL)
+    {
+        u32 index = romchunk->offset/VERIFY_CHUNK;
+        u32 done = romchunk->offset+romchunk->size;
+
+        // Wait for the same chunk to come from the cart
+        {
+            std::unique_lock<std::mutex> guard(verify->lock);
+            verify->signal.wait(guard, [&]{return verify->readcount > index || verify->failed;});
+            failed = verify->failed;
+        }
+        if (failed)
+        {
+            pipeline_release(pipe, romchunk);
+            break;
+        }
+
+        // Compare them, and give both buffers back
+        header = NULL;
+        if (romchunk->offset == 0 && !verify_patchheader(cart, romchunk->data, romchunk->size, &header))
+            resend.nomemory = true;
+        verify_compare((header != NULL) ? header : romchunk->data, verify->buffers[index%VERIFY_BUFFERS], romchunk->offset, romchunk->size, &diffs, &resend);
+        pipeline_release(pipe, romchunk);
+        free(header);
+        {
+            std::lock_guard<std::mutex> guard(verify->lock);
+            verify->donecount++;
+            verify->signal.notify_all();
+        }
+        progressbar_draw("Verifying ROM", CRDEF_PROGRAM, (float)done/size);
+    }
+
+    // Stop the workers
+    {
+        std::lock_guard<std::mutex> guard(verify->lock);
+        verify->stopping = true;
+        verify->signal.notify_all();
+    }
+    reader.join();
+    readable = pipeline_stop(pipe);
+    for (i=0; i<VERIFY_BUFFERS; i++)
+        free(verify->buffers[i]);
+    delete verify;
+    if (failed || !readable || diffs.nomemory || resend.nomemory)
+    {
+        verify_free(&diffs);
+        verify_free(&resend);
+        if (failed)
+            return device_fail(cart, "Unable to read the ROM back from the flashcart.");
+        if (!readable)
+            return device_fail(cart, "Unable to read the ROM file.");
+        return device_fail(cart, "Unable to allocate memory for the ranges to resend.");
+    }
+
+    // Report the ranges that didn't match, and send them again
+    if (diffs.count == 0)
+        pdprint_replace("ROM verified in %.2f seconds.\n", CRDEF_PROGRAM, ((double)(clock()-verify_time))/CLOCKS_PER_SEC);
+    else
+    {
+        u32 sent = 0;
+        pdprint_replace("%d parts of the ROM didn't match:\n", CRDEF_PROGRAM, diffs.count);
+        for (i=0; i<(int)diffs.count && i<VERIFY_REPORT; i++)
+            pdprint("  0x%08X-0x%08X (%d bytes)\n", CRDEF_PROGRAM, diffs.items[i].offset, diffs.items[i].offset+diffs.items[i].size-1, diffs.items[i].size);
+        if (diffs.count > VERIFY_REPORT)
+            pdprint("  ...and %d more.\n", CRDEF_PROGRAM, diffs.count-VERIFY_REPORT);
+        if (!verify_resend(cart, &resend, readrom, writerom, &sent))
+        {
+            verify_free(&diffs);
+            verify_free(&resend);
+            return false;
+        }
+        pdprint("Sent %d KB of the ROM again, and it matches now.\n", CRDEF_PROGRAM, (sent+1023)/1024);
+    }
+    verify_free(&diffs);
+    verify_free(&resend);
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef __VERIFY_HEADER
+#define __VERIFY_HEADER
+
+    #include "device.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define VERIFY_CHUNK   (128*1024) // How many bytes to read back from the cart at a time
+    #define VERIFY_BUFFERS 3          // How many chunks can be read ahead of the comparison
+    #define VERIFY_ALIGN   512        // The alignment of the ranges that are sent again
+    #define VERIFY_RETRIES 3          // How many times to resend a range before giving up
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef bool (*verify_func)(ftdi_context_t* cart, u32 address, u8* data, u32 size);
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    bool verify_rom(ftdi_context_t* cart, romfile_t* rom, u32 size, verify_func readrom, verify_func writerom);
+
+#endif
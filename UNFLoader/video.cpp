@@ -0,0 +1,328 @@
+/***************************************************************
+                           video.cpp
+
+Records the framebuffers that the carts send into a Y4M video
+stream instead of a PNG per frame, so that dozens of frames per
+second can be captured. Each cart gets a stream of its own, and
+every frame in it is tagged with the time it was received. Debug
+mode only copies the frame into a ring of buffers that are
+allocated once and reused, and a thread converts and writes them
+in the background. If the disk can't keep up, frames are dropped
+instead of holding up USB.
+***************************************************************/
+
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include "main.h"
+#include "helper.h"
+#include "device.h"
+#include "debug.h"
+#include "screenshot.h"
+#include "video.h"
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define CLAMP8(x) ((u8)((x) < 0 ? 0 : ((x) > 255 ? 255 : (x)))) // Saturated red or blue would otherwise give a chroma of 256, which wraps to 0
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef struct {
+    int cart;
+    int header[HEADER_SIZE];
+    u64 time;     // When the frame was received, in microseconds since the video started
+    u8* data;     // The framebuffer
+    u32 size;
+    u32 capacity; // How big the buffer holding the framebuffer is
+} videoframe_t;
+
+typedef struct {
+    FILE* fp;
+    char* path;
+    int   w, h;    // The size of the stream, decided by its first frame
+    u8*   image;   // The frame as RGBA
+    u8*   planes;  // The frame as Y, U and V planes
+    u32   frames;  // How many frames were written
+    u32   dropped;  // How many frames didn't fit in the ring
+    u32   nomemory; // How many frames there was no memory to copy
+    u32   skipped;  // How many frames weren't the size of the stream
+    bool  failed;
+} videostream_t;
+
+
+/*********************************
+             Globals
+*********************************/
+
+static std::mutex local_lock;
+static std::condition_variable local_wake; // Wakes up the writer when there's a frame to write
+static videoframe_t local_ring[VIDEO_RING];
+static u32  local_head = 0; // Where the next frame goes
+static u32  local_tail = 0; // The next frame to write
+static bool local_stop = false;
+static std::thread* local_writer = NULL;
+static videostream_t local_streams[DEVICE_MAX];
+static int  local_streamcount = 0;
+static std::chrono::steady_clock::time_point local_start;
+
+
+/*==============================
+    video_planes
+    Converts an RGBA image to full range BT.601 Y, U and V
+    planes, at full resolution
+    @param The buffer to store the planes in, which needs to
+           fit 3 bytes per pixel
+    @param The image
+    @param The number of pixels in the image
+==============================*/
+
+static void video_planes(u8* planes, const u8* image, u32 pixels)
+{
+    u32 i;
+    u8* y = planes;
+    u8* u = planes + pixels;
+    u8* v = planes + 2*pixels;
+    for (i=0; i<pixels; i++)
+    {
+        int r = image[4*i], g = image[4*i+1], b = image[4*i+2];
+        y[i] = CLAMP8((77*r + 150*g + 29*b + 128) >> 8);
+        u[i] = CLAMP8(((-43*r - 85*g + 128*b + 128) >> 8) + 128);
+        v[i] = CLAMP8(((128*r - 107*g - 21*b + 128) >> 8) + 128);
+    }
+}
+
+
+/*==============================
+    video_write
+    Writes a frame to its cart's stream
+    @param A pointer to the stream
+    @param A pointer to the frame
+==============================*/
+
+static void video_write(videostream_t* stream, videoframe_t* frame)
+{
+    int w = frame->header[2], h = frame->header[3];
+    if (stream->failed)
+        return;
+
+    // The first frame decides the size of the stream
+    if (stream->image == NULL)
+    {
+        if (w <= 0 || h <= 0)
+        {
+            stream->skipped++;
+            return;
+        }
+        stream->image = (u8*) malloc(4*w*h);
+        stream->planes = (u8*) malloc(3*w*h);
+        if (stream->image == NULL || stream->planes == NULL)
+        {
+            stream->failed = true;
+            return;
+        }
+        stream->w = w;
+        stream->h = h;
+        fprintf(stream->fp, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444 XCOLORRANGE=FULL\n", w, h, VIDEO_FPS);
+    }
+    if (w != stream->w || h != stream->h)
+    {
+        stream->skipped++;
+        return;
+    }
+
+    // Convert it and add it to the stream
+    screenshot_convertto(stream->image, frame->header, frame->data, frame->size);
+    video_planes(stream->planes, stream->image, w*h);
+    fprintf(stream->fp, "FRAME Xts=%llu\n", (unsigned long long)frame->time);
+    if (fwrite(stream->planes, 1, 3*w*h, stream->fp) != (size_t)(3*w*h))
+        stream->failed = true;
+    else
+        stream->frames++;
+}
+
+
+/*==============================
+    video_writer
+    Writes frames until told to stop and there are none left
+==============================*/
+
+static void video_writer()
+{
+    while (true)
+    {
+        videoframe_t* frame;
+        {
+            std::unique_lock<std::mutex> guard(local_lock);
+            local_wake.wait(guard, []{return local_stop || local_head != local_tail;});
+            if (local_head == local_tail)
+                return;
+            frame = &local_ring[local_tail & (VIDEO_RING-1)];
+        }
+
+        // The frame's buffer stays ours until the tail moves past it
+        video_write(&local_streams[frame->cart], frame);
+        std::lock_guard<std::mutex> guard(local_lock);
+        local_tail++;
+    }
+}
+
+
+/*==============================
+    video_open
+    Opens the video streams, if a video was requested
+    @param The number of carts. If there's more than one,
+           each cart's frames go to a stream of its own
+==============================*/
+
+void video_open(int count)
+{
+    int i;
+    if (global_videoout == NULL)
+        return;
+
+    // Open a stream for every cart, named after the one that was requested
+    for (i=0; i<count; i++)
+    {
+        videostream_t* stream = &local_streams[i];
+        memset(stream, 0, sizeof(videostream_t));
+        stream->path = (char*) malloc(strlen(global_videoout)+8);
+        if (stream->path == NULL)
+            terminate("Unable to allocate memory for the video path.");
+        if (count > 1)
+            sprintf(stream->path, "%s.%d", global_videoout, i+1);
+        else
+            strcpy(stream->path, global_videoout);
+        stream->fp = fopen(stream->path, "wb");
+        if (stream->fp == NULL)
+        {
+            pdprint("\n", CRDEF_ERROR);
+            terminate("Unable to open %s for writing the video.", stream->path);
+        }
+        setvbuf(stream->fp, NULL, _IOFBF, VIDEO_BUFFER);
+    }
+    local_streamcount = count;
+
+    // Start the writer
+    local_head = 0;
+    local_tail = 0;
+    local_stop = false;
+    local_start = std::chrono::steady_clock::now();
+    local_writer = new std::thread(video_writer);
+}
+
+
+/*==============================
+    video_frame
+    Queues a framebuffer to be added to its cart's stream,
+    if a video is being recorded. Never waits for the disk
+    @param The cart that sent the framebuffer
+    @param The data header that came before the framebuffer
+    @param The framebuffer, which is copied
+    @param The size of the framebuffer
+    @returns Whether a video is being recorded
+==============================*/
+
+bool video_frame(int cart, int* header, const u8* data, u32 size)
+{
+    videoframe_t* frame;
+    if (local_writer == NULL)
+        return false;
+    u64 time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - local_start).count();
+
+    // Drop the frame if the ring is full
+    {
+        std::lock_guard<std::mutex> guard(local_lock);
+        if (local_head - local_tail == VIDEO_RING)
+        {
+            local_streams[cart].dropped++;
+            return true;
+        }
+        frame = &local_ring[local_head & (VIDEO_RING-1)];
+    }
+
+    // The slot is ours until the head moves past it. Its buffer is only reallocated if a frame is bigger than any before
+    if (frame->capacity < size)
+    {
+        u8* buffer = (u8*) realloc(frame->data, size);
+        if (buffer == NULL)
+        {
+            std::lock_guard<std::mutex> guard(local_lock);
+            local_streams[cart].nomemory++;
+            return true;
+        }
+        frame->data = buffer;
+        frame->capacity = size;
+    }
+    memcpy(frame->data, data, size);
+    memcpy(frame->header, header, sizeof(frame->header));
+    frame->cart = cart;
+    frame->time = time;
+    frame->size = size;
+
+    // Hand it over
+    std::lock_guard<std::mutex> guard(local_lock);
+    local_head++;
+    local_wake.notify_one();
+    return true;
+}
+
+
+/*==============================
+    video_close
+    Writes the frames that are left and closes the streams
+==============================*/
+
+void video_close()
+{
+    int i;
+    if (local_writer == NULL)
+        return;
+
+    // Stop the writer once it's written everything
+    {
+        std::lock_guard<std::mutex> guard(local_lock);
+        local_stop = true;
+        local_wake.notify_all();
+    }
+    local_writer->join();
+    delete local_writer;
+    local_writer = NULL;
+
+    // Close the streams, and say how they went
+    for (i=0; i<local_streamcount; i++)
+    {
+        videostream_t* stream = &local_streams[i];
+        if (fclose(stream->fp) != 0)
+            stream->failed = true;
+        if (stream->failed)
+            pdprint("Unable to write %s.\n", CRDEF_ERROR, stream->path);
+        else if (stream->frames == 0)
+            remove(stream->path);
+        else
+            pdprint("Captured %u frames to %s.\n", CRDEF_INFO, stream->frames, stream->path);
+        if (stream->dropped > 0)
+            pdprint("Dropped %u frames from %s because the disk couldn't keep up.\n", CRDEF_ERROR, stream->dropped, stream->path);
+        if (stream->nomemory > 0)
+            pdprint("Dropped %u frames from %s because there was no memory to copy them.\n", CRDEF_ERROR, stream->nomemory, stream->path);
+        if (stream->skipped > 0)
+            pdprint("Skipped %u frames that weren't %dx%d.\n", CRDEF_ERROR, stream->skipped, stream->w, stream->h);
+        free(stream->image);
+        free(stream->planes);
+        free(stream->path);
+        memset(stream, 0, sizeof(videostream_t));
+    }
+    local_streamcount = 0;
+    for (i=0; i<VIDEO_RING; i++)
+    {
+        free(local_ring[i].data);
+        local_ring[i].data = NULL;
+        local_ring[i].capacity = 0;
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef __VIDEO_HEADER
+#define __VIDEO_HEADER
+
+    #include "main.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define VIDEO_RING   32            // How many frames can wait to be written before new ones are dropped. Must be a power of two
+    #define VIDEO_FPS    30            // The frame rate written in the stream's header. The real times are stored with each frame
+    #define VIDEO_BUFFER (1024*1024)   // How much of the stream is buffered before it's written to the disk
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    void video_open(int count);
+    bool video_frame(int cart, int* header, const u8* data, u32 size);
+    void video_close();
+
+#endif
@@ -0,0 +1,219 @@
+/***************************************************************
+                           watcher.cpp
+
+Waits for the ROM to change or for a key to be pressed, for
+listen mode. On Linux, inotify reports when whoever is writing
+the ROM closes it (or moves a new one in its place), and poll()
+sleeps on that and the keyboard at the same time. Elsewhere, the
+file's modification time is checked a few times per second.
+***************************************************************/
+
+#include <sys/stat.h>
+#include "main.h"
+#include "helper.h"
+#include "watcher.h"
+#ifdef LINUX
+    #include <poll.h>
+    #include <limits.h>
+    #include <sys/inotify.h>
+#endif
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define POLL_INTERVAL 100 // How many milliseconds to wait between checks when inotify isn't available
+
+
+/*********************************
+             Typedefs
+*********************************/
+
+struct watcher_s {
+    const char* path;
+    time_t lastmod;
+    #ifdef LINUX
+        int  fd;
+        char name[NAME_MAX+1];
+    #endif
+};
+
+
+/*==============================
+    watcher_sleep
+    Waits for a bit
+    @param The number of milliseconds to wait
+==============================*/
+
+static void watcher_sleep(int ms)
+{
+    #ifndef LINUX
+        Sleep(ms);
+    #else
+        usleep(ms*1000);
+    #endif
+}
+
+
+/*==============================
+    watcher_modified
+    Checks if the file's modification time changed
+    @param A pointer to the watcher
+    @returns Whether the file was modified
+==============================*/
+
+static bool watcher_modified(watcher_t* watcher)
+{
+    struct stat finfo;
+    if (stat(watcher->path, &finfo) != 0 || finfo.st_mtime == watcher->lastmod)
+        return false;
+    watcher->lastmod = finfo.st_mtime;
+    return true;
+}
+
+
+#ifdef LINUX
+
+/*==============================
+    watcher_events
+    Reads the pending inotify events
+    @param A pointer to the watcher
+    @param How many milliseconds to wait for an event, or -1 to wait forever
+    @param Whether to also wake up when a key is pressed
+    @returns Whether any of the events were about our file
+==============================*/
+
+static bool watcher_events(watcher_t* watcher, int wait, bool keyboard)
+{
+    struct pollfd fds[2];
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    char* ptr;
+    bool found = false;
+
+    // Sleep until there's something to read
+    fds[0].fd = watcher->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = STDIN_FILENO;
+    fds[1].events = POLLIN;
+    if (poll(fds, keyboard ? 2 : 1, wait) <= 0 || !(fds[0].revents & POLLIN))
+        return false;
+
+    // Check if any of the events are for our file
+    len = read(watcher->fd, buffer, sizeof(buffer));
+    for (ptr = buffer; len > 0 && ptr < buffer+len; ptr += sizeof(struct inotify_event)+((struct inotify_event*)ptr)->len)
+    {
+        struct inotify_event* event = (struct inotify_event*)ptr;
+        if (event->len > 0 && !strcmp(event->name, watcher->name))
+            found = true;
+    }
+    return found;
+}
+
+#endif
+
+
+/*==============================
+    watcher_start
+    Starts watching a file for changes
+    @param A string with the path to the file
+    @returns A pointer to the new watcher
+==============================*/
+
+watcher_t* watcher_start(const char* path)
+{
+    watcher_t* watcher = (watcher_t*) calloc(1, sizeof(watcher_t));
+    struct stat finfo;
+    if (watcher == NULL)
+        terminate("Unable to allocate memory for the file watcher.");
+    watcher->path = path;
+    if (stat(path, &finfo) == 0)
+        watcher->lastmod = finfo.st_mtime;
+
+    // Watch the folder instead of the file itself, so that we still notice if the file gets replaced
+    #ifdef LINUX
+    {
+        char folder[PATH_MAX];
+        const char* slash = strrchr(path, '/');
+        if (slash == NULL)
+        {
+            strcpy(folder, ".");
+            strncpy(watcher->name, path, NAME_MAX);
+        }
+        else
+        {
+            snprintf(folder, PATH_MAX, "%.*s", (int)(slash == path ? 1 : slash-path), path);
+            strncpy(watcher->name, slash+1, NAME_MAX);
+        }
+        watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watcher->fd != -1 && inotify_add_watch(watcher->fd, folder, IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+        {
+            close(watcher->fd);
+            watcher->fd = -1;
+        }
+    }
+    #endif
+    return watcher;
+}
+
+
+/*==============================
+    watcher_wait
+    Waits for the file to change, or for a key to be pressed
+    @param A pointer to the watcher
+    @returns WATCHER_CHANGED, or the key that was pressed
+==============================*/
+
+int watcher_wait(watcher_t* watcher)
+{
+    timeout(0);
+    for ( ; ; )
+    {
+        int ch = getch();
+        if (ch != ERR)
+            return ch;
+
+        // Sleep until the file is closed or a key is pressed
+        #ifdef LINUX
+            if (watcher->fd != -1)
+            {
+                if (!watcher_events(watcher, -1, true))
+                    continue;
+
+                // Wait for the writes to settle down, so that we don't upload a file that's still being built
+                while (watcher_events(watcher, WATCHER_DEBOUNCE, false))
+                    ;
+                watcher_modified(watcher);
+                return WATCHER_CHANGED;
+            }
+        #endif
+
+        // Otherwise, check the modification time every now and then
+        watcher_sleep(POLL_INTERVAL);
+        if (watcher_modified(watcher))
+        {
+            // Wait for the file to stop changing
+            do
+                watcher_sleep(WATCHER_DEBOUNCE);
+            while (watcher_modified(watcher));
+            return WATCHER_CHANGED;
+        }
+    }
+}
+
+
+/*==============================
+    watcher_stop
+    Stops watching the file
+    @param A pointer to the watcher
+==============================*/
+
+void watcher_stop(watcher_t* watcher)
+{
+    #ifdef LINUX
+        if (watcher->fd != -1)
+            close(watcher->fd);
+    #endif
+    free(watcher);
+}
@@ -0,0 +1,28 @@
+#ifndef __WATCHER_HEADER
+#define __WATCHER_HEADER
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define WATCHER_CHANGED  -2 // Returned by watcher_wait when the file changed
+    #define WATCHER_DEBOUNCE 50 // How many milliseconds the file must stay untouched before it counts as changed
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct watcher_s watcher_t;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    watcher_t* watcher_start(const char* path);
+    int        watcher_wait(watcher_t* watcher);
+    void       watcher_stop(watcher_t* watcher);
+
+#endif